@@ -263,6 +263,7 @@ StringSet NixRepl::completePrefix(const std::string & prefix)
     } else {
         /* Temporarily disable the debugger, to avoid re-entering readline. */
         auto debug_repl = state->debugRepl;
+        if (debug_repl) state->stopParallelEval();
         state->debugRepl = nullptr;
         Finally restoreDebug([&]() { state->debugRepl = debug_repl; });
         try {
@@ -0,0 +1,182 @@
+#include <gtest/gtest.h>
+
+#include "environment-variables.hh"
+#include "file-system.hh"
+#include "parse-cache.hh"
+#include "tests/libexpr.hh"
+
+namespace nix {
+
+/**
+ * Set an environment variable for the lifetime of this object.
+ */
+struct ScopedEnv
+{
+    std::string name;
+    std::optional<std::string> oldValue;
+
+    ScopedEnv(const std::string & name, const std::string & value)
+        : name(name)
+        , oldValue(getEnv(name))
+    {
+        setEnv(name.c_str(), value.c_str());
+    }
+
+    ~ScopedEnv()
+    {
+        if (oldValue)
+            setEnv(name.c_str(), oldValue->c_str());
+        else
+            unsetenv(name.c_str());
+    }
+};
+
+class ParseCacheTest : public LibExprTest
+{
+protected:
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir{tmpDir, true};
+    ScopedEnv cacheHome{"NIX_CACHE_HOME", tmpDir + "/cache"};
+
+    ParseCacheTest()
+    {
+        evalSettings.parseCache = true;
+    }
+
+    size_t nrCacheEntries()
+    {
+        auto dir = tmpDir + "/cache/parse-cache-v1";
+        if (!pathExists(dir)) return 0;
+        return std::distance(std::filesystem::directory_iterator(dir), std::filesystem::directory_iterator());
+    }
+};
+
+TEST_F(ParseCacheTest, roundTrip)
+{
+    auto file = tmpDir + "/default.nix";
+    writeFile(file, R"(
+        /** Some docs. */
+        { a ? 1, b, ... }@args:
+        let
+          inherit (args) c d;
+          f = x: x + 1.5;
+        in
+        rec {
+          g = "s${toString a}";
+          h = [ b ./foo ''
+            x ${g}
+          '' ];
+          i = if a == 1 then f 2 else assert true; -3;
+          j.k = with args; c;
+          j.l = { inherit g; };
+          ${"m"} = __curPos;
+          n = g.o or null;
+          p = args ? b && !false || true -> false;
+          q = [ 1 ] ++ [ 2 ] // { } != null;
+        }
+    )");
+    auto path = state.rootPath(CanonPath(file));
+
+    auto e1 = state.parseExprFromFile(path);
+    ASSERT_EQ(nrCacheEntries(), 1u);
+
+    auto e2 = state.parseExprFromFile(path);
+    ASSERT_NE(e1, e2);
+
+    std::ostringstream s1, s2;
+    e1->show(state.symbols, s1);
+    e2->show(state.symbols, s2);
+    ASSERT_EQ(s1.str(), s2.str());
+
+    auto pos1 = state.positions[e1->getPos()];
+    auto pos2 = state.positions[e2->getPos()];
+    ASSERT_EQ(pos2.line, pos1.line);
+    ASSERT_EQ(pos2.column, pos1.column);
+
+    auto lambda1 = dynamic_cast<ExprLambda *>(e1);
+    auto lambda2 = dynamic_cast<ExprLambda *>(e2);
+    ASSERT_NE(lambda2, nullptr);
+    ASSERT_EQ(
+        lambda2->docComment.getInnerText(state.positions),
+        lambda1->docComment.getInnerText(state.positions));
+
+    auto v = eval(fmt("(import %s { b = 2; c = 3; d = 4; }).j.k", file));
+    ASSERT_THAT(v, IsIntEq(3));
+}
+
+TEST_F(ParseCacheTest, changedFile)
+{
+    auto file = tmpDir + "/default.nix";
+    auto path = state.rootPath(CanonPath(file));
+
+    writeFile(file, "1");
+    state.parseExprFromFile(path);
+    writeFile(file, "2");
+    auto e = state.parseExprFromFile(path);
+    ASSERT_EQ(nrCacheEntries(), 2u);
+
+    std::ostringstream s;
+    e->show(state.symbols, s);
+    ASSERT_EQ(s.str(), "2");
+}
+
+TEST_F(ParseCacheTest, badEntry)
+{
+    auto file = tmpDir + "/default.nix";
+    auto path = state.rootPath(CanonPath(file));
+
+    writeFile(file, "{ a = 1; }");
+    state.parseExprFromFile(path);
+    ASSERT_EQ(nrCacheEntries(), 1u);
+
+    for (auto & entry : std::filesystem::directory_iterator(tmpDir + "/cache/parse-cache-v1"))
+        writeFile(entry.path().string(), "garbage");
+
+    auto e = state.parseExprFromFile(path);
+    std::ostringstream s;
+    e->show(state.symbols, s);
+    ASSERT_EQ(s.str(), "{ a = 1; }");
+}
+
+TEST_F(ParseCacheTest, sizeLimit)
+{
+    evalSettings.parseCacheSize = 10000;
+
+    /* Files whose cache entries are a bit over 1000 bytes. */
+    auto contents = [](int n) { return fmt("\"%d%s\"", n, std::string(1000, 'x')); };
+
+    auto parse = [&](int n) {
+        auto file = fmt("%s/file-%d.nix", tmpDir, n);
+        writeFile(file, contents(n));
+        state.parseExprFromFile(state.rootPath(CanonPath(file)));
+    };
+
+    auto isCached = [&](int n) {
+        /* The parser's input includes two terminating NULs. */
+        auto key = ParseCache::key(contents(n) + std::string("\0\0", 2), state.rootPath(CanonPath(tmpDir)), evalSettings);
+        return pathExists(tmpDir + "/cache/parse-cache-v1/" + key.to_string(HashFormat::Base16, false));
+    };
+
+    for (int n = 0; n < 7; ++n)
+        parse(n);
+    ASSERT_EQ(nrCacheEntries(), 7u);
+    ASSERT_TRUE(isCached(0));
+
+    /* Using the oldest entry makes it the most recently used one. */
+    parse(0);
+
+    for (int n = 7; n < 11; ++n)
+        parse(n);
+
+    uint64_t totalSize = 0;
+    for (auto & entry : std::filesystem::directory_iterator(tmpDir + "/cache/parse-cache-v1"))
+        totalSize += entry.file_size();
+    ASSERT_LE(totalSize, 10000u);
+    ASSERT_LT(nrCacheEntries(), 11u);
+
+    ASSERT_TRUE(isCached(0));
+    ASSERT_FALSE(isCached(1));
+    ASSERT_TRUE(isCached(10));
+}
+
+}
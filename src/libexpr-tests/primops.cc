@@ -586,6 +586,28 @@ namespace nix {
         auto v = eval("builtins.stringLength \"123\"");
         ASSERT_THAT(v, IsIntEq(3));
     }
+
+    TEST_F(PrimOpTest, stringLengthRope) {
+        auto v = eval("builtins.stringLength (builtins.foldl' (s: x: s + \"abc\") \"\" (builtins.genList (x: x) 10000))");
+        ASSERT_THAT(v, IsIntEq(30000));
+    }
+
+    TEST_F(PrimOpTest, substringRope) {
+        auto v = eval(R"(
+          let s = builtins.foldl' (s: x: s + toString x) "" (builtins.genList (x: x) 1000);
+          in builtins.substring 2887 10 ("<" + s + ">"))");
+        ASSERT_THAT(v, IsStringEq("8999>"));
+    }
+
+    TEST_F(PrimOpTest, stringWithNul) {
+        auto v = eval(R"(builtins.fromJSON "\"a\\u0000b\"")");
+        ASSERT_THAT(v, IsStringEq("a"));
+        ASSERT_EQ(v.string_size(), 1u);
+
+        auto v2 = eval(R"(builtins.stringLength (builtins.fromJSON "\"a\\u0000b\""))");
+        ASSERT_THAT(v2, IsIntEq(1));
+    }
+
     TEST_F(PrimOpTest, hashStringMd5) {
         auto v = eval("builtins.hashString \"md5\" \"asdf\"");
         ASSERT_THAT(v, IsStringEq("912ec803b2ce49e4a541068d495ab570"));
@@ -741,6 +763,11 @@ namespace nix {
         ASSERT_EQ(v.string_view(), "foo%bar%baz");
     }
 
+    TEST_F(PrimOpTest, concatStringsSepEmpty) {
+        auto v = eval("builtins.concatStringsSep \"%\" [ \"\" \"\" ]");
+        ASSERT_THAT(v, IsStringEq("%"));
+    }
+
     TEST_F(PrimOpTest, split1) {
         // v = [ "" [ "a" ] "c" ]
         auto v = eval("builtins.split \"(a)b\" \"abc\"");
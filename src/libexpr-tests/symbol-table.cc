@@ -0,0 +1,73 @@
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include "symbol-table.hh"
+
+namespace nix {
+
+    TEST(SymbolTable, createIsIdempotent) {
+        SymbolTable symbols;
+        auto a = symbols.create("foo");
+        auto b = symbols.create("bar");
+        ASSERT_NE(a, b);
+        ASSERT_EQ(a, symbols.create("foo"));
+        ASSERT_EQ(b, symbols.create("bar"));
+        ASSERT_EQ(symbols.size(), 2);
+    }
+
+    TEST(SymbolTable, resolve) {
+        SymbolTable symbols;
+        auto a = symbols.create("foo");
+        auto e = symbols.create("");
+        ASSERT_EQ(symbols[a], "foo");
+        ASSERT_TRUE(symbols[e].empty());
+        ASSERT_EQ(symbols.totalSize(), 3);
+    }
+
+    TEST(SymbolTable, manyChunks) {
+        SymbolTable symbols;
+        std::vector<Symbol> created;
+        for (int i = 0; i < 20000; ++i)
+            created.push_back(symbols.create("attr" + std::to_string(i)));
+        for (int i = 0; i < 20000; ++i)
+            ASSERT_EQ(symbols[created[i]], "attr" + std::to_string(i));
+
+        std::vector<std::string> dumped;
+        symbols.dump([&](const std::string & s) { dumped.push_back(s); });
+        ASSERT_EQ(dumped.size(), 20000);
+        ASSERT_EQ(dumped[12345], "attr12345");
+    }
+
+    TEST(SymbolTable, concurrentCreate) {
+        SymbolTable symbols;
+        const size_t nrThreads = 8;
+        const size_t nrNames = 50000;
+
+        std::vector<std::vector<Symbol>> results(nrThreads);
+        std::vector<std::thread> threads;
+
+        for (size_t t = 0; t < nrThreads; ++t)
+            threads.emplace_back([&, t]() {
+                /* Every thread interns the same names, starting at a
+                   different offset, so that creations race with lookups. */
+                auto & res = results[t];
+                res.resize(nrNames);
+                for (size_t i = 0; i < nrNames; ++i) {
+                    auto n = (i + t * nrNames / nrThreads) % nrNames;
+                    res[n] = symbols.create("name" + std::to_string(n));
+                }
+            });
+
+        for (auto & thread : threads)
+            thread.join();
+
+        ASSERT_EQ(symbols.size(), nrNames);
+        for (size_t i = 0; i < nrNames; ++i) {
+            for (size_t t = 1; t < nrThreads; ++t)
+                ASSERT_EQ(results[0][i], results[t][i]);
+            ASSERT_EQ(symbols[results[0][i]], "name" + std::to_string(i));
+        }
+    }
+
+} /* namespace nix */
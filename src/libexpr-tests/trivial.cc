@@ -71,6 +71,52 @@ namespace nix {
         ASSERT_THAT(*b->value, IsIntEq(2));
     }
 
+    // Large enough to get a hash index (see `Bindings::minIndexedCapacity`).
+    TEST_F(TrivialExpressionTest, largeAttrs) {
+        auto v = eval(R"(
+            let
+              big = builtins.listToAttrs (builtins.genList (n: { name = "a${toString n}"; value = n; }) 1000);
+              updated = big // { a500 = "x"; b = 1; };
+              removed = removeAttrs big [ "a1" ];
+            in
+              [ big.a0 big.a999 (big ? a1000) updated.a500 updated.a501 updated.b (removed ? a1) removed.a2 ]
+        )");
+        ASSERT_THAT(v, IsListOfSize(8));
+        auto items = v.listItems();
+        for (auto & i : items)
+            state.forceValue(*i, noPos);
+        ASSERT_THAT(*items[0], IsIntEq(0));
+        ASSERT_THAT(*items[1], IsIntEq(999));
+        ASSERT_THAT(*items[2], IsFalse());
+        ASSERT_THAT(*items[3], IsStringEq("x"));
+        ASSERT_THAT(*items[4], IsIntEq(501));
+        ASSERT_THAT(*items[5], IsIntEq(1));
+        ASSERT_THAT(*items[6], IsFalse());
+        ASSERT_THAT(*items[7], IsIntEq(2));
+    }
+
+    // Updates of large sets with small ones create overlays (see
+    // `Bindings::maxOverlaySize`), which must behave like a copy.
+    TEST_F(TrivialExpressionTest, updateAttrsOverlay) {
+        auto v = eval(R"(
+            let
+              big = builtins.listToAttrs (builtins.genList (n: { name = "a${toString n}"; value = n; }) 100);
+              chain = builtins.foldl' (acc: n: acc // { "a${toString (n * 5)}" = -n; "b${toString n}" = n; }) big (builtins.genList (n: n) 20);
+            in
+              [ (builtins.length (builtins.attrNames chain)) chain.a5 chain.a8 chain.b19 (chain ? b20) (builtins.head (builtins.attrNames chain)) ]
+        )");
+        ASSERT_THAT(v, IsListOfSize(6));
+        auto items = v.listItems();
+        for (auto & i : items)
+            state.forceValue(*i, noPos);
+        ASSERT_THAT(*items[0], IsIntEq(120));
+        ASSERT_THAT(*items[1], IsIntEq(-1));
+        ASSERT_THAT(*items[2], IsIntEq(8));
+        ASSERT_THAT(*items[3], IsIntEq(19));
+        ASSERT_THAT(*items[4], IsFalse());
+        ASSERT_THAT(*items[5], IsStringEq("a0"));
+    }
+
     TEST_F(TrivialExpressionTest, hasAttrOpFalse) {
         auto v = eval("{} ? a");
         ASSERT_THAT(v, IsFalse());
@@ -40,6 +40,15 @@ TEST(NixStringContextElemTest, slash_invalid) {
         BadStorePath);
 }
 
+TEST(NixStringContextElemTest, intern) {
+    auto a = NixStringContextElem::parse("!out!g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-x.drv");
+    auto b = NixStringContextElem::parse("!out!g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-x.drv");
+    auto c = NixStringContextElem::parse("=g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-x.drv");
+    ASSERT_EQ(&a.intern(), &b.intern());
+    ASSERT_NE(&a.intern(), &c.intern());
+    ASSERT_EQ(a.intern(), a);
+}
+
 /**
  * Round trip (string <-> data structure) test for
  * `NixStringContextElem::Opaque`.
@@ -117,6 +126,73 @@ TEST(NixStringContextElemTest, built_built_xp) {
         NixStringContextElem::parse("!foo!bar!g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-x.drv"),        MissingExperimentalFeature);
 }
 
+class StringContextTest : public LibExprTest
+{
+protected:
+    static NixStringContextElem opaque(std::string_view name)
+    {
+        return NixStringContextElem::parse("g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-" + std::string(name));
+    }
+
+    static const Value::StringContext * make(const NixStringContext & context)
+    {
+        Value v;
+        v.mkString("", context);
+        return v.context();
+    }
+
+    static NixStringContext toSet(const Value::StringContext * context)
+    {
+        Value v;
+        v.mkString("", context);
+        NixStringContext res;
+        copyContext(v, res);
+        return res;
+    }
+};
+
+TEST_F(StringContextTest, mergeNull) {
+    auto a = make({opaque("a")});
+    ASSERT_EQ(mergeContexts(nullptr, nullptr), nullptr);
+    ASSERT_EQ(mergeContexts(a, nullptr), a);
+    ASSERT_EQ(mergeContexts(nullptr, a), a);
+    ASSERT_EQ(mergeContexts(a, a), a);
+}
+
+TEST_F(StringContextTest, mergeSubset) {
+    auto ab = make({opaque("a"), opaque("b")});
+    auto b = make({opaque("b")});
+    ASSERT_EQ(mergeContexts(ab, b), ab);
+    ASSERT_EQ(mergeContexts(b, ab), ab);
+    ASSERT_EQ(mergeContexts(ab, make({opaque("b"), opaque("a")})), ab);
+}
+
+TEST_F(StringContextTest, mergeUnion) {
+    auto ab = make({opaque("a"), opaque("b")});
+    auto bc = make({opaque("c"), opaque("b")});
+    auto abc = mergeContexts(ab, bc);
+    ASSERT_EQ(abc->size, 3u);
+    ASSERT_TRUE(std::is_sorted(abc->begin(), abc->end()));
+    ASSERT_EQ(toSet(abc), (NixStringContext{opaque("a"), opaque("b"), opaque("c")}));
+    ASSERT_EQ(toSet(mergeContexts(bc, ab)), toSet(abc));
+}
+
+/**
+ * Interned elements are ordered by address, which depends on the order
+ * in which they were created; `copyContext()` must not.
+ */
+TEST_F(StringContextTest, copyContextOrder) {
+    auto zy = make({opaque("z")});
+    zy = mergeContexts(zy, make({opaque("y")}));
+    std::vector<std::string> names;
+    for (auto & elem : toSet(zy))
+        names.push_back(elem.to_string());
+    ASSERT_EQ(names, (std::vector<std::string>{
+        "g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-y",
+        "g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-z",
+    }));
+}
+
 #ifndef COVERAGE
 
 RC_GTEST_PROP(
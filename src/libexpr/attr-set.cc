@@ -3,10 +3,20 @@
 
 #include <algorithm>
 
+#include <boost/container/small_vector.hpp>
+
 
 namespace nix {
 
 
+Counter Bindings::nrIndexedLookups;
+Counter Bindings::nrSortedLookups;
+Counter Bindings::nrLayeredLookups;
+Counter Bindings::nrFlattened;
+Counter Bindings::nrFlattenedAttrs;
+
+static_assert(sizeof(Bindings) == 16);
+
 
 /* Allocate a new array of attributes for an attribute set with a specific
    capacity. The space is implicitly reserved after the Bindings
@@ -19,7 +29,47 @@ Bindings * EvalState::allocBindings(size_t capacity)
         throw Error("attribute set of size %d is too big", capacity);
     nrAttrsets++;
     nrAttrsInAttrsets += capacity;
-    return new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity)) Bindings((Bindings::size_t) capacity);
+    auto indexSize = Bindings::indexSize(capacity);
+    nrAttrsetIndexSlots += indexSize;
+    if (currentAllocStats)
+        currentAllocStats->bytes += sizeof(Bindings) + sizeof(Attr) * capacity + sizeof(uint32_t) * indexSize;
+    return new (allocBytes(sizeof(Bindings) + sizeof(Attr) * capacity + sizeof(uint32_t) * indexSize))
+        Bindings((Bindings::size_t) capacity);
+}
+
+
+/* Allocate an overlay that contains the attributes of `overlay` on top
+   of those of `base`, without copying `base`. */
+Bindings * EvalState::allocOverlay(const Bindings & base, const Bindings & overlay)
+{
+    assert(base.layers() < Bindings::maxLayers);
+
+    auto ownSize = overlay.size();
+    nrAttrsets++;
+    nrAttrsInAttrsets += ownSize;
+    nrOpUpdateOverlays++;
+    if (currentAllocStats)
+        currentAllocStats->bytes += sizeof(Bindings) + sizeof(Attr) * ownSize + sizeof(Bindings::Layer);
+
+    auto res = new (allocBytes(sizeof(Bindings) + sizeof(Attr) * ownSize + sizeof(Bindings::Layer)))
+        Bindings(ownSize);
+
+    size_t shadowed = 0;
+    for (auto & attr : overlay) {
+        res->push_back(attr);
+        if (base.get(attr.name))
+            shadowed++;
+    }
+
+    new (res->attrs + ownSize) Bindings::Layer{
+        .base = &base,
+        .ownSize = ownSize,
+        .depth = base.layers() + 1,
+    };
+    res->indexedSize_ = Bindings::overlayMarker;
+    res->size_ = base.size() + ownSize - shadowed;
+
+    return res;
 }
 
 
@@ -40,6 +90,115 @@ Value & BindingsBuilder::alloc(std::string_view name, PosIdx pos)
 void Bindings::sort()
 {
     if (size_) std::sort(begin(), end());
+    buildIndex();
+}
+
+
+void Bindings::buildIndex()
+{
+    if (!size_ || capacity_ < minIndexedCapacity) return;
+
+    auto bits = indexBits(capacity_);
+    auto mask = (std::size_t(1) << bits) - 1;
+    auto idx = index();
+    std::fill(idx, idx + mask + 1, 0);
+
+    /* Insert in order, so that if there are duplicate names (which the
+       sorted array allows), lookups find the first one, like binary
+       search does. */
+    for (size_t n = 0; n < size_; ++n) {
+        auto i = indexSlot(attrs[n].name, bits);
+        while (idx[i]) i = (i + 1) & mask;
+        idx[i] = n + 1;
+    }
+
+    indexedSize_ = size_;
+}
+
+
+const Attr * Bindings::lookupLayered(Symbol name) const
+{
+    if (auto flat = layer()->flattened.load(std::memory_order_acquire))
+        return flat->lookup(name);
+
+    /* Every lookup walks up to `depth` layers. Once that has cost
+       about as much as copying the set, flatten it. */
+    if ((layer()->lookups.fetch_add(1, std::memory_order_relaxed) + 1) * layer()->depth >= size_)
+        return flatten()->lookup(name);
+
+    nrLayeredLookups++;
+
+    for (auto b = this; ; b = b->layer()->base) {
+        if (!b->isOverlay())
+            return b->lookup(name);
+        if (auto flat = b->layer()->flattened.load(std::memory_order_acquire))
+            return flat->lookup(name);
+        auto end = b->attrs + b->layer()->ownSize;
+        auto i = std::lower_bound(b->attrs, end, Attr(name, 0));
+        if (i != end && i->name == name)
+            return i;
+    }
+}
+
+
+const Bindings * Bindings::flatten() const
+{
+    if (auto flat = layer()->flattened.load(std::memory_order_acquire))
+        return flat;
+
+    /* Collect the attributes of all overlays, and find the flat set
+       at the bottom. Upper layers come first, so that after a stable
+       sort, the first of several attributes with the same name is the
+       one that wins. */
+    boost::container::small_vector<Attr, maxOverlaySize * 2> top;
+    const Bindings * bottom = this;
+    while (bottom->isOverlay()) {
+        if (auto flat = bottom->layer()->flattened.load(std::memory_order_acquire)) {
+            bottom = flat;
+            break;
+        }
+        top.insert(top.end(), bottom->attrs, bottom->attrs + bottom->layer()->ownSize);
+        bottom = bottom->layer()->base;
+    }
+    std::stable_sort(top.begin(), top.end());
+    top.erase(
+        std::unique(top.begin(), top.end(), [](const Attr & a, const Attr & b) { return a.name == b.name; }),
+        top.end());
+
+    auto res = new (allocBytes(sizeof(Bindings) + sizeof(Attr) * size_ + sizeof(IndexSlot) * indexSize(size_)))
+        Bindings(size_);
+    res->pos = pos;
+
+    auto i = top.begin();
+    auto j = bottom->attrs;
+    auto jEnd = bottom->attrs + bottom->size_;
+
+    while (i != top.end() && j != jEnd) {
+        if (i->name == j->name) {
+            res->push_back(*i++);
+            ++j;
+        }
+        else if (i->name < j->name)
+            res->push_back(*i++);
+        else
+            res->push_back(*j++);
+    }
+
+    while (i != top.end()) res->push_back(*i++);
+    while (j != jEnd) res->push_back(*j++);
+
+    assert(res->size_ == size_);
+    res->buildIndex();
+
+    /* Another thread may have beaten us to it. */
+    const Bindings * expected = nullptr;
+    if (!layer()->flattened.compare_exchange_strong(expected, res, std::memory_order_acq_rel))
+        return expected;
+
+    nrFlattened++;
+    nrFlattenedAttrs += size_;
+
+    return res;
 }
 
 
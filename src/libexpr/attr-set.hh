@@ -3,8 +3,12 @@
 
 #include "nixexpr.hh"
 #include "symbol-table.hh"
+#include "counter.hh"
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
+#include <limits>
 
 namespace nix {
 
@@ -43,6 +47,22 @@ static_assert(sizeof(Attr) == 2 * sizeof(uint32_t) + sizeof(Value *),
  * by its size and its capacity, the capacity being the number of Attr
  * elements allocated after this structure, while the size corresponds to
  * the number of elements already inserted in this structure.
+ *
+ * Bindings with a capacity of at least `minIndexedCapacity` also have
+ * room for a hash index after the Attr elements: an open-addressing
+ * table of `indexSize(capacity)` slots, keyed on the symbol, that
+ * holds the position (plus one) of each attribute in the sorted array.
+ * The index is (re)built by `sort()` and `buildIndex()`, and is only
+ * used by lookups as long as no attributes have been added since.
+ * Smaller sets are searched using binary search.
+ *
+ * Bindings can also be an *overlay* on top of another set (see
+ * `EvalState::allocOverlay()`), which is how `a // b` avoids copying a
+ * large `a` when `b` is small. An overlay only stores the attributes of
+ * `b`; lookups fall through to the layers below it. Iterating over an
+ * overlay, or looking up attributes in it often enough that walking the
+ * layers costs about as much as a copy, flattens it into a regular set
+ * once, which is then used for all further accesses.
  */
 class Bindings
 {
@@ -50,13 +70,144 @@ public:
     typedef uint32_t size_t;
     PosIdx pos;
 
+    /**
+     * The minimum capacity for which a hash index is allocated. Below
+     * this, binary search touches only a few cache lines anyway.
+     */
+    static constexpr std::size_t minIndexedCapacity = 128;
+
+    /**
+     * Number of lookups that used the hash index and binary search,
+     * respectively.
+     */
+    static Counter nrIndexedLookups, nrSortedLookups, nrLayeredLookups;
+
+    /**
+     * Number of overlays that have been flattened, and the number of
+     * attributes copied to do so.
+     */
+    static Counter nrFlattened, nrFlattenedAttrs;
+
+    /**
+     * `a // b` creates an overlay if `b` has at most `maxOverlaySize`
+     * attributes, `a` has at least `minOverlayBaseSize` attributes and
+     * `a` doesn't have `maxLayers` layers already.
+     */
+    static constexpr std::size_t maxOverlaySize = 16;
+    static constexpr std::size_t minOverlayBaseSize = 64;
+    static constexpr unsigned int maxLayers = 8;
+
+    /**
+     * Bookkeeping of an overlay, stored after its Attr elements.
+     */
+    struct Layer
+    {
+        /**
+         * The set that this overlay is on top of.
+         */
+        const Bindings * base;
+
+        /**
+         * The number of attributes stored in this overlay. (`size_`
+         * is the number of distinct attributes in all layers.)
+         */
+        size_t ownSize;
+
+        /**
+         * The number of layers, including this one.
+         */
+        unsigned int depth;
+
+        std::atomic<size_t> lookups{0};
+
+        /**
+         * A flat copy of this overlay, created on demand by `flatten()`.
+         */
+        std::atomic<const Bindings *> flattened{nullptr};
+    };
+
 private:
     size_t size_, capacity_;
+    /**
+     * The size of the bindings when the index was last built, or
+     * `overlayMarker` if this is an overlay. Overlays have no index,
+     * so their `Layer` is stored where the index would be. This keeps
+     * the header at 16 bytes.
+     */
+    size_t indexedSize_ = 0;
     Attr attrs[0];
 
+    static constexpr size_t overlayMarker = std::numeric_limits<size_t>::max();
+
+    bool isOverlay() const { return indexedSize_ == overlayMarker; }
+
+    /**
+     * The bookkeeping of an overlay, which is mutable even if the
+     * overlay is not.
+     */
+    Layer * layer() const
+    {
+        assert(isOverlay());
+        return reinterpret_cast<Layer *>(const_cast<Attr *>(attrs + capacity_));
+    }
+
     Bindings(size_t capacity) : size_(0), capacity_(capacity) { }
     Bindings(const Bindings & bindings) = delete;
 
+    typedef uint32_t IndexSlot;
+
+    const IndexSlot * index() const
+    {
+        return reinterpret_cast<const IndexSlot *>(attrs + capacity_);
+    }
+
+    IndexSlot * index()
+    {
+        return reinterpret_cast<IndexSlot *>(attrs + capacity_);
+    }
+
+    static std::size_t indexBits(std::size_t capacity)
+    {
+        return std::bit_width(capacity * 2 - 1);
+    }
+
+    static std::size_t indexSlot(Symbol name, std::size_t bits)
+    {
+        /* Fibonacci hashing, since symbol ids are dense. */
+        return (name.id * UINT64_C(0x9e3779b97f4a7c15)) >> (64 - bits);
+    }
+
+    const Attr * lookupLayered(Symbol name) const;
+
+    /**
+     * Return a flat copy of an overlay.
+     */
+    const Bindings * flatten() const;
+
+    const Attr * lookup(Symbol name) const
+    {
+        if (isOverlay()) [[unlikely]]
+            return lookupLayered(name);
+
+        if (size_ && indexedSize_ == size_) {
+            nrIndexedLookups++;
+            auto bits = indexBits(capacity_);
+            auto mask = (std::size_t(1) << bits) - 1;
+            auto idx = index();
+            for (auto i = indexSlot(name, bits); ; i = (i + 1) & mask) {
+                auto slot = idx[i];
+                if (!slot) return nullptr;
+                if (attrs[slot - 1].name == name) return &attrs[slot - 1];
+            }
+        }
+
+        nrSortedLookups++;
+        Attr key(name, 0);
+        const_iterator i = std::lower_bound(&attrs[0], &attrs[size_], key);
+        if (i != &attrs[size_] && i->name == name) return &*i;
+        return nullptr;
+    }
+
 public:
     size_t size() const { return size_; }
 
@@ -66,46 +217,74 @@ public:
 
     typedef const Attr * const_iterator;
 
+    /**
+     * The number of layers of the set, 1 for a set that is not an
+     * overlay.
+     */
+    unsigned int layers() const { return isOverlay() ? layer()->depth : 1; }
+
     void push_back(const Attr & attr)
     {
-        assert(size_ < capacity_);
+        assert(!isOverlay() && size_ < capacity_);
         attrs[size_++] = attr;
     }
 
+    /**
+     * Note: comparing the result with `end()` flattens overlays, so
+     * `get()` should be preferred.
+     */
     const_iterator find(Symbol name) const
     {
-        Attr key(name, 0);
-        const_iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return i;
-        return end();
+        auto i = lookup(name);
+        return i ? i : end();
     }
 
     const Attr * get(Symbol name) const
     {
-        Attr key(name, 0);
-        const_iterator i = std::lower_bound(begin(), end(), key);
-        if (i != end() && i->name == name) return &*i;
-        return nullptr;
+        return lookup(name);
     }
 
-    iterator begin() { return &attrs[0]; }
-    iterator end() { return &attrs[size_]; }
+    /**
+     * Mutable access is only for building sets, which are never
+     * overlays.
+     */
+    iterator begin() { assert(!isOverlay()); return &attrs[0]; }
+    iterator end() { assert(!isOverlay()); return &attrs[size_]; }
 
-    const_iterator begin() const { return &attrs[0]; }
-    const_iterator end() const { return &attrs[size_]; }
+    const_iterator begin() const { return isOverlay() ? flatten()->attrs : &attrs[0]; }
+    const_iterator end() const { return isOverlay() ? flatten()->attrs + size_ : &attrs[size_]; }
 
     Attr & operator[](size_t pos)
     {
-        return attrs[pos];
+        return begin()[pos];
     }
 
     const Attr & operator[](size_t pos) const
     {
-        return attrs[pos];
+        return begin()[pos];
     }
 
+    /**
+     * Sort the attributes by symbol, and rebuild the index if there is
+     * one.
+     */
     void sort();
 
+    /**
+     * Rebuild the index of bindings that are already sorted. This is a
+     * no-op if the capacity is too small to have an index.
+     */
+    void buildIndex();
+
+    /**
+     * The number of index slots allocated for bindings of the given
+     * capacity, or 0 if they don't have an index.
+     */
+    static std::size_t indexSize(std::size_t capacity)
+    {
+        return capacity >= minIndexedCapacity ? std::size_t(1) << indexBits(capacity) : 0;
+    }
+
     size_t capacity() const { return capacity_; }
 
     /**
@@ -115,8 +294,8 @@ public:
     {
         std::vector<const Attr *> res;
         res.reserve(size_);
-        for (size_t n = 0; n < size_; n++)
-            res.emplace_back(&attrs[n]);
+        for (auto & attr : *this)
+            res.emplace_back(&attr);
         std::sort(res.begin(), res.end(), [&](const Attr * a, const Attr * b) {
             std::string_view sa = symbols[a->name], sb = symbols[b->name];
             return sa < sb;
@@ -173,6 +352,7 @@ public:
 
     Bindings * alreadySorted()
     {
+        bindings->buildIndex();
         return bindings;
     }
 
@@ -0,0 +1,73 @@
+#pragma once
+///@file
+
+#include <atomic>
+#include <cstdint>
+
+namespace nix {
+
+/**
+ * An atomic counter for evaluator statistics, aligned on a cache line
+ * to prevent false sharing between evaluator threads.
+ *
+ * Counting is only done when `enabled` is set (i.e. when statistics
+ * are requested through `NIX_SHOW_STATS`), so that parallel evaluation
+ * doesn't contend on these counters when nobody looks at them.
+ */
+struct alignas(64) Counter
+{
+    using value_type = uint64_t;
+
+    std::atomic<value_type> inner{0};
+
+    static bool enabled;
+
+    Counter() { }
+
+    operator value_type() const noexcept
+    {
+        return inner;
+    }
+
+    void operator =(value_type n) noexcept
+    {
+        inner = n;
+    }
+
+    value_type load() const noexcept
+    {
+        return inner;
+    }
+
+    value_type operator ++() noexcept
+    {
+        return enabled ? ++inner : 0;
+    }
+
+    value_type operator ++(int) noexcept
+    {
+        return enabled ? inner++ : 0;
+    }
+
+    value_type operator --() noexcept
+    {
+        return enabled ? --inner : 0;
+    }
+
+    value_type operator --(int) noexcept
+    {
+        return enabled ? inner-- : 0;
+    }
+
+    value_type operator +=(value_type n) noexcept
+    {
+        return enabled ? inner += n : 0;
+    }
+
+    value_type operator -=(value_type n) noexcept
+    {
+        return enabled ? inner -= n : 0;
+    }
+};
+
+}
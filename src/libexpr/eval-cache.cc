@@ -149,17 +149,17 @@ struct AttrDb
     AttrId setString(
         AttrKey key,
         std::string_view s,
-        const char * * context = nullptr)
+        const NixStringContext * context = nullptr)
     {
         return doSQLite([&]()
         {
             auto state(_state->lock());
 
-            if (context) {
+            if (context && !context->empty()) {
                 std::string ctx;
-                for (const char * * p = context; *p; ++p) {
-                    if (p != context) ctx.push_back(' ');
-                    ctx.append(*p);
+                for (auto & elem : *context) {
+                    if (!ctx.empty()) ctx.push_back(' ');
+                    ctx.append(elem.to_string());
                 }
                 state->insertAttributeWithContext.use()
                     (key.first)
@@ -461,9 +461,14 @@ Value & AttrCursor::forceValue()
     }
 
     if (root->db && (!cachedValue || std::get_if<placeholder_t>(&cachedValue->second))) {
-        if (v.type() == nString)
-            cachedValue = {root->db->setString(getKey(), v.c_str(), v.context()),
+        if (v.type() == nString) {
+            /* Copy the context into a set, so that it's stored in a
+               deterministic order. */
+            NixStringContext context;
+            copyContext(v, context);
+            cachedValue = {root->db->setString(getKey(), v.c_str(), &context),
                            string_t{v.c_str(), {}}};
+        }
         else if (v.type() == nPath) {
             auto path = v.path().path;
             cachedValue = {root->db->setString(getKey(), path.abs()), string_t{path.abs(), {}}};
@@ -5,6 +5,8 @@
 #include "serialise.hh"
 #include "eval-gc.hh"
 
+#include <atomic>
+
 #if HAVE_BOEHMGC
 
 #  include <pthread.h>
@@ -32,6 +34,27 @@ static void * oomHandler(size_t requested)
     throw std::bad_alloc();
 }
 
+static std::atomic<uint64_t> gcPauses{0};
+static std::atomic<uint64_t> gcPauseTotalNs{0};
+static std::atomic<uint64_t> gcPauseMaxNs{0};
+
+/* Called by the Boehm GC, with its allocation lock held, at the start
+   and end of every collection. */
+static void onCollectionEvent(GC_EventType event)
+{
+    static std::chrono::steady_clock::time_point start;
+
+    if (event == GC_EVENT_START)
+        start = std::chrono::steady_clock::now();
+    else if (event == GC_EVENT_END) {
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        gcPauses++;
+        gcPauseTotalNs += ns;
+        if (ns > gcPauseMaxNs) gcPauseMaxNs = ns;
+    }
+}
+
 static inline void initGCReal()
 {
     /* Initialise the Boehm garbage collector. */
@@ -52,6 +75,8 @@ static inline void initGCReal()
 
     GC_set_oom_fn(oomHandler);
 
+    GC_set_on_collection_event(onCollectionEvent);
+
     /* Set the initial heap size to something fairly big (25% of
        physical RAM, up to a maximum of 384 MiB) so that in most cases
        we don't need to garbage collect at all.  (Collection has a
@@ -85,6 +110,15 @@ size_t getGCCycles()
     return static_cast<size_t>(GC_get_gc_no()) - gcCyclesAfterInit;
 }
 
+GCPauseStats getGCPauseStats()
+{
+    return {
+        .number = gcPauses,
+        .total = std::chrono::nanoseconds(gcPauseTotalNs),
+        .max = std::chrono::nanoseconds(gcPauseMaxNs),
+    };
+}
+
 #endif
 
 static bool gcInitialised = false;
@@ -1,7 +1,9 @@
 #pragma once
 ///@file
 
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 
 #if HAVE_BOEHMGC
 
@@ -48,6 +50,20 @@ void assertGCInitialized();
  * The number of GC cycles since initGC().
  */
 size_t getGCCycles();
+
+struct GCPauseStats
+{
+    uint64_t number = 0;
+    std::chrono::nanoseconds total{0};
+    std::chrono::nanoseconds max{0};
+};
+
+/**
+ * The number of garbage collections since initGC(), and the total and
+ * longest time that they paused the evaluator, as reported by the
+ * collector's collection event callbacks.
+ */
+GCPauseStats getGCPauseStats();
 #endif
 
 } // namespace nix
@@ -24,6 +24,19 @@ inline void * allocBytes(size_t n)
     return p;
 }
 
+/**
+ * Allocate memory for a string, which is not scanned by the garbage
+ * collector and not zeroed.
+ */
+[[gnu::always_inline]]
+inline char * allocString(size_t size)
+{
+    char * t;
+    t = (char *) GC_MALLOC_ATOMIC(size);
+    if (!t) throw std::bad_alloc();
+    return t;
+}
+
 
 [[gnu::always_inline]]
 Value * EvalState::allocValue()
@@ -33,10 +46,8 @@ Value * EvalState::allocValue()
        GC_malloc_many returns a linked list of objects of the given size, where the first word
        of each object is also the pointer to the next object in the list. This also means that we
        have to explicitly clear the first word of every object we take. */
-    if (!*valueAllocCache) {
-        *valueAllocCache = GC_malloc_many(sizeof(Value));
-        if (!*valueAllocCache) throw std::bad_alloc();
-    }
+    if (!valueAllocCache || !*valueAllocCache) [[unlikely]]
+        refillAllocCache(valueAllocCache, sizeof(Value));
 
     /* GC_NEXT is a convenience macro for accessing the first word of an object.
        Take the first list item, advance the list to the next item, and clear the next pointer. */
@@ -48,6 +59,10 @@ Value * EvalState::allocValue()
 #endif
 
     nrValues++;
+    if (currentAllocStats) [[unlikely]] {
+        currentAllocStats->values++;
+        currentAllocStats->bytes += sizeof(Value);
+    }
     return (Value *) p;
 }
 
@@ -57,16 +72,18 @@ Env & EvalState::allocEnv(size_t size)
 {
     nrEnvs++;
     nrValuesInEnvs += size;
+    if (currentAllocStats) [[unlikely]] {
+        currentAllocStats->envs++;
+        currentAllocStats->bytes += sizeof(Env) + size * sizeof(Value *);
+    }
 
     Env * env;
 
 #if HAVE_BOEHMGC
     if (size == 1) {
         /* see allocValue for explanations. */
-        if (!*env1AllocCache) {
-            *env1AllocCache = GC_malloc_many(sizeof(Env) + sizeof(Value *));
-            if (!*env1AllocCache) throw std::bad_alloc();
-        }
+        if (!env1AllocCache || !*env1AllocCache) [[unlikely]]
+            refillAllocCache(env1AllocCache, sizeof(Env) + sizeof(Value *));
 
         void * p = *env1AllocCache;
         *env1AllocCache = GC_NEXT(p);
@@ -85,9 +102,15 @@ Env & EvalState::allocEnv(size_t size)
 [[gnu::always_inline]]
 void EvalState::forceValue(Value & v, const PosIdx pos)
 {
-    if (v.isThunk()) {
+    auto type = v.getInternalType();
+    if (type == tThunk) {
+        if (executor) [[unlikely]]
+            return forceValueParallel(v, pos);
         Env * env = v.payload.thunk.env;
         Expr * expr = v.payload.thunk.expr;
+        nrThunksForced++;
+        if (currentAllocStats) [[unlikely]]
+            currentAllocStats->thunksForced++;
         try {
             v.mkBlackhole();
             //checkInterrupt();
@@ -98,8 +121,13 @@ void EvalState::forceValue(Value & v, const PosIdx pos)
             throw;
         }
     }
-    else if (v.isApp())
+    else if (type == tApp) {
+        if (executor) [[unlikely]]
+            return forceValueParallel(v, pos);
         callFunction(*v.payload.app.left, *v.payload.app.right, v, pos);
+    }
+    else if (type == tBlackhole || type == tPending || type == tAwaited) [[unlikely]]
+        forceValueParallel(v, pos);
 }
 
 
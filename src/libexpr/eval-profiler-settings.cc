@@ -0,0 +1,40 @@
+#include "eval-profiler-settings.hh"
+#include "args.hh"
+#include "abstract-setting-to-json.hh"
+#include "logging.hh"
+#include "config-impl.hh"
+
+#include <nlohmann/json.hpp>
+
+namespace nix {
+
+NLOHMANN_JSON_SERIALIZE_ENUM(EvalProfilerMode, {
+    {EvalProfilerMode::Disabled, "disabled"},
+    {EvalProfilerMode::Flamegraph, "flamegraph"},
+});
+
+template<> EvalProfilerMode BaseSetting<EvalProfilerMode>::parse(const std::string & str) const
+{
+    if (str == "disabled") return EvalProfilerMode::Disabled;
+    else if (str == "flamegraph") return EvalProfilerMode::Flamegraph;
+    else throw UsageError("option '%s' has invalid value '%s'", name, str);
+}
+
+template<> struct BaseSetting<EvalProfilerMode>::trait
+{
+    static constexpr bool appendable = false;
+};
+
+template<> std::string BaseSetting<EvalProfilerMode>::to_string() const
+{
+    if (value == EvalProfilerMode::Disabled) return "disabled";
+    else if (value == EvalProfilerMode::Flamegraph) return "flamegraph";
+    else unreachable();
+}
+
+/* Instantiated here rather than where `EvalSettings` is defined,
+   since `config-impl.hh` can't be included together with
+   `globals.hh`. */
+template class BaseSetting<EvalProfilerMode>;
+
+}
@@ -0,0 +1,13 @@
+#pragma once
+///@file
+
+#include "config.hh"
+
+namespace nix {
+
+enum struct EvalProfilerMode { Disabled, Flamegraph };
+
+template<> EvalProfilerMode BaseSetting<EvalProfilerMode>::parse(const std::string & str) const;
+template<> std::string BaseSetting<EvalProfilerMode>::to_string() const;
+
+}
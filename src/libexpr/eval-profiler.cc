@@ -0,0 +1,89 @@
+#include "eval-profiler.hh"
+#include "eval.hh"
+#include "file-system.hh"
+
+namespace nix {
+
+thread_local std::vector<EvalProfiler::Frame> EvalProfiler::stack;
+
+thread_local uint64_t EvalProfiler::lastTick = 0;
+
+EvalProfiler::EvalProfiler(EvalState & state, Path profileFile, unsigned int frequency)
+    : state(state)
+    , profileFile(std::move(profileFile))
+{
+    if (frequency == 0)
+        throw UsageError("'eval-profiler-frequency' must be greater than 0");
+
+    lastTick = tick;
+
+    timerThread = std::thread([this, interval = std::chrono::nanoseconds(1000000000 / frequency)]() {
+        auto next = std::chrono::steady_clock::now();
+        auto timerState_(timerState.lock());
+        while (!timerState_->quit) {
+            next += interval;
+            timerState_.wait_until(timerWakeup, next);
+            tick++;
+        }
+    });
+}
+
+EvalProfiler::~EvalProfiler()
+{
+    timerState.lock()->quit = true;
+    timerWakeup.notify_one();
+    timerThread.join();
+
+    try {
+        writeProfile();
+    } catch (...) {
+        ignoreExceptionInDestructor();
+    }
+}
+
+void EvalProfiler::sample()
+{
+    lastTick = tick.load(std::memory_order_relaxed);
+    (*samples.lock())[stack]++;
+}
+
+std::string EvalProfiler::showFrame(const Frame & frame)
+{
+    return std::visit(overloaded {
+        [&](const ExprLambda * lambda) {
+            return fmt("%s at %s",
+                lambda->name ? std::string(state.symbols[lambda->name]) : "anonymous lambda",
+                state.positions[lambda->pos]);
+        },
+        [&](const PrimOp * primOp) {
+            return "builtins." + primOp->name;
+        },
+    }, frame);
+}
+
+void EvalProfiler::writeProfile()
+{
+    /* Different lambdas can have the same name and position (e.g. if
+       a file was parsed twice), so merge their stacks. */
+    std::map<std::string, uint64_t> folded;
+
+    for (auto & [frames, count] : *samples.lock()) {
+        std::string s;
+        for (auto & frame : frames) {
+            if (!s.empty()) s += ';';
+            /* Semicolons separate frames. */
+            auto f = showFrame(frame);
+            std::replace(f.begin(), f.end(), ';', ',');
+            s += f;
+        }
+        folded[s] += count;
+    }
+
+    std::string res;
+    for (auto & [s, count] : folded)
+        res += fmt("%s %d\n", s, count);
+
+    writeFile(profileFile, res);
+}
+
+}
@@ -0,0 +1,111 @@
+#pragma once
+///@file
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <thread>
+#include <variant>
+#include <vector>
+
+#include "sync.hh"
+#include "types.hh"
+
+namespace nix {
+
+class EvalState;
+struct ExprLambda;
+struct PrimOp;
+
+/**
+ * A sampling profiler for the evaluator, enabled by the
+ * `eval-profiler` setting.
+ *
+ * Each thread keeps a stack of the lambdas and primops that it is
+ * currently calling. A timer thread ticks `eval-profiler-frequency`
+ * times per second, and the first function call on each thread after a
+ * tick records that thread's stack. So unlike `trace-function-calls`,
+ * a function call only costs a push, a pop and an atomic load.
+ *
+ * Samples are only taken at function calls, so time spent in a single
+ * long-running primop without calls back into the evaluator (e.g.
+ * fetching a tarball) is under-represented.
+ *
+ * When the profiler is destroyed, it writes the samples to
+ * `eval-profile-file` in the "folded stacks" format that is understood
+ * by `flamegraph.pl`, speedscope and similar tools.
+ */
+class EvalProfiler
+{
+public:
+
+    using Frame = std::variant<const ExprLambda *, const PrimOp *>;
+
+private:
+
+    EvalState & state;
+
+    const Path profileFile;
+
+    /**
+     * Incremented by the timer thread every sampling interval.
+     */
+    std::atomic<uint64_t> tick{0};
+
+    struct TimerState
+    {
+        bool quit = false;
+    };
+
+    Sync<TimerState> timerState;
+
+    std::condition_variable timerWakeup;
+
+    std::thread timerThread;
+
+    /**
+     * The number of samples for each distinct stack, outermost frame
+     * first.
+     */
+    Sync<std::map<std::vector<Frame>, uint64_t>> samples;
+
+    static thread_local std::vector<Frame> stack;
+
+    static thread_local uint64_t lastTick;
+
+    [[gnu::noinline]]
+    void sample();
+
+    std::string showFrame(const Frame & frame);
+
+    void writeProfile();
+
+public:
+
+    EvalProfiler(EvalState & state, Path profileFile, unsigned int frequency);
+
+    ~EvalProfiler();
+
+    /**
+     * Records that the current thread is calling a function for the
+     * lifetime of this object.
+     */
+    struct Call
+    {
+        Call(EvalProfiler & profiler, Frame frame)
+        {
+            stack.push_back(frame);
+            if (lastTick != profiler.tick.load(std::memory_order_relaxed)) [[unlikely]]
+                profiler.sample();
+        }
+
+        ~Call()
+        {
+            stack.pop_back();
+        }
+
+        Call(const Call &) = delete;
+    };
+};
+
+}
@@ -2,6 +2,7 @@
 ///@file
 
 #include "config.hh"
+#include "eval-profiler-settings.hh"
 #include "ref.hh"
 
 namespace nix {
@@ -193,6 +194,37 @@ struct EvalSettings : Config
           `flamegraph.pl`.
         )"};
 
+    Setting<EvalProfilerMode> evalProfiler{this, EvalProfilerMode::Disabled, "eval-profiler",
+        R"(
+          Enables the sampling profiler for the evaluator. Possible values are:
+
+          - `disabled`: Don't profile.
+
+          - `flamegraph`: Periodically record the stack of lambdas and
+            builtins being called, and write the result to
+            [`eval-profile-file`](#conf-eval-profile-file) in the
+            folded stack format, which can be turned into a flame graph
+            using `flamegraph.pl` or loaded into tools like
+            [speedscope](https://www.speedscope.app/).
+
+          Unlike [`trace-function-calls`](#conf-trace-function-calls),
+          this has little overhead, so it can be used on large
+          evaluations such as NixOS systems. Lambdas are identified by
+          their name and the position of their definition.
+        )"};
+
+    Setting<Path> evalProfileFile{this, "nix.profile", "eval-profile-file",
+        R"(
+          The file to which the evaluation profile is written when
+          [`eval-profiler`](#conf-eval-profiler) is enabled.
+        )"};
+
+    Setting<unsigned int> evalProfilerFrequency{this, 99, "eval-profiler-frequency",
+        R"(
+          The number of times per second that the
+          [`eval-profiler`](#conf-eval-profiler) samples the call stack.
+        )"};
+
     Setting<bool> useEvalCache{this, true, "eval-cache",
         R"(
             Whether to use the flake evaluation cache.
@@ -200,6 +232,26 @@ struct EvalSettings : Config
             Intermediate results are not cached.
         )"};
 
+    Setting<bool> parseCache{this, false, "parse-cache",
+        R"(
+          Whether to cache the result of parsing Nix files on disk, in
+          `$XDG_CACHE_HOME/nix/parse-cache-v1`. Cache entries are keyed
+          on the contents of the file, so parsing a file that hasn't
+          changed since it was last parsed only requires reading its
+          syntax tree from the cache.
+
+          Warnings emitted by the parser are not repeated when a file
+          is loaded from the cache.
+        )"};
+
+    Setting<uint64_t> parseCacheSize{this, 1024 * 1024 * 1024, "parse-cache-size",
+        R"(
+          The maximum size in bytes of the parse cache (see
+          [`parse-cache`](#conf-parse-cache)). When it grows larger,
+          the least recently used entries are removed. `0` means no
+          limit.
+        )"};
+
     Setting<bool> ignoreExceptionsDuringTry{this, false, "ignore-try",
         R"(
           If set to true, ignore exceptions inside 'tryEval' calls when evaluating nix expressions in
@@ -212,6 +264,27 @@ struct EvalSettings : Config
     Setting<unsigned int> maxCallDepth{this, 10000, "max-call-depth",
         "The maximum function call depth to allow before erroring."};
 
+    Setting<unsigned int> evalCores{this, 1, "eval-cores",
+        R"(
+          The number of threads used to evaluate Nix expressions. If
+          set to a value greater than 1, Nix starts `eval-cores - 1`
+          worker threads that force the attributes of attribute sets
+          in parallel while the main thread forces them deeply, e.g.
+          in `nix eval --json`, `nix-instantiate --eval --strict` and
+          `builtins.deepSeq`.
+
+          The result of evaluation is the same as with a single thread.
+          Side effects such as
+          [`builtins.trace`](@docroot@/language/builtins.md#builtins-trace),
+          `builtins.warn`, fetching, writing to the store (e.g.
+          `builtins.toFile`, `builtins.path`, copying paths and
+          instantiating derivations) and import-from-derivation only
+          happen on the main thread, in the same order as with a single
+          thread.
+          Parallel evaluation is disabled when the debugger is enabled
+          or `NIX_COUNT_CALLS` is set.
+        )"};
+
     Setting<bool> builtinsTraceDebugger{this, false, "debugger-on-trace",
         R"(
           If set to true and the `--debugger` flag is given, the following functions
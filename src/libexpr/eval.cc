@@ -10,6 +10,8 @@
 #include "downstream-placeholder.hh"
 #include "eval-inline.hh"
 #include "filetransfer.hh"
+#include "eval-profiler.hh"
+#include "finally.hh"
 #include "function-trace.hh"
 #include "profiles.hh"
 #include "print.hh"
@@ -19,6 +21,8 @@
 #include "url.hh"
 #include "fetch-to-store.hh"
 #include "tarball.hh"
+#include "parallel-eval.hh"
+#include "parse-cache.hh"
 #include "parser-tab.hh"
 
 #include <algorithm>
@@ -44,15 +48,6 @@ using json = nlohmann::json;
 
 namespace nix {
 
-static char * allocString(size_t size)
-{
-    char * t;
-    t = (char *) GC_MALLOC_ATOMIC(size);
-    if (!t) throw std::bad_alloc();
-    return t;
-}
-
-
 // When there's no need to write to the string, we can optimize away empty
 // string allocations.
 // This function handles makeImmutableString(std::string_view()) by returning
@@ -134,6 +129,7 @@ std::string showType(const Value & v)
             return fmt("the partially applied built-in function '%s'", std::string(getPrimOp(v)->payload.primOp->name));
         case tExternal: return v.external()->showType();
         case tThunk: return v.isBlackhole() ? "a black hole" : "a thunk";
+        case tBlackhole: return "a black hole";
         case tApp: return "a function application";
     default:
         return std::string(showType(v.type()));
@@ -160,6 +156,9 @@ bool Value::isTrivial() const
     return
         internalType != tApp
         && internalType != tPrimOpApp
+        && internalType != tBlackhole
+        && internalType != tPending
+        && internalType != tAwaited
         && (internalType != tThunk
             || (dynamic_cast<ExprAttrs *>(payload.thunk.expr)
                 && ((ExprAttrs *) payload.thunk.expr)->dynamicAttrs.empty())
@@ -269,11 +268,8 @@ EvalState::EvalState(
     , buildStore(buildStore ? buildStore : store)
     , debugRepl(nullptr)
     , debugStop(false)
-    , trylevel(0)
     , regexCache(makeRegexCache())
 #if HAVE_BOEHMGC
-    , valueAllocCache(std::allocate_shared<void *>(traceable_allocator<void *>(), nullptr))
-    , env1AllocCache(std::allocate_shared<void *>(traceable_allocator<void *>(), nullptr))
     , baseEnvP(std::allocate_shared<Env *>(traceable_allocator<Env *>(), &allocEnv(BASE_ENV_SIZE)))
     , baseEnv(**baseEnvP)
 #else
@@ -285,6 +281,8 @@ EvalState::EvalState(
     internalFS->setPathDisplay("«nix-internal»", "");
 
     countCalls = getEnv("NIX_COUNT_CALLS").value_or("0") != "0";
+    if (countCalls)
+        currentAllocStats = &topLevelAllocStats;
 
     assertGCInitialized();
 
@@ -327,13 +325,85 @@ EvalState::EvalState(
     );
 
     createBaseEnv();
+
+    /* Function call counting isn't thread-safe. */
+    if (settings.evalCores > 1 && !countCalls)
+        executor = std::make_unique<Executor>(*this, settings.evalCores);
+
+    if (settings.evalProfiler == EvalProfilerMode::Flamegraph)
+        profiler = std::make_unique<EvalProfiler>(*this, settings.evalProfileFile, settings.evalProfilerFrequency);
 }
 
 
 EvalState::~EvalState()
 {
+    /* Stop the workers before tearing down the state they use. */
+    if (executor)
+        executor->stop();
+
+    /* Write the profile while the symbols and positions it refers to
+       still exist. */
+    profiler.reset();
+}
+
+
+bool Counter::enabled = getEnv("NIX_SHOW_STATS").value_or("0") != "0";
+
+thread_local size_t EvalState::callDepth = 0;
+thread_local int EvalState::trylevel = 0;
+
+thread_local EvalPhase EvalState::currentPhase = EvalPhase::Eval;
+thread_local std::chrono::steady_clock::time_point EvalState::currentPhaseStart;
+
+EvalState::PhaseTimer::PhaseTimer(EvalState & state, EvalPhase phase)
+    : state(state)
+    , prevPhase(currentPhase)
+    , enabled(Counter::enabled)
+{
+    if (!enabled) return;
+    auto now = std::chrono::steady_clock::now();
+    if (currentPhase != EvalPhase::Eval)
+        state.phaseTime[(size_t) currentPhase] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - currentPhaseStart).count();
+    state.phaseCount[(size_t) phase]++;
+    currentPhase = phase;
+    currentPhaseStart = now;
+}
+
+EvalState::PhaseTimer::~PhaseTimer()
+{
+    if (!enabled) return;
+    auto now = std::chrono::steady_clock::now();
+    if (currentPhase != EvalPhase::Eval)
+        state.phaseTime[(size_t) currentPhase] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - currentPhaseStart).count();
+    currentPhase = prevPhase;
+    currentPhaseStart = now;
 }
 
+AllocStats & AllocStats::operator += (const AllocStats & other)
+{
+    values += other.values;
+    envs += other.envs;
+    bytes += other.bytes;
+    thunksForced += other.thunksForced;
+    return *this;
+}
+
+#if HAVE_BOEHMGC
+thread_local void * * EvalState::valueAllocCache = nullptr;
+thread_local void * * EvalState::env1AllocCache = nullptr;
+
+void EvalState::refillAllocCache(void * * & cache, size_t size)
+{
+    if (!cache) {
+        cache = (void * *) GC_MALLOC_UNCOLLECTABLE(sizeof(void *));
+        if (!cache) throw std::bad_alloc();
+        *cache = nullptr;
+    }
+    *cache = GC_malloc_many(size);
+    if (!*cache) throw std::bad_alloc();
+}
+#endif
+
 
 void EvalState::allowPath(const Path & path)
 {
@@ -525,7 +595,7 @@ Value * EvalState::addPrimOp(PrimOp && primOp)
 
 Value & EvalState::getBuiltin(const std::string & name)
 {
-    return *baseEnv.values[0]->attrs()->find(symbols.create(name))->value;
+    return *baseEnv.values[0]->attrs()->get(symbols.create(name))->value;
 }
 
 
@@ -587,7 +657,7 @@ std::optional<EvalState::Doc> EvalState::getDoc(Value & v)
     }
     if (isFunctor(v)) {
         try {
-            Value & functor = *v.attrs()->find(sFunctor)->value;
+            Value & functor = *v.attrs()->get(sFunctor)->value;
             Value * vp = &v;
             Value partiallyApplied;
             // The first paramater is not user-provided, and may be
@@ -812,30 +882,106 @@ DebugTraceStacker::DebugTraceStacker(EvalState & evalState, DebugTrace t)
         evalState.runDebugRepl(nullptr, trace.env, trace.expr);
 }
 
+/**
+ * The part of `s` before the first NUL byte. Strings are also read
+ * through `c_str()`, so their length must not include anything after
+ * an embedded NUL (e.g. from `builtins.fromJSON "\"a\\u0000b\""`).
+ */
+static std::string_view upToNul(std::string_view s)
+{
+    return s.substr(0, s.find('\0'));
+}
+
 void Value::mkString(std::string_view s)
 {
-    mkString(makeImmutableString(s));
+    s = upToNul(s);
+    mkString(makeImmutableString(s), s.size(), nullptr);
 }
 
 
-static const char * * encodeContext(const NixStringContext & context)
+/**
+ * Copy the contents of a rope to `dest`, which must have room for
+ * `rope.length` bytes. Ropes built by repeated appends are as deep as
+ * they are long, so this uses an explicit stack rather than recursion.
+ */
+static void copyRope(const Value::StringRope & rope, char * dest)
 {
-    if (!context.empty()) {
-        size_t n = 0;
-        auto ctx = (const char * *)
-            allocBytes((context.size() + 1) * sizeof(char *));
-        for (auto & i : context) {
-            ctx[n++] = makeImmutableString({i.to_string()});
+    std::vector<const Value::StringRope::Part *> todo;
+
+    auto pushParts = [&](const Value::StringRope & rope) {
+        for (size_t n = rope.size; n > 0; --n)
+            todo.push_back(&rope.parts[n - 1]);
+    };
+
+    pushParts(rope);
+
+    while (!todo.empty()) {
+        auto part = todo.back();
+        todo.pop_back();
+        if (!part->rope)
+            memcpy(dest, part->s, part->length);
+        else if (auto flat = part->rope->flat.load(std::memory_order_acquire))
+            memcpy(dest, flat, part->length);
+        else {
+            pushParts(*part->rope);
+            continue;
         }
-        ctx[n] = nullptr;
-        return ctx;
-    } else
-        return nullptr;
+        dest += part->length;
+    }
+}
+
+const char * Value::flattenRope(const StringRope & rope)
+{
+    if (auto flat = rope.flat.load(std::memory_order_acquire))
+        return flat;
+
+    auto s = allocString(rope.length + 1);
+    copyRope(rope, s);
+    s[rope.length] = 0;
+
+    /* Another thread may have flattened the rope in the meantime, in
+       which case we use its copy. */
+    const char * expected = nullptr;
+    if (!rope.flat.compare_exchange_strong(expected, s, std::memory_order_acq_rel))
+        return expected;
+    return s;
+}
+
+
+static Value::StringContext * allocStringContext(size_t size)
+{
+    auto ctx = (Value::StringContext *)
+        allocBytes(sizeof(Value::StringContext) + size * sizeof(const NixStringContextElem *));
+    ctx->size = size;
+    return ctx;
+}
+
+static const Value::StringContext * encodeContext(const NixStringContext & context)
+{
+    if (context.empty()) return nullptr;
+    auto ctx = allocStringContext(context.size());
+    size_t n = 0;
+    for (auto & i : context)
+        ctx->elems[n++] = &i.intern();
+    std::sort(ctx->elems, ctx->elems + n);
+    return ctx;
+}
+
+const Value::StringContext * mergeContexts(const Value::StringContext * a, const Value::StringContext * b)
+{
+    if (!a) return b;
+    if (!b || a == b) return a;
+    if (std::includes(a->begin(), a->end(), b->begin(), b->end())) return a;
+    if (std::includes(b->begin(), b->end(), a->begin(), a->end())) return b;
+    auto ctx = allocStringContext(a->size + b->size);
+    ctx->size = std::set_union(a->begin(), a->end(), b->begin(), b->end(), ctx->elems) - ctx->elems;
+    return ctx;
 }
 
 void Value::mkString(std::string_view s, const NixStringContext & context)
 {
-    mkString(makeImmutableString(s), encodeContext(context));
+    s = upToNul(s);
+    mkString(makeImmutableString(s), s.size(), encodeContext(context));
 }
 
 void Value::mkStringMove(const char * s, const NixStringContext & context)
@@ -843,6 +989,11 @@ void Value::mkStringMove(const char * s, const NixStringContext & context)
     mkString(s, encodeContext(context));
 }
 
+void Value::mkStringMove(const char * s, size_t length, const NixStringContext & context)
+{
+    mkString(s, length, encodeContext(context));
+}
+
 void Value::mkPath(const SourcePath & path)
 {
     mkPath(&*path.accessor, makeImmutableString(path.path.abs()));
@@ -879,13 +1030,15 @@ ListBuilder::ListBuilder(EvalState & state, size_t size)
     , elems(size <= 2 ? inlineElems : (Value * *) allocBytes(size * sizeof(Value *)))
 {
     state.nrListElems += size;
+    if (state.currentAllocStats && size > 2)
+        state.currentAllocStats->bytes += size * sizeof(Value *);
 }
 
 Value * EvalState::getBool(bool b) {
     return b ? &vTrue : &vFalse;
 }
 
-unsigned long nrThunks = 0;
+Counter nrThunks;
 
 static inline void mkThunk(Value & v, Env & env, Expr * expr)
 {
@@ -1037,29 +1190,33 @@ Value * ExprPath::maybeThunk(EvalState & state, Env & env)
 
 void EvalState::evalFile(const SourcePath & path, Value & v, bool mustBeTrivial)
 {
-    FileEvalCache::iterator i;
-    if ((i = fileEvalCache.find(path)) != fileEvalCache.end()) {
+    auto lookup = [&](const SourcePath & path) {
+        auto cache(fileEvalCache.readLock());
+        auto i = cache->find(path);
+        if (i == cache->end()) return false;
         v = i->second;
-        return;
-    }
+        return true;
+    };
+
+    if (lookup(path)) return;
 
     auto resolvedPath = resolveExprPath(path);
-    if ((i = fileEvalCache.find(resolvedPath)) != fileEvalCache.end()) {
-        v = i->second;
-        return;
-    }
+    if (lookup(resolvedPath)) return;
 
     printTalkative("evaluating file '%1%'", resolvedPath);
     Expr * e = nullptr;
 
-    auto j = fileParseCache.find(resolvedPath);
-    if (j != fileParseCache.end())
-        e = j->second;
+    {
+        auto cache(fileParseCache.readLock());
+        auto j = cache->find(resolvedPath);
+        if (j != cache->end())
+            e = j->second;
+    }
 
-    if (!e)
+    if (!e) {
         e = parseExprFromFile(resolvedPath);
-
-    fileParseCache.emplace(resolvedPath, e);
+        fileParseCache.lock()->emplace(resolvedPath, e);
+    }
 
     try {
         auto dts = debugRepl
@@ -1082,15 +1239,16 @@ void EvalState::evalFile(const SourcePath & path, Value & v, bool mustBeTrivial)
         throw;
     }
 
-    fileEvalCache.emplace(resolvedPath, v);
-    if (path != resolvedPath) fileEvalCache.emplace(path, v);
+    auto cache(fileEvalCache.lock());
+    cache->emplace(resolvedPath, v);
+    if (path != resolvedPath) cache->emplace(path, v);
 }
 
 
 void EvalState::resetFileCache()
 {
-    fileEvalCache.clear();
-    fileParseCache.clear();
+    fileEvalCache.lock()->clear();
+    fileParseCache.lock()->clear();
 }
 
 
@@ -1561,6 +1719,10 @@ void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value &
             nrFunctionCalls++;
             if (countCalls) incrFunctionCall(&lambda);
 
+            auto prevAllocStats = currentAllocStats;
+            if (countCalls) currentAllocStats = &lambdaAllocStats[&lambda];
+            Finally restoreAllocStats([&]() { currentAllocStats = prevAllocStats; });
+
             /* Evaluate the body. */
             try {
                 auto dts = debugRepl
@@ -1572,6 +1734,9 @@ void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value &
                         : "anonymous lambda")
                     : nullptr;
 
+                std::optional<EvalProfiler::Call> profilerCall;
+                if (profiler) profilerCall.emplace(*profiler, &lambda);
+
                 lambda.body->eval(*this, env2, vCur);
             } catch (Error & e) {
                 if (loggerSettings.showTrace.get()) {
@@ -1607,6 +1772,9 @@ void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value &
                 if (countCalls) primOpCalls[fn->name]++;
 
                 try {
+                    std::optional<EvalProfiler::Call> profilerCall;
+                    if (profiler) profilerCall.emplace(*profiler, fn);
+
                     fn->fun(*this, vCur.determinePos(noPos), args, vCur);
                 } catch (Error & e) {
                     if (fn->addTrace)
@@ -1656,6 +1824,9 @@ void EvalState::callFunction(Value & fun, size_t nrArgs, Value * * args, Value &
                     // 1. Unify this and above code. Heavily redundant.
                     // 2. Create a fake env (arg1, arg2, etc.) and a fake expr (arg1: arg2: etc: builtins.name arg1 arg2 etc)
                     //    so the debugger allows to inspect the wrong parameters passed to the builtin.
+                    std::optional<EvalProfiler::Call> profilerCall;
+                    if (profiler) profilerCall.emplace(*profiler, fn);
+
                     fn->fun(*this, vCur.determinePos(noPos), vArgs, vCur);
                 } catch (Error & e) {
                     if (fn->addTrace)
@@ -1743,8 +1914,8 @@ void EvalState::autoCallFunction(const Bindings & args, Value & fun, Value & res
     forceValue(fun, pos);
 
     if (fun.type() == nAttrs) {
-        auto found = fun.attrs()->find(sFunctor);
-        if (found != fun.attrs()->end()) {
+        auto found = fun.attrs()->get(sFunctor);
+        if (found) {
             Value * v = allocValue();
             callFunction(*found->value, fun, *v, pos);
             forceValue(*v, pos);
@@ -1878,6 +2049,18 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
     if (v1.attrs()->size() == 0) { v = v2; return; }
     if (v2.attrs()->size() == 0) { v = v1; return; }
 
+    /* If the second set is small and the first is large, put the
+       former on top of the latter rather than copying both. */
+    if (v2.attrs()->size() <= Bindings::maxOverlaySize
+        && v1.attrs()->size() >= Bindings::minOverlayBaseSize
+        && v1.attrs()->layers() < Bindings::maxLayers)
+    {
+        v.mkAttrs(state.allocOverlay(*v1.attrs(), *v2.attrs()));
+        state.nrOpUpdateValuesCopied += v2.attrs()->size();
+        state.nrOpUpdateValuesAvoided += v.attrs()->size() - v2.attrs()->size();
+        return;
+    }
+
     auto attrs = state.buildBindings(v1.attrs()->size() + v2.attrs()->size());
 
     /* Merge the sets, preferring values from the second set.  Make
@@ -1944,10 +2127,18 @@ void EvalState::concatLists(Value & v, size_t nrLists, Value * const * lists, co
 }
 
 
+/**
+ * Concatenations of strings that are at least this long produce a
+ * `Value::StringRope` rather than a copy.
+ */
+static constexpr size_t minRopeLength = 1024;
+
 void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
 {
     NixStringContext context;
+    const Value::StringContext * stringContext = nullptr;
     std::vector<BackedStringView> s;
+    std::vector<Value::StringRope::Part> parts;
     size_t sSize = 0;
     NixInt n{0};
     NixFloat nf = 0;
@@ -1955,10 +2146,15 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
     bool first = !forceString;
     ValueType firstType = nString;
 
+    /* Whether all parts are strings, which can be referenced by a rope
+       rather than copied. */
+    bool allStrings = true;
+
     const auto str = [&] {
         std::string result;
         result.reserve(sSize);
-        for (const auto & part : s) result += *part;
+        for (const auto & part : parts)
+            result += part.rope ? Value::flattenRope(*part.rope) : std::string_view(part.s, part.length);
         return result;
     };
     /* c_str() is not str().c_str() because we want to create a string
@@ -1967,9 +2163,12 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
     const auto c_str = [&] {
         char * result = allocString(sSize + 1);
         char * tmp = result;
-        for (const auto & part : s) {
-            memcpy(tmp, part->data(), part->size());
-            tmp += part->size();
+        for (const auto & part : parts) {
+            if (part.rope)
+                copyRope(*part.rope, tmp);
+            else
+                memcpy(tmp, part.s, part.length);
+            tmp += part.length;
         }
         *tmp = 0;
         return result;
@@ -2014,15 +2213,37 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
             } else
                 state.error<EvalError>("cannot add %1% to a float", showType(vTmp)).atPos(i_pos).withFrame(env, *this).debugThrow();
         } else {
-            if (s.empty()) s.reserve(es->size());
-            /* skip canonization of first path, which would only be not
-            canonized in the first place if it's coming from a ./${foo} type
-            path */
-            auto part = state.coerceToString(i_pos, vTmp, context,
-                                             "while evaluating a path segment",
-                                             false, firstType == nString, !first);
-            sSize += part->size();
-            s.emplace_back(std::move(part));
+            if (s.empty()) {
+                /* `parts` may point into `s`, so it must not be
+                   reallocated. */
+                s.reserve(es->size());
+                parts.reserve(es->size());
+            }
+            if (firstType == nString && vTmp.type() == nString) {
+                /* Merge the contexts of strings directly, which is
+                   much cheaper than going through `context`. Ropes
+                   are referenced without flattening them. */
+                stringContext = mergeContexts(stringContext, vTmp.context());
+                auto size = vTmp.string_size();
+                if (size) {
+                    if (auto rope = vTmp.rope())
+                        parts.push_back({ .s = nullptr, .rope = rope, .length = size });
+                    else
+                        parts.push_back({ .s = vTmp.c_str(), .rope = nullptr, .length = size });
+                }
+                sSize += size;
+            } else {
+                /* skip canonization of first path, which would only be not
+                canonized in the first place if it's coming from a ./${foo} type
+                path */
+                auto part = state.coerceToString(i_pos, vTmp, context,
+                                                 "while evaluating a path segment",
+                                                 false, firstType == nString, !first);
+                sSize += part->size();
+                s.emplace_back(std::move(part));
+                parts.push_back({ .s = s.back()->data(), .rope = nullptr, .length = s.back()->size() });
+                allStrings = false;
+            }
         }
 
         first = false;
@@ -2036,8 +2257,20 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
         if (!context.empty())
             state.error<EvalError>("a string that refers to a store path cannot be appended to a path").atPos(pos).withFrame(env, *this).debugThrow();
         v.mkPath(state.rootPath(CanonPath(canonPath(str()))));
+    } else if (allStrings && parts.size() > 1 && sSize >= minRopeLength) {
+        auto rope = new (allocBytes(sizeof(Value::StringRope) + parts.size() * sizeof(Value::StringRope::Part)))
+            Value::StringRope { .length = sSize, .flat = nullptr, .size = parts.size() };
+        std::copy(parts.begin(), parts.end(), rope->parts);
+        v.mkString(rope, stringContext);
+    } else if (allStrings && parts.size() == 1) {
+        /* A single non-empty string, e.g. `"${x}"`, which doesn't
+           need to be copied. */
+        if (parts[0].rope)
+            v.mkString(parts[0].rope, stringContext);
+        else
+            v.mkString(parts[0].s, sSize, stringContext);
     } else
-        v.mkStringMove(c_str(), context);
+        v.mkString(c_str(), sSize, mergeContexts(stringContext, encodeContext(context)));
 }
 
 
@@ -2083,6 +2316,7 @@ void EvalState::forceValueDeep(Value & v)
         forceValue(v, v.determinePos(noPos));
 
         if (v.type() == nAttrs) {
+            prefetch(*v.attrs());
             for (auto & i : *v.attrs())
                 try {
                     // If the value is a thunk, we're evaling. Otherwise no trace necessary.
@@ -2099,6 +2333,7 @@ void EvalState::forceValueDeep(Value & v)
         }
 
         else if (v.isList()) {
+            prefetch(v.listItems());
             for (auto v2 : v.listItems())
                 recurse(*v2);
         }
@@ -2170,7 +2405,7 @@ bool EvalState::forceBool(Value & v, const PosIdx pos, std::string_view errorCtx
 
 bool EvalState::isFunctor(Value & fun)
 {
-    return fun.type() == nAttrs && fun.attrs()->find(sFunctor) != fun.attrs()->end();
+    return fun.type() == nAttrs && fun.attrs()->get(sFunctor);
 }
 
 
@@ -2212,8 +2447,8 @@ std::string_view EvalState::forceString(Value & v, const PosIdx pos, std::string
 void copyContext(const Value & v, NixStringContext & context)
 {
     if (v.payload.string.context)
-        for (const char * * p = v.payload.string.context; *p; ++p)
-            context.insert(NixStringContextElem::parse(*p));
+        for (auto elem : *v.payload.string.context)
+            context.insert(*elem);
 }
 
 
@@ -2229,7 +2464,9 @@ std::string_view EvalState::forceStringNoCtx(Value & v, const PosIdx pos, std::s
 {
     auto s = forceString(v, pos, errorCtx);
     if (v.context()) {
-        error<EvalError>("the string '%1%' is not allowed to refer to a store path (such as '%2%')", v.string_view(), v.context()[0]).withTrace(pos, errorCtx).debugThrow();
+        NixStringContext context;
+        copyContext(v, context);
+        error<EvalError>("the string '%1%' is not allowed to refer to a store path (such as '%2%')", v.string_view(), context.begin()->to_string()).withTrace(pos, errorCtx).debugThrow();
     }
     return s;
 }
@@ -2249,8 +2486,8 @@ bool EvalState::isDerivation(Value & v)
 std::optional<std::string> EvalState::tryAttrsToString(const PosIdx pos, Value & v,
     NixStringContext & context, bool coerceMore, bool copyToStore)
 {
-    auto i = v.attrs()->find(sToString);
-    if (i != v.attrs()->end()) {
+    auto i = v.attrs()->get(sToString);
+    if (i) {
         Value v1;
         callFunction(*i->value, v, v1, pos);
         return coerceToString(pos, v1, context,
@@ -2292,8 +2529,8 @@ BackedStringView EvalState::coerceToString(
         auto maybeString = tryAttrsToString(pos, v, context, coerceMore, copyToStore);
         if (maybeString)
             return std::move(*maybeString);
-        auto i = v.attrs()->find(sOutPath);
-        if (i == v.attrs()->end()) {
+        auto i = v.attrs()->get(sOutPath);
+        if (!i) {
             error<TypeError>(
                 "cannot coerce %1% to a string: %2%",
                 showType(v),
@@ -2363,6 +2600,8 @@ StorePath EvalState::copyPathToStore(NixStringContext & context, const SourcePat
     auto dstPath = dstPathCached
         ? *dstPathCached
         : [&]() {
+            Executor::abortIfWorker();
+            PhaseTimer phaseTimer(*this, EvalPhase::StoreCopy);
             auto dstPath = fetchToStore(
                 *store,
                 path.resolveSymlinks(),
@@ -2400,8 +2639,8 @@ SourcePath EvalState::coerceToPath(const PosIdx pos, Value & v, NixStringContext
     /* Similarly, handle __toString where the result may be a path
        value. */
     if (v.type() == nAttrs) {
-        auto i = v.attrs()->find(sToString);
-        if (i != v.attrs()->end()) {
+        auto i = v.attrs()->get(sToString);
+        if (i) {
             Value v1;
             callFunction(*i->value, v, v1, pos);
             return coerceToPath(pos, v1, context, errorCtx);
@@ -2814,7 +3053,8 @@ void EvalState::printStatistics()
     uint64_t bEnvs = nrEnvs * sizeof(Env) + nrValuesInEnvs * sizeof(Value *);
     uint64_t bLists = nrListElems * sizeof(Value *);
     uint64_t bValues = nrValues * sizeof(Value);
-    uint64_t bAttrsets = nrAttrsets * sizeof(Bindings) + nrAttrsInAttrsets * sizeof(Attr);
+    uint64_t bAttrsets = nrAttrsets * sizeof(Bindings) + nrAttrsInAttrsets * sizeof(Attr)
+        + nrAttrsetIndexSlots * sizeof(uint32_t) + nrOpUpdateOverlays * sizeof(Bindings::Layer);
 
 #if HAVE_BOEHMGC
     GC_word heapSize, totalBytes;
@@ -2824,8 +3064,11 @@ void EvalState::printStatistics()
         ms * 0.001;
     });
     auto gcCycles = getGCCycles();
+    auto gcPauses = getGCPauseStats();
 #endif
 
+    auto wallTime = std::chrono::steady_clock::now() - startTime;
+
     auto outPath = getEnv("NIX_SHOW_STATS_PATH").value_or("-");
     std::fstream fs;
     if (outPath != "-")
@@ -2845,19 +3088,45 @@ void EvalState::printStatistics()
 #endif
 #endif
     };
+    {
+        auto toSeconds = [](uint64_t ns) { return ns * 1e-9; };
+        auto & phases = topObj["phases"];
+        uint64_t otherTime = 0;
+        for (auto [phase, name] : {
+            std::pair{EvalPhase::Parse, "parse"},
+            std::pair{EvalPhase::Derivation, "derivation"},
+            std::pair{EvalPhase::StoreCopy, "storeCopy"},
+        }) {
+            auto ns = phaseTime[(size_t) phase].load();
+            otherTime += ns;
+            phases[name] = {
+                {"time", toSeconds(ns)},
+                {"number", phaseCount[(size_t) phase].load()},
+            };
+        }
+        /* With `eval-cores`, the other phases are summed over all
+           threads, so this is approximate. */
+        auto wallNs = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(wallTime).count();
+        phases["eval"] = {
+            {"time", toSeconds(wallNs > otherTime ? wallNs - otherTime : 0)},
+        };
+        phases["total"] = {
+            {"time", toSeconds(wallNs)},
+        };
+    }
     topObj["envs"] = {
-        {"number", nrEnvs},
-        {"elements", nrValuesInEnvs},
+        {"number", nrEnvs.load()},
+        {"elements", nrValuesInEnvs.load()},
         {"bytes", bEnvs},
     };
     topObj["nrExprs"] = Expr::nrExprs;
     topObj["list"] = {
-        {"elements", nrListElems},
+        {"elements", nrListElems.load()},
         {"bytes", bLists},
-        {"concats", nrListConcats},
+        {"concats", nrListConcats.load()},
     };
     topObj["values"] = {
-        {"number", nrValues},
+        {"number", nrValues.load()},
         {"bytes", bValues},
     };
     topObj["symbols"] = {
@@ -2865,9 +3134,11 @@ void EvalState::printStatistics()
         {"bytes", symbols.totalSize()},
     };
     topObj["sets"] = {
-        {"number", nrAttrsets},
+        {"number", nrAttrsets.load()},
         {"bytes", bAttrsets},
-        {"elements", nrAttrsInAttrsets},
+        {"elements", nrAttrsInAttrsets.load()},
+        {"indexedLookups", Bindings::nrIndexedLookups.load()},
+        {"sortedLookups", Bindings::nrSortedLookups.load()},
     };
     topObj["sizes"] = {
         {"Env", sizeof(Env)},
@@ -2875,18 +3146,35 @@ void EvalState::printStatistics()
         {"Bindings", sizeof(Bindings)},
         {"Attr", sizeof(Attr)},
     };
-    topObj["nrOpUpdates"] = nrOpUpdates;
-    topObj["nrOpUpdateValuesCopied"] = nrOpUpdateValuesCopied;
-    topObj["nrThunks"] = nrThunks;
-    topObj["nrAvoided"] = nrAvoided;
-    topObj["nrLookups"] = nrLookups;
-    topObj["nrPrimOpCalls"] = nrPrimOpCalls;
-    topObj["nrFunctionCalls"] = nrFunctionCalls;
+    topObj["nrOpUpdates"] = nrOpUpdates.load();
+    topObj["nrOpUpdateValuesCopied"] = nrOpUpdateValuesCopied.load();
+    topObj["parseCache"] = {
+        {"hits", nrParseCacheHits.load()},
+        {"misses", nrParseCacheMisses.load()},
+    };
+    topObj["opUpdateOverlays"] = {
+        {"number", nrOpUpdateOverlays.load()},
+        {"flattened", Bindings::nrFlattened.load()},
+        {"layeredLookups", Bindings::nrLayeredLookups.load()},
+        {"bytesSaved",
+            ((int64_t) nrOpUpdateValuesAvoided.load() - (int64_t) Bindings::nrFlattenedAttrs.load()) * (int64_t) sizeof(Attr)},
+    };
+    topObj["nrThunks"] = nrThunks.load();
+    topObj["nrThunksForced"] = nrThunksForced.load();
+    topObj["nrAvoided"] = nrAvoided.load();
+    topObj["nrLookups"] = nrLookups.load();
+    topObj["nrPrimOpCalls"] = nrPrimOpCalls.load();
+    topObj["nrFunctionCalls"] = nrFunctionCalls.load();
 #if HAVE_BOEHMGC
     topObj["gc"] = {
         {"heapSize", heapSize},
         {"totalBytes", totalBytes},
         {"cycles", gcCycles},
+        {"pauses", {
+            {"number", gcPauses.number},
+            {"time", std::chrono::duration<double>(gcPauses.total).count()},
+            {"maxTime", std::chrono::duration<double>(gcPauses.max).count()},
+        }},
     };
 #endif
 
@@ -2911,6 +3199,62 @@ void EvalState::printStatistics()
                 list.push_back(obj);
             }
         }
+        {
+            auto allocStatsToJSON = [](json & obj, const AllocStats & stats) {
+                obj["values"] = stats.values;
+                obj["envs"] = stats.envs;
+                obj["bytes"] = stats.bytes;
+                obj["thunksForced"] = stats.thunksForced;
+            };
+
+            /* Sort by the number of bytes allocated, then by the
+               number of thunks forced, so that the most expensive
+               code comes first. */
+            auto byCost = [](const json & a, const json & b) {
+                return std::pair(a["bytes"].get<uint64_t>(), a["thunksForced"].get<uint64_t>())
+                    > std::pair(b["bytes"].get<uint64_t>(), b["thunksForced"].get<uint64_t>());
+            };
+
+            std::map<std::optional<std::string>, AllocStats> fileAllocStats;
+            fileAllocStats[std::nullopt] += topLevelAllocStats;
+
+            auto functions = json::array();
+            for (auto & [fun, stats] : lambdaAllocStats) {
+                json obj = json::object();
+                if (fun->name)
+                    obj["name"] = (std::string_view) symbols[fun->name];
+                else
+                    obj["name"] = nullptr;
+                std::optional<std::string> file;
+                if (auto pos = positions[fun->pos]) {
+                    if (auto path = std::get_if<SourcePath>(&pos.origin))
+                        obj["file"] = *(file = path->to_string());
+                    obj["line"] = pos.line;
+                    obj["column"] = pos.column;
+                }
+                allocStatsToJSON(obj, stats);
+                functions.push_back(std::move(obj));
+                fileAllocStats[file] += stats;
+            }
+            std::sort(functions.begin(), functions.end(), byCost);
+
+            auto files = json::array();
+            for (auto & [file, stats] : fileAllocStats) {
+                json obj = json::object();
+                if (file)
+                    obj["file"] = *file;
+                else
+                    obj["file"] = nullptr;
+                allocStatsToJSON(obj, stats);
+                files.push_back(std::move(obj));
+            }
+            std::sort(files.begin(), files.end(), byCost);
+
+            topObj["allocations"] = {
+                {"functions", std::move(functions)},
+                {"files", std::move(files)},
+            };
+        }
         {
             auto list = topObj["attributes"];
             list = json::array();
@@ -3048,12 +3392,15 @@ SourcePath EvalState::findFile(const LookupPath & lookupPath, const std::string_
 std::optional<std::string> EvalState::resolveLookupPathPath(const LookupPath::Path & value0, bool initAccessControl)
 {
     auto & value = value0.s;
-    auto i = lookupPathResolved.find(value);
-    if (i != lookupPathResolved.end()) return i->second;
+    {
+        auto resolved(lookupPathResolved.lock());
+        auto i = resolved->find(value);
+        if (i != resolved->end()) return i->second;
+    }
 
     auto finish = [&](std::string res) {
         debug("resolved search path element '%s' to '%s'", value, res);
-        lookupPathResolved.emplace(value, res);
+        lookupPathResolved.lock()->emplace(value, res);
         return res;
     };
 
@@ -3120,6 +3467,10 @@ Expr * EvalState::parse(
     const SourcePath & basePath,
     std::shared_ptr<StaticEnv> & staticEnv)
 {
+    PhaseTimer phaseTimer(*this, EvalPhase::Parse);
+
+    std::lock_guard lock(parseMutex);
+
     DocCommentMap tmpDocComments; // Only used when not origin is not a SourcePath
     DocCommentMap *docComments = &tmpDocComments;
 
@@ -3128,7 +3479,25 @@ Expr * EvalState::parse(
         docComments = &it->second;
     }
 
-    auto result = parseExprFromBuf(text, length, origin, basePath, symbols, settings, positions, *docComments, rootFS, exprSymbols);
+    auto posOrigin = positions.addOrigin(origin, length);
+
+    std::optional<Hash> cacheKey;
+    if (settings.parseCache && std::holds_alternative<SourcePath>(origin)) {
+        if (!parseCache)
+            parseCache = std::make_unique<ParseCache>(settings.parseCacheSize);
+        cacheKey = ParseCache::key({text, length}, basePath, settings);
+        if (auto result = parseCache->lookup(*cacheKey, symbols, positions, posOrigin, *docComments, rootFS)) {
+            nrParseCacheHits++;
+            result->bindVars(*this, staticEnv);
+            return result;
+        }
+        nrParseCacheMisses++;
+    }
+
+    auto result = parseExprFromBuf(text, length, posOrigin, basePath, symbols, settings, positions, *docComments, rootFS, exprSymbols);
+
+    if (cacheKey)
+        parseCache->add(*cacheKey, result, symbols, posOrigin, *docComments);
 
     result->bindVars(*this, staticEnv);
 
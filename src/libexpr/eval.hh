@@ -2,6 +2,7 @@
 ///@file
 
 #include "attr-set.hh"
+#include "counter.hh"
 #include "eval-error.hh"
 #include "types.hh"
 #include "value.hh"
@@ -16,9 +17,11 @@
 #include "repl-exit-status.hh"
 #include "ref.hh"
 
+#include <chrono>
 #include <map>
 #include <optional>
 #include <functional>
+#include <unordered_map>
 
 namespace nix {
 
@@ -37,6 +40,9 @@ class StorePath;
 struct SingleDerivedPath;
 enum RepairFlag : bool;
 struct MemorySourceAccessor;
+struct Executor;
+class ParseCache;
+class EvalProfiler;
 namespace eval_cache {
     class EvalCache;
 }
@@ -161,6 +167,12 @@ std::unique_ptr<ValMap> mapStaticEnvBindings(const SymbolTable & st, const Stati
 
 void copyContext(const Value & v, NixStringContext & context);
 
+/**
+ * Return the union of two string contexts. If one contains the other,
+ * it is returned rather than a copy.
+ */
+const Value::StringContext * mergeContexts(const Value::StringContext * a, const Value::StringContext * b);
+
 
 std::string printValue(EvalState & state, Value & v);
 std::ostream & operator << (std::ostream & os, const ValueType t);
@@ -170,6 +182,39 @@ struct RegexCache;
 
 std::shared_ptr<RegexCache> makeRegexCache();
 
+/**
+ * The phases of evaluation that are timed separately in the
+ * statistics printed by `NIX_SHOW_STATS`. Time that isn't spent in one
+ * of the other phases is attributed to `Eval`.
+ */
+enum struct EvalPhase : uint8_t {
+    Eval,
+    Parse,
+    Derivation,
+    StoreCopy,
+};
+
+constexpr size_t nrEvalPhases = 4;
+
+/**
+ * Memory allocated and thunks forced while a function was being
+ * called, for `NIX_COUNT_CALLS`.
+ */
+struct AllocStats
+{
+    uint64_t values = 0;
+    uint64_t envs = 0;
+    /**
+     * The bytes allocated for values, environments, attribute sets
+     * and lists. Strings and string contexts aren't counted, since
+     * they're mostly allocated without access to the `EvalState`.
+     */
+    uint64_t bytes = 0;
+    uint64_t thunksForced = 0;
+
+    AllocStats & operator += (const AllocStats & other);
+};
+
 struct DebugTrace {
     std::shared_ptr<Pos> pos;
     const Expr & expr;
@@ -283,7 +328,11 @@ public:
     ReplExitStatus (* debugRepl)(ref<EvalState> es, const ValMap & extraEnv);
     bool debugStop;
     bool inDebugger = false;
-    int trylevel;
+
+    /**
+     * Number of `builtins.tryEval` calls that this thread is in.
+     */
+    static thread_local int trylevel;
     std::list<DebugTrace> debugTraces;
     std::map<const Expr*, const std::shared_ptr<const StaticEnv>> exprEnvs;
     const std::shared_ptr<const StaticEnv> getStaticEnv(const Expr & expr) const
@@ -331,13 +380,25 @@ private:
      * A cache from path names to parse trees.
      */
     typedef std::unordered_map<SourcePath, Expr *, std::hash<SourcePath>, std::equal_to<SourcePath>, traceable_allocator<std::pair<const SourcePath, Expr *>>> FileParseCache;
-    FileParseCache fileParseCache;
+    SharedSync<FileParseCache> fileParseCache;
 
     /**
      * A cache from path names to values.
      */
     typedef std::unordered_map<SourcePath, Value, std::hash<SourcePath>, std::equal_to<SourcePath>, traceable_allocator<std::pair<const SourcePath, Value>>> FileEvalCache;
-    FileEvalCache fileEvalCache;
+    SharedSync<FileEvalCache> fileEvalCache;
+
+    /**
+     * Serialises parsing, which updates `positions`,
+     * `positionToDocComment` and `exprEnvs`.
+     */
+    std::mutex parseMutex;
+
+    /**
+     * The on-disk cache of parsed files, if `parse-cache` is enabled.
+     * Protected by `parseMutex`.
+     */
+    std::unique_ptr<ParseCache> parseCache;
 
     /**
      * Associate source positions of certain AST nodes with their preceding doc comment, if they have one.
@@ -347,7 +408,7 @@ private:
 
     LookupPath lookupPath;
 
-    std::map<std::string, std::optional<std::string>> lookupPathResolved;
+    Sync<std::map<std::string, std::optional<std::string>>> lookupPathResolved;
 
     /**
      * Cache used by prim_match().
@@ -356,16 +417,34 @@ private:
 
 #if HAVE_BOEHMGC
     /**
-     * Allocation cache for GC'd Value objects.
+     * Per-thread allocation cache for GC'd Value objects. This points
+     * to traceable memory so that the GC doesn't reclaim the cached
+     * objects.
      */
-    std::shared_ptr<void *> valueAllocCache;
+    static thread_local void * * valueAllocCache;
 
     /**
-     * Allocation cache for size-1 Env objects.
+     * Per-thread allocation cache for size-1 Env objects.
      */
-    std::shared_ptr<void *> env1AllocCache;
+    static thread_local void * * env1AllocCache;
+
+    [[gnu::noinline]]
+    static void refillAllocCache(void * * & cache, size_t size);
 #endif
 
+    /**
+     * Worker threads for parallel evaluation, if `eval-cores` is
+     * greater than 1.
+     */
+    std::unique_ptr<Executor> executor;
+
+    friend struct Executor;
+
+    /**
+     * The evaluation profiler, if `eval-profiler` is enabled.
+     */
+    std::unique_ptr<EvalProfiler> profiler;
+
 public:
 
     EvalState(
@@ -483,12 +562,39 @@ public:
 
     void tryFixupBlackHolePos(Value & v, PosIdx pos);
 
+private:
+
+    /**
+     * Slow path of `forceValue()` when evaluating with multiple
+     * threads.
+     */
+    [[gnu::noinline]]
+    void forceValueParallel(Value & v, const PosIdx pos);
+
+public:
+
     /**
      * Force a value, then recursively force list elements and
      * attributes.
      */
     void forceValueDeep(Value & v);
 
+    /**
+     * When evaluating with multiple threads (`eval-cores`), let the
+     * worker threads start forcing the given values deeply, because
+     * the caller is about to do so. This is a no-op otherwise.
+     */
+    void prefetch(const Bindings & attrs);
+    void prefetch(std::span<Value * const> values);
+
+    /**
+     * Stop the worker threads for the rest of the evaluation. This
+     * must be called by the main thread before enabling or disabling
+     * the debugger, since the workers don't synchronise with the
+     * debugger's state.
+     */
+    void stopParallelEval();
+
     /**
      * Force `v`, and then verify that it has the expected type.
      */
@@ -662,12 +768,28 @@ private:
         std::shared_ptr<StaticEnv> & staticEnv);
 
     /**
-     * Current Nix call stack depth, used with `max-call-depth` setting to throw stack overflow hopefully before we run out of system stack.
+     * Current Nix call stack depth of this thread, used with `max-call-depth` setting to throw stack overflow hopefully before we run out of system stack.
      */
-    size_t callDepth = 0;
+    static thread_local size_t callDepth;
 
 public:
 
+    /**
+     * Attributes the time spent until this object is destroyed to a
+     * phase of evaluation, if statistics are enabled.
+     */
+    class PhaseTimer
+    {
+        EvalState & state;
+        EvalPhase prevPhase;
+        bool enabled;
+
+    public:
+        PhaseTimer(EvalState & state, EvalPhase phase);
+        ~PhaseTimer();
+    };
+
+
     /**
      * Check that the call depth is within limits, and increment it, until the returned object is destroyed.
      */
@@ -713,6 +835,12 @@ public:
 
     Bindings * allocBindings(size_t capacity);
 
+    /**
+     * Allocate a set containing the attributes of `overlay` on top of
+     * those of `base`, without copying `base`. Used by `//`.
+     */
+    Bindings * allocOverlay(const Bindings & base, const Bindings & overlay);
+
     BindingsBuilder buildBindings(size_t capacity)
     {
         return BindingsBuilder(*this, allocBindings(capacity));
@@ -832,19 +960,40 @@ private:
     std::string mkSingleDerivedPathStringRaw(
         const SingleDerivedPath & p);
 
-    unsigned long nrEnvs = 0;
-    unsigned long nrValuesInEnvs = 0;
-    unsigned long nrValues = 0;
-    unsigned long nrListElems = 0;
-    unsigned long nrLookups = 0;
-    unsigned long nrAttrsets = 0;
-    unsigned long nrAttrsInAttrsets = 0;
-    unsigned long nrAvoided = 0;
-    unsigned long nrOpUpdates = 0;
-    unsigned long nrOpUpdateValuesCopied = 0;
-    unsigned long nrListConcats = 0;
-    unsigned long nrPrimOpCalls = 0;
-    unsigned long nrFunctionCalls = 0;
+    Counter nrEnvs;
+    Counter nrValuesInEnvs;
+    Counter nrValues;
+    Counter nrListElems;
+    Counter nrLookups;
+    Counter nrAttrsets;
+    Counter nrAttrsInAttrsets;
+    Counter nrAttrsetIndexSlots;
+    Counter nrAvoided;
+    Counter nrOpUpdates;
+    Counter nrOpUpdateValuesCopied;
+    Counter nrOpUpdateOverlays;
+    Counter nrOpUpdateValuesAvoided;
+    Counter nrParseCacheHits;
+    Counter nrParseCacheMisses;
+    Counter nrListConcats;
+    Counter nrPrimOpCalls;
+    Counter nrFunctionCalls;
+    Counter nrThunksForced;
+
+    /**
+     * Time spent in each phase other than `EvalPhase::Eval`, in
+     * nanoseconds, and the number of times it was entered.
+     */
+    Counter phaseTime[nrEvalPhases];
+    Counter phaseCount[nrEvalPhases];
+
+    const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+    /**
+     * The phase that this thread is in, and since when.
+     */
+    static thread_local EvalPhase currentPhase;
+    static thread_local std::chrono::steady_clock::time_point currentPhaseStart;
 
     bool countCalls;
 
@@ -856,6 +1005,20 @@ private:
 
     void incrFunctionCall(ExprLambda * fun);
 
+    /**
+     * Allocations per lambda, if `countCalls` is set. Allocations
+     * are attributed to the innermost lambda being called, or to
+     * `topLevelAllocStats` outside of lambdas.
+     */
+    std::unordered_map<ExprLambda *, AllocStats> lambdaAllocStats;
+    AllocStats topLevelAllocStats;
+
+    /**
+     * Where allocations are currently counted, or `nullptr` if
+     * `countCalls` is not set.
+     */
+    AllocStats * currentAllocStats = nullptr;
+
     typedef std::map<PosIdx, size_t> AttrSelects;
     AttrSelects attrSelects;
 
@@ -0,0 +1,252 @@
+#include "parallel-eval.hh"
+#include "eval.hh"
+#include "eval-inline.hh"
+
+#include <boost/container/small_vector.hpp>
+
+namespace nix {
+
+static thread_local bool isWorker = false;
+
+bool Executor::amWorker()
+{
+    return isWorker;
+}
+
+#ifndef _WIN32
+static void * workerEntry(void * executor)
+{
+    ((Executor *) executor)->worker();
+    return nullptr;
+}
+#endif
+
+Executor::Executor(EvalState & state, unsigned int nrCores)
+    : state(state)
+    , maxQueued(8 * (nrCores - 1))
+{
+    assert(nrCores > 1);
+
+#if HAVE_BOEHMGC
+    GC_allow_register_threads();
+#endif
+
+    for (unsigned int n = 0; n < nrCores - 1; ++n) {
+#ifndef _WIN32
+        /* Give the workers the same stack size as the main thread
+           (see `setStackSize()`), since they run arbitrarily deep
+           evaluations. With `GC_THREADS`, `pthread_create()` is
+           redirected to the Boehm GC so that it scans the workers'
+           stacks. */
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, 64 * 1024 * 1024);
+        pthread_t thread;
+        int err = pthread_create(&thread, &attr, workerEntry, this);
+        pthread_attr_destroy(&attr);
+        if (err) {
+            stop();
+            throw SysError(err, "creating evaluator thread");
+        }
+        workers.push_back(thread);
+#else
+        workers.emplace_back([this]() { worker(); });
+#endif
+    }
+
+    debug("started %d evaluator worker threads", workers.size());
+}
+
+Executor::~Executor()
+{
+    stop();
+}
+
+void Executor::stop()
+{
+    {
+        auto state(state_.lock());
+        if (quit) return;
+        quit = true;
+        state->queue.clear();
+    }
+
+    wakeup.notify_all();
+
+    for (auto & thread : workers)
+#ifndef _WIN32
+        pthread_join(thread, nullptr);
+#else
+        thread.join();
+#endif
+}
+
+void Executor::worker()
+{
+    isWorker = true;
+
+    while (true) {
+        Value * v;
+
+        {
+            auto state(state_.lock());
+            while (state->queue.empty() && !quit)
+                state.wait(wakeup);
+            if (quit) break;
+            /* The main thread consumes attributes front to back,
+               so take work from the back. */
+            v = state->queue.back();
+            state->queue.pop_back();
+        }
+
+        try {
+            state.forceValueDeep(*v);
+        } catch (ParallelEvalAbort &) {
+        } catch (...) {
+            /* Any thunk that failed has been restored, so the main
+               thread will get (and report) this error when it forces
+               the value itself. */
+        }
+    }
+
+#if HAVE_BOEHMGC
+    GC_FREE(EvalState::valueAllocCache);
+    EvalState::valueAllocCache = nullptr;
+    GC_FREE(EvalState::env1AllocCache);
+    EvalState::env1AllocCache = nullptr;
+#endif
+}
+
+void Executor::prefetch(std::span<Value * const> values)
+{
+    size_t added = 0;
+
+    {
+        auto state(state_.lock());
+        for (auto v : values) {
+            if (state->queue.size() >= maxQueued) break;
+            /* Evaluated values are traversed by the main thread, which
+               prefetches their children in turn. */
+            auto type = v->getInternalType();
+            if (type != tThunk && type != tApp) continue;
+            state->queue.push_back(v);
+            added++;
+        }
+    }
+
+    if (added == 1)
+        wakeup.notify_one();
+    else if (added > 1)
+        wakeup.notify_all();
+}
+
+void Executor::waitFor(Value & v)
+{
+    std::unique_lock lock(finishedMutex);
+    finished.wait(lock, [&]() { return v.getInternalType() != tAwaited; });
+}
+
+void Executor::notifyFinished()
+{
+    /* Taking the lock ensures that a thread that has seen `tAwaited`
+       in `waitFor()` is actually waiting before we notify it. */
+    {
+        std::lock_guard lock(finishedMutex);
+    }
+    finished.notify_all();
+}
+
+void EvalState::prefetch(const Bindings & attrs)
+{
+    if (!executor || attrs.size() < 2) return;
+
+    if (debugRepl) {
+        stopParallelEval();
+        return;
+    }
+
+    boost::container::small_vector<Value *, 64> values;
+    for (auto & attr : attrs)
+        values.push_back(attr.value);
+    executor->prefetch({values.data(), values.size()});
+}
+
+void EvalState::prefetch(std::span<Value * const> values)
+{
+    if (!executor || values.size() < 2) return;
+
+    if (debugRepl) {
+        stopParallelEval();
+        return;
+    }
+
+    executor->prefetch(values);
+}
+
+void EvalState::stopParallelEval()
+{
+    assert(!Executor::amWorker());
+    if (!executor) return;
+    /* After this, no value can be claimed by a worker anymore. */
+    executor->stop();
+    executor.reset();
+}
+
+void EvalState::forceValueParallel(Value & v, const PosIdx pos)
+{
+    bool worker = Executor::amWorker();
+
+    while (true) {
+        auto type = v.getInternalType();
+
+        if (type == tThunk || type == tApp) {
+            if (worker && executor->quitting())
+                throw ParallelEvalAbort();
+
+            if (!v.claim(type, worker ? tPending : tBlackhole))
+                continue;
+
+            /* We own the value now, so its payload is stable. */
+            auto payload = v.payload;
+
+            Value res;
+            try {
+                if (type == tThunk) {
+                    nrThunksForced++;
+                    payload.thunk.expr->eval(*this, *payload.thunk.env, res);
+                } else
+                    callFunction(*payload.app.left, *payload.app.right, res, pos);
+            } catch (...) {
+                Value orig;
+                orig.finishValue(type, payload);
+                if (v.publish(orig) == tAwaited)
+                    executor->notifyFinished();
+                throw;
+            }
+
+            if (v.publish(res) == tAwaited)
+                executor->notifyFinished();
+            return;
+        }
+
+        else if (type == tBlackhole || type == tPending || type == tAwaited) {
+            /* Workers never wait, so that there can be no deadlocks. */
+            if (worker)
+                throw ParallelEvalAbort();
+
+            /* Only the main thread claims values as black holes. */
+            if (type == tBlackhole)
+                error<InfiniteRecursionError>("infinite recursion encountered")
+                    .atPos(pos)
+                    .debugThrow();
+
+            if (v.markAwaited())
+                executor->waitFor(v);
+        }
+
+        else
+            return;
+    }
+}
+
+}
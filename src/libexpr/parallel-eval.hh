@@ -0,0 +1,156 @@
+#pragma once
+///@file
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <span>
+#include <vector>
+
+#ifndef _WIN32
+#  include <pthread.h>
+#else
+#  include <thread>
+#endif
+
+#include "eval-gc.hh"
+#include "sync.hh"
+
+namespace nix {
+
+struct Value;
+class EvalState;
+
+/**
+ * Thrown by a worker thread when it runs into a value that is being
+ * evaluated by another thread. Workers never wait for each other (so
+ * there can be no deadlocks); instead they give up on their current
+ * task, which leaves any thunks they claimed in their original state
+ * for the main evaluator thread to force.
+ *
+ * This deliberately does not derive from `nix::Error`, so that it
+ * passes through `tryEval` and error trace handlers untouched.
+ */
+struct ParallelEvalAbort { };
+
+/**
+ * A pool of worker threads that speculatively force values on behalf
+ * of the main evaluator thread when `eval-cores` is greater than 1.
+ *
+ * Only one thread, the one that owns the `EvalState`, drives
+ * evaluation. It hands out independent values (such as the attributes
+ * of an attribute set that it is about to force deeply) through
+ * `prefetch()`. Workers force those values concurrently. Each thunk is
+ * claimed atomically by the thread that evaluates it (see
+ * `Value::claim()`): when the main thread runs into a thunk claimed by
+ * a worker, it waits for the worker to finish it; when a worker runs
+ * into a thunk claimed by any other thread, it throws
+ * `ParallelEvalAbort` and drops its task. Errors in workers are
+ * discarded, since the main thread will encounter and report them
+ * itself.
+ *
+ * A thunk whose evaluation is aborted or fails is restored, and will
+ * be evaluated again by the main thread. Primops with side effects
+ * therefore call `abortIfWorker()` first, so that the side effects
+ * only happen on the main thread, once, as in sequential evaluation.
+ * The debugger's state isn't synchronised with the workers. So they
+ * are stopped for good once the debugger is enabled (see
+ * `EvalState::stopParallelEval()`).
+ */
+struct Executor
+{
+    EvalState & state;
+
+    Executor(EvalState & state, unsigned int nrCores);
+
+    ~Executor();
+
+    /**
+     * Stop and join all workers. Running tasks are aborted the next
+     * time they try to claim a thunk.
+     */
+    void stop();
+
+    /**
+     * Enqueue the unevaluated values among `values` to be forced
+     * deeply by the workers, as long as the queue isn't long enough
+     * yet to keep all workers busy.
+     */
+    void prefetch(std::span<Value * const> values);
+
+    /**
+     * Whether the current thread is one of the executor's workers.
+     */
+    static bool amWorker();
+
+    /**
+     * Throw `ParallelEvalAbort` if the current thread is a worker.
+     * This is called before side effects such as printing a trace or
+     * building a derivation. If a worker's task is aborted, the main
+     * thread forces its thunks again, so the side effect could
+     * otherwise happen twice.
+     */
+    static void abortIfWorker()
+    {
+        if (amWorker()) throw ParallelEvalAbort();
+    }
+
+    /**
+     * Wait until the value `v`, which has been marked as `tAwaited` by
+     * the current thread, is no longer being evaluated by a worker.
+     */
+    void waitFor(Value & v);
+
+    /**
+     * Wake up the main thread after finishing a value that was
+     * `tAwaited`.
+     */
+    void notifyFinished();
+
+    bool quitting() const
+    {
+        return quit;
+    }
+
+    /**
+     * Main loop of a worker thread.
+     */
+    void worker();
+
+private:
+
+    size_t maxQueued;
+
+    struct State
+    {
+        /**
+         * Values to be forced. This lives in traceable memory so that
+         * the values aren't garbage-collected while they're queued.
+         */
+        std::deque<Value *, traceable_allocator<Value *>> queue;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup;
+
+    std::atomic<bool> quit{false};
+
+    /**
+     * Worker threads. On Unix we create them ourselves so that they
+     * get as much stack space as the main thread.
+     */
+#ifndef _WIN32
+    std::vector<pthread_t> workers;
+#else
+    std::vector<std::thread> workers;
+#endif
+
+    /**
+     * Used by `waitFor()` and `notifyFinished()`.
+     */
+    std::mutex finishedMutex;
+    std::condition_variable finished;
+};
+
+}
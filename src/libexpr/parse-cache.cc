@@ -0,0 +1,820 @@
+#include "parse-cache.hh"
+#include "eval-settings.hh"
+#include "globals.hh"
+#include "users.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <tuple>
+#include <unistd.h>
+
+namespace nix {
+
+/* Bump this whenever the format below or the AST changes. */
+static constexpr uint64_t formatVersion = 1;
+
+static constexpr std::string_view magic = "nix-ast";
+
+/**
+ * Tags of the serialised expression nodes.
+ */
+enum class ExprTag : uint8_t {
+    Null,
+    Ref,
+    Int,
+    Float,
+    String,
+    Path,
+    Var,
+    InheritFrom,
+    Select,
+    OpHasAttr,
+    Attrs,
+    List,
+    Lambda,
+    Call,
+    Let,
+    With,
+    If,
+    Assert,
+    OpNot,
+    OpEq,
+    OpNEq,
+    OpAnd,
+    OpOr,
+    OpImpl,
+    OpUpdate,
+    OpConcatLists,
+    ConcatStrings,
+    Pos,
+};
+
+struct BadParseCacheEntry : Error
+{
+    using Error::Error;
+};
+
+namespace {
+
+/**
+ * Writes an expression tree in a compact binary format. Integers are
+ * LEB128-encoded, symbols are indices into a table of names written in
+ * front of the tree, and positions are offsets into the source. Nodes
+ * are numbered in post-order, so that nodes that occur more than once
+ * in the tree (like the `from` of `inherit (from) ...`) can be written
+ * as a reference to their first occurrence.
+ */
+struct ExprWriter
+{
+    const SymbolTable & symbols;
+    const PosTable::Origin & origin;
+
+    std::string out;
+
+    std::unordered_map<Symbol, uint64_t> symbolIds;
+    std::vector<Symbol> symbolList;
+
+    std::unordered_map<const Expr *, uint64_t> exprIds;
+
+    void num(uint64_t n)
+    {
+        do {
+            uint8_t b = n & 0x7f;
+            n >>= 7;
+            out.push_back(n ? b | 0x80 : b);
+        } while (n);
+    }
+
+    void str(std::string_view s)
+    {
+        num(s.size());
+        out.append(s);
+    }
+
+    void tag(ExprTag t)
+    {
+        out.push_back((char) t);
+    }
+
+    void symbol(Symbol s)
+    {
+        if (!s) {
+            num(0);
+            return;
+        }
+        auto [i, inserted] = symbolIds.try_emplace(s, symbolList.size());
+        if (inserted)
+            symbolList.push_back(s);
+        num(i->second + 1);
+    }
+
+    void pos(PosIdx p)
+    {
+        if (!p) {
+            num(0);
+            return;
+        }
+        auto offset = origin.offsetOf(p);
+        if (offset > origin.size)
+            throw Error("position does not belong to the expression's source");
+        num(offset + 1);
+    }
+
+    void attrPath(const AttrPath & attrPath)
+    {
+        num(attrPath.size());
+        for (auto & i : attrPath) {
+            if (i.symbol) {
+                num(0);
+                symbol(i.symbol);
+            } else {
+                num(1);
+                expr(i.expr);
+            }
+        }
+    }
+
+    void exprs(const std::vector<Expr *> & es)
+    {
+        num(es.size());
+        for (auto e : es)
+            expr(e);
+    }
+
+    template<typename T>
+    bool binOp(ExprTag t, Expr * e)
+    {
+        auto op = dynamic_cast<T *>(e);
+        if (!op) return false;
+        tag(t);
+        pos(op->pos);
+        expr(op->e1);
+        expr(op->e2);
+        return true;
+    }
+
+    void expr(Expr * e)
+    {
+        if (!e) {
+            tag(ExprTag::Null);
+            return;
+        }
+
+        if (auto i = exprIds.find(e); i != exprIds.end()) {
+            tag(ExprTag::Ref);
+            num(i->second);
+            return;
+        }
+
+        if (auto e2 = dynamic_cast<ExprInt *>(e)) {
+            tag(ExprTag::Int);
+            auto n = e2->v.integer().value;
+            num(((uint64_t) n << 1) ^ (uint64_t) (n >> 63));
+        }
+
+        else if (auto e2 = dynamic_cast<ExprFloat *>(e)) {
+            tag(ExprTag::Float);
+            auto f = e2->v.fpoint();
+            char buf[sizeof(f)];
+            std::memcpy(buf, &f, sizeof(f));
+            out.append(buf, sizeof(buf));
+        }
+
+        else if (auto e2 = dynamic_cast<ExprString *>(e)) {
+            tag(ExprTag::String);
+            str(e2->s);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprPath *>(e)) {
+            tag(ExprTag::Path);
+            str(e2->s);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprInheritFrom *>(e)) {
+            tag(ExprTag::InheritFrom);
+            pos(e2->pos);
+            num(e2->displ);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprVar *>(e)) {
+            tag(ExprTag::Var);
+            pos(e2->pos);
+            symbol(e2->name);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+            tag(ExprTag::Select);
+            pos(e2->pos);
+            expr(e2->e);
+            attrPath(e2->attrPath);
+            expr(e2->def);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+            tag(ExprTag::OpHasAttr);
+            expr(e2->e);
+            attrPath(e2->attrPath);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAttrs *>(e)) {
+            tag(ExprTag::Attrs);
+            num(e2->recursive);
+            pos(e2->pos);
+            num(e2->attrs.size());
+            for (auto & [name, def] : e2->attrs) {
+                symbol(name);
+                num((uint64_t) def.kind);
+                pos(def.pos);
+                expr(def.e);
+            }
+            if (e2->inheritFromExprs) {
+                num(1);
+                exprs(*e2->inheritFromExprs);
+            } else
+                num(0);
+            num(e2->dynamicAttrs.size());
+            for (auto & def : e2->dynamicAttrs) {
+                pos(def.pos);
+                expr(def.nameExpr);
+                expr(def.valueExpr);
+            }
+        }
+
+        else if (auto e2 = dynamic_cast<ExprList *>(e)) {
+            tag(ExprTag::List);
+            exprs(e2->elems);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLambda *>(e)) {
+            tag(ExprTag::Lambda);
+            pos(e2->pos);
+            symbol(e2->name);
+            symbol(e2->arg);
+            if (e2->formals) {
+                num(1 + e2->formals->ellipsis);
+                num(e2->formals->formals.size());
+                for (auto & formal : e2->formals->formals) {
+                    pos(formal.pos);
+                    symbol(formal.name);
+                    expr(formal.def);
+                }
+            } else
+                num(0);
+            expr(e2->body);
+            pos(e2->docComment.begin);
+            pos(e2->docComment.end);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprCall *>(e)) {
+            tag(ExprTag::Call);
+            pos(e2->pos);
+            expr(e2->fun);
+            exprs(e2->args);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLet *>(e)) {
+            tag(ExprTag::Let);
+            expr(e2->attrs);
+            expr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprWith *>(e)) {
+            tag(ExprTag::With);
+            pos(e2->pos);
+            expr(e2->attrs);
+            expr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprIf *>(e)) {
+            tag(ExprTag::If);
+            pos(e2->pos);
+            expr(e2->cond);
+            expr(e2->then);
+            expr(e2->else_);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAssert *>(e)) {
+            tag(ExprTag::Assert);
+            pos(e2->pos);
+            expr(e2->cond);
+            expr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpNot *>(e)) {
+            tag(ExprTag::OpNot);
+            expr(e2->e);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+            tag(ExprTag::ConcatStrings);
+            pos(e2->pos);
+            num(e2->forceString);
+            num(e2->es->size());
+            for (auto & [p, e3] : *e2->es) {
+                pos(p);
+                expr(e3);
+            }
+        }
+
+        else if (auto e2 = dynamic_cast<ExprPos *>(e)) {
+            tag(ExprTag::Pos);
+            pos(e2->pos);
+        }
+
+        else if (
+            binOp<ExprOpEq>(ExprTag::OpEq, e)
+            || binOp<ExprOpNEq>(ExprTag::OpNEq, e)
+            || binOp<ExprOpAnd>(ExprTag::OpAnd, e)
+            || binOp<ExprOpOr>(ExprTag::OpOr, e)
+            || binOp<ExprOpImpl>(ExprTag::OpImpl, e)
+            || binOp<ExprOpUpdate>(ExprTag::OpUpdate, e)
+            || binOp<ExprOpConcatLists>(ExprTag::OpConcatLists, e))
+            ;
+
+        else
+            throw Error("cannot serialise expression of type '%s'", typeid(*e).name());
+
+        exprIds.emplace(e, exprIds.size());
+    }
+};
+
+/**
+ * The inverse of `ExprWriter`.
+ */
+struct ExprReader
+{
+    std::string_view in;
+
+    PosTable & positions;
+    const PosTable::Origin & origin;
+    const ref<SourceAccessor> & rootFS;
+
+    std::vector<Symbol> symbolList;
+
+    std::vector<Expr *> exprList;
+
+    uint64_t num()
+    {
+        uint64_t n = 0;
+        for (unsigned int shift = 0; ; shift += 7) {
+            if (in.empty() || shift >= 64)
+                throw BadParseCacheEntry("bad number");
+            uint8_t b = in[0];
+            in.remove_prefix(1);
+            n |= (uint64_t) (b & 0x7f) << shift;
+            if (!(b & 0x80)) return n;
+        }
+    }
+
+    std::string_view bytes(size_t n)
+    {
+        if (in.size() < n)
+            throw BadParseCacheEntry("unexpected end of data");
+        auto s = in.substr(0, n);
+        in.remove_prefix(n);
+        return s;
+    }
+
+    std::string str()
+    {
+        return std::string(bytes(num()));
+    }
+
+    Symbol symbol()
+    {
+        auto n = num();
+        if (!n) return {};
+        if (n > symbolList.size())
+            throw BadParseCacheEntry("bad symbol");
+        return symbolList[n - 1];
+    }
+
+    PosIdx pos()
+    {
+        auto n = num();
+        if (!n) return noPos;
+        if (n - 1 > origin.size)
+            throw BadParseCacheEntry("bad position");
+        return positions.add(origin, n - 1);
+    }
+
+    AttrPath attrPath()
+    {
+        AttrPath res;
+        auto n = num();
+        for (uint64_t i = 0; i < n; ++i) {
+            if (num() == 0)
+                res.emplace_back(symbol());
+            else
+                res.emplace_back(nonNull(expr()));
+        }
+        return res;
+    }
+
+    std::vector<Expr *> exprs()
+    {
+        std::vector<Expr *> res;
+        auto n = num();
+        for (uint64_t i = 0; i < n; ++i)
+            res.push_back(nonNull(expr()));
+        return res;
+    }
+
+    Expr * nonNull(Expr * e)
+    {
+        if (!e)
+            throw BadParseCacheEntry("unexpected null expression");
+        return e;
+    }
+
+    template<typename T>
+    T * exprOf()
+    {
+        auto e = dynamic_cast<T *>(expr());
+        if (!e)
+            throw BadParseCacheEntry("unexpected expression type");
+        return e;
+    }
+
+    template<typename T>
+    Expr * binOp()
+    {
+        auto p = pos();
+        auto e1 = nonNull(expr());
+        auto e2 = nonNull(expr());
+        return new T(p, e1, e2);
+    }
+
+    Expr * expr()
+    {
+        auto t = (ExprTag) (uint8_t) bytes(1)[0];
+
+        Expr * e;
+
+        switch (t) {
+
+        case ExprTag::Null:
+            return nullptr;
+
+        case ExprTag::Ref: {
+            auto id = num();
+            if (id >= exprList.size())
+                throw BadParseCacheEntry("bad expression reference");
+            return exprList[id];
+        }
+
+        case ExprTag::Int: {
+            auto n = num();
+            e = new ExprInt((NixInt::Inner) ((n >> 1) ^ -(n & 1)));
+            break;
+        }
+
+        case ExprTag::Float: {
+            NixFloat f;
+            std::memcpy(&f, bytes(sizeof(f)).data(), sizeof(f));
+            e = new ExprFloat(f);
+            break;
+        }
+
+        case ExprTag::String:
+            e = new ExprString(str());
+            break;
+
+        case ExprTag::Path:
+            e = new ExprPath(rootFS, str());
+            break;
+
+        case ExprTag::InheritFrom: {
+            auto p = pos();
+            e = new ExprInheritFrom(p, num());
+            break;
+        }
+
+        case ExprTag::Var: {
+            auto p = pos();
+            e = new ExprVar(p, symbol());
+            break;
+        }
+
+        case ExprTag::Select: {
+            auto p = pos();
+            auto e2 = nonNull(expr());
+            auto path = attrPath();
+            e = new ExprSelect(p, e2, std::move(path), expr());
+            break;
+        }
+
+        case ExprTag::OpHasAttr: {
+            auto e2 = nonNull(expr());
+            e = new ExprOpHasAttr(e2, attrPath());
+            break;
+        }
+
+        case ExprTag::Attrs: {
+            auto recursive = num();
+            auto e2 = new ExprAttrs(pos());
+            e2->recursive = recursive;
+            auto nrAttrs = num();
+            for (uint64_t i = 0; i < nrAttrs; ++i) {
+                auto name = symbol();
+                auto kind = num();
+                if (kind > (uint64_t) ExprAttrs::AttrDef::Kind::InheritedFrom)
+                    throw BadParseCacheEntry("bad attribute kind");
+                auto p = pos();
+                e2->attrs.emplace(name, ExprAttrs::AttrDef(nonNull(expr()), p, (ExprAttrs::AttrDef::Kind) kind));
+            }
+            if (num())
+                e2->inheritFromExprs = std::make_unique<std::vector<Expr *>>(exprs());
+            auto nrDynamicAttrs = num();
+            for (uint64_t i = 0; i < nrDynamicAttrs; ++i) {
+                auto p = pos();
+                auto nameExpr = nonNull(expr());
+                e2->dynamicAttrs.emplace_back(nameExpr, nonNull(expr()), p);
+            }
+            e = e2;
+            break;
+        }
+
+        case ExprTag::List: {
+            auto e2 = new ExprList;
+            e2->elems = exprs();
+            e = e2;
+            break;
+        }
+
+        case ExprTag::Lambda: {
+            auto p = pos();
+            auto name = symbol();
+            auto arg = symbol();
+            Formals * formals = nullptr;
+            if (auto hasFormals = num()) {
+                formals = new Formals;
+                formals->ellipsis = hasFormals == 2;
+                auto nrFormals = num();
+                for (uint64_t i = 0; i < nrFormals; ++i) {
+                    auto formalPos = pos();
+                    auto formalName = symbol();
+                    formals->formals.push_back(Formal{formalPos, formalName, expr()});
+                }
+                /* `Formals::has()` relies on the formals being sorted
+                   by symbol, which depends on the symbol table. */
+                std::sort(formals->formals.begin(), formals->formals.end(),
+                    [] (const auto & a, const auto & b) {
+                        return std::tie(a.name, a.pos) < std::tie(b.name, b.pos);
+                    });
+            }
+            auto e2 = new ExprLambda(p, arg, formals, nonNull(expr()));
+            e2->name = name;
+            e2->docComment.begin = pos();
+            e2->docComment.end = pos();
+            e = e2;
+            break;
+        }
+
+        case ExprTag::Call: {
+            auto p = pos();
+            auto fun = nonNull(expr());
+            e = new ExprCall(p, fun, exprs());
+            break;
+        }
+
+        case ExprTag::Let: {
+            auto attrs = exprOf<ExprAttrs>();
+            e = new ExprLet(attrs, nonNull(expr()));
+            break;
+        }
+
+        case ExprTag::With: {
+            auto p = pos();
+            auto attrs = nonNull(expr());
+            e = new ExprWith(p, attrs, nonNull(expr()));
+            break;
+        }
+
+        case ExprTag::If: {
+            auto p = pos();
+            auto cond = nonNull(expr());
+            auto then = nonNull(expr());
+            e = new ExprIf(p, cond, then, nonNull(expr()));
+            break;
+        }
+
+        case ExprTag::Assert: {
+            auto p = pos();
+            auto cond = nonNull(expr());
+            e = new ExprAssert(p, cond, nonNull(expr()));
+            break;
+        }
+
+        case ExprTag::OpNot:
+            e = new ExprOpNot(nonNull(expr()));
+            break;
+
+        case ExprTag::OpEq: e = binOp<ExprOpEq>(); break;
+        case ExprTag::OpNEq: e = binOp<ExprOpNEq>(); break;
+        case ExprTag::OpAnd: e = binOp<ExprOpAnd>(); break;
+        case ExprTag::OpOr: e = binOp<ExprOpOr>(); break;
+        case ExprTag::OpImpl: e = binOp<ExprOpImpl>(); break;
+        case ExprTag::OpUpdate: e = binOp<ExprOpUpdate>(); break;
+        case ExprTag::OpConcatLists: e = binOp<ExprOpConcatLists>(); break;
+
+        case ExprTag::ConcatStrings: {
+            auto p = pos();
+            auto forceString = num();
+            auto es = new std::vector<std::pair<PosIdx, Expr *>>;
+            auto n = num();
+            for (uint64_t i = 0; i < n; ++i) {
+                auto p2 = pos();
+                es->emplace_back(p2, nonNull(expr()));
+            }
+            e = new ExprConcatStrings(p, forceString, es);
+            break;
+        }
+
+        case ExprTag::Pos:
+            e = new ExprPos(pos());
+            break;
+
+        default:
+            throw BadParseCacheEntry("bad expression tag %d", (int) t);
+        }
+
+        exprList.push_back(e);
+        return e;
+    }
+};
+
+}
+
+ParseCache::ParseCache(uint64_t maxSize)
+    : cacheDir(getCacheDir() + "/parse-cache-v1")
+    , maxSize(maxSize)
+{
+}
+
+Hash ParseCache::key(std::string_view text, const SourcePath & basePath, const EvalSettings & settings)
+{
+    HashSink sink(HashAlgorithm::SHA256);
+    sink << formatVersion << nixVersion;
+    sink << basePath.path.abs();
+    sink << getHome();
+    sink << (uint64_t) settings.pureEval.get();
+    sink << experimentalFeatureSettings.experimentalFeatures.to_string();
+    sink << text;
+    return sink.finish().first;
+}
+
+Path ParseCache::entryPath(const Hash & key) const
+{
+    return cacheDir + "/" + key.to_string(HashFormat::Base16, false);
+}
+
+Expr * ParseCache::lookup(
+    const Hash & key,
+    SymbolTable & symbols,
+    PosTable & positions,
+    const PosTable::Origin & origin,
+    DocCommentMap & docComments,
+    const ref<SourceAccessor> & rootFS)
+{
+    auto path = entryPath(key);
+
+    std::string data;
+    try {
+        data = readFile(path);
+    } catch (SysError & e) {
+        if (e.errNo != ENOENT)
+            debug("cannot read parse cache entry '%s': %s", path, e.msg());
+        return nullptr;
+    }
+
+    try {
+        ExprReader reader{
+            .in = data,
+            .positions = positions,
+            .origin = origin,
+            .rootFS = rootFS,
+        };
+
+        if (reader.bytes(magic.size()) != magic)
+            throw BadParseCacheEntry("bad magic");
+        if (reader.num() != origin.size)
+            throw BadParseCacheEntry("source size mismatch");
+
+        auto nrSymbols = reader.num();
+        for (uint64_t i = 0; i < nrSymbols; ++i)
+            reader.symbolList.push_back(symbols.create(reader.str()));
+
+        DocCommentMap newDocComments;
+        auto nrDocComments = reader.num();
+        for (uint64_t i = 0; i < nrDocComments; ++i) {
+            auto p = reader.pos();
+            auto begin = reader.pos();
+            newDocComments.emplace(p, DocComment{begin, reader.pos()});
+        }
+
+        auto e = reader.nonNull(reader.expr());
+
+        if (!reader.in.empty())
+            throw BadParseCacheEntry("trailing data");
+
+        docComments.merge(newDocComments);
+
+        /* Mark the entry as recently used, for `trim()`. */
+        std::error_code ec;
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+
+        return e;
+    } catch (BadParseCacheEntry & e) {
+        /* The expressions that were read are leaked, but this should
+           never happen in practice anyway. */
+        debug("ignoring bad parse cache entry '%s': %s", path, e.msg());
+        return nullptr;
+    }
+}
+
+void ParseCache::add(
+    const Hash & key,
+    Expr * e,
+    const SymbolTable & symbols,
+    const PosTable::Origin & origin,
+    const DocCommentMap & docComments)
+{
+    auto path = entryPath(key);
+
+    try {
+        ExprWriter body{.symbols = symbols, .origin = origin};
+
+        /* Only the doc comments of this file, not those of previous
+           parses of the same path. */
+        size_t nrDocComments = 0;
+        for (auto & [p, comment] : docComments) {
+            if (origin.offsetOf(p) > origin.size) continue;
+            body.pos(p);
+            body.pos(comment.begin);
+            body.pos(comment.end);
+            nrDocComments++;
+        }
+
+        auto docCommentsData = std::move(body.out);
+        body.out.clear();
+
+        body.expr(e);
+
+        ExprWriter header{.symbols = symbols, .origin = origin};
+        header.out.append(magic);
+        header.num(origin.size);
+        header.num(body.symbolList.size());
+        for (auto & s : body.symbolList)
+            header.str(symbols[s]);
+        header.num(nrDocComments);
+
+        createDirs(cacheDir);
+        auto tmpPath = fmt("%s.tmp-%d", path, getpid());
+        auto data = header.out + docCommentsData + body.out;
+        writeFile(tmpPath, data);
+        std::filesystem::rename(tmpPath, path);
+
+        if (maxSize) {
+            auto totalSize(totalSize_.lock());
+            if (*totalSize)
+                **totalSize += data.size();
+            if (!*totalSize || **totalSize > maxSize)
+                *totalSize = trim();
+        }
+    } catch (std::exception & e) {
+        debug("cannot write parse cache entry '%s': %s", path, e.what());
+    }
+}
+
+uint64_t ParseCache::trim()
+{
+    std::vector<std::tuple<std::filesystem::file_time_type, uint64_t, std::filesystem::path>> entries;
+    uint64_t totalSize = 0;
+
+    for (auto & entry : std::filesystem::directory_iterator(cacheDir)) {
+        std::error_code ec;
+        auto size = entry.file_size(ec);
+        if (ec) continue;
+        auto time = entry.last_write_time(ec);
+        if (ec) continue;
+        totalSize += size;
+        entries.emplace_back(time, size, entry.path());
+    }
+
+    if (totalSize <= maxSize) return totalSize;
+
+    std::sort(entries.begin(), entries.end());
+
+    for (auto & [time, size, path] : entries) {
+        if (totalSize <= maxSize / 4 * 3) break;
+        std::error_code ec;
+        if (std::filesystem::remove(path, ec))
+            totalSize -= size;
+    }
+
+    return totalSize;
+}
+
+}
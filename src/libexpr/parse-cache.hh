@@ -0,0 +1,92 @@
+#pragma once
+///@file
+
+#include "eval.hh"
+#include "hash.hh"
+#include "sync.hh"
+
+namespace nix {
+
+/**
+ * An on-disk cache of parsed Nix files, so that evaluating the same
+ * files again (e.g. Nixpkgs in every `nix build`) doesn't have to lex
+ * and parse them again.
+ *
+ * Entries are keyed on a hash of the source text and of everything
+ * else that influences the result of parsing (the Nix version, the
+ * base path used to resolve relative path literals, the home directory,
+ * pure evaluation mode and the enabled experimental features). They
+ * contain the abstract syntax tree *before* variable binding, with
+ * symbols stored as strings and positions as offsets into the source,
+ * so that they can be loaded into any `EvalState`.
+ *
+ * Warnings that the parser would have printed are not printed again
+ * when an expression is loaded from the cache.
+ *
+ * When the entries exceed `maxSize` bytes, the least recently used
+ * ones are removed.
+ */
+class ParseCache
+{
+    const Path cacheDir;
+
+    const uint64_t maxSize;
+
+    /**
+     * The total size of the entries, as of the last time the cache
+     * was trimmed plus the entries added since. Unknown until the first
+     * entry is added.
+     */
+    Sync<std::optional<uint64_t>> totalSize_;
+
+public:
+
+    /**
+     * @param maxSize The maximum size of the cache in bytes, or 0 for
+     * no limit.
+     */
+    ParseCache(uint64_t maxSize);
+
+    /**
+     * Compute the cache key of a source file.
+     */
+    static Hash key(std::string_view text, const SourcePath & basePath, const EvalSettings & settings);
+
+    /**
+     * Load a cached expression, allocating its positions in `origin`
+     * and adding its doc comments to `docComments`. Returns `nullptr` if
+     * there is no usable cache entry.
+     */
+    Expr * lookup(
+        const Hash & key,
+        SymbolTable & symbols,
+        PosTable & positions,
+        const PosTable::Origin & origin,
+        DocCommentMap & docComments,
+        const ref<SourceAccessor> & rootFS);
+
+    /**
+     * Store an expression that was just parsed from `origin`. Errors
+     * are ignored, since the cache is only an optimisation.
+     */
+    void add(
+        const Hash & key,
+        Expr * e,
+        const SymbolTable & symbols,
+        const PosTable::Origin & origin,
+        const DocCommentMap & docComments);
+
+private:
+
+    Path entryPath(const Hash & key) const;
+
+    /**
+     * Remove the least recently used entries if the cache is larger
+     * than `maxSize`, and return its new size. It is trimmed to three
+     * quarters of `maxSize`, so that this doesn't happen on every
+     * addition.
+     */
+    uint64_t trim();
+};
+
+}
@@ -62,7 +62,7 @@ typedef std::unordered_map<PosIdx, DocComment> DocCommentMap;
 Expr * parseExprFromBuf(
     char * text,
     size_t length,
-    Pos::Origin origin,
+    const PosTable::Origin & origin,
     const SourcePath & basePath,
     SymbolTable & symbols,
     const EvalSettings & settings,
@@ -515,7 +515,7 @@ namespace nix {
 Expr * parseExprFromBuf(
     char * text,
     size_t length,
-    Pos::Origin origin,
+    const PosTable::Origin & origin,
     const SourcePath & basePath,
     SymbolTable & symbols,
     const EvalSettings & settings,
@@ -528,7 +528,7 @@ Expr * parseExprFromBuf(
     LexerState lexerState {
         .positionToDocComment = docComments,
         .positions = positions,
-        .origin = positions.addOrigin(origin, length),
+        .origin = origin,
     };
     ParserState state {
         .lexerState = lexerState,
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <map>
 #include <vector>
 
 #include "pos-idx.hh"
@@ -35,7 +36,12 @@ public:
 private:
     using Lines = std::vector<uint32_t>;
 
-    std::map<uint32_t, Origin> origins;
+    /**
+     * Origins are added while parsing, possibly concurrently with
+     * other evaluator threads resolving positions. Map nodes are
+     * stable, so `resolve()` can return pointers into it.
+     */
+    SharedSync<std::map<uint32_t, Origin>> origins;
     mutable Sync<std::map<uint32_t, Lines>> lines;
 
     const Origin * resolve(PosIdx p) const
@@ -47,22 +53,24 @@ private:
         /* we want the last key <= idx, so we'll take prev(first key > idx).
             this is guaranteed to never rewind origin.begin because the first
             key is always 0. */
-        const auto pastOrigin = origins.upper_bound(idx);
+        auto origins_(origins.readLock());
+        const auto pastOrigin = origins_->upper_bound(idx);
         return &std::prev(pastOrigin)->second;
     }
 
 public:
     Origin addOrigin(Pos::Origin origin, size_t size)
     {
+        auto origins_(origins.lock());
         uint32_t offset = 0;
-        if (auto it = origins.rbegin(); it != origins.rend())
+        if (auto it = origins_->rbegin(); it != origins_->rend())
             offset = it->first + it->second.size;
         // +1 because all PosIdx are offset by 1 to begin with, and
         // another +1 to ensure that all origins can point to EOF, eg
         // on (invalid) empty inputs.
         if (2 + offset + size < offset)
             return Origin{origin, offset, 0};
-        return origins.emplace(offset, Origin{origin, offset, size}).first->second;
+        return origins_->emplace(offset, Origin{origin, offset, size}).first->second;
     }
 
     PosIdx add(const Origin & origin, size_t offset)
@@ -14,6 +14,7 @@
 #include "value-to-xml.hh"
 #include "primops.hh"
 #include "fetch-to-store.hh"
+#include "parallel-eval.hh"
 
 #include <boost/container/small_vector.hpp>
 #include <nlohmann/json.hpp>
@@ -49,6 +50,10 @@ static inline Value * mkString(EvalState & state, const std::csub_match & match)
 
 StringMap EvalState::realiseContext(const NixStringContext & context, StorePathSet * maybePathsOut, bool isIFD)
 {
+    /* Leave building derivations to the main thread. */
+    if (!context.empty())
+        Executor::abortIfWorker();
+
     std::vector<DerivedPath::Built> drvs;
     StringMap res;
 
@@ -401,6 +406,7 @@ void prim_importNative(EvalState & state, const PosIdx pos, Value * * args, Valu
 /* Execute a program and parse its output */
 void prim_exec(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
+    Executor::abortIfWorker();
     state.forceList(*args[0], pos, "while evaluating the first argument passed to builtins.exec");
     auto elems = args[0]->listElems();
     auto count = args[0]->listSize();
@@ -673,8 +679,8 @@ static Bindings::const_iterator getAttr(
     const Bindings * attrSet,
     std::string_view errorCtx)
 {
-    auto value = attrSet->find(attrSym);
-    if (value == attrSet->end()) {
+    auto value = attrSet->get(attrSym);
+    if (!value) {
         state.error<TypeError>("attribute '%s' missing", state.symbols[attrSym]).withTrace(noPos, errorCtx).debugThrow();
     }
     return value;
@@ -931,6 +937,11 @@ static void prim_tryEval(EvalState & state, const PosIdx pos, Value * * args, Va
     ReplExitStatus (* savedDebugRepl)(ref<EvalState> es, const ValMap & extraEnv) = nullptr;
     if (state.debugRepl && state.settings.ignoreExceptionsDuringTry)
     {
+        /* Workers would see the debugger disabled only until we
+           restore it, so don't use them anymore. */
+        Executor::abortIfWorker();
+        state.stopParallelEval();
+
         /* to prevent starting the repl from exceptions withing a tryEval, null it. */
         savedDebugRepl = state.debugRepl;
         state.debugRepl = nullptr;
@@ -1043,6 +1054,7 @@ static RegisterPrimOp primop_deepSeq({
    return the second expression.  Useful for debugging. */
 static void prim_trace(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
+    Executor::abortIfWorker();
     state.forceValue(*args[0], pos);
     if (args[0]->type() == nString)
         printError("trace: %1%", args[0]->string_view());
@@ -1074,6 +1086,7 @@ static RegisterPrimOp primop_trace({
 
 static void prim_warn(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
+    Executor::abortIfWorker();
     // We only accept a string argument for now. The use case for pretty printing a value is covered by `trace`.
     // By rejecting non-strings we allow future versions to add more features without breaking existing code.
     auto msgStr = state.forceString(*args[0], pos, "while evaluating the first argument; the message passed to builtins.warn");
@@ -1150,6 +1163,9 @@ static void derivationStrictInternal(
    derivation. */
 static void prim_derivationStrict(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
+    /* Leave writing .drv files to the main thread. */
+    Executor::abortIfWorker();
+
     state.forceAttrs(*args[0], pos, "while evaluating the argument passed to builtins.derivationStrict");
 
     auto attrs = args[0]->attrs();
@@ -1226,8 +1242,8 @@ static void derivationStrictInternal(
     using nlohmann::json;
     std::optional<json> jsonObject;
     auto pos = v.determinePos(noPos);
-    auto attr = attrs->find(state.sStructuredAttrs);
-    if (attr != attrs->end() &&
+    auto attr = attrs->get(state.sStructuredAttrs);
+    if (attr &&
         state.forceBool(*attr->value, pos,
                         "while evaluating the `__structuredAttrs` "
                         "attribute passed to builtins.derivationStrict"))
@@ -1235,8 +1251,8 @@ static void derivationStrictInternal(
 
     /* Check whether null attributes should be ignored. */
     bool ignoreNulls = false;
-    attr = attrs->find(state.sIgnoreNulls);
-    if (attr != attrs->end())
+    attr = attrs->get(state.sIgnoreNulls);
+    if (attr)
         ignoreNulls = state.forceBool(*attr->value, pos, "while evaluating the `__ignoreNulls` attribute " "passed to builtins.derivationStrict");
 
     /* Build the derivation expression by processing the attributes. */
@@ -1454,6 +1470,10 @@ static void derivationStrictInternal(
         ).atPos(v).debugThrow();
     }
 
+    /* All attributes have been evaluated; the rest is computing
+       output paths and writing the derivation. */
+    EvalState::PhaseTimer phaseTimer(state, EvalPhase::Derivation);
+
     if (outputHash) {
         /* Handle fixed-output derivations.
 
@@ -1648,8 +1668,10 @@ static void prim_storePath(EvalState & state, const PosIdx pos, Value * * args,
         state.error<EvalError>("path '%1%' is not in the Nix store", path)
             .atPos(pos).debugThrow();
     auto path2 = state.store->toStorePath(path.abs()).first;
-    if (!settings.readOnlyMode)
+    if (!settings.readOnlyMode) {
+        Executor::abortIfWorker();
         state.store->ensurePath(path2);
+    }
     context.insert(NixStringContextElem::Opaque { .path = path2 });
     v.mkString(path.abs(), context);
 }
@@ -1836,8 +1858,8 @@ static void prim_findFile(EvalState & state, const PosIdx pos, Value * * args, V
         state.forceAttrs(*v2, pos, "while evaluating an element of the list passed to builtins.findFile");
 
         std::string prefix;
-        auto i = v2->attrs()->find(state.sPrefix);
-        if (i != v2->attrs()->end())
+        auto i = v2->attrs()->get(state.sPrefix);
+        if (i)
             prefix = state.forceStringNoCtx(*i->value, pos, "while evaluating the `prefix` attribute of an element of the list passed to builtins.findFile");
 
         i = getAttr(state, state.sPath, v2->attrs(), "in an element of the __nixPath");
@@ -2321,6 +2343,7 @@ static RegisterPrimOp primop_fromJSON({
    as an input by derivations. */
 static void prim_toFile(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
+    Executor::abortIfWorker();
     NixStringContext context;
     std::string name(state.forceStringNoCtx(*args[0], pos, "while evaluating the first argument passed to builtins.toFile"));
     std::string contents(state.forceString(*args[1], context, pos, "while evaluating the second argument passed to builtins.toFile"));
@@ -2466,6 +2489,8 @@ static void addPath(
     Value & v,
     const NixStringContext & context)
 {
+    Executor::abortIfWorker();
+
     try {
         StorePathSet refs;
 
@@ -2499,6 +2524,7 @@ static void addPath(
                 {}));
 
         if (!expectedHash || !state.store->isValidPath(*expectedStorePath)) {
+            EvalState::PhaseTimer phaseTimer(state, EvalPhase::StoreCopy);
             auto dstPath = fetchToStore(
                 *state.store,
                 path.resolveSymlinks(),
@@ -2765,8 +2791,8 @@ static void prim_unsafeGetAttrPos(EvalState & state, const PosIdx pos, Value * *
 {
     auto attr = state.forceStringNoCtx(*args[0], pos, "while evaluating the first argument passed to builtins.unsafeGetAttrPos");
     state.forceAttrs(*args[1], pos, "while evaluating the second argument passed to builtins.unsafeGetAttrPos");
-    auto i = args[1]->attrs()->find(state.symbols.create(attr));
-    if (i == args[1]->attrs()->end())
+    auto i = args[1]->attrs()->get(state.symbols.create(attr));
+    if (!i)
         v.mkNull();
     else
         state.mkPos(v, i->pos);
@@ -2831,7 +2857,7 @@ static void prim_hasAttr(EvalState & state, const PosIdx pos, Value * * args, Va
 {
     auto attr = state.forceStringNoCtx(*args[0], pos, "while evaluating the first argument passed to builtins.hasAttr");
     state.forceAttrs(*args[1], pos, "while evaluating the second argument passed to builtins.hasAttr");
-    v.mkBool(args[1]->attrs()->find(state.symbols.create(attr)) != args[1]->attrs()->end());
+    v.mkBool(args[1]->attrs()->get(state.symbols.create(attr)));
 }
 
 static RegisterPrimOp primop_hasAttr({
@@ -4119,6 +4145,13 @@ static RegisterPrimOp primop_substring({
 
 static void prim_stringLength(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
+    /* Don't flatten ropes just to get their length. */
+    state.forceValue(*args[0], pos);
+    if (args[0]->type() == nString) {
+        v.mkInt(NixInt::Inner(args[0]->string_size()));
+        return;
+    }
+
     NixStringContext context;
     auto s = state.coerceToString(pos, *args[0], context, "while evaluating the argument passed to builtins.stringLength");
     v.mkInt(NixInt::Inner(s->size()));
@@ -4470,16 +4503,38 @@ static void prim_concatStringsSep(EvalState & state, const PosIdx pos, Value * *
     auto sep = state.forceString(*args[0], context, pos, "while evaluating the first argument (the separator string) passed to builtins.concatStringsSep");
     state.forceList(*args[1], pos, "while evaluating the second argument (the list of strings to concat) passed to builtins.concatStringsSep");
 
-    std::string res;
-    res.reserve((args[1]->listSize() + 32) * sep.size());
-    bool first = true;
+    /* Compute the size of the result first, so that it can be built
+       in place rather than copied. */
+    std::vector<BackedStringView> strings;
+    strings.reserve(args[1]->listSize());
+    size_t size = 0;
 
     for (auto elem : args[1]->listItems()) {
-        if (first) first = false; else res += sep;
-        res += *state.coerceToString(pos, *elem, context, "while evaluating one element of the list of strings to concat passed to builtins.concatStringsSep");
+        if (!strings.empty()) size += sep.size();
+        strings.push_back(state.coerceToString(pos, *elem, context, "while evaluating one element of the list of strings to concat passed to builtins.concatStringsSep"));
+        size += strings.back()->size();
     }
 
-    v.mkString(res, context);
+    if (size == 0) {
+        v.mkString("", context);
+        return;
+    }
+
+    auto res = allocString(size + 1);
+    auto p = res;
+    bool first = true;
+
+    for (auto & s : strings) {
+        if (first) first = false; else {
+            memcpy(p, sep.data(), sep.size());
+            p += sep.size();
+        }
+        memcpy(p, s->data(), s->size());
+        p += s->size();
+    }
+    *p = 0;
+
+    v.mkStringMove(res, size, context);
 }
 
 static RegisterPrimOp primop_concatStringsSep({
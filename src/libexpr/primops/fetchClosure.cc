@@ -3,6 +3,7 @@
 #include "realisation.hh"
 #include "make-content-addressed.hh"
 #include "url.hh"
+#include "parallel-eval.hh"
 
 namespace nix {
 
@@ -114,6 +115,7 @@ typedef std::optional<StorePath> StorePathOrGap;
 
 static void prim_fetchClosure(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
+    Executor::abortIfWorker();
     state.forceAttrs(*args[0], pos, "while evaluating the argument passed to builtins.fetchClosure");
 
     std::optional<std::string> fromStoreUrl;
@@ -5,11 +5,14 @@
 #include "fetchers.hh"
 #include "url.hh"
 #include "url-parts.hh"
+#include "parallel-eval.hh"
 
 namespace nix {
 
 static void prim_fetchMercurial(EvalState & state, const PosIdx pos, Value * * args, Value & v)
 {
+    Executor::abortIfWorker();
+
     std::string url;
     std::optional<Hash> rev;
     std::optional<std::string> ref;
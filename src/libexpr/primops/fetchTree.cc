@@ -10,6 +10,7 @@
 #include "url.hh"
 #include "value-to-json.hh"
 #include "fetch-to-store.hh"
+#include "parallel-eval.hh"
 
 #include <nlohmann/json.hpp>
 
@@ -88,6 +89,9 @@ static void fetchTree(
     Value & v,
     const FetchTreeParams & params = FetchTreeParams{}
 ) {
+    /* Leave fetching to the main thread. */
+    Executor::abortIfWorker();
+
     fetchers::Input input { state.fetchSettings };
     NixStringContext context;
     std::optional<std::string> type;
@@ -454,6 +458,8 @@ static RegisterPrimOp primop_fetchFinalTree({
 static void fetch(EvalState & state, const PosIdx pos, Value * * args, Value & v,
     const std::string & who, bool unpack, std::string name)
 {
+    Executor::abortIfWorker();
+
     std::optional<std::string> url;
     std::optional<Hash> expectedHash;
 
@@ -497,7 +497,7 @@ private:
             output << "«potential infinite recursion»";
             if (options.ansiColors)
                 output << ANSI_NORMAL;
-        } else if (v.isThunk() || v.isApp()) {
+        } else if (v.isThunk() || v.isApp() || v.isPending()) {
             if (options.ansiColors)
                     output << ANSI_MAGENTA;
             output << "«thunk»";
@@ -1,13 +1,16 @@
 #pragma once
 ///@file
 
+#include <array>
+#include <atomic>
 #include <list>
 #include <map>
+#include <memory>
 #include <unordered_map>
 
 #include "types.hh"
-#include "chunked-vector.hh"
 #include "error.hh"
+#include "sync.hh"
 
 namespace nix {
 
@@ -72,35 +75,102 @@ public:
     bool operator==(const Symbol other) const { return id == other.id; }
 
     friend class std::hash<Symbol>;
+    friend class Bindings;
 };
 
 /**
  * Symbol table used by the parser and evaluator to represent and look
  * up identifiers and attributes efficiently.
+ *
+ * The table is safe to use from multiple threads. Interning is done
+ * through a fixed number of shards, each protected by a reader/writer
+ * lock, so lookups of existing symbols only take a shared lock on one
+ * shard. Symbol strings live in chunks that are never moved or freed
+ * while the table exists, so resolving a `Symbol` through `operator[]`
+ * does not take any lock at all.
  */
 class SymbolTable
 {
 private:
-    std::unordered_map<std::string_view, std::pair<const std::string *, uint32_t>> symbols;
-    ChunkedVector<std::string, 8192> store{16};
+    static constexpr size_t chunkSize = 8192;
+    static constexpr size_t maxChunks = 16384;
+    static constexpr size_t nrShards = 64;
+
+    typedef std::unordered_map<std::string_view, uint32_t> Shard;
+
+    std::array<SharedSync<Shard>, nrShards> shards;
+
+    /**
+     * Storage for the symbol strings. Chunks are allocated on demand
+     * and published atomically; an element is written exactly once,
+     * before its id is made visible through its shard.
+     */
+    std::unique_ptr<std::atomic<std::string *>[]> chunks;
+    std::atomic<uint32_t> size_{0};
+
+    std::pair<const std::string &, uint32_t> add(std::string_view s)
+    {
+        auto idx = size_.fetch_add(1, std::memory_order_relaxed);
+        auto chunkIdx = idx / chunkSize;
+        if (chunkIdx >= maxChunks)
+            throw Error("symbol table overflow");
+
+        auto chunk = chunks[chunkIdx].load(std::memory_order_acquire);
+        if (!chunk) {
+            auto newChunk = new std::string[chunkSize];
+            if (chunks[chunkIdx].compare_exchange_strong(chunk, newChunk, std::memory_order_acq_rel))
+                chunk = newChunk;
+            else
+                delete[] newChunk;
+        }
+
+        auto & result = chunk[idx % chunkSize];
+        result = s;
+        return {result, idx};
+    }
+
+    const std::string & get(uint32_t idx) const
+    {
+        return chunks[idx / chunkSize].load(std::memory_order_acquire)[idx % chunkSize];
+    }
 
 public:
 
+    SymbolTable()
+        : chunks(new std::atomic<std::string *>[maxChunks]())
+    { }
+
+    SymbolTable(const SymbolTable &) = delete;
+    SymbolTable & operator = (const SymbolTable &) = delete;
+
+    ~SymbolTable()
+    {
+        for (size_t i = 0; i < maxChunks; ++i)
+            delete[] chunks[i].load(std::memory_order_relaxed);
+    }
+
     /**
      * converts a string into a symbol.
      */
     Symbol create(std::string_view s)
     {
-        // Most symbols are looked up more than once, so we trade off insertion performance
-        // for lookup performance.
-        // TODO: could probably be done more efficiently with transparent Hash and Equals
-        // on the original implementation using unordered_set
-        // FIXME: make this thread-safe.
-        auto it = symbols.find(s);
-        if (it != symbols.end()) return Symbol(it->second.second + 1);
-
-        const auto & [rawSym, idx] = store.add(std::string(s));
-        symbols.emplace(rawSym, std::make_pair(&rawSym, idx));
+        auto & shard = shards[std::hash<std::string_view>{}(s) % nrShards];
+
+        {
+            auto symbols(shard.readLock());
+            auto it = symbols->find(s);
+            if (it != symbols->end()) return Symbol(it->second + 1);
+        }
+
+        auto symbols(shard.lock());
+
+        /* Another thread may have added the symbol between releasing
+           the read lock and acquiring the write lock. */
+        auto it = symbols->find(s);
+        if (it != symbols->end()) return Symbol(it->second + 1);
+
+        const auto & [rawSym, idx] = add(s);
+        symbols->emplace(rawSym, idx);
         return Symbol(idx + 1);
     }
 
@@ -115,22 +185,27 @@ public:
 
     SymbolStr operator[](Symbol s) const
     {
-        if (s.id == 0 || s.id > store.size())
+        if (s.id == 0 || s.id > size())
             unreachable();
-        return SymbolStr(store[s.id - 1]);
+        return SymbolStr(get(s.id - 1));
     }
 
     size_t size() const
     {
-        return store.size();
+        return size_.load(std::memory_order_relaxed);
     }
 
     size_t totalSize() const;
 
+    /**
+     * Call `callback` on every symbol in order of creation. This must
+     * not run concurrently with `create()`.
+     */
     template<typename T>
     void dump(T callback) const
     {
-        store.forEach(callback);
+        for (uint32_t idx = 0; idx < size(); ++idx)
+            callback(get(idx));
     }
 };
 
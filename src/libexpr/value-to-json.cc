@@ -56,6 +56,7 @@ json printValueAsJSON(EvalState & state, bool strict,
                 return printValueAsJSON(state, strict, *i->value, i->pos, context, copyToStore);
             else {
                 out = json::object();
+                if (strict) state.prefetch(*v.attrs());
                 for (auto & a : v.attrs()->lexicographicOrder(state.symbols)) {
                     try {
                         out.emplace(state.symbols[a->name], printValueAsJSON(state, strict, *a->value, a->pos, context, copyToStore));
@@ -71,6 +72,7 @@ json printValueAsJSON(EvalState & state, bool strict,
 
         case nList: {
             out = json::array();
+            if (strict) state.prefetch(v.listItems());
             int i = 0;
             for (auto elem : v.listItems()) {
                 try {
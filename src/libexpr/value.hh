@@ -1,7 +1,9 @@
 #pragma once
 ///@file
 
+#include <atomic>
 #include <cassert>
+#include <cstring>
 #include <span>
 
 #include "eval-gc.hh"
@@ -36,7 +38,12 @@ typedef enum {
     tPrimOp,
     tPrimOpApp,
     tExternal,
-    tFloat
+    tFloat,
+    /* Thunks claimed by an evaluator thread when evaluating in
+       parallel; see `Executor`. */
+    tBlackhole,
+    tPending,
+    tAwaited,
 } InternalType;
 
 /**
@@ -168,6 +175,16 @@ struct Value
 private:
     InternalType internalType = tUninitialized;
 
+    /**
+     * For strings, the length of the string, `unknownStringLength` if
+     * it's too long to fit, or `ropeStringLength` if the string is a
+     * `StringRope`. This uses padding that would otherwise be wasted.
+     */
+    uint32_t stringLength = 0;
+
+    static constexpr uint32_t ropeStringLength = UINT32_MAX - 1;
+    static constexpr uint32_t unknownStringLength = UINT32_MAX;
+
     friend std::string showType(const Value & v);
 
 public:
@@ -183,6 +200,12 @@ public:
     inline bool isApp() const { return internalType == tApp; };
     inline bool isBlackhole() const;
 
+    /**
+     * Whether the value is being evaluated by a worker thread of the
+     * parallel evaluator.
+     */
+    inline bool isPending() const { return internalType == tPending || internalType == tAwaited; };
+
     // type() == nFunction
     inline bool isLambda() const { return internalType == tLambda; };
     inline bool isPrimOp() const { return internalType == tPrimOp; };
@@ -208,11 +231,55 @@ public:
      * derivation, and the other store paths in C will be added to
      * the inputSrcs of the derivations.
 
-     * For canonicity, the store paths should be in sorted order.
+     * The context is stored as a set of interned elements (see
+     * `NixStringContextElem::intern()`), sorted by address. It is
+     * never modified, so strings derived from other strings share
+     * their context where possible. Since addresses differ between
+     * runs, use `copyContext()` to get the elements in a deterministic
+     * order.
      */
+    struct StringContext {
+        size_t size;
+        const NixStringContextElem * elems[0];
+
+        const NixStringContextElem * const * begin() const { return elems; }
+        const NixStringContextElem * const * end() const { return elems + size; }
+    };
+
+    /**
+     * A string that is the concatenation of other strings, and that
+     * is only copied into a contiguous buffer when its contents are
+     * needed. This makes repeated concatenation, as in
+     * `foldl' (s: x: s + x) ""`, linear instead of quadratic.
+     */
+    struct StringRope {
+        struct Part {
+            /**
+             * The contents of the part, or null if it's a rope.
+             */
+            const char * s;
+            const StringRope * rope;
+            size_t length;
+        };
+
+        size_t length;
+
+        /**
+         * The flattened contents, once they've been needed. See
+         * `flattenRope()`.
+         */
+        mutable std::atomic<const char *> flat;
+
+        size_t size;
+        Part parts[0];
+    };
+
     struct StringWithContext {
-        const char * c_str;
-        const char * * context; // must be in sorted order
+        union {
+            const char * c_str;
+            const StringRope * rope;
+        };
+        const StringContext * context; // null if empty
     };
 
     struct Path {
@@ -281,7 +348,7 @@ public:
             case tLambda: case tPrimOp: case tPrimOpApp: return nFunction;
             case tExternal: return nExternal;
             case tFloat: return nFloat;
-            case tThunk: case tApp: return nThunk;
+            case tThunk: case tApp: case tBlackhole: case tPending: case tAwaited: return nThunk;
         }
         if (invalidIsThunk)
             return nThunk;
@@ -295,6 +362,53 @@ public:
         internalType = newType;
     }
 
+    /**
+     * Thread-safe updating of thunks, used when evaluating with
+     * multiple threads (see `Executor`).
+     *
+     * A thread that wants to force a thunk or function application
+     * first claims it by atomically changing its type to `tBlackhole`
+     * (main thread) or `tPending` (worker thread). It then evaluates it
+     * and makes the result (or, on error, the original thunk) visible
+     * to other threads through `publish()`. The payload of a claimed
+     * value is left untouched until then. A thread waiting for a value
+     * claimed by a worker marks it as `tAwaited` first, so that the
+     * worker knows to wake it up.
+     */
+    inline InternalType getInternalType() const
+    {
+        return std::atomic_ref(const_cast<InternalType &>(internalType)).load(std::memory_order_acquire);
+    }
+
+    inline bool claim(InternalType expected, InternalType pending)
+    {
+        return std::atomic_ref(internalType).compare_exchange_strong(expected, pending, std::memory_order_acquire);
+    }
+
+    /**
+     * Mark a value claimed by a worker as awaited.
+     *
+     * @return false if the value is no longer pending.
+     */
+    inline bool markAwaited()
+    {
+        InternalType expected = tPending;
+        return std::atomic_ref(internalType).compare_exchange_strong(expected, tAwaited, std::memory_order_acq_rel)
+            || expected == tAwaited;
+    }
+
+    /**
+     * Replace a claimed value by `v`.
+     *
+     * @return The type of the value while it was claimed.
+     */
+    inline InternalType publish(const Value & v)
+    {
+        stringLength = v.stringLength;
+        payload = v.payload;
+        return std::atomic_ref(internalType).exchange(v.internalType, std::memory_order_acq_rel);
+    }
+
     /**
      * A value becomes valid when it is initialized. We don't use this
      * in the evaluator; only in the bindings, where the slight extra
@@ -320,17 +434,35 @@ public:
         finishValue(tBool, { .boolean = b });
     }
 
-    inline void mkString(const char * s, const char * * context = 0)
+    inline void mkString(const char * s, const StringContext * context = nullptr)
     {
+        mkString(s, strlen(s), context);
+    }
+
+    /**
+     * Make a string whose length is already known. `s` must still be
+     * NUL-terminated.
+     */
+    inline void mkString(const char * s, size_t length, const StringContext * context)
+    {
+        stringLength = length < unknownStringLength - 1 ? length : unknownStringLength;
         finishValue(tString, { .string = { .c_str = s, .context = context } });
     }
 
+    inline void mkString(const StringRope * rope, const StringContext * context)
+    {
+        stringLength = ropeStringLength;
+        finishValue(tString, { .string = { .rope = rope, .context = context } });
+    }
+
     void mkString(std::string_view s);
 
     void mkString(std::string_view s, const NixStringContext & context);
 
     void mkStringMove(const char * s, const NixStringContext & context);
 
+    void mkStringMove(const char * s, size_t length, const NixStringContext & context);
+
     inline void mkString(const SymbolStr & s)
     {
         mkString(s.c_str());
@@ -451,16 +583,50 @@ public:
     std::string_view string_view() const
     {
         assert(internalType == tString);
+        if (stringLength < ropeStringLength)
+            return std::string_view(payload.string.c_str, stringLength);
+        if (stringLength == ropeStringLength)
+            return std::string_view(flattenRope(*payload.string.rope), payload.string.rope->length);
         return std::string_view(payload.string.c_str);
     }
 
     const char * c_str() const
     {
         assert(internalType == tString);
+        if (stringLength == ropeStringLength)
+            return flattenRope(*payload.string.rope);
         return payload.string.c_str;
     }
 
-    const char * * context() const
+    /**
+     * The length of a string, without flattening it.
+     */
+    size_t string_size() const
+    {
+        assert(internalType == tString);
+        if (stringLength < ropeStringLength)
+            return stringLength;
+        if (stringLength == ropeStringLength)
+            return payload.string.rope->length;
+        return strlen(payload.string.c_str);
+    }
+
+    /**
+     * The rope of a string, or null if the string is contiguous.
+     */
+    const StringRope * rope() const
+    {
+        assert(internalType == tString);
+        return stringLength == ropeStringLength ? payload.string.rope : nullptr;
+    }
+
+    /**
+     * Return the contents of a rope, copying them into a contiguous
+     * buffer the first time.
+     */
+    static const char * flattenRope(const StringRope & rope);
+
+    const StringContext * context() const
     {
         return payload.string.context;
     }
@@ -489,7 +655,8 @@ extern ExprBlackHole eBlackHole;
 
 bool Value::isBlackhole() const
 {
-    return internalType == tThunk && payload.thunk.expr == (Expr*) &eBlackHole;
+    return internalType == tBlackhole
+        || (internalType == tThunk && payload.thunk.expr == (Expr*) &eBlackHole);
 }
 
 void Value::mkBlackhole()
@@ -1,4 +1,5 @@
 #include "util.hh"
+#include "sync.hh"
 #include "value/context.hh"
 
 #include <optional>
@@ -105,4 +106,19 @@ std::string NixStringContextElem::to_string() const
     return res;
 }
 
+const NixStringContextElem & NixStringContextElem::intern() const
+{
+    /* Never destroyed, since string values may refer to its elements
+       until the very end. */
+    static auto & table = *new SharedSync<std::set<NixStringContextElem>>;
+
+    {
+        auto elems(table.readLock());
+        auto i = elems->find(*this);
+        if (i != elems->end()) return *i;
+    }
+
+    return *table.lock()->insert(*this).first;
+}
+
 }
@@ -78,6 +78,14 @@ struct NixStringContextElem {
         std::string_view s,
         const ExperimentalFeatureSettings & xpSettings = experimentalFeatureSettings);
     std::string to_string() const;
+
+    /**
+     * Return the canonical copy of this element. Equal elements are
+     * interned to the same object, so string contexts can be stored
+     * and merged as sets of pointers. Interned elements are never
+     * freed.
+     */
+    const NixStringContextElem & intern() const;
 };
 
 typedef std::set<NixStringContextElem> NixStringContext;
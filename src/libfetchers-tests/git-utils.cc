@@ -109,4 +109,95 @@ TEST_F(GitUtilsTest, sink_hardlink)
     }
 };
 
+TEST_F(GitUtilsTest, sink_small_batches)
+{
+    auto repo = openRepo();
+    /* With a tiny batch size, most files end a batch, directories are
+       closed and reopened while a batch is pending, and files with a
+       declared size are streamed into pack files of their own. */
+    auto sink = repo->getFileSystemObjectSink(16);
+
+    auto writeFile = [&](const char * path, std::string contents, bool preallocate = true, bool executable = false) {
+        sink->createRegularFile(CanonPath(path), [&](CreateRegularFileSink & fileSink) {
+            if (preallocate)
+                writeString(fileSink, contents, executable);
+            else
+                fileSink(contents);
+        });
+    };
+
+    std::string big(100, 'b');
+    std::string buffered(40, 'c');
+
+    writeFile("foo-1.1/a/x", "0123456789");
+    writeFile("foo-1.1/a/b/y", "abcdef");
+    writeFile("foo-1.1/a/b/z", "short");
+    writeFile("foo-1.1/c/w", "hello");
+    writeFile("foo-1.1/c/dup", "hello");
+    writeFile("foo-1.1/a/v", "reopened");
+    writeFile("foo-1.1/a/b/big", big);
+    writeFile("foo-1.1/c/buffered", buffered, false);
+    writeFile("foo-1.1/run", std::string(32, 'r'), true, true);
+    sink->createSymlink(CanonPath("foo-1.1/c/link"), "../a/b/big");
+
+    auto result = repo->dereferenceSingletonDirectory(sink->flush());
+    auto accessor = repo->getAccessor(result, false);
+    ASSERT_EQ(accessor->readDirectory(CanonPath::root).size(), 3);
+    ASSERT_EQ(accessor->readDirectory(CanonPath("a")).size(), 3);
+    ASSERT_EQ(accessor->readDirectory(CanonPath("a/b")).size(), 3);
+    ASSERT_EQ(accessor->readDirectory(CanonPath("c")).size(), 4);
+    ASSERT_EQ(accessor->readFile(CanonPath("a/x")), "0123456789");
+    ASSERT_EQ(accessor->readFile(CanonPath("a/v")), "reopened");
+    ASSERT_EQ(accessor->readFile(CanonPath("a/b/y")), "abcdef");
+    ASSERT_EQ(accessor->readFile(CanonPath("a/b/z")), "short");
+    ASSERT_EQ(accessor->readFile(CanonPath("a/b/big")), big);
+    ASSERT_EQ(accessor->readFile(CanonPath("c/w")), "hello");
+    ASSERT_EQ(accessor->readFile(CanonPath("c/dup")), "hello");
+    ASSERT_EQ(accessor->readFile(CanonPath("c/buffered")), buffered);
+    ASSERT_EQ(accessor->readLink(CanonPath("c/link")), "../a/b/big");
+    ASSERT_EQ(accessor->readFile(CanonPath("run")), std::string(32, 'r'));
+    ASSERT_TRUE(accessor->lstat(CanonPath("run")).isExecutable);
+};
+
+TEST_F(GitUtilsTest, sink_replace_while_batch_pending)
+{
+    auto repo = openRepo();
+    auto sink = repo->getFileSystemObjectSink(1000);
+
+    auto writeFile = [&](const char * path, std::string contents) {
+        sink->createRegularFile(CanonPath(path), [&](CreateRegularFileSink & fileSink) {
+            writeString(fileSink, contents, false);
+        });
+    };
+
+    /* A later entry replaces an earlier one with the same name, also
+       while their contents are waiting in the same batch. */
+    writeFile("foo-1.1/d/foo/x", "dir");
+    writeFile("foo-1.1/d/foo", "file");
+    writeFile("foo-1.1/e/bar", "file");
+    writeFile("foo-1.1/e/bar/y", "dir");
+
+    auto result = repo->dereferenceSingletonDirectory(sink->flush());
+    auto accessor = repo->getAccessor(result, false);
+    ASSERT_EQ(accessor->readFile(CanonPath("d/foo")), "file");
+    ASSERT_EQ(accessor->lstat(CanonPath("e/bar")).type, SourceAccessor::tDirectory);
+    ASSERT_EQ(accessor->readFile(CanonPath("e/bar/y")), "dir");
+};
+
+TEST_F(GitUtilsTest, sink_streamed_size_mismatch)
+{
+    auto repo = openRepo();
+    auto sink = repo->getFileSystemObjectSink(16);
+
+    try {
+        sink->createRegularFile(CanonPath("foo-1.1/short"), [](CreateRegularFileSink & fileSink) {
+            fileSink.preallocateContents(100);
+            fileSink(std::string(50, 'x'));
+        });
+        FAIL() << "Expected an exception";
+    } catch (const nix::Error & e) {
+        ASSERT_THAT(e.msg(), testing::HasSubstr("declared size"));
+    }
+};
+
 } // namespace nix
@@ -85,6 +85,15 @@ struct Settings : public Config
           e.g. `github:NixOS/patchelf/7c2f768bf9601268a4e71c2ebe91e2011918a70f?narHash=sha256-PPXqKY2hJng4DBVE0I4xshv/vGLUskL7jl53roB8UdU%3D`.
         )"};
 
+    Setting<uint64_t> tarballCacheBatchSize{this, 64 * 1024 * 1024, "tarball-cache-batch-size",
+        R"(
+          The number of bytes of file contents that Nix keeps in memory
+          while unpacking a tarball into the tarball cache, before it
+          writes them to the cache as a pack file. Files of at least
+          this size are written to a pack file of their own as they're
+          unpacked.
+        )"};
+
     Setting<std::string> flakeRegistry{this, "https://channels.nixos.org/flake-registry.json", "flake-registry",
         R"(
           Path or URI of the global flake registry.
@@ -5,6 +5,7 @@
 #include "signals.hh"
 #include "users.hh"
 #include "fs-sink.hh"
+#include "thread-pool.hh"
 
 #include <git2/attr.h>
 #include <git2/blob.h>
@@ -26,6 +27,10 @@
 #include <git2/sys/mempack.h>
 #include <git2/tree.h>
 
+#include <zlib.h>
+
+#include <array>
+#include <deque>
 #include <iostream>
 #include <unordered_set>
 #include <queue>
@@ -294,10 +299,7 @@ struct GitRepoImpl : GitRepo, std::enable_shared_from_this<GitRepoImpl>
         );
         checkInterrupt();
 
-        std::string repo_path = std::string(git_repository_path(repo.get()));
-        while (!repo_path.empty() && repo_path.back() == '/')
-            repo_path.pop_back();
-        std::string pack_dir_path = repo_path + "/objects/pack";
+        std::string pack_dir_path = getPackDir();
 
         // TODO (performance): could the indexing be done in a separate thread?
         //                     we'd need a more streaming variation of
@@ -328,6 +330,14 @@ struct GitRepoImpl : GitRepo, std::enable_shared_from_this<GitRepoImpl>
         checkInterrupt();
     }
 
+    std::string getPackDir()
+    {
+        std::string repo_path = std::string(git_repository_path(repo.get()));
+        while (!repo_path.empty() && repo_path.back() == '/')
+            repo_path.pop_back();
+        return repo_path + "/objects/pack";
+    }
+
     uint64_t getRevCount(const Hash & rev) override
     {
         std::unordered_set<git_oid> done;
@@ -505,7 +515,7 @@ struct GitRepoImpl : GitRepo, std::enable_shared_from_this<GitRepoImpl>
 
     ref<SourceAccessor> getAccessor(const WorkdirInfo & wd, bool exportIgnore, MakeNotAllowedError e) override;
 
-    ref<GitFileSystemObjectSink> getFileSystemObjectSink() override;
+    ref<GitFileSystemObjectSink> getFileSystemObjectSink(size_t maxBatchSize) override;
 
     static int sidebandProgressCallback(const char * str, int len, void * payload)
     {
@@ -967,23 +977,219 @@ struct GitExportIgnoreSourceAccessor : CachingFilteringSourceAccessor {
 
 };
 
+/**
+ * Return the header of an object in a pack file, i.e. its type and
+ * size as a variable-length integer.
+ */
+static std::string packObjectHeader(git_object_t type, uint64_t size)
+{
+    std::string header;
+    unsigned char c = (type << 4) | (size & 0x0f);
+    size >>= 4;
+    while (size) {
+        header.push_back(c | 0x80);
+        c = size & 0x7f;
+        size >>= 7;
+    }
+    header.push_back(c);
+    return header;
+}
+
+static void appendBigEndian32(std::string & s, uint32_t n)
+{
+    for (int i = 3; i >= 0; --i)
+        s.push_back((n >> (i * 8)) & 0xff);
+}
+
+/**
+ * Write a single blob of known size to a pack file of its own, without
+ * keeping it in memory.
+ */
+struct BlobPackWriter
+{
+    CanonPath path;
+    uint64_t size, written = 0;
+    Indexer indexer;
+    git_indexer_progress stats;
+    HashSink packHash{HashAlgorithm::SHA1};
+    HashSink blobHash{HashAlgorithm::SHA1};
+    z_stream strm{};
+
+    BlobPackWriter(const std::string & packDir, uint64_t size, const CanonPath & path)
+        : path(path), size(size)
+    {
+        if (git_indexer_new(Setter(indexer), packDir.c_str(), 0, nullptr, nullptr))
+            throw Error("creating git packfile indexer: %s", git_error_last()->message);
+
+        if (deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK)
+            throw Error("initialising zlib for tarball member '%s'", path);
+
+        std::string header = "PACK";
+        appendBigEndian32(header, 2);
+        appendBigEndian32(header, 1);
+        header += packObjectHeader(GIT_OBJECT_BLOB, size);
+        append(header);
+
+        blobHash(fmt("blob %d", size));
+        blobHash({"", 1});
+    }
+
+    ~BlobPackWriter()
+    {
+        deflateEnd(&strm);
+    }
+
+    void append(std::string_view data)
+    {
+        packHash(data);
+        if (git_indexer_append(indexer.get(), data.data(), data.size(), &stats))
+            throw Error("appending to git packfile index: %s", git_error_last()->message);
+    }
+
+    void compressChunk(std::string_view data, int flush)
+    {
+        strm.next_in = (Bytef *) data.data();
+        strm.avail_in = data.size();
+        std::array<char, 65536> buf;
+        int ret;
+        do {
+            strm.next_out = (Bytef *) buf.data();
+            strm.avail_out = buf.size();
+            ret = deflate(&strm, flush);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                throw Error("compressing tarball member '%s'", path);
+            append({buf.data(), buf.size() - strm.avail_out});
+        } while (flush == Z_FINISH ? ret != Z_STREAM_END : strm.avail_out == 0);
+    }
+
+    void operator () (std::string_view data)
+    {
+        written += data.size();
+        if (written > size)
+            throw Error("tarball member '%s' is larger than its declared size of %d bytes", path, size);
+        blobHash(data);
+        compressChunk(data, Z_NO_FLUSH);
+    }
+
+    git_oid finish()
+    {
+        if (written != size)
+            throw Error("tarball member '%s' has %d bytes rather than its declared size of %d bytes", path, written, size);
+
+        compressChunk({}, Z_FINISH);
+
+        auto trailer = packHash.finish().first;
+        append({(const char *) trailer.hash, trailer.hashSize});
+
+        if (git_indexer_commit(indexer.get(), &stats))
+            throw Error("committing git packfile index: %s", git_error_last()->message);
+
+        return hashToOID(blobHash.finish().first);
+    }
+};
+
 struct GitFileSystemObjectSinkImpl : GitFileSystemObjectSink
 {
     ref<GitRepoImpl> repo;
 
+    /**
+     * Regular files are not written through the mempack, which would
+     * keep the entire tarball in memory until `flush()`. Instead, they
+     * are hashed and compressed by a thread pool, and written to the
+     * repository as a pack file every `maxBatchSize` bytes. Files of
+     * at least `maxBatchSize` bytes whose size is known in advance are
+     * streamed into a pack file of their own by `BlobPackWriter`.
+     */
+    const size_t maxBatchSize;
+
+    struct PackedBlob
+    {
+        git_oid oid;
+
+        /**
+         * The contents of the file, and once it has been processed,
+         * its entry in the pack file.
+         */
+        std::string data;
+    };
+
+    /**
+     * The blobs in the current batch. A deque, so that the workers can
+     * keep references to blobs while new ones are added.
+     */
+    std::deque<PackedBlob> batch;
+
+    size_t batchSize = 0;
+
+    /**
+     * The pool that processes `batch`. Declared after it, so that
+     * it's destroyed first.
+     */
+    std::unique_ptr<ThreadPool> pool;
+
+    /**
+     * The index of a directory in `closedDirs`.
+     */
+    struct ClosedDir
+    {
+        size_t index;
+    };
+
+    struct PendingEntry
+    {
+        std::string name;
+        git_filemode_t mode;
+
+        /**
+         * The object ID, the index of the blob in `batch`, or the
+         * directory whose tree hasn't been written yet.
+         */
+        std::variant<git_oid, size_t, ClosedDir> target;
+    };
+
     struct PendingDir
     {
         std::string name;
         TreeBuilder builder;
+
+        /**
+         * Entries that can't be added to `builder` until the current
+         * batch has been written, since a tree can only refer to
+         * objects that exist. They're added in order, so that a later
+         * entry replaces an earlier one with the same name.
+         */
+        std::vector<PendingEntry> entries;
+
+        /**
+         * Subdirectories in `closedDirs`.
+         */
+        std::set<std::string> closedChildren;
     };
 
     std::vector<PendingDir> pendingDirs;
 
+    /**
+     * Directories that were finished while a batch was in progress,
+     * in the order in which they were finished. They're written by
+     * `flushBatch()`.
+     */
+    std::vector<PendingDir> closedDirs;
+
+    /**
+     * The trees written for `closedDirs` so far.
+     */
+    std::vector<git_oid> closedTrees;
+
     void pushBuilder(std::string name)
     {
         const git_tree_entry * entry;
         Tree prevTree = nullptr;
 
+        /* If we're reopening a directory that is waiting for the
+           current batch, write it first so we can clone it below. */
+        if (!pendingDirs.empty() && pendingDirs.back().closedChildren.count(name))
+            flushBatch();
+
         if (!pendingDirs.empty() &&
             (entry = git_treebuilder_get(pendingDirs.back().builder.get(), name.c_str())))
         {
@@ -1003,30 +1209,164 @@ struct GitFileSystemObjectSinkImpl : GitFileSystemObjectSink
         pendingDirs.push_back({ .name = std::move(name), .builder = TreeBuilder(b) });
     };
 
-    GitFileSystemObjectSinkImpl(ref<GitRepoImpl> repo) : repo(repo)
+    GitFileSystemObjectSinkImpl(ref<GitRepoImpl> repo, size_t maxBatchSize)
+        : repo(repo)
+        , maxBatchSize(maxBatchSize)
     {
         pushBuilder("");
     }
 
-    std::pair<git_oid, std::string> popBuilder()
+    git_oid writeTree(PendingDir & dir)
     {
-        assert(!pendingDirs.empty());
-        auto pending = std::move(pendingDirs.back());
         git_oid oid;
-        if (git_treebuilder_write(&oid, pending.builder.get()))
+        if (git_treebuilder_write(&oid, dir.builder.get()))
             throw Error("creating a tree object: %s", git_error_last()->message);
+        return oid;
+    }
+
+    void popBuilder()
+    {
+        assert(pendingDirs.size() > 1);
+        auto pending = std::move(pendingDirs.back());
         pendingDirs.pop_back();
-        return {oid, pending.name};
+        if (batch.empty())
+            addToTree(pending.name, writeTree(pending), GIT_FILEMODE_TREE);
+        else {
+            auto & parent = pendingDirs.back();
+            parent.closedChildren.insert(pending.name);
+            parent.entries.push_back({
+                .name = pending.name,
+                .mode = GIT_FILEMODE_TREE,
+                .target = ClosedDir{closedDirs.size()},
+            });
+            closedDirs.push_back(std::move(pending));
+        }
     };
 
+    void addToTree(PendingDir & dir, const std::string & name, const git_oid & oid, git_filemode_t mode)
+    {
+        if (git_treebuilder_insert(nullptr, dir.builder.get(), name.c_str(), &oid, mode))
+            throw Error("adding a file to a tree builder: %s", git_error_last()->message);
+    }
+
     void addToTree(const std::string & name, const git_oid & oid, git_filemode_t mode)
     {
         assert(!pendingDirs.empty());
         auto & pending = pendingDirs.back();
-        if (git_treebuilder_insert(nullptr, pending.builder.get(), name.c_str(), &oid, mode))
-            throw Error("adding a file to a tree builder: %s", git_error_last()->message);
+        /* Preserve the order of entries with the same name. */
+        if (!pending.entries.empty())
+            pending.entries.push_back({ .name = name, .mode = mode, .target = oid });
+        else
+            addToTree(pending, name, oid, mode);
     };
 
+    void addPendingEntries(PendingDir & dir)
+    {
+        for (auto & entry : dir.entries)
+            addToTree(dir, entry.name,
+                std::visit(overloaded {
+                    [&](const git_oid & oid) { return oid; },
+                    [&](size_t n) { return batch[n].oid; },
+                    [&](ClosedDir d) { return closedTrees.at(d.index); },
+                }, entry.target),
+                entry.mode);
+        dir.entries.clear();
+    }
+
+    /**
+     * Hash and compress a file's contents into its pack file entry.
+     * This runs on the thread pool.
+     */
+    static void packBlob(PackedBlob & blob, const CanonPath & path)
+    {
+        if (git_odb_hash(&blob.oid, blob.data.data(), blob.data.size(), GIT_OBJECT_BLOB))
+            throw Error("hashing tarball member '%s': %s", path, git_error_last()->message);
+
+        auto packed = packObjectHeader(GIT_OBJECT_BLOB, blob.data.size());
+        auto headerSize = packed.size();
+        uLongf compressedSize = compressBound(blob.data.size());
+        packed.resize(headerSize + compressedSize);
+        if (compress((Bytef *) packed.data() + headerSize, &compressedSize,
+                (const Bytef *) blob.data.data(), blob.data.size()) != Z_OK)
+            throw Error("compressing tarball member '%s'", path);
+        packed.resize(headerSize + compressedSize);
+
+        blob.data = std::move(packed);
+    }
+
+    /**
+     * Write the blobs in the current batch to a pack file, then add
+     * them to their trees and write the trees that were waiting for
+     * them.
+     */
+    void flushBatch()
+    {
+        if (pool) {
+            pool->process();
+            pool.reset();
+        }
+
+        if (batch.empty()) return;
+
+        Indexer indexer;
+        git_indexer_progress stats;
+        if (git_indexer_new(Setter(indexer), repo->getPackDir().c_str(), 0, nullptr, nullptr))
+            throw Error("creating git packfile indexer: %s", git_error_last()->message);
+
+        HashSink hashSink(HashAlgorithm::SHA1);
+
+        auto append = [&](std::string_view data)
+        {
+            hashSink(data);
+            if (git_indexer_append(indexer.get(), data.data(), data.size(), &stats))
+                throw Error("appending to git packfile index: %s", git_error_last()->message);
+        };
+
+        /* Tarballs often contain identical files, but a pack file
+           must not contain an object twice. */
+        std::unordered_set<git_oid> oids;
+        std::vector<PackedBlob *> blobs;
+        for (auto & blob : batch)
+            if (oids.insert(blob.oid).second)
+                blobs.push_back(&blob);
+
+        std::string header = "PACK";
+        appendBigEndian32(header, 2);
+        appendBigEndian32(header, blobs.size());
+        append(header);
+
+        for (auto blob : blobs) {
+            checkInterrupt();
+            append(blob->data);
+            blob->data = {};
+        }
+
+        auto trailer = hashSink.finish().first;
+        append({(const char *) trailer.hash, trailer.hashSize});
+
+        if (git_indexer_commit(indexer.get(), &stats))
+            throw Error("committing git packfile index: %s", git_error_last()->message);
+
+        /* Write the finished directories. Since they're in the order
+           in which they were finished, a directory's subdirectories
+           precede it. */
+        for (auto & dir : closedDirs) {
+            addPendingEntries(dir);
+            closedTrees.push_back(writeTree(dir));
+        }
+
+        for (auto & dir : pendingDirs) {
+            addPendingEntries(dir);
+            dir.closedChildren.clear();
+        }
+
+        closedDirs.clear();
+        closedTrees.clear();
+
+        batch.clear();
+        batchSize = 0;
+    }
+
     void updateBuilders(std::span<const std::string> names)
     {
         // Find the common prefix of pendingDirs and names.
@@ -1036,10 +1376,8 @@ struct GitFileSystemObjectSinkImpl : GitFileSystemObjectSink
                 break;
 
         // Finish the builders that are not part of the common prefix.
-        for (auto n = pendingDirs.size(); n > prefixLen + 1; --n) {
-            auto [oid, name] = popBuilder();
-            addToTree(name, oid, GIT_FILEMODE_TREE);
-        }
+        for (auto n = pendingDirs.size(); n > prefixLen + 1; --n)
+            popBuilder();
 
         // Create builders for the new directories.
         for (auto n = prefixLen; n < names.size(); ++n)
@@ -1065,38 +1403,57 @@ struct GitFileSystemObjectSinkImpl : GitFileSystemObjectSink
         auto pathComponents = tokenizeString<std::vector<std::string>>(path.rel(), "/");
         if (!prepareDirs(pathComponents, false)) return;
 
-        git_writestream * stream = nullptr;
-        if (git_blob_create_from_stream(&stream, *repo, nullptr))
-            throw Error("creating a blob stream object: %s", git_error_last()->message);
-
         struct CRF : CreateRegularFileSink {
+            GitFileSystemObjectSinkImpl & sink;
             const CanonPath & path;
-            GitFileSystemObjectSinkImpl & back;
-            git_writestream * stream;
+            std::string data;
+            std::unique_ptr<BlobPackWriter> writer;
             bool executable = false;
-            CRF(const CanonPath & path, GitFileSystemObjectSinkImpl & back, git_writestream * stream)
-                : path(path), back(back), stream(stream)
-            {}
-            void operator () (std::string_view data) override
+            CRF(GitFileSystemObjectSinkImpl & sink, const CanonPath & path)
+                : sink(sink), path(path)
+            { }
+            void operator () (std::string_view s) override
             {
-                if (stream->write(stream, data.data(), data.size()))
-                    throw Error("writing a blob for tarball member '%s': %s", path, git_error_last()->message);
+                if (writer)
+                    (*writer)(s);
+                else
+                    data.append(s);
             }
             void isExecutable() override
             {
                 executable = true;
             }
-        } crf { path, *this, stream };
+            void preallocateContents(uint64_t size) override
+            {
+                if (size >= sink.maxBatchSize && data.empty() && !writer)
+                    writer = std::make_unique<BlobPackWriter>(sink.repo->getPackDir(), size, path);
+                else
+                    data.reserve(size);
+            }
+        } crf(*this, path);
         func(crf);
 
-        git_oid oid;
-        if (git_blob_create_from_stream_commit(&oid, stream))
-            throw Error("creating a blob object for tarball member '%s': %s", path, git_error_last()->message);
+        auto mode = crf.executable ? GIT_FILEMODE_BLOB_EXECUTABLE : GIT_FILEMODE_BLOB;
 
-        addToTree(*pathComponents.rbegin(), oid,
-            crf.executable
-            ? GIT_FILEMODE_BLOB_EXECUTABLE
-            : GIT_FILEMODE_BLOB);
+        if (crf.writer) {
+            addToTree(*pathComponents.rbegin(), crf.writer->finish(), mode);
+            return;
+        }
+
+        batchSize += crf.data.size();
+        auto & blob = batch.emplace_back(PackedBlob { .data = std::move(crf.data) });
+
+        if (!pool) pool = std::make_unique<ThreadPool>();
+        pool->enqueue([&blob, path]() { packBlob(blob, path); });
+
+        pendingDirs.back().entries.push_back({
+            .name = *pathComponents.rbegin(),
+            .mode = mode,
+            .target = batch.size() - 1,
+        });
+
+        if (batchSize >= maxBatchSize)
+            flushBatch();
     }
 
     void createDirectory(const CanonPath & path) override
@@ -1125,6 +1482,10 @@ struct GitFileSystemObjectSinkImpl : GitFileSystemObjectSink
 
         if (!prepareDirs(pathComponents, false)) return;
 
+        /* The target may be in the current batch, so write it first.
+           Hard links are rare in tarballs, so this is cheap. */
+        flushBatch();
+
         // We can't just look up the path from the start of the root, since
         // some parent directories may not have finished yet, so we compute
         // a relative path that helps us find the right git_tree_builder or object.
@@ -1176,7 +1537,11 @@ struct GitFileSystemObjectSinkImpl : GitFileSystemObjectSink
     {
         updateBuilders({});
 
-        auto [oid, _name] = popBuilder();
+        flushBatch();
+
+        assert(pendingDirs.size() == 1);
+        auto oid = writeTree(pendingDirs.back());
+        pendingDirs.pop_back();
 
         repo->flush();
 
@@ -1222,9 +1587,9 @@ ref<SourceAccessor> GitRepoImpl::getAccessor(const WorkdirInfo & wd, bool export
         return fileAccessor;
 }
 
-ref<GitFileSystemObjectSink> GitRepoImpl::getFileSystemObjectSink()
+ref<GitFileSystemObjectSink> GitRepoImpl::getFileSystemObjectSink(size_t maxBatchSize)
 {
-    return make_ref<GitFileSystemObjectSinkImpl>(ref<GitRepoImpl>(shared_from_this()));
+    return make_ref<GitFileSystemObjectSinkImpl>(ref<GitRepoImpl>(shared_from_this()), maxBatchSize);
 }
 
 std::vector<std::tuple<GitRepoImpl::Submodule, Hash>> GitRepoImpl::getSubmodules(const Hash & rev, bool exportIgnore)
@@ -82,7 +82,11 @@ struct GitRepo
 
     virtual ref<SourceAccessor> getAccessor(const WorkdirInfo & wd, bool exportIgnore, MakeNotAllowedError makeNotAllowedError) = 0;
 
-    virtual ref<GitFileSystemObjectSink> getFileSystemObjectSink() = 0;
+    /**
+     * @param maxBatchSize The number of bytes of file contents that
+     * the sink buffers before writing them to a pack file.
+     */
+    virtual ref<GitFileSystemObjectSink> getFileSystemObjectSink(size_t maxBatchSize = 64 * 1024 * 1024) = 0;
 
     virtual void flush() = 0;
 
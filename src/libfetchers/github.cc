@@ -259,7 +259,7 @@ struct GitArchiveInputScheme : InputScheme
 
         TarArchive archive { *source };
         auto tarballCache = getTarballCache();
-        auto parseSink = tarballCache->getFileSystemObjectSink();
+        auto parseSink = tarballCache->getFileSystemObjectSink(input.settings->tarballCacheBatchSize);
         auto lastModified = unpackTarfileToSink(archive, *parseSink);
         auto tree = parseSink->flush();
 
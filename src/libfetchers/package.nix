@@ -6,6 +6,7 @@
 , nix-store
 , nlohmann_json
 , libgit2
+, zlib
 
 # Configuration Options
 
@@ -33,6 +34,7 @@ mkMesonLibrary (finalAttrs: {
 
   buildInputs = [
     libgit2
+    zlib
   ];
 
   propagatedBuildInputs = [
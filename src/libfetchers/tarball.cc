@@ -1,5 +1,6 @@
 #include "tarball.hh"
 #include "fetchers.hh"
+#include "fetch-settings.hh"
 #include "cache.hh"
 #include "filetransfer.hh"
 #include "store-api.hh"
@@ -104,6 +105,7 @@ DownloadFileResult downloadFile(
 }
 
 static DownloadTarballResult downloadTarball_(
+    const Settings & settings,
     const std::string & url,
     const Headers & headers)
 {
@@ -169,7 +171,7 @@ static DownloadTarballResult downloadTarball_(
           })
         : TarArchive{*source};
     auto tarballCache = getTarballCache();
-    auto parseSink = tarballCache->getFileSystemObjectSink();
+    auto parseSink = tarballCache->getFileSystemObjectSink(settings.tarballCacheBatchSize);
     auto lastModified = unpackTarfileToSink(archive, *parseSink);
     auto tree = parseSink->flush();
 
@@ -371,7 +373,7 @@ struct TarballInputScheme : CurlInputScheme
     {
         auto input(_input);
 
-        auto result = downloadTarball_(getStrAttr(input.attrs, "url"), {});
+        auto result = downloadTarball_(*input.settings, getStrAttr(input.attrs, "url"), {});
 
         result.accessor->setPathDisplay("«" + input.to_string() + "»");
 
@@ -0,0 +1,172 @@
+#include <gtest/gtest.h>
+
+#include "tests/libstore.hh"
+#include "file-system.hh"
+#include "finally.hh"
+#include "globals.hh"
+#include "logging.hh"
+#include "store-api.hh"
+#include "sync.hh"
+
+namespace nix {
+
+/**
+ * Records the order in which copyPaths() reads the paths it copies,
+ * and the largest total NAR size of the paths that are read at the
+ * same time.
+ */
+struct CopyLogger : Logger
+{
+    std::map<std::string, uint64_t> narSizes;
+
+    struct State
+    {
+        std::vector<std::string> started;
+        std::map<ActivityId, std::string> running;
+        uint64_t bytesInFlight = 0;
+        /**
+         * The largest value of `bytesInFlight` while more than one path
+         * was being read.
+         */
+        uint64_t maxSharedBytesInFlight = 0;
+    };
+
+    Sync<State> state_;
+
+    void log(Verbosity lvl, std::string_view s) override { }
+
+    void logEI(const ErrorInfo & ei) override { }
+
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        if (type != actCopyPath) return;
+        auto & path = fields.at(0).s;
+        auto state(state_.lock());
+        state->started.push_back(path);
+        state->running.emplace(act, path);
+        state->bytesInFlight += narSizes.at(path);
+        if (state->running.size() > 1)
+            state->maxSharedBytesInFlight = std::max(state->maxSharedBytesInFlight, state->bytesInFlight);
+    }
+
+    void stopActivity(ActivityId act) override
+    {
+        auto state(state_.lock());
+        auto i = state->running.find(act);
+        if (i == state->running.end()) return;
+        state->bytesInFlight -= narSizes.at(i->second);
+        state->running.erase(i);
+    }
+};
+
+class CopyPathsTest : public LibStoreTest
+{
+protected:
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir{tmpDir, true};
+
+    ref<Store> srcStore = openStore("file://" + tmpDir + "/src");
+    ref<Store> dstStore = openStore("file://" + tmpDir + "/dst");
+
+    StorePath missing{"g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-missing"};
+
+    StorePath addText(std::string_view name, std::string contents, const StorePathSet & references = {})
+    {
+        StringSource source(contents);
+        return srcStore->addToStoreFromDump(
+            source, name,
+            FileSerialisationMethod::Flat, ContentAddressMethod::Raw::Text, HashAlgorithm::SHA256,
+            references);
+    }
+
+    /**
+     * Copy `paths` from `srcStore` to `dstStore` and return the
+     * recorded copies.
+     */
+    CopyLogger::State copy(const StorePathSet & paths)
+    {
+        CopyLogger copyLogger;
+        for (auto & path : paths)
+            copyLogger.narSizes.emplace(srcStore->printStorePath(path), srcStore->queryPathInfo(path)->narSize);
+
+        auto oldLogger = logger;
+        logger = &copyLogger;
+        Finally restoreLogger([&]() { logger = oldLogger; });
+
+        copyPaths(*srcStore, *dstStore, paths, NoRepair, NoCheckSigs);
+
+        return std::move(*copyLogger.state_.lock());
+    }
+};
+
+TEST_F(CopyPathsTest, queryPathInfos)
+{
+    auto a = addText("a", "a");
+    auto b = addText("b", "b", {a});
+
+    auto infos = srcStore->queryPathInfos({a, b, missing});
+
+    ASSERT_EQ(infos.size(), 2);
+    EXPECT_EQ(infos.at(a)->references, StorePathSet{});
+    EXPECT_EQ(infos.at(b)->references, StorePathSet{a});
+    EXPECT_FALSE(infos.count(missing));
+}
+
+TEST_F(CopyPathsTest, missingPath)
+{
+    auto a = addText("a", "a");
+
+    EXPECT_THROW(copyPaths(*srcStore, *dstStore, StorePathSet{a, missing}, NoRepair, NoCheckSigs), InvalidPath);
+    EXPECT_FALSE(dstStore->isValidPath(a));
+}
+
+TEST_F(CopyPathsTest, topologicalOrder)
+{
+    /* A chain, and a diamond on top of it. */
+    StorePathSet paths;
+    std::optional<StorePath> prev;
+    for (int i = 0; i < 10; ++i) {
+        auto path = addText(fmt("chain-%d", i), std::to_string(i), prev ? StorePathSet{*prev} : StorePathSet{});
+        paths.insert(path);
+        prev = path;
+    }
+    auto bottom = addText("bottom", "bottom");
+    auto left = addText("left", "left", {bottom});
+    auto right = addText("right", "right", {bottom});
+    auto top = addText("top", "top", {left, right, *prev});
+    paths.insert({bottom, left, right, top});
+
+    auto copied = copy(paths);
+
+    ASSERT_EQ(copied.started.size(), paths.size());
+    std::set<std::string> seen;
+    for (auto & path : copied.started) {
+        for (auto & ref : srcStore->queryPathInfo(srcStore->parseStorePath(path))->references)
+            EXPECT_TRUE(seen.count(srcStore->printStorePath(ref))) << path << " was copied before " << srcStore->printStorePath(ref);
+        seen.insert(path);
+    }
+    EXPECT_EQ(dstStore->queryValidPaths(paths), paths);
+}
+
+TEST_F(CopyPathsTest, memoryBudget)
+{
+    uint64_t budget = 50000;
+    auto oldBudget = settings.copyMemoryBudget.get();
+    settings.copyMemoryBudget = budget;
+    Finally restoreBudget([&]() { settings.copyMemoryBudget = oldBudget; });
+
+    StorePathSet paths;
+    for (int i = 0; i < 20; ++i)
+        paths.insert(addText(fmt("small-%d", i), std::string(10000, 'a' + i)));
+    auto large = addText("large", std::string(4 * budget, 'x'));
+    paths.insert(large);
+
+    auto copied = copy(paths);
+
+    EXPECT_EQ(copied.started.size(), paths.size());
+    EXPECT_LE(copied.maxSharedBytesInFlight, budget);
+    EXPECT_EQ(dstStore->queryValidPaths(paths), paths);
+}
+
+} // namespace nix
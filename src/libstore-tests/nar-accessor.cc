@@ -0,0 +1,125 @@
+#include <gtest/gtest.h>
+#include <nlohmann/json.hpp>
+
+#include "archive.hh"
+#include "file-system.hh"
+#include "nar-accessor.hh"
+
+namespace nix {
+
+class NarAccessorTest : public ::testing::Test
+{
+protected:
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir{tmpDir, true};
+
+    std::string nar;
+
+    NarAccessorTest()
+    {
+        auto root = tmpDir + "/root";
+        createDirs(root + "/dir/sub");
+        createDirs(root + "/empty");
+        writeFile(root + "/file", "hello");
+        writeFile(root + "/dir/b", "");
+        writeFile(root + "/dir/a", std::string(10000, 'x'));
+        writeFile(root + "/dir/sub/exe", "#! /bin/sh\n");
+        chmod((root + "/dir/sub/exe").c_str(), 0755);
+        for (int i = 0; i < 100; ++i)
+            writeFile(fmt("%s/dir/f%d", root, i), std::to_string(i));
+        createSymlink("../file", root + "/dir/link");
+
+        StringSink sink;
+        dumpPath(root, sink);
+        nar = std::move(sink.s);
+    }
+
+    void check(ref<SourceAccessor> accessor, bool withContents = true)
+    {
+        auto st = accessor->lstat(CanonPath::root);
+        ASSERT_EQ(st.type, SourceAccessor::Type::tDirectory);
+
+        ASSERT_EQ(accessor->readDirectory(CanonPath::root).size(), 3u);
+        ASSERT_EQ(accessor->readDirectory(CanonPath("dir")).size(), 104u);
+        ASSERT_TRUE(accessor->readDirectory(CanonPath("empty")).empty());
+
+        st = accessor->lstat(CanonPath("dir/sub/exe"));
+        ASSERT_EQ(st.type, SourceAccessor::Type::tRegular);
+        ASSERT_TRUE(st.isExecutable);
+        ASSERT_EQ(st.fileSize, 11u);
+
+        ASSERT_EQ(accessor->lstat(CanonPath("dir/b")).fileSize, 0u);
+        ASSERT_FALSE(accessor->lstat(CanonPath("file")).isExecutable);
+
+        ASSERT_EQ(accessor->readLink(CanonPath("dir/link")), "../file");
+
+        ASSERT_FALSE(accessor->maybeLstat(CanonPath("missing")));
+        ASSERT_FALSE(accessor->maybeLstat(CanonPath("file/foo")));
+        ASSERT_FALSE(accessor->maybeLstat(CanonPath("dir/f100")));
+        ASSERT_THROW(accessor->readFile(CanonPath("dir")), Error);
+        ASSERT_THROW(accessor->readLink(CanonPath("file")), Error);
+
+        if (withContents) {
+            ASSERT_EQ(accessor->readFile(CanonPath("file")), "hello");
+            ASSERT_EQ(accessor->readFile(CanonPath("dir/a")), std::string(10000, 'x'));
+            ASSERT_EQ(accessor->readFile(CanonPath("dir/b")), "");
+            for (int i = 0; i < 100; ++i)
+                ASSERT_EQ(accessor->readFile(CanonPath(fmt("dir/f%d", i))), std::to_string(i));
+        }
+    }
+};
+
+TEST_F(NarAccessorTest, inMemory)
+{
+    check(makeNarAccessor(std::string(nar)));
+}
+
+TEST_F(NarAccessorTest, fromSource)
+{
+    StringSource source(nar);
+    check(makeNarAccessor(source), false);
+}
+
+TEST_F(NarAccessorTest, fromListing)
+{
+    auto listing = listNar(makeNarAccessor(std::string(nar)), CanonPath::root, true).dump();
+    check(makeLazyNarAccessor(listing, [&](uint64_t offset, uint64_t length) {
+        return nar.substr(offset, length);
+    }));
+}
+
+TEST_F(NarAccessorTest, indexed)
+{
+    auto narFile = tmpDir + "/test.nar";
+    auto indexFile = tmpDir + "/test.narindex";
+    writeFile(narFile, nar);
+
+    check(makeIndexedNarAccessor(narFile));
+    ASSERT_FALSE(pathExists(indexFile));
+
+    check(makeIndexedNarAccessor(narFile, indexFile));
+    StringSource source(nar);
+    ASSERT_EQ(readFile(indexFile), makeNarIndex(source));
+
+    /* Use the existing index. */
+    check(makeIndexedNarAccessor(narFile, indexFile));
+}
+
+TEST_F(NarAccessorTest, badIndex)
+{
+    auto narFile = tmpDir + "/test.nar";
+    auto indexFile = tmpDir + "/test.narindex";
+    writeFile(narFile, nar);
+
+    writeFile(indexFile, "garbage");
+    check(makeIndexedNarAccessor(narFile, indexFile));
+
+    /* An index of a different NAR is replaced. */
+    StringSink sink;
+    dumpString("foo", sink);
+    StringSource source(sink.s);
+    writeFile(indexFile, makeNarIndex(source));
+    check(makeIndexedNarAccessor(narFile, indexFile));
+}
+
+}
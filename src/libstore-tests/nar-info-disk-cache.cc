@@ -120,4 +120,48 @@ TEST(NarInfoDiskCacheImpl, create_and_read) {
     }
 }
 
+TEST(NarInfoDiskCacheImpl, lookupNarInfos) {
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir);
+
+    auto cache = getTestNarInfoDiskCache(tmpDir + "/test-narinfo-disk-cache.sqlite");
+    cache->createCache("http://foo", "/nix/storedir", true, 10);
+
+    auto narHash = Hash::parseSRI("sha256-FePFYIlMuycIXPZbWi7LGEiMmZSX9FMbaQenWBzm1Sc=");
+
+    StorePath path1 { "g1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-foo" };
+    auto info1 = std::make_shared<NarInfo>(path1, narHash);
+    info1->url = "nar/1.nar.xz";
+    info1->compression = "xz";
+    info1->narSize = 123;
+    cache->upsertNarInfo("http://foo", std::string(path1.hashPart()), info1);
+
+    StorePath path2 { "h1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-bar" };
+    cache->upsertNarInfo("http://foo", std::string(path2.hashPart()), nullptr);
+
+    // Known in another cache only.
+    StorePath path3 { "i1w7hy3qg1w7hy3qg1w7hy3qg1w7hy3q-baz" };
+    cache->createCache("http://bar", "/nix/storedir", true, 10);
+    cache->upsertNarInfo("http://bar", std::string(path3.hashPart()), info1);
+
+    auto res = cache->lookupNarInfos("http://foo", {
+        std::string(path1.hashPart()),
+        std::string(path2.hashPart()),
+        std::string(path3.hashPart()),
+    });
+
+    ASSERT_EQ(res.size(), 2u);
+
+    auto & r1 = res.at(std::string(path1.hashPart()));
+    ASSERT_EQ(r1.first, NarInfoDiskCache::oValid);
+    ASSERT_EQ(r1.second->path, path1);
+    ASSERT_EQ(r1.second->url, "nar/1.nar.xz");
+    ASSERT_EQ(r1.second->narSize, 123u);
+
+    ASSERT_EQ(res.at(std::string(path2.hashPart())).first, NarInfoDiskCache::oInvalid);
+
+    // The batched lookup agrees with the single one.
+    ASSERT_EQ(cache->lookupNarInfo("http://foo", std::string(path1.hashPart())).second->narHash, narHash);
+}
+
 }
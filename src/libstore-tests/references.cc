@@ -42,4 +42,51 @@ TEST(references, scan)
     }
 }
 
+TEST(references, scanBlockBoundaries)
+{
+    std::string hash1 = "dc04vv14dak1c1r48qa0m23vr9jy8sm0";
+    std::string hash2 = "zc842j0rz61mjsp3h3wp5ly71ak6qgdn";
+
+    /* Put the hash at every offset around the 64-byte blocks that the
+       scanner works on, surrounded by binary data or by other base-32
+       characters. */
+    for (auto filler : {'\0', '\xff', 'a'}) {
+        for (size_t offset = 0; offset < 200; ++offset) {
+            std::string s(offset, filler);
+            s += hash1;
+            s += std::string(offset % 7, filler);
+
+            RefScanSink scanner(StringSet{hash1, hash2});
+            scanner(s);
+            ASSERT_EQ(scanner.getResult(), StringSet{hash1}) << "at offset " << offset;
+        }
+    }
+
+    /* A run of base-32 characters that is one short of a hash. */
+    {
+        RefScanSink scanner(StringSet{hash1});
+        scanner("x" + hash1.substr(0, 31) + "e" + hash1.substr(1));
+        ASSERT_EQ(scanner.getResult(), StringSet{});
+    }
+}
+
+TEST(references, scanManyHashes)
+{
+    StringSet hashes, expected;
+    std::string s;
+    for (size_t n = 0; n < 100; ++n) {
+        auto hash = hashString(HashAlgorithm::SHA256, std::to_string(n)).to_string(HashFormat::Nix32, false).substr(0, 32);
+        hashes.insert(hash);
+        if (n % 3 == 0) {
+            expected.insert(hash);
+            s += std::string(n, n % 2 ? '/' : 'a') + hash;
+        }
+    }
+
+    RefScanSink scanner(std::move(hashes));
+    for (size_t pos = 0; pos < s.size(); pos += 1000)
+        scanner(((std::string_view) s).substr(pos, 1000));
+    ASSERT_EQ(scanner.getResult(), expected);
+}
+
 }
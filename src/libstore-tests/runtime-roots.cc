@@ -0,0 +1,101 @@
+#include <gtest/gtest.h>
+#include <random>
+#include <regex>
+
+#include "runtime-roots.hh"
+
+namespace nix {
+
+/* The regular expressions that `LocalStore::findRuntimeRoots()` used
+   to use, which the hand-written scanners must agree with. */
+static const std::regex mapRegex(R"(^\s*\S+\s+\S+\s+\S+\s+\S+\s+\S+\s+(/\S+)\s*$)");
+static const std::regex storePathRegex(R"(/nix/store/[0-9a-z]+[0-9a-zA-Z\+\-\._\?=]*)");
+
+static std::optional<std::string> parseProcMapsLineRegex(const std::string & line)
+{
+    std::smatch match;
+    if (std::regex_match(line, match, mapRegex))
+        return match[1];
+    return std::nullopt;
+}
+
+static std::vector<std::string> scanForStorePathsRegex(const std::string & s)
+{
+    std::vector<std::string> res;
+    for (auto i = std::sregex_iterator{s.begin(), s.end(), storePathRegex}; i != std::sregex_iterator{}; ++i)
+        res.push_back(i->str());
+    return res;
+}
+
+static std::vector<std::string> scanForStorePaths(const std::string & s)
+{
+    std::vector<std::string> res;
+    scanForStorePaths("/nix/store", s, [&](std::string_view path) { res.emplace_back(path); });
+    return res;
+}
+
+TEST(parseProcMapsLine, examples)
+{
+    ASSERT_EQ(
+        parseProcMapsLine("7f6e1c000000-7f6e1c021000 r--p 00000000 fd:01 1234 /nix/store/abc-glibc-2.39/lib/libc.so.6"),
+        "/nix/store/abc-glibc-2.39/lib/libc.so.6");
+    ASSERT_EQ(
+        parseProcMapsLine("  7f6e1c000000-7f6e1c021000 r--p 00000000 fd:01 1234   /usr/lib/x.so  "),
+        "/usr/lib/x.so");
+    ASSERT_EQ(parseProcMapsLine("7ffd4f1e5000-7ffd4f206000 rw-p 00000000 00:00 0 [stack]"), std::nullopt);
+    ASSERT_EQ(parseProcMapsLine("7ffd4f1e5000-7ffd4f206000 rw-p 00000000 00:00 0"), std::nullopt);
+    ASSERT_EQ(parseProcMapsLine("7f6e1c000000-7f6e1c021000 r--p 00000000 fd:01 1234 /tmp/foo (deleted)"), std::nullopt);
+    ASSERT_EQ(parseProcMapsLine(""), std::nullopt);
+}
+
+TEST(scanForStorePaths, examples)
+{
+    using S = std::vector<std::string>;
+    ASSERT_EQ(
+        scanForStorePaths(std::string("PATH=/nix/store/abc-foo/bin:/nix/store/def-bar-1.0/bin\0HOME=/root\0X=/nix/store/", 80)),
+        (S{"/nix/store/abc-foo", "/nix/store/def-bar-1.0"}));
+    ASSERT_EQ(scanForStorePaths("/nix/store/Abc /nix/store//x /nix/store/x/nix/store/y"), (S{"/nix/store/x", "/nix/store/y"}));
+    ASSERT_EQ(scanForStorePaths("/nix/store"), S{});
+}
+
+/* Compare with the regular expressions on random strings made of the
+   interesting pieces. */
+TEST(runtimeRoots, matchesRegex)
+{
+    std::mt19937 gen(42);
+
+    std::vector<std::string> pieces = {
+        "/nix/store", "/nix/store/", "/", "nix", "a", "Z", "0", "-", ".", "?", "=", "+", "_",
+        " ", "\t", "\v", "\n", std::string(1, '\0'), ":", "(", "x y", "/tmp", "rw-p",
+    };
+
+    auto randomString = [&]() {
+        std::string s;
+        auto n = std::uniform_int_distribution<size_t>(0, 30)(gen);
+        for (size_t i = 0; i < n; ++i)
+            s += pieces[std::uniform_int_distribution<size_t>(0, pieces.size() - 1)(gen)];
+        return s;
+    };
+
+    for (int i = 0; i < 20000; ++i) {
+        auto s = randomString();
+        ASSERT_EQ(scanForStorePaths(s), scanForStorePathsRegex(s)) << s;
+    }
+
+    std::vector<std::string> fields = {"a", "b-c", "/", "/nix/store/x", "/x y", "[heap]", "0"};
+
+    for (int i = 0; i < 20000; ++i) {
+        std::string line;
+        auto n = std::uniform_int_distribution<size_t>(0, 8)(gen);
+        for (size_t j = 0; j < n; ++j) {
+            line += pieces[std::uniform_int_distribution<size_t>(13, 16)(gen)];
+            line += fields[std::uniform_int_distribution<size_t>(0, fields.size() - 1)(gen)];
+        }
+        if (gen() % 2) line += " ";
+        auto expected = parseProcMapsLineRegex(line);
+        auto actual = parseProcMapsLine(line);
+        ASSERT_EQ(actual ? std::optional<std::string>(*actual) : std::nullopt, expected) << line;
+    }
+}
+
+}
@@ -1,5 +1,6 @@
 #include "archive.hh"
 #include "binary-cache-store.hh"
+#include "chunking.hh"
 #include "compression.hh"
 #include "derivations.hh"
 #include "source-accessor.hh"
@@ -15,6 +16,7 @@
 #include "archive.hh"
 
 #include <chrono>
+#include <condition_variable>
 #include <future>
 #include <regex>
 #include <fstream>
@@ -103,6 +105,33 @@ std::optional<std::string> BinaryCacheStore::getFile(const std::string & path)
     return std::move(sink.s);
 }
 
+/**
+ * The file name extension of files compressed using `compression`.
+ */
+static std::string compressionExtension(const std::string & compression)
+{
+    return
+        compression == "xz" ? ".xz" :
+        compression == "bzip2" ? ".bz2" :
+        compression == "zstd" || compression == "zstd-seekable" ? ".zst" :
+        compression == "lzip" ? ".lzip" :
+        compression == "lz4" ? ".lz4" :
+        compression == "br" ? ".br" :
+        "";
+}
+
+/**
+ * NARs uploaded with `chunk-nars` have a URL with this suffix,
+ * pointing to a list of their chunks. Each line of the list contains
+ * the SHA-256 hash (in Nix32 format) and the size of a chunk.
+ */
+static const std::string chunkListSuffix = ".chunks";
+
+static std::string chunkFileFor(const Hash & hash, const std::string & compression)
+{
+    return "chunks/" + hash.to_string(HashFormat::Nix32, false) + compressionExtension(compression);
+}
+
 std::string BinaryCacheStore::narInfoFileFor(const StorePath & storePath)
 {
     return std::string(storePath.hashPart()) + ".narinfo";
@@ -114,12 +143,9 @@ void BinaryCacheStore::writeNarInfo(ref<NarInfo> narInfo)
 
     upsertFile(narInfoFile, narInfo->to_string(*this), "text/x-nix-narinfo");
 
-    {
-        auto state_(state.lock());
-        state_->pathInfoCache.upsert(
-            std::string(narInfo->path.to_string()),
-            PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
-    }
+    pathInfoCache.upsert(
+        narInfo->path,
+        PathInfoCacheValue { .value = std::shared_ptr<NarInfo>(narInfo) });
 
     if (diskCache)
         diskCache->upsertNarInfo(getUri(), std::string(narInfo->path.hashPart()), std::shared_ptr<NarInfo>(narInfo));
@@ -137,18 +163,101 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
 
     /* Read the NAR simultaneously into a CompressionSink+FileSink (to
        write the compressed NAR to disk), into a HashSink (to get the
-       NAR hash), and into a NarAccessor (to get the NAR listing). */
+       NAR hash), and into a NarAccessor (to get the NAR listing). With
+       `chunk-nars`, the NAR goes into a ChunkingSink that uploads the
+       chunks instead, and the file on disk is the list of chunks. */
     HashSink fileHashSink { HashAlgorithm::SHA256 };
     std::shared_ptr<SourceAccessor> narAccessor;
     HashSink narHashSink { HashAlgorithm::SHA256 };
+    uint64_t nrChunks = 0;
+    std::atomic<uint64_t> chunkBytesWritten{0};
     {
     FdSink fileSink(fdTemp.get());
     TeeSink teeSinkCompressed { fileSink, fileHashSink };
-    auto compressionSink = makeCompressionSink(compression, teeSinkCompressed, parallelCompression, compressionLevel);
-    TeeSink teeSinkUncompressed { *compressionSink, narHashSink };
-    TeeSource teeSource { narSource, teeSinkUncompressed };
-    narAccessor = makeNarAccessor(teeSource);
-    compressionSink->finish();
+    if (chunkNars) {
+        /* Chunks are hashed here, so that the chunk list is in order,
+           but checked for and uploaded by a thread pool. At most
+           `maxQueued` chunks are waiting to be uploaded at any time,
+           to bound memory use. */
+        static constexpr size_t maxQueued = 100;
+
+        struct UploadState
+        {
+            size_t queued = 0;
+            /* The error of the first upload that failed. */
+            std::exception_ptr error;
+        };
+
+        Sync<UploadState> uploadState_;
+        std::condition_variable wakeup;
+
+        /* Chunks that occur more than once in this NAR are only
+           uploaded once. */
+        std::set<Hash> seen;
+
+        /* The pool counts the thread calling process() as one of its
+           threads, but this thread is busy chunking until the end. */
+        ThreadPool pool(std::max(1u, chunkUploadThreads.get()) + 1);
+
+        ChunkingSink chunkingSink(chunkSize, [&](std::string_view chunk) {
+            auto hash = hashString(HashAlgorithm::SHA256, chunk);
+            teeSinkCompressed(hash.to_string(HashFormat::Nix32, false) + " " + std::to_string(chunk.size()) + "\n");
+            nrChunks++;
+
+            if (!seen.insert(hash).second) {
+                stats.chunkWriteAverted++;
+                stats.chunkWriteAvertedBytes += chunk.size();
+                return;
+            }
+
+            {
+                auto uploadState(uploadState_.lock());
+                while (uploadState->queued >= maxQueued && !uploadState->error)
+                    uploadState.wait(wakeup);
+                if (uploadState->error)
+                    std::rethrow_exception(uploadState->error);
+                uploadState->queued++;
+            }
+
+            try {
+                pool.enqueue([&, hash, chunk{std::string(chunk)}]() {
+                    try {
+                        if (writeChunk(hash, chunk, repair))
+                            chunkBytesWritten += chunk.size();
+                    } catch (...) {
+                        {
+                            auto uploadState(uploadState_.lock());
+                            uploadState->queued--;
+                            if (!uploadState->error)
+                                uploadState->error = std::current_exception();
+                        }
+                        wakeup.notify_one();
+                        throw;
+                    }
+                    uploadState_.lock()->queued--;
+                    wakeup.notify_one();
+                });
+            } catch (ThreadPoolShutDown &) {
+                /* An upload failed after the check above. */
+                auto uploadState(uploadState_.lock());
+                uploadState->queued--;
+                if (uploadState->error)
+                    std::rethrow_exception(uploadState->error);
+                throw;
+            }
+        });
+        TeeSink teeSinkUncompressed { chunkingSink, narHashSink };
+        TeeSource teeSource { narSource, teeSinkUncompressed };
+        narAccessor = makeNarAccessor(teeSource);
+        chunkingSink.finish();
+        pool.process();
+    } else {
+        auto compressionSink = makeCompressionSink(compression, teeSinkCompressed, parallelCompression, compressionLevel);
+        TeeSink teeSinkUncompressed { *compressionSink, narHashSink };
+        TeeSource teeSource { narSource, teeSinkUncompressed };
+        narAccessor = makeNarAccessor(teeSource);
+        compressionSink->finish();
+    }
     fileSink.flush();
     }
 
@@ -156,24 +265,24 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
 
     auto info = mkInfo(narHashSink.finish());
     auto narInfo = make_ref<NarInfo>(info);
-    narInfo->compression = compression;
+    /* The seekable format is ordinary zstd data as far as clients
+       are concerned. */
+    narInfo->compression = compression.get() == "zstd-seekable" ? "zstd" : compression.get();
     auto [fileHash, fileSize] = fileHashSink.finish();
     narInfo->fileHash = fileHash;
     narInfo->fileSize = fileSize;
-    narInfo->url = "nar/" + narInfo->fileHash->to_string(HashFormat::Nix32, false) + ".nar"
-                   + (compression == "xz" ? ".xz" :
-           compression == "bzip2" ? ".bz2" :
-           compression == "zstd" ? ".zst" :
-           compression == "lzip" ? ".lzip" :
-           compression == "lz4" ? ".lz4" :
-           compression == "br" ? ".br" :
-           "");
+    narInfo->url = "nar/" + narInfo->fileHash->to_string(HashFormat::Nix32, false)
+        + (chunkNars ? chunkListSuffix : ".nar" + compressionExtension(compression));
 
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
-    printMsg(lvlTalkative, "copying path '%1%' (%2% bytes, compressed %3$.1f%% in %4% ms) to binary cache",
-        printStorePath(narInfo->path), info.narSize,
-        ((1.0 - (double) fileSize / info.narSize) * 100.0),
-        duration);
+    if (chunkNars)
+        printMsg(lvlTalkative, "copying path '%1%' (%2% bytes in %3% chunks, %4% bytes new, in %5% ms) to binary cache",
+            printStorePath(narInfo->path), info.narSize, nrChunks, chunkBytesWritten, duration);
+    else
+        printMsg(lvlTalkative, "copying path '%1%' (%2% bytes, compressed %3$.1f%% in %4% ms) to binary cache",
+            printStorePath(narInfo->path), info.narSize,
+            ((1.0 - (double) fileSize / info.narSize) * 100.0),
+            duration);
 
     /* Verify that all references are valid. This may do some .narinfo
        reads, but typically they'll already be cached. */
@@ -254,18 +363,20 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
         }
     }
 
-    /* Atomically write the NAR file. */
+    /* Atomically write the NAR file (or the chunk list). */
     if (repair || !fileExists(narInfo->url)) {
         stats.narWrite++;
         upsertFile(narInfo->url,
             std::make_shared<std::fstream>(fnTemp, std::ios_base::in | std::ios_base::binary),
-            "application/x-nix-nar");
+            chunkNars ? "text/x-nix-chunk-list" : "application/x-nix-nar");
     } else
         stats.narWriteAverted++;
 
     stats.narWriteBytes += info.narSize;
-    stats.narWriteCompressedBytes += fileSize;
-    stats.narWriteCompressionTimeMs += duration;
+    if (!chunkNars) {
+        stats.narWriteCompressedBytes += fileSize;
+        stats.narWriteCompressionTimeMs += duration;
+    }
 
     /* Atomically write the NAR info file.*/
     if (signer) narInfo->sign(*this, *signer);
@@ -277,6 +388,40 @@ ref<const ValidPathInfo> BinaryCacheStore::addToStoreCommon(
     return narInfo;
 }
 
+bool BinaryCacheStore::writeChunk(const Hash & hash, std::string_view chunk, RepairFlag repair)
+{
+    if (!repair && knownChunks.lock()->count(hash)) {
+        stats.chunkWriteAverted++;
+        stats.chunkWriteAvertedBytes += chunk.size();
+        return false;
+    }
+
+    auto path = chunkFileFor(hash, compression);
+
+    bool write = repair || !fileExists(path);
+
+    if (write) {
+        auto compressed = compress(compression, chunk, parallelCompression, compressionLevel);
+        stats.chunkWrite++;
+        stats.chunkWriteBytes += chunk.size();
+        stats.chunkWriteCompressedBytes += compressed.size();
+        upsertFile(path, std::move(compressed), "application/x-nix-nar-chunk");
+    } else {
+        stats.chunkWriteAverted++;
+        stats.chunkWriteAvertedBytes += chunk.size();
+    }
+
+    /* Bound the memory used by `knownChunks` when copying a lot of
+       data. */
+    static constexpr size_t maxKnownChunks = 1 << 20;
+
+    auto known(knownChunks.lock());
+    if (known->size() >= maxKnownChunks) known->clear();
+    known->insert(hash);
+
+    return write;
+}
+
 void BinaryCacheStore::addToStore(const ValidPathInfo & info, Source & narSource,
     RepairFlag repair, CheckSigsFlag checkSigs)
 {
@@ -394,6 +539,13 @@ void BinaryCacheStore::narFromPath(const StorePath & storePath, Sink & sink)
     LengthSink narSize;
     TeeSink tee { sink, narSize };
 
+    if (hasSuffix(info->url, chunkListSuffix)) {
+        narFromChunks(*info, tee);
+        stats.narRead++;
+        stats.narReadBytes += narSize.length;
+        return;
+    }
+
     auto decompressor = makeDecompressionSink(info->compression, tee);
 
     try {
@@ -409,6 +561,133 @@ void BinaryCacheStore::narFromPath(const StorePath & storePath, Sink & sink)
     stats.narReadBytes += narSize.length;
 }
 
+void BinaryCacheStore::narFromChunks(const NarInfo & info, Sink & sink)
+{
+    auto chunkList = getFile(info.url);
+    if (!chunkList)
+        throw SubstituteGone("file '%s' does not exist in binary cache '%s'", info.url, getUri());
+
+    auto corrupt = [&]() {
+        return Error("chunk list '%s' in binary cache '%s' is corrupt", info.url, getUri());
+    };
+
+    if (info.fileHash && hashString(info.fileHash->algo, *chunkList) != *info.fileHash)
+        throw corrupt();
+
+    struct Chunk
+    {
+        Hash hash;
+        uint64_t size;
+        std::optional<std::future<std::optional<std::string>>> download;
+    };
+
+    std::vector<Chunk> chunks;
+
+    for (auto & line : tokenizeString<std::vector<std::string>>(*chunkList, "\n")) {
+        auto fields = tokenizeString<std::vector<std::string>>(line, " ");
+        std::optional<uint64_t> size;
+        if (fields.size() != 2 || !(size = string2Int<uint64_t>(fields[1])))
+            throw corrupt();
+        try {
+            chunks.push_back({Hash::parseNonSRIUnprefixed(fields[0], HashAlgorithm::SHA256), *size, {}});
+        } catch (BadHash &) {
+            throw corrupt();
+        }
+    }
+
+    if (localChunkCache != "")
+        createDirs(localChunkCache);
+
+    auto localFile = [&](const Hash & hash) {
+        return localChunkCache.get() + "/" + hash.to_string(HashFormat::Nix32, false);
+    };
+
+    auto startDownload = [&](Chunk & chunk) {
+        auto promise = std::make_shared<std::promise<std::optional<std::string>>>();
+        chunk.download = promise->get_future();
+        getFile(chunkFileFor(chunk.hash, info.compression),
+            {[promise](std::future<std::optional<std::string>> result) {
+                try {
+                    promise->set_value(result.get());
+                } catch (...) {
+                    promise->set_exception(std::current_exception());
+                }
+            }});
+    };
+
+    /* Download the chunks that are not in the local chunk cache a
+       few chunks ahead of the one we're writing, so that (for
+       binary caches that support it) several downloads are in
+       progress at the same time. */
+    static constexpr size_t lookahead = 16;
+    size_t next = 0;
+
+    uint64_t nrDownloaded = 0;
+
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        checkInterrupt();
+
+        for (; next < std::min(i + lookahead, chunks.size()); ++next)
+            if (localChunkCache == "" || !pathExists(localFile(chunks[next].hash)))
+                startDownload(chunks[next]);
+
+        auto & chunk = chunks[i];
+
+        std::optional<std::string> data;
+
+        if (!chunk.download) {
+            try {
+                data = readFile(localFile(chunk.hash));
+                if (hashString(HashAlgorithm::SHA256, *data) != chunk.hash)
+                    data.reset();
+            } catch (SystemError &) {
+            }
+            if (data) {
+                stats.chunkReadAverted++;
+                stats.chunkReadAvertedBytes += data->size();
+            } else
+                startDownload(chunk);
+        }
+
+        if (!data) {
+            auto compressed = chunk.download->get();
+            chunk.download.reset();
+            if (!compressed)
+                throw SubstituteGone("chunk '%s' of '%s' does not exist in binary cache '%s'",
+                    chunk.hash.to_string(HashFormat::Nix32, false), info.url, getUri());
+
+            data = decompress(info.compression, *compressed);
+            if (hashString(HashAlgorithm::SHA256, *data) != chunk.hash)
+                throw Error("chunk '%s' in binary cache '%s' is corrupt",
+                    chunk.hash.to_string(HashFormat::Nix32, false), getUri());
+
+            stats.chunkRead++;
+            stats.chunkReadBytes += data->size();
+            stats.chunkReadCompressedBytes += compressed->size();
+            nrDownloaded++;
+
+            if (localChunkCache != "") {
+                try {
+                    auto path = localFile(chunk.hash);
+                    static std::atomic<int> counter{0};
+                    auto tmpFile = fmt("%s.tmp.%d.%d", path, getpid(), ++counter);
+                    AutoDelete del(tmpFile, false);
+                    writeFile(tmpFile, *data);
+                    std::filesystem::rename(tmpFile, path);
+                    del.cancel();
+                } catch (...) {
+                    ignoreExceptionExceptInterrupt();
+                }
+            }
+        }
+
+        sink(*data);
+    }
+
+    printMsg(lvlTalkative, "downloaded %d of %d chunks of '%s' from '%s'",
+        nrDownloaded, chunks.size(), info.url, getUri());
+}
+
 void BinaryCacheStore::queryPathInfoUncached(const StorePath & storePath,
     Callback<std::shared_ptr<const ValidPathInfo>> callback) noexcept
 {
@@ -6,6 +6,7 @@
 #include "log-store.hh"
 
 #include "pool.hh"
+#include "sync.hh"
 
 #include <atomic>
 
@@ -18,7 +19,12 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
     using StoreConfig::StoreConfig;
 
     const Setting<std::string> compression{this, "xz", "compression",
-        "NAR compression method (`xz`, `bzip2`, `gzip`, `zstd`, or `none`)."};
+        R"(
+          NAR compression method (`xz`, `bzip2`, `gzip`, `zstd`, `zstd-seekable`, or `none`).
+
+          `zstd-seekable` writes zstd data that consists of independently compressed blocks, which Nix decompresses on multiple cores.
+          Since this is still valid zstd data, such NARs are advertised as `zstd` and can be read by any client.
+        )"};
 
     const Setting<bool> writeNARListing{this, false, "write-nar-listing",
         "Whether to write a JSON file that lists the files in each NAR."};
@@ -36,7 +42,7 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
         "Path to a local cache of NARs fetched from this binary cache, used by commands such as `nix store cat`."};
 
     const Setting<bool> parallelCompression{this, false, "parallel-compression",
-        "Enable multi-threaded compression of NARs. This is currently only available for `xz` and `zstd`."};
+        "Enable multi-threaded compression of NARs. This is currently only available for `xz`, `zstd` and `zstd-seekable`."};
 
     const Setting<int> compressionLevel{this, -1, "compression-level",
         R"(
@@ -44,6 +50,32 @@ struct BinaryCacheStoreConfig : virtual StoreConfig
           The meaning and accepted values depend on the compression method selected.
           `-1` specifies that the default compression level should be used.
         )"};
+
+    const Setting<bool> chunkNars{this, false, "chunk-nars",
+        R"(
+          Whether to split NARs into content-defined chunks that are stored by hash under `chunks/`, rather than uploading each NAR as a single file.
+          Chunks that already exist in the binary cache are not uploaded again, so store paths with similar contents share most of their data.
+          Each chunk is compressed separately using the method set by `compression`.
+          Versions of Nix that predate this setting can't substitute paths uploaded in this format.
+        )"};
+
+    const Setting<uint64_t> chunkSize{this, 64 * 1024, "chunk-size",
+        R"(
+          The average size in bytes of the chunks created if `chunk-nars` is enabled.
+          NARs uploaded with different chunk sizes generally don't share chunks.
+        )"};
+
+    const Setting<unsigned int> chunkUploadThreads{this, 25, "chunk-upload-threads",
+        R"(
+          The number of threads that upload chunks at the same time if `chunk-nars` is enabled.
+        )"};
+
+    const Setting<Path> localChunkCache{this, "", "local-chunk-cache",
+        R"(
+          Path to a local cache of NAR chunks fetched from binary caches that use `chunk-nars`.
+          When substituting a path, only the chunks that are not in this cache are downloaded.
+          The cache can be shared between binary caches, and files in it can be deleted at any time.
+        )"};
 };
 
 
@@ -106,6 +138,26 @@ private:
 
     void writeNarInfo(ref<NarInfo> narInfo);
 
+    /**
+     * Hashes of chunks that are known to exist in this binary cache,
+     * to avoid checking for them again.
+     */
+    Sync<std::set<Hash>> knownChunks;
+
+    /**
+     * Upload a NAR chunk with SHA-256 hash `hash`, unless it already
+     * exists in the binary cache. Return whether it was uploaded. This
+     * may be called from several threads at once.
+     */
+    bool writeChunk(const Hash & hash, std::string_view chunk, RepairFlag repair);
+
+    /**
+     * Write the NAR of a path that was uploaded with `chunk-nars` to
+     * `sink`, fetching only the chunks that are not in the local chunk
+     * cache.
+     */
+    void narFromChunks(const NarInfo & info, Sink & sink);
+
     ref<const ValidPathInfo> addToStoreCommon(
         Source & narSource, RepairFlag repair, CheckSigsFlag checkSigs,
         std::function<ValidPathInfo(HashResult)> mkInfo);
@@ -0,0 +1,42 @@
+-- Extension of the sql schema that lets the garbage collector find
+-- paths that have no referrers without looking at every path in the
+-- store.
+-- The counts are maintained by triggers rather than by Nix itself, so
+-- that they stay correct even if the database is modified by a
+-- version of Nix that doesn't know about them.
+
+create table if not exists GCReferrerCounts (
+    id        integer primary key not null,
+    referrers integer not null, -- number of referrers, not counting the path itself
+    foreign key (id) references ValidPaths(id) on delete cascade
+);
+
+create index if not exists IndexUnreferenced on GCReferrerCounts(id) where referrers = 0;
+
+create trigger if not exists GCAddPath after insert on ValidPaths
+  begin
+    insert into GCReferrerCounts (id, referrers) values (new.id, 0);
+  end;
+
+-- References are added with `insert or replace', which doesn't fire
+-- the delete trigger when replacing an existing row, so only count
+-- references that don't exist yet.
+create trigger if not exists GCAddRef before insert on Refs
+  when new.referrer != new.reference
+    and not exists (select 1 from Refs where referrer = new.referrer and reference = new.reference)
+  begin
+    update GCReferrerCounts set referrers = referrers + 1 where id = new.reference;
+  end;
+
+-- This also fires for the references of invalidated paths, which are
+-- removed by the `on delete cascade' of the Refs table.
+create trigger if not exists GCDeleteRef after delete on Refs
+  when old.referrer != old.reference
+  begin
+    update GCReferrerCounts set referrers = referrers - 1 where id = old.reference;
+  end;
+
+-- Initialise the counts of the paths that were registered before the
+-- triggers existed.
+insert or replace into GCReferrerCounts (id, referrers)
+  select id, (select count(*) from Refs where reference = ValidPaths.id and referrer != reference) from ValidPaths;
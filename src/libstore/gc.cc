@@ -4,6 +4,8 @@
 #include "finally.hh"
 #include "unix-domain-socket.hh"
 #include "signals.hh"
+#include "thread-pool.hh"
+#include "runtime-roots.hh"
 
 #if !defined(__linux__)
 // For shelling out to lsof
@@ -326,10 +328,63 @@ static void readProcLink(const std::filesystem::path & file, UncheckedRoots & ro
         roots[buf.string()].emplace(file.string());
 }
 
-static std::string quoteRegexChars(const std::string & raw)
+/* Whitespace as in the `\s` regex character class. */
+static bool isRegexSpace(char c)
 {
-    static auto specialRegex = std::regex(R"([.^$\\*+?()\[\]{}|])");
-    return std::regex_replace(raw, specialRegex, R"(\$&)");
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+std::optional<std::string_view> parseProcMapsLine(std::string_view line)
+{
+    std::string_view fields[6];
+    size_t nrFields = 0, pos = 0;
+
+    while (true) {
+        while (pos < line.size() && isRegexSpace(line[pos])) pos++;
+        if (pos == line.size()) break;
+        if (nrFields == 6) return std::nullopt;
+        auto start = pos;
+        while (pos < line.size() && !isRegexSpace(line[pos])) pos++;
+        fields[nrFields++] = line.substr(start, pos - start);
+    }
+
+    if (nrFields != 6 || fields[5].size() < 2 || fields[5][0] != '/') return std::nullopt;
+
+    return fields[5];
+}
+
+void scanForStorePaths(
+    std::string_view storeDir,
+    std::string_view s,
+    std::function<void(std::string_view)> callback)
+{
+    auto isHashChar = [](char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z');
+    };
+
+    auto isNameChar = [](char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+            || c == '+' || c == '-' || c == '.' || c == '_' || c == '?' || c == '=';
+    };
+
+    size_t pos = 0;
+
+    while (true) {
+        pos = s.find(storeDir, pos);
+        if (pos == s.npos) break;
+
+        auto end = pos + storeDir.size();
+        if (end + 1 >= s.size() || s[end] != '/' || !isHashChar(s[end + 1])) {
+            pos++;
+            continue;
+        }
+
+        end += 2;
+        while (end < s.size() && isNameChar(s[end])) end++;
+
+        callback(s.substr(pos, end - pos));
+        pos = end;
+    }
 }
 
 #if __linux__
@@ -350,58 +405,78 @@ void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
 
     auto procDir = AutoCloseDir{opendir("/proc")};
     if (procDir) {
-        struct dirent * ent;
-        auto digitsRegex = std::regex(R"(^\d+$)");
-        auto mapRegex = std::regex(R"(^\s*\S+\s+\S+\s+\S+\s+\S+\s+\S+\s+(/\S+)\s*$)");
-        auto storePathRegex = std::regex(quoteRegexChars(storeDir) + R"(/[0-9a-z]+[0-9a-zA-Z\+\-\._\?=]*)");
-        while (errno = 0, ent = readdir(procDir.get())) {
-            checkInterrupt();
-            if (std::regex_match(ent->d_name, digitsRegex)) {
-                try {
-                    readProcLink(fmt("/proc/%s/exe" ,ent->d_name), unchecked);
-                    readProcLink(fmt("/proc/%s/cwd", ent->d_name), unchecked);
-
-                    auto fdStr = fmt("/proc/%s/fd", ent->d_name);
-                    auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
-                    if (!fdDir) {
-                        if (errno == ENOENT || errno == EACCES)
-                            continue;
-                        throw SysError("opening %1%", fdStr);
-                    }
-                    struct dirent * fd_ent;
-                    while (errno = 0, fd_ent = readdir(fdDir.get())) {
-                        if (fd_ent->d_name[0] != '.')
-                            readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), unchecked);
-                    }
-                    if (errno) {
-                        if (errno == ESRCH)
-                            continue;
-                        throw SysError("iterating /proc/%1%/fd", ent->d_name);
-                    }
-                    fdDir.reset();
-
-                    std::filesystem::path mapFile = fmt("/proc/%s/maps", ent->d_name);
-                    auto mapLines = tokenizeString<std::vector<std::string>>(readFile(mapFile.string()), "\n");
-                    for (const auto & line : mapLines) {
-                        auto match = std::smatch{};
-                        if (std::regex_match(line, match, mapRegex))
-                            unchecked[match[1]].emplace(mapFile.string());
-                    }
+        /* Scan the processes in parallel, since reading their memory
+           maps can be slow if there are many of them. */
+        Sync<UncheckedRoots> unchecked_;
+        ThreadPool pool;
 
-                    auto envFile = fmt("/proc/%s/environ", ent->d_name);
-                    auto envString = readFile(envFile);
-                    auto env_end = std::sregex_iterator{};
-                    for (auto i = std::sregex_iterator{envString.begin(), envString.end(), storePathRegex}; i != env_end; ++i)
-                        unchecked[i->str()].emplace(envFile);
-                } catch (SystemError & e) {
-                    if (errno == ENOENT || errno == EACCES || errno == ESRCH)
-                        continue;
-                    throw;
+        auto scanProcess = [&](const std::string & pid) {
+            UncheckedRoots unchecked;
+
+            Finally merge([&]() {
+                auto allUnchecked(unchecked_.lock());
+                for (auto & [target, links] : unchecked)
+                    (*allUnchecked)[target].merge(links);
+            });
+
+            try {
+                readProcLink(fmt("/proc/%s/exe" , pid), unchecked);
+                readProcLink(fmt("/proc/%s/cwd", pid), unchecked);
+
+                auto fdStr = fmt("/proc/%s/fd", pid);
+                auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
+                if (!fdDir) {
+                    if (errno == ENOENT || errno == EACCES)
+                        return;
+                    throw SysError("opening %1%", fdStr);
+                }
+                struct dirent * fd_ent;
+                while (errno = 0, fd_ent = readdir(fdDir.get())) {
+                    if (fd_ent->d_name[0] != '.')
+                        readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), unchecked);
+                }
+                if (errno) {
+                    if (errno == ESRCH)
+                        return;
+                    throw SysError("iterating /proc/%1%/fd", pid);
                 }
+                fdDir.reset();
+
+                auto mapFile = fmt("/proc/%s/maps", pid);
+                auto maps = readFile(mapFile);
+                for (size_t pos = 0; pos < maps.size(); ) {
+                    auto eol = maps.find('\n', pos);
+                    if (eol == maps.npos) eol = maps.size();
+                    if (auto file = parseProcMapsLine(std::string_view(maps).substr(pos, eol - pos)))
+                        unchecked[std::string(*file)].emplace(mapFile);
+                    pos = eol + 1;
+                }
+
+                auto envFile = fmt("/proc/%s/environ", pid);
+                auto envString = readFile(envFile);
+                scanForStorePaths(storeDir, envString, [&](std::string_view path) {
+                    unchecked[std::string(path)].emplace(envFile);
+                });
+            } catch (SystemError & e) {
+                if (errno == ENOENT || errno == EACCES || errno == ESRCH)
+                    return;
+                throw;
             }
+        };
+
+        struct dirent * ent;
+        while (errno = 0, ent = readdir(procDir.get())) {
+            checkInterrupt();
+            std::string_view name = ent->d_name;
+            if (!name.empty() && std::all_of(name.begin(), name.end(), [](char c) { return c >= '0' && c <= '9'; }))
+                pool.enqueue(std::bind(scanProcess, std::string(name)));
         }
         if (errno)
             throw SysError("iterating /proc");
+
+        pool.process();
+
+        unchecked = std::move(*unchecked_.lock());
     }
 
 #if !defined(__linux__)
@@ -448,6 +523,98 @@ void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
 struct GCLimitReached { };
 
 
+/**
+ * Runs deletions on a thread pool. Since the garbage collector can
+ * find garbage much faster than it can be deleted, `enqueue()` blocks
+ * while too many work items are pending.
+ *
+ * Errors thrown by work items are rethrown by the next call to
+ * `enqueue()` or by `finish()`. If the queue is destroyed without
+ * calling `finish()` (i.e. because of an exception), it still runs the
+ * work items that are queued, since the paths they delete have already
+ * been invalidated. There are at most `maxQueued` of them.
+ */
+struct DeletionQueue
+{
+    ThreadPool pool;
+
+    size_t maxQueued;
+
+    struct State
+    {
+        size_t queued = 0;
+        std::exception_ptr error;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup;
+
+    static unsigned int threadCount(unsigned int nrThreads)
+    {
+        return nrThreads ? nrThreads : std::max(1U, std::thread::hardware_concurrency());
+    }
+
+    /**
+     * @param nrThreads Number of deletion threads, or 0 for the number
+     * of CPU cores.
+     */
+    DeletionQueue(unsigned int nrThreads)
+        /* The thread pool counts the thread calling `process()` as one
+           of its threads, but we need `nrThreads` threads before that. */
+        : pool(threadCount(nrThreads) + 1)
+        , maxQueued(4 * threadCount(nrThreads))
+    { }
+
+    ~DeletionQueue()
+    {
+        try {
+            pool.process();
+        } catch (...) {
+            ignoreExceptionInDestructor();
+        }
+    }
+
+    void enqueue(std::function<void()> work)
+    {
+        {
+            auto state(state_.lock());
+            while (state->queued >= maxQueued && !state->error)
+                state.wait(wakeup);
+            if (state->error)
+                std::rethrow_exception(state->error);
+            state->queued++;
+        }
+
+        pool.enqueue([this, work{std::move(work)}]() {
+            std::exception_ptr exc;
+            try {
+                work();
+            } catch (...) {
+                exc = std::current_exception();
+            }
+            {
+                auto state(state_.lock());
+                state->queued--;
+                if (exc && !state->error)
+                    state->error = exc;
+            }
+            wakeup.notify_all();
+        });
+    }
+
+    /**
+     * Wait for all work items to finish.
+     */
+    void finish()
+    {
+        pool.process();
+        if (auto error = state_.lock()->error)
+            std::rethrow_exception(error);
+    }
+};
+
+
 void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 {
     bool shouldDelete = options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific;
@@ -465,6 +632,10 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         // Hash part of the store path currently being deleted, if
         // any.
         std::optional<std::string> pending;
+
+        // Hash parts of the store paths that have been handed to the
+        // deletion threads but haven't been deleted yet.
+        std::unordered_set<std::string> deleting;
     };
 
     Sync<Shared> _shared;
@@ -578,7 +749,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                                    done. FIXME: ideally we would use a
                                    FD for this so we don't block the
                                    poll loop. */
-                                while (shared->pending == hashPart) {
+                                while (shared->pending == hashPart || shared->deleting.count(hashPart)) {
                                     debug("synchronising with deletion of path '%s'", path);
                                     shared.wait(wakeup);
                                 }
@@ -627,8 +798,22 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     if (auto p = getEnv("_NIX_TEST_GC_SYNC_2"))
         readFile(*p);
 
+    /* If we bail out, wake up any GC client waiting for the deletion
+       of a path that will now not be deleted. */
+    Finally releaseDeleting([&]() {
+        auto shared(_shared.lock());
+        shared->deleting.clear();
+        wakeup.notify_all();
+    });
+
+    /* Deciding which paths are garbage has to happen serially, but
+       the actual deletion can be done in parallel. */
+    DeletionQueue deletionQueue(settings.gcThreads);
+
     /* Helper function that deletes a path from the store and throws
-       GCLimitReached if we've deleted enough garbage. */
+       GCLimitReached if we've deleted enough garbage. Since paths are
+       deleted asynchronously, we may go over the limit by the size of
+       the deletions that are in progress. */
     auto deleteFromStore = [&](std::string_view baseName)
     {
         Path path = storeDir + "/" + std::string(baseName);
@@ -645,19 +830,37 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
             }
         }
 
+        {
+            auto shared(_shared.lock());
+            if (results.bytesFreed > options.maxFreed) {
+                printInfo("deleted more than %d bytes; stopping", options.maxFreed);
+                throw GCLimitReached();
+            }
+        }
+
         printInfo("deleting '%1%'", path);
 
         results.paths.insert(path);
 
-        uint64_t bytesFreed;
-        deleteStorePath(realPath, bytesFreed);
+        std::optional<std::string> hashPart;
+        if (auto storePath = maybeParseStorePath(path)) {
+            hashPart = std::string(storePath->hashPart());
+            _shared.lock()->deleting.insert(*hashPart);
+        }
 
-        results.bytesFreed += bytesFreed;
+        deletionQueue.enqueue([&, realPath, hashPart]() {
+            uint64_t bytesFreed = 0;
 
-        if (results.bytesFreed > options.maxFreed) {
-            printInfo("deleted more than %d bytes; stopping", options.maxFreed);
-            throw GCLimitReached();
-        }
+            Finally done([&]() {
+                auto shared(_shared.lock());
+                results.bytesFreed += bytesFreed;
+                if (hashPart)
+                    shared->deleting.erase(*hashPart);
+                wakeup.notify_all();
+            });
+
+            deleteStorePath(realPath, bytesFreed);
+        });
     };
 
     std::map<StorePath, StorePathSet> referrersCache;
@@ -796,6 +999,32 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
             printInfo("determining live/dead paths...");
 
         try {
+            /* Whether every valid path that is still in the database
+               is known to be alive. */
+            bool allValidAlive = false;
+
+            /* Start with the paths that have no referrers, which are
+               garbage unless they are (reachable from) a root in some
+               other way. Deleting them may leave their references
+               without referrers, so repeat until there are no new
+               candidates. Since the graph of references is acyclic,
+               all remaining valid paths are then referenced by an
+               alive path, and so are alive themselves. This frees
+               garbage without visiting every path in the store, which
+               matters if `maxFreed` is reached quickly. */
+            if (shouldDelete && !readOnly) {
+                while (true) {
+                    bool found = false;
+                    for (auto & path : queryUnreferencedPaths()) {
+                        if (alive.count(path) || dead.count(path)) continue;
+                        found = true;
+                        deleteReferrersClosure(path);
+                    }
+                    if (!found) break;
+                }
+                allValidAlive = true;
+            }
+
             AutoCloseDir dir(opendir(realStoreDir.get().c_str()));
             if (!dir) throw SysError("opening directory '%1%'", realStoreDir);
 
@@ -810,9 +1039,14 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                 std::string name = dirent->d_name;
                 if (name == "." || name == ".." || name == linksName) continue;
 
-                if (auto storePath = maybeParseStorePath(storeDir + "/" + name))
+                if (auto storePath = maybeParseStorePath(storeDir + "/" + name)) {
+                    /* What remains to be deleted are paths that are
+                       not in the database, i.e. invalid paths and
+                       those of an underlying store. */
+                    if (allValidAlive && isValidPath_(*_state.lock(), *storePath))
+                        continue;
                     deleteReferrersClosure(*storePath);
-                else
+                } else
                     deleteFromStore(name);
 
             }
@@ -820,6 +1054,10 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         }
     }
 
+    /* Wait for the deletions to finish, so that `results.bytesFreed`
+       is accurate and the link counts in `linksDir` are up to date. */
+    deletionQueue.finish();
+
     if (options.action == GCOptions::gcReturnLive) {
         for (auto & i : alive)
             results.paths.insert(printStorePath(i));
@@ -843,31 +1081,59 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
         AutoCloseDir dir(opendir(linksDir.c_str()));
         if (!dir) throw SysError("opening directory '%1%'", linksDir);
 
-        int64_t actualSize = 0, unsharedSize = 0;
+        std::atomic<int64_t> actualSize{0}, unsharedSize{0};
+
+        /* The directory can contain millions of links, so stat and
+           unlink them in batches on the deletion threads while we're
+           reading it. */
+        DeletionQueue linksQueue(settings.gcThreads);
+
+        auto sweepLinks = [&](std::vector<std::string> names) {
+            linksQueue.enqueue([&, names{std::move(names)}]() {
+                int64_t actual = 0, unshared = 0;
 
+                for (auto & name : names) {
+                    checkInterrupt();
+                    Path path = linksDir + "/" + name;
+
+                    auto st = lstat(path);
+
+                    if (st.st_nlink != 1) {
+                        actual += st.st_size;
+                        unshared += (st.st_nlink - 1) * st.st_size;
+                        continue;
+                    }
+
+                    printMsg(lvlTalkative, "deleting unused link '%1%'", path);
+
+                    if (unlink(path.c_str()) == -1)
+                        throw SysError("deleting '%1%'", path);
+
+                    /* Do not account for deleted file here. Rely on deletePath()
+                       accounting.  */
+                }
+
+                actualSize += actual;
+                unsharedSize += unshared;
+            });
+        };
+
+        std::vector<std::string> names;
         struct dirent * dirent;
         while (errno = 0, dirent = readdir(dir.get())) {
             checkInterrupt();
             std::string name = dirent->d_name;
             if (name == "." || name == "..") continue;
-            Path path = linksDir + "/" + name;
-
-            auto st = lstat(path);
-
-            if (st.st_nlink != 1) {
-                actualSize += st.st_size;
-                unsharedSize += (st.st_nlink - 1) * st.st_size;
-                continue;
-            }
-
-            printMsg(lvlTalkative, "deleting unused link '%1%'", path);
+            names.push_back(std::move(name));
+            if (names.size() >= 1024)
+                sweepLinks(std::exchange(names, {}));
+        }
+        if (errno) throw SysError("reading directory '%1%'", linksDir);
 
-            if (unlink(path.c_str()) == -1)
-                throw SysError("deleting '%1%'", path);
+        if (!names.empty())
+            sweepLinks(std::move(names));
 
-            /* Do not account for deleted file here. Rely on deletePath()
-               accounting.  */
-        }
+        linksQueue.finish();
 
         struct stat st;
         if (stat(linksDir.c_str(), &st) == -1)
@@ -297,6 +297,30 @@ template<> void BaseSetting<SandboxMode>::convertToArg(Args & args, const std::s
     });
 }
 
+NLOHMANN_JSON_SERIALIZE_ENUM(OptimiseStoreMethod, {
+    {OptimiseStoreMethod::HardLink, "hardlink"},
+    {OptimiseStoreMethod::Reflink, "reflink"},
+});
+
+template<> OptimiseStoreMethod BaseSetting<OptimiseStoreMethod>::parse(const std::string & str) const
+{
+    if (str == "hardlink") return OptimiseStoreMethod::HardLink;
+    else if (str == "reflink") return OptimiseStoreMethod::Reflink;
+    else throw UsageError("option '%s' has invalid value '%s'", name, str);
+}
+
+template<> struct BaseSetting<OptimiseStoreMethod>::trait
+{
+    static constexpr bool appendable = false;
+};
+
+template<> std::string BaseSetting<OptimiseStoreMethod>::to_string() const
+{
+    if (value == OptimiseStoreMethod::HardLink) return "hardlink";
+    else if (value == OptimiseStoreMethod::Reflink) return "reflink";
+    else unreachable();
+}
+
 unsigned int MaxBuildJobsSetting::parse(const std::string & str) const
 {
     if (str == "auto") return std::max(1U, std::thread::hardware_concurrency());
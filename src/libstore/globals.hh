@@ -16,6 +16,8 @@ namespace nix {
 
 typedef enum { smEnabled, smRelaxed, smDisabled } SandboxMode;
 
+enum struct OptimiseStoreMethod { HardLink, Reflink };
+
 struct MaxBuildJobsSetting : public BaseSetting<unsigned int>
 {
     MaxBuildJobsSetting(Config * options,
@@ -499,6 +501,22 @@ public:
         )"};
     #endif
 
+    Setting<unsigned int> daemonPreforkedWorkers{
+        this, 0, "daemon-preforked-workers",
+        R"(
+          The number of idle worker processes that the Nix daemon keeps ready to handle new connections.
+
+          By default (`0`), the daemon forks a process for each connection after accepting it, and that process then opens the Nix store.
+          With a positive value, the daemon forks this many workers in advance, each of which waits for a connection and only then opens the store.
+          As soon as a worker takes a connection, the daemon forks a replacement.
+          This takes `fork()` off the critical path of clients, which matters when many short-lived clients connect in quick succession.
+          Idle workers don't hold any locks or database handles of the store.
+
+          Every connection is still served by its own process, so client settings and trust are handled exactly as before.
+          This also means that each connection still opens the store and starts with an empty path info cache:
+          the daemon doesn't serve several connections from one process with a shared store.
+        )"};
+
     Setting<bool> impersonateLinux26{this, false, "impersonate-linux-26",
         "Whether to impersonate a Linux 2.6 machine on newer kernels.",
         {"build-impersonate-linux-26"}};
@@ -576,6 +594,24 @@ public:
           duplicate files.
         )"};
 
+    Setting<OptimiseStoreMethod> optimiseStoreMethod{
+        this, OptimiseStoreMethod::HardLink, "optimise-store-method",
+        R"(
+          How [`auto-optimise-store`](#conf-auto-optimise-store) and
+          `nix-store --optimise` deduplicate files with identical contents:
+
+          - `hardlink` (the default): replace them with hard links to a
+            single copy, which is kept in `/nix/store/.links`.
+
+          - `reflink`: replace them with copies that share their data on
+            disk ("reflinks"). This requires Linux and a file system that
+            supports reflinks, such as Btrfs or XFS; files on other file
+            systems are left alone. The hashes of the files are recorded
+            in the Nix database, so optimising a new store path only has
+            to hash that path, and the garbage collector doesn't have to
+            scan `/nix/store/.links` for unused links.
+        )"};
+
     Setting<bool> envKeepDerivations{
         this, false, "keep-env-derivations",
         R"(
@@ -1147,9 +1183,27 @@ public:
     Setting<uint64_t> minFreeCheckInterval{this, 5, "min-free-check-interval",
         "Number of seconds between checking free disk space."};
 
+    Setting<unsigned int> gcThreads{
+        this, 0, "gc-threads",
+        R"(
+          The number of threads that the garbage collector uses to delete
+          store paths and unused links in `/nix/store/.links`. Which paths
+          are garbage is still decided by a single thread. `0` means the
+          number of CPU cores.
+        )"};
+
     Setting<size_t> narBufferSize{this, 32 * 1024 * 1024, "nar-buffer-size",
         "Maximum size of NARs before spilling them to disk."};
 
+    Setting<uint64_t> copyMemoryBudget{
+        this, 1024 * 1024 * 1024, "copy-memory-budget",
+        R"(
+          When copying paths to a store that adds them in parallel (such as
+          a binary cache), the maximum total NAR size, in bytes, of the
+          paths that are being added at the same time. A path larger than
+          this is added on its own. `0` means no limit.
+        )"};
+
     Setting<bool> allowSymlinkedStore{
         this, false, "allow-symlinked-store",
         R"(
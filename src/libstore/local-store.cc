@@ -91,6 +91,10 @@ struct LocalStore::State::Stmts {
     SQLiteStmt QueryAllRealisedOutputs;
     SQLiteStmt QueryPathFromHashPart;
     SQLiteStmt QueryValidPaths;
+    SQLiteStmt QueryUnreferencedPaths;
+    SQLiteStmt AddOptimisedFile;
+    SQLiteStmt QueryOptimisedFiles;
+    SQLiteStmt QueryOptimisedFileByHash;
     SQLiteStmt QueryRealisationReferences;
     SQLiteStmt AddRealisationReference;
 };
@@ -140,6 +144,41 @@ void migrateCASchema(SQLite& db, Path schemaPath, AutoCloseFD& lockFd)
     }
 }
 
+/**
+ * Apply an extension of the SQL schema that doesn't need any
+ * migration beyond creating it, recording its version in
+ * `schemaPath`.
+ */
+static void migrateSchemaExtension(SQLite & db, Path schemaPath, AutoCloseFD & lockFd,
+    std::string_view name, const char * schema)
+{
+    const int schemaVersion = 1;
+    int curSchema = getSchema(schemaPath);
+    if (curSchema != schemaVersion) {
+        if (curSchema > schemaVersion) {
+            throw Error("current Nix store %1% is version %2%, but I only support %3%",
+                 name, curSchema, schemaVersion);
+        }
+
+        if (!lockFile(lockFd.get(), ltWrite, false)) {
+            printInfo("waiting for exclusive access to the Nix store...");
+            lockFile(lockFd.get(), ltNone, false); // We have acquired a shared lock; release it to prevent deadlocks
+            lockFile(lockFd.get(), ltWrite, true);
+        }
+
+        /* Get the schema version again, because another process may
+           have performed the upgrade already. */
+        if (getSchema(schemaPath) == 0) {
+            SQLiteTxn txn(db);
+            db.exec(schema);
+            txn.commit();
+        }
+
+        writeFile(schemaPath, fmt("%d", schemaVersion), 0666, true);
+        lockFile(lockFd.get(), ltRead, true);
+    }
+}
+
 LocalStore::LocalStore(
     std::string_view scheme,
     PathView path,
@@ -342,6 +381,20 @@ LocalStore::LocalStore(
 
     else openDB(*state, false);
 
+    if (!readOnly) {
+        /* The referrer counts used by the garbage collector. */
+        static const char gcSchema[] =
+          #include "gc-schema.sql.gen.hh"
+            ;
+        migrateSchemaExtension(state->db, dbDir + "/gc-schema", globalLock, "gc-schema", gcSchema);
+
+        /* The file hashes used by reflink-based optimisation. */
+        static const char optimiseSchema[] =
+          #include "optimise-schema.sql.gen.hh"
+            ;
+        migrateSchemaExtension(state->db, dbDir + "/optimise-schema", globalLock, "optimise-schema", optimiseSchema);
+    }
+
     if (experimentalFeatureSettings.isEnabled(Xp::CaDerivations)) {
         if (!readOnly) {
             migrateCASchema(state->db, dbDir + "/ca-schema", globalLock);
@@ -376,6 +429,16 @@ LocalStore::LocalStore(
     state->stmts->QueryPathFromHashPart.create(state->db,
         "select path from ValidPaths where path >= ? limit 1;");
     state->stmts->QueryValidPaths.create(state->db, "select path from ValidPaths");
+    if (!readOnly) {
+        state->stmts->QueryUnreferencedPaths.create(state->db,
+            "select path from GCReferrerCounts join ValidPaths using (id) where referrers = 0;");
+        state->stmts->AddOptimisedFile.create(state->db,
+            "insert or replace into OptimisedFiles (path, name, hash) values (?, ?, ?);");
+        state->stmts->QueryOptimisedFiles.create(state->db,
+            "select name, hash from OptimisedFiles where path = ?;");
+        state->stmts->QueryOptimisedFileByHash.create(state->db,
+            "select v.path, f.name from OptimisedFiles f join ValidPaths v on f.path = v.id where f.hash = ? limit 1;");
+    }
     if (experimentalFeatureSettings.isEnabled(Xp::CaDerivations)) {
         state->stmts->RegisterRealisedOutput.create(state->db,
             R"(
@@ -705,11 +768,8 @@ uint64_t LocalStore::addValidPath(State & state,
         }
     }
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.upsert(std::string(info.path.to_string()),
-            PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
-    }
+    pathInfoCache.upsert(info.path,
+        PathInfoCacheValue{ .value = std::make_shared<const ValidPathInfo>(info) });
 
     return id;
 }
@@ -834,6 +894,84 @@ StorePathSet LocalStore::queryAllValidPaths()
 }
 
 
+StorePathSet LocalStore::queryUnreferencedPaths()
+{
+    return retrySQLite<StorePathSet>([&]() {
+        auto state(_state.lock());
+        auto use(state->stmts->QueryUnreferencedPaths.use());
+        StorePathSet res;
+        while (use.next()) res.insert(parseStorePath(use.getStr(0)));
+        return res;
+    });
+}
+
+
+/**
+ * The file hashes in the OptimisedFiles table are SHA-256 NAR hashes,
+ * stored as blobs.
+ */
+static Hash fileHashFromBlob(std::string_view blob)
+{
+    Hash hash(HashAlgorithm::SHA256);
+    if (blob.size() != hash.hashSize)
+        throw Error("invalid file hash in the Nix database");
+    memcpy(hash.hash, blob.data(), blob.size());
+    return hash;
+}
+
+
+LocalStore::FileHashes LocalStore::queryOptimisedFiles(const StorePath & path)
+{
+    return retrySQLite<FileHashes>([&]() {
+        auto state(_state.lock());
+        FileHashes res;
+        if (!isValidPath_(*state, path)) return res;
+        auto use(state->stmts->QueryOptimisedFiles.use()(queryValidPathId(*state, path)));
+        while (use.next())
+            res.insert_or_assign(CanonPath(use.getStr(0)), fileHashFromBlob(use.getBlob(1)));
+        return res;
+    });
+}
+
+
+std::optional<Path> LocalStore::queryOptimisedFileByHash(const Hash & hash)
+{
+    return retrySQLite<std::optional<Path>>([&]() -> std::optional<Path> {
+        auto state(_state.lock());
+        auto use(state->stmts->QueryOptimisedFileByHash.use()(hash.hash, hash.hashSize));
+        if (!use.next()) return std::nullopt;
+        auto name = use.getStr(1);
+        return realStoreDir + "/" + std::string(baseNameOf(use.getStr(0))) + (name == "/" ? "" : name);
+    });
+}
+
+
+void LocalStore::addOptimisedFiles(const StorePath & path, const FileHashes & fileHashes)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        /* The path may have been garbage-collected in the meantime. */
+        if (!isValidPath_(*state, path)) return;
+        SQLiteTxn txn(state->db);
+        addOptimisedFiles(*state, queryValidPathId(*state, path), fileHashes);
+        txn.commit();
+    });
+}
+
+
+void LocalStore::addOptimisedFiles(State & state, uint64_t id, const FileHashes & fileHashes)
+{
+    for (auto & [name, hash] : fileHashes) {
+        assert(hash.algo == HashAlgorithm::SHA256);
+        state.stmts->AddOptimisedFile.use()
+            (id)
+            (name.abs())
+            (hash.hash, hash.hashSize)
+            .exec();
+    }
+}
+
+
 void LocalStore::queryReferrers(State & state, const StorePath & path, StorePathSet & referrers)
 {
     auto useQueryReferrers(state.stmts->QueryReferrers.use()(printStorePath(path)));
@@ -1015,10 +1153,7 @@ void LocalStore::invalidatePath(State & state, const StorePath & path)
     /* Note that the foreign key constraints on the Refs table take
        care of deleting the references entries for `path'. */
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.erase(std::string(path.to_string()));
-    }
+    pathInfoCache.erase(path);
 }
 
 const PublicKeys & LocalStore::getPublicKeys()
@@ -1084,8 +1219,18 @@ void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
 
                 TeeSource wrapperSource { source, hashSink };
 
+                /* If the path is going to be optimised, also hash the
+                   individual files, so that optimisePath() doesn't
+                   have to read them again. */
+                RestoreSink restoreSink{settings.fsyncStorePaths};
+                restoreSink.dstPath = realPath;
+                FileHashingSink fileHashingSink{restoreSink};
+
                 narRead = true;
-                restorePath(realPath, wrapperSource, settings.fsyncStorePaths);
+                if (settings.autoOptimiseStore)
+                    parseDump(fileHashingSink, wrapperSource);
+                else
+                    parseDump(restoreSink, wrapperSource);
 
                 auto hashResult = hashSink.finish();
 
@@ -1137,7 +1282,7 @@ void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
 
                 canonicalisePathMetaData(realPath);
 
-                optimisePath(realPath, repair); // FIXME: combine with hashPath()
+                auto fileHashes = optimisePath(realPath, repair, &fileHashingSink.fileHashes);
 
                 if (settings.fsyncStorePaths) {
                     recursiveSync(realPath);
@@ -1145,6 +1290,7 @@ void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
                 }
 
                 registerValidPath(info);
+                addOptimisedFiles(info.path, fileHashes);
             }
 
             outputLock.setDeletion(true);
@@ -1298,7 +1444,7 @@ StorePath LocalStore::addToStoreFromDump(
 
             canonicalisePathMetaData(realPath); // FIXME: merge into restorePath
 
-            optimisePath(realPath, repair);
+            auto fileHashes = optimisePath(realPath, repair);
 
             if (settings.fsyncStorePaths) {
                 recursiveSync(realPath);
@@ -1313,6 +1459,7 @@ StorePath LocalStore::addToStoreFromDump(
             };
             info.narSize = narHash.second;
             registerValidPath(info);
+            addOptimisedFiles(info.path, fileHashes);
         }
 
         outputLock.setDeletion(true);
@@ -77,6 +77,14 @@ class LocalStore : public virtual LocalStoreConfig
     , public virtual IndirectRootStore
     , public virtual GcStore
 {
+public:
+
+    /**
+     * The NAR hashes of the regular files and symlinks in a path, keyed
+     * on their path relative to it.
+     */
+    typedef std::map<CanonPath, Hash> FileHashes;
+
 private:
 
     /**
@@ -265,9 +273,20 @@ public:
 
     /**
      * Optimise a single store path. Optionally, test the encountered
-     * symlinks for corruption.
+     * symlinks for corruption. If `knownHashes` is given, the files
+     * listed in it are not read again to compute their hashes.
+     *
+     * With `optimise-store-method = reflink`, returns the hashes of the
+     * files, which the caller should record with `addOptimisedFiles()`
+     * once the path is valid.
      */
-    void optimisePath(const Path & path, RepairFlag repair);
+    FileHashes optimisePath(const Path & path, RepairFlag repair, const FileHashes * knownHashes = nullptr);
+
+    /**
+     * Record the hashes of files in `path` in the database. Nothing is
+     * recorded if the path isn't valid.
+     */
+    void addOptimisedFiles(const StorePath & path, const FileHashes & fileHashes);
 
     bool verifyStore(bool checkContents, RepairFlag repair) override;
 
@@ -388,7 +407,45 @@ private:
 
     InodeHash loadInodeHash();
     Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
-    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash, RepairFlag repair);
+    void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash, RepairFlag repair,
+        const FileHashes * knownHashes = nullptr, const CanonPath & relPath = CanonPath::root);
+
+    /**
+     * Deduplicate the files in `storePath` by replacing them with
+     * reflinks to files with the same contents elsewhere in the store,
+     * which are found through the file hashes in the database.
+     * Returns the hashes of the files that aren't in the database yet.
+     */
+    FileHashes optimisePathReflink(Activity * act, OptimiseStats & stats, const StorePath & storePath,
+        const FileHashes * knownHashes = nullptr);
+
+    /**
+     * Atomically replace `path` by a reflink to `source`. Returns false
+     * if that isn't possible, e.g. because the file system doesn't
+     * support reflinks.
+     */
+    bool reflinkFile(const Path & source, const Path & path, const struct stat & st);
+
+    /**
+     * Return the valid paths that have no referrers other than
+     * themselves, using the referrer counts in the database. Only
+     * available if the store is not read-only.
+     */
+    StorePathSet queryUnreferencedPaths();
+
+    /**
+     * Return the files in `path` whose hashes are recorded in the
+     * database, for reflink-based optimisation.
+     */
+    FileHashes queryOptimisedFiles(const StorePath & path);
+
+    /**
+     * Return a file in the store that has NAR hash `hash` according to
+     * the database.
+     */
+    std::optional<Path> queryOptimisedFileByHash(const Hash & hash);
+
+    void addOptimisedFiles(State & state, uint64_t id, const FileHashes & fileHashes);
 
     // Internal versions that are not wrapped in retry_sqlite.
     bool isValidPath_(State & state, const StorePath & path);
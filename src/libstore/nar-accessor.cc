@@ -1,197 +1,399 @@
 #include "nar-accessor.hh"
 #include "archive.hh"
+#include "file-system.hh"
+#include "signals.hh"
 
-#include <map>
-#include <stack>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
 
 #include <nlohmann/json.hpp>
 
 namespace nix {
 
-struct NarMember
+/**
+ * A NAR index is a flat table of the file system objects in a NAR. It
+ * consists of a `NarIndexHeader`, followed by the entries, followed by
+ * a string table containing file names and symlink targets. The
+ * entries are laid out such that the children of each directory are
+ * contiguous and sorted by name, so looking up a path is a binary
+ * search per path component. The root is the first entry.
+ *
+ * Since the index is only a local cache, it uses the host byte order.
+ */
+struct NarIndexHeader
 {
-    SourceAccessor::Stat stat;
+    char magic[8];
+
+    /**
+     * The size of the indexed NAR, to detect stale indices. 0 if
+     * unknown.
+     */
+    uint64_t narSize;
 
-    std::string target;
+    uint64_t nrEntries;
 
-    /* If this is a directory, all the children of the directory. */
-    std::map<std::string, NarMember> children;
+    uint64_t namesSize;
 };
 
-struct NarMemberConstructor : CreateRegularFileSink
+struct NarIndexEntry
 {
-private:
+    /**
+     * For regular files, the offset of the contents in the NAR. For
+     * symlinks, the offset of the target in the string table.
+     */
+    uint64_t offset;
 
-    NarMember & narMember;
+    /**
+     * For regular files, the size of the file. For symlinks, the
+     * length of the target. For directories, the number of children.
+     */
+    uint64_t size;
 
-    uint64_t & pos;
+    uint64_t nameOffset;
 
-public:
+    uint32_t nameLength;
 
-    NarMemberConstructor(NarMember & nm, uint64_t & pos)
-        : narMember(nm), pos(pos)
-    { }
+    /**
+     * For directories, the index of the first child.
+     */
+    uint32_t firstChild;
 
-    void isExecutable() override
-    {
-        narMember.stat.isExecutable = true;
-    }
+    uint8_t type;
 
-    void preallocateContents(uint64_t size) override
-    {
-        narMember.stat.fileSize = size;
-        narMember.stat.narOffset = pos;
-    }
+    uint8_t isExecutable;
 
-    void operator () (std::string_view data) override
-    { }
+    uint8_t padding[6];
 };
 
-struct NarAccessor : public SourceAccessor
+static_assert(sizeof(NarIndexHeader) == 32);
+static_assert(sizeof(NarIndexEntry) == 40);
+
+static constexpr char narIndexMagic[8] = {'N', 'A', 'R', 'I', 'D', 'X', '0', '1'};
+
+/**
+ * Collects the entries of a NAR in depth-first order, and turns them
+ * into a NAR index.
+ */
+struct NarIndexBuilder
 {
-    std::optional<const std::string> nar;
+    static constexpr uint32_t noParent = std::numeric_limits<uint32_t>::max();
 
-    GetNarBytes getNarBytes;
+    std::vector<NarIndexEntry> entries;
+
+    std::vector<uint32_t> parents;
 
-    NarMember root;
+    std::string names;
 
-    struct NarIndexer : FileSystemObjectSink, Source
+    /**
+     * The entry that was added last, and its ancestors.
+     */
+    std::vector<uint32_t> stack;
+
+    uint64_t addString(std::string_view s)
     {
-        NarAccessor & acc;
-        Source & source;
+        auto offset = names.size();
+        names.append(s);
+        return offset;
+    }
 
-        std::stack<NarMember *> parents;
+    uint32_t add(const CanonPath & path, SourceAccessor::Type type)
+    {
+        size_t level = 0;
+        for (auto _ : path) {
+            (void)_;
+            ++level;
+        }
 
-        bool isExec = false;
+        if (stack.size() > level) stack.resize(level);
 
-        uint64_t pos = 0;
+        if (stack.size() != level
+            || (level == 0 && !entries.empty())
+            || (level > 0 && entries[stack.back()].type != SourceAccessor::Type::tDirectory))
+            throw Error("NAR file missing parent directory of path '%s'", path);
 
-        NarIndexer(NarAccessor & acc, Source & source)
-            : acc(acc), source(source)
-        { }
+        if (entries.size() >= noParent)
+            throw Error("NAR file has too many entries");
 
-        NarMember & createMember(const CanonPath & path, NarMember member)
-        {
-            size_t level = 0;
-            for (auto _ : path) {
-                (void)_;
-                ++level;
-            }
+        auto name = path.baseName().value_or("");
 
-            while (parents.size() > level) parents.pop();
-
-            if (parents.empty()) {
-                acc.root = std::move(member);
-                parents.push(&acc.root);
-                return acc.root;
-            } else {
-                if (parents.top()->stat.type != Type::tDirectory)
-                    throw Error("NAR file missing parent directory of path '%s'", path);
-                auto result = parents.top()->children.emplace(*path.baseName(), std::move(member));
-                auto & ref = result.first->second;
-                parents.push(&ref);
-                return ref;
-            }
-        }
+        NarIndexEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.type = type;
+        entry.nameOffset = addString(name);
+        entry.nameLength = name.size();
+
+        uint32_t n = entries.size();
+        entries.push_back(entry);
+        parents.push_back(level ? stack.back() : noParent);
+        stack.push_back(n);
+        return n;
+    }
+
+    void addSymlink(const CanonPath & path, std::string_view target)
+    {
+        auto n = add(path, SourceAccessor::Type::tSymlink);
+        entries[n].offset = addString(target);
+        entries[n].size = target.size();
+    }
+
+    std::string finish(uint64_t narSize)
+    {
+        if (entries.empty())
+            throw Error("NAR file is empty");
 
-        void createDirectory(const CanonPath & path) override
+        uint32_t nrEntries = entries.size();
+
+        /* Group the children of each directory, i.e. the children of
+           entry `i` are `children[start[i]..start[i + 1]]`. */
+        std::vector<uint32_t> start(nrEntries + 1, 0);
+        for (uint32_t i = 1; i < nrEntries; ++i)
+            start[parents[i] + 1]++;
+        for (uint32_t i = 0; i < nrEntries; ++i)
+            start[i + 1] += start[i];
+
+        std::vector<uint32_t> children(nrEntries);
         {
-            createMember(path, NarMember{ .stat = {
-                .type = Type::tDirectory,
-                .fileSize = 0,
-                .isExecutable = false,
-                .narOffset = 0
-            } });
+            auto pos = start;
+            for (uint32_t i = 1; i < nrEntries; ++i)
+                children[pos[parents[i]]++] = i;
         }
 
-        void createRegularFile(const CanonPath & path, std::function<void(CreateRegularFileSink &)> func) override
-        {
-            auto & nm = createMember(path, NarMember{ .stat = {
-                .type = Type::tRegular,
-                .fileSize = 0,
-                .isExecutable = false,
-                .narOffset = 0
-            } });
-            NarMemberConstructor nmc { nm, pos };
-            func(nmc);
+        auto name = [&](uint32_t i) {
+            return std::string_view(names).substr(entries[i].nameOffset, entries[i].nameLength);
+        };
+
+        /* Assign positions breadth-first, so that the children of
+           each directory are contiguous. */
+        std::vector<uint32_t> order;
+        order.reserve(nrEntries);
+        order.push_back(0);
+        for (size_t j = 0; j < order.size(); ++j) {
+            auto i = order[j];
+            /* NAR directories are already sorted, except for names
+               that got case-hacked. */
+            std::sort(children.begin() + start[i], children.begin() + start[i + 1],
+                [&](uint32_t a, uint32_t b) { return name(a) < name(b); });
+            order.insert(order.end(), children.begin() + start[i], children.begin() + start[i + 1]);
+        }
+
+        std::vector<uint32_t> position(nrEntries);
+        for (uint32_t j = 0; j < nrEntries; ++j)
+            position[order[j]] = j;
+
+        NarIndexHeader header;
+        memcpy(header.magic, narIndexMagic, sizeof(header.magic));
+        header.narSize = narSize;
+        header.nrEntries = nrEntries;
+        header.namesSize = names.size();
+
+        std::string res;
+        res.reserve(sizeof(header) + nrEntries * sizeof(NarIndexEntry) + names.size());
+        res.append((const char *) &header, sizeof(header));
+
+        for (auto i : order) {
+            auto entry = entries[i];
+            if (entry.type == SourceAccessor::Type::tDirectory) {
+                entry.size = start[i + 1] - start[i];
+                entry.firstChild = entry.size ? position[children[start[i]]] : 0;
+            }
+            res.append((const char *) &entry, sizeof(entry));
         }
 
-        void createSymlink(const CanonPath & path, const std::string & target) override
+        res.append(names);
+
+        return res;
+    }
+};
+
+struct NarIndexer : FileSystemObjectSink, Source
+{
+    NarIndexBuilder & builder;
+    Source & source;
+
+    uint64_t pos = 0;
+
+    NarIndexer(NarIndexBuilder & builder, Source & source)
+        : builder(builder), source(source)
+    { }
+
+    struct RegularFileIndexer : CreateRegularFileSink
+    {
+        NarIndexEntry & entry;
+        uint64_t & pos;
+
+        RegularFileIndexer(NarIndexEntry & entry, uint64_t & pos)
+            : entry(entry), pos(pos)
+        { }
+
+        void isExecutable() override
         {
-            createMember(path,
-                NarMember{
-                    .stat = {.type = Type::tSymlink},
-                    .target = target});
+            entry.isExecutable = true;
         }
 
-        size_t read(char * data, size_t len) override
+        void preallocateContents(uint64_t size) override
         {
-            auto n = source.read(data, len);
-            pos += n;
-            return n;
+            entry.size = size;
+            entry.offset = pos;
         }
+
+        void operator () (std::string_view data) override
+        { }
     };
 
-    NarAccessor(std::string && _nar) : nar(_nar)
+    void createDirectory(const CanonPath & path) override
     {
-        StringSource source(*nar);
-        NarIndexer indexer(*this, source);
-        parseDump(indexer, indexer);
+        builder.add(path, SourceAccessor::Type::tDirectory);
     }
 
-    NarAccessor(Source & source)
+    void createRegularFile(const CanonPath & path, std::function<void(CreateRegularFileSink &)> func) override
     {
-        NarIndexer indexer(*this, source);
-        parseDump(indexer, indexer);
+        auto n = builder.add(path, SourceAccessor::Type::tRegular);
+        RegularFileIndexer indexer(builder.entries[n], pos);
+        func(indexer);
     }
 
-    NarAccessor(const std::string & listing, GetNarBytes getNarBytes)
-        : getNarBytes(getNarBytes)
+    void createSymlink(const CanonPath & path, const std::string & target) override
     {
-        using json = nlohmann::json;
-
-        std::function<void(NarMember &, json &)> recurse;
-
-        recurse = [&](NarMember & member, json & v) {
-            std::string type = v["type"];
-
-            if (type == "directory") {
-                member.stat = {.type = Type::tDirectory};
-                for (const auto &[name, function] : v["entries"].items()) {
-                    recurse(member.children[name], function);
-                }
-            } else if (type == "regular") {
-                member.stat = {
-                    .type = Type::tRegular,
-                    .fileSize = v["size"],
-                    .isExecutable = v.value("executable", false),
-                    .narOffset = v["narOffset"]
-                };
-            } else if (type == "symlink") {
-                member.stat = {.type = Type::tSymlink};
-                member.target = v.value("target", "");
-            } else return;
-        };
+        builder.addSymlink(path, target);
+    }
 
-        json v = json::parse(listing);
-        recurse(root, v);
+    size_t read(char * data, size_t len) override
+    {
+        auto n = source.read(data, len);
+        pos += n;
+        return n;
     }
+};
+
+std::string makeNarIndex(Source & source)
+{
+    NarIndexBuilder builder;
+    NarIndexer indexer(builder, source);
+    parseDump(indexer, indexer);
+    return builder.finish(indexer.pos);
+}
+
+static std::string makeNarIndexFromListing(const std::string & listing)
+{
+    using json = nlohmann::json;
+
+    NarIndexBuilder builder;
+
+    std::function<void(const CanonPath &, const json &)> recurse;
+
+    recurse = [&](const CanonPath & path, const json & v) {
+        std::string type = v["type"];
+
+        if (type == "directory") {
+            builder.add(path, SourceAccessor::Type::tDirectory);
+            for (const auto & [name, entry] : v["entries"].items())
+                recurse(path / name, entry);
+        } else if (type == "regular") {
+            auto n = builder.add(path, SourceAccessor::Type::tRegular);
+            auto & entry = builder.entries[n];
+            entry.size = v["size"];
+            entry.isExecutable = v.value("executable", false);
+            entry.offset = v["narOffset"];
+        } else if (type == "symlink") {
+            builder.addSymlink(path, v.value("target", ""));
+        }
+    };
+
+    recurse(CanonPath::root, json::parse(listing));
 
-    NarMember * find(const CanonPath & path)
+    return builder.finish(0);
+}
+
+struct NarAccessor : public SourceAccessor
+{
+    /**
+     * Keeps the memory that `index` points to alive.
+     */
+    std::shared_ptr<const void> storage;
+
+    std::string_view index;
+
+    const NarIndexHeader * header;
+
+    const NarIndexEntry * entries;
+
+    std::string_view names;
+
+    GetNarBytes getNarBytes;
+
+    NarAccessor(std::shared_ptr<const void> storage, std::string_view index, GetNarBytes getNarBytes)
+        : storage(std::move(storage))
+        , index(index)
+        , getNarBytes(std::move(getNarBytes))
     {
-        NarMember * current = &root;
+        if (index.size() < sizeof(NarIndexHeader))
+            corrupt();
+        header = (const NarIndexHeader *) index.data();
+        if (memcmp(header->magic, narIndexMagic, sizeof(narIndexMagic)) != 0
+            || header->nrEntries == 0
+            || header->nrEntries > (index.size() - sizeof(NarIndexHeader)) / sizeof(NarIndexEntry)
+            || index.size() != sizeof(NarIndexHeader) + header->nrEntries * sizeof(NarIndexEntry) + header->namesSize)
+            corrupt();
+        entries = (const NarIndexEntry *) (index.data() + sizeof(NarIndexHeader));
+        names = index.substr(sizeof(NarIndexHeader) + header->nrEntries * sizeof(NarIndexEntry));
+    }
+
+    NarAccessor(std::string && index, GetNarBytes getNarBytes)
+        : NarAccessor(
+            std::make_shared<const std::string>(std::move(index)),
+            getNarBytes)
+    { }
+
+    NarAccessor(std::shared_ptr<const std::string> index, GetNarBytes getNarBytes)
+        : NarAccessor(index, *index, std::move(getNarBytes))
+    { }
 
-        for (const auto & i : path) {
-            if (current->stat.type != Type::tDirectory) return nullptr;
-            auto child = current->children.find(std::string(i));
-            if (child == current->children.end()) return nullptr;
-            current = &child->second;
+    [[noreturn]] static void corrupt()
+    {
+        throw Error("NAR index is corrupt");
+    }
+
+    std::string_view getString(uint64_t offset, uint64_t length)
+    {
+        if (offset > names.size() || length > names.size() - offset)
+            corrupt();
+        return names.substr(offset, length);
+    }
+
+    std::string_view getName(const NarIndexEntry & entry)
+    {
+        return getString(entry.nameOffset, entry.nameLength);
+    }
+
+    const NarIndexEntry * find(const CanonPath & path)
+    {
+        auto current = &entries[0];
+
+        for (const auto & name : path) {
+            if (current->type != Type::tDirectory) return nullptr;
+            if (current->firstChild > header->nrEntries || current->size > header->nrEntries - current->firstChild)
+                corrupt();
+            auto first = &entries[current->firstChild];
+            auto last = first + current->size;
+            auto child = std::lower_bound(first, last, name,
+                [&](const NarIndexEntry & entry, std::string_view name) { return getName(entry) < name; });
+            if (child == last || getName(*child) != name) return nullptr;
+            current = child;
         }
 
         return current;
     }
 
-    NarMember & get(const CanonPath & path) {
+    const NarIndexEntry & get(const CanonPath & path)
+    {
         auto result = find(path);
         if (!result)
             throw Error("NAR file does not contain path '%1%'", path);
@@ -203,58 +405,194 @@ struct NarAccessor : public SourceAccessor
         auto i = find(path);
         if (!i)
             return std::nullopt;
-        return i->stat;
+        switch (i->type) {
+        case Type::tRegular:
+            return Stat{
+                .type = Type::tRegular,
+                .fileSize = i->size,
+                .isExecutable = (bool) i->isExecutable,
+                .narOffset = i->offset
+            };
+        case Type::tDirectory:
+            return Stat{.type = Type::tDirectory};
+        case Type::tSymlink:
+            return Stat{.type = Type::tSymlink};
+        default:
+            corrupt();
+        }
     }
 
     DirEntries readDirectory(const CanonPath & path) override
     {
-        auto i = get(path);
+        auto & i = get(path);
 
-        if (i.stat.type != Type::tDirectory)
+        if (i.type != Type::tDirectory)
             throw Error("path '%1%' inside NAR file is not a directory", path);
 
+        if (i.firstChild > header->nrEntries || i.size > header->nrEntries - i.firstChild)
+            corrupt();
+
         DirEntries res;
-        for (const auto & child : i.children)
-            res.insert_or_assign(child.first, std::nullopt);
+        for (uint64_t n = 0; n < i.size; ++n) {
+            auto & child = entries[i.firstChild + n];
+            res.insert_or_assign(std::string(getName(child)), std::nullopt);
+        }
 
         return res;
     }
 
     std::string readFile(const CanonPath & path) override
     {
-        auto i = get(path);
-        if (i.stat.type != Type::tRegular)
+        auto & i = get(path);
+        if (i.type != Type::tRegular)
             throw Error("path '%1%' inside NAR file is not a regular file", path);
 
-        if (getNarBytes) return getNarBytes(*i.stat.narOffset, *i.stat.fileSize);
-
-        assert(nar);
-        return std::string(*nar, *i.stat.narOffset, *i.stat.fileSize);
+        assert(getNarBytes);
+        return getNarBytes(i.offset, i.size);
     }
 
     std::string readLink(const CanonPath & path) override
     {
-        auto i = get(path);
-        if (i.stat.type != Type::tSymlink)
+        auto & i = get(path);
+        if (i.type != Type::tSymlink)
             throw Error("path '%1%' inside NAR file is not a symlink", path);
-        return i.target;
+        return std::string(getString(i.offset, i.size));
     }
 };
 
 ref<SourceAccessor> makeNarAccessor(std::string && nar)
 {
-    return make_ref<NarAccessor>(std::move(nar));
+    auto nar2 = std::make_shared<const std::string>(std::move(nar));
+    StringSource source(*nar2);
+    return make_ref<NarAccessor>(makeNarIndex(source),
+        [nar2](uint64_t offset, uint64_t length) {
+            if (offset > nar2->size() || length > nar2->size() - offset)
+                throw Error("reading past the end of the NAR");
+            return nar2->substr(offset, length);
+        });
 }
 
 ref<SourceAccessor> makeNarAccessor(Source & source)
 {
-    return make_ref<NarAccessor>(source);
+    return make_ref<NarAccessor>(makeNarIndex(source), nullptr);
 }
 
 ref<SourceAccessor> makeLazyNarAccessor(const std::string & listing,
     GetNarBytes getNarBytes)
 {
-    return make_ref<NarAccessor>(listing, getNarBytes);
+    return make_ref<NarAccessor>(makeNarIndexFromListing(listing), getNarBytes);
+}
+
+#ifndef _WIN32
+
+/**
+ * Memory-map the NAR index in `indexFile`. Returns `nullptr` if it
+ * doesn't exist or doesn't match a NAR of size `narSize`.
+ */
+static std::shared_ptr<NarAccessor> mapNarIndex(const Path & indexFile, uint64_t narSize, GetNarBytes getNarBytes)
+{
+    AutoCloseFD fd = open(indexFile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) {
+        if (errno == ENOENT) return nullptr;
+        throw SysError("opening NAR index '%s'", indexFile);
+    }
+
+    struct stat st;
+    if (fstat(fd.get(), &st))
+        throw SysError("statting NAR index '%s'", indexFile);
+
+    size_t size = st.st_size;
+    if (size < sizeof(NarIndexHeader)) return nullptr;
+
+    auto p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.get(), 0);
+    if (p == MAP_FAILED)
+        throw SysError("mapping NAR index '%s'", indexFile);
+
+    std::shared_ptr<const void> storage(p, [size](const void * p) {
+        munmap(const_cast<void *>(p), size);
+    });
+
+    try {
+        auto accessor = std::make_shared<NarAccessor>(
+            std::move(storage), std::string_view((const char *) p, size), std::move(getNarBytes));
+        if (accessor->header->narSize != narSize) return nullptr;
+        return accessor;
+    } catch (Error &) {
+        return nullptr;
+    }
+}
+
+#endif
+
+ref<SourceAccessor> makeIndexedNarAccessor(const Path & narFile, const std::optional<Path> & indexFile)
+{
+#ifdef _WIN32
+    return makeNarAccessor(readFile(narFile));
+#else
+    AutoCloseFD fd = open(narFile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd)
+        throw SysError("opening NAR file '%s'", narFile);
+
+    struct stat st;
+    if (fstat(fd.get(), &st))
+        throw SysError("statting NAR file '%s'", narFile);
+
+    /* We can't read from pipes (like /dev/stdin) at random
+       offsets. */
+    if (!S_ISREG(st.st_mode))
+        return makeNarAccessor(readFile(narFile));
+
+    auto narSize = st.st_size;
+
+    auto narFd = std::make_shared<AutoCloseFD>(std::move(fd));
+
+    auto getNarBytes = [narFd, narFile](uint64_t offset, uint64_t length)
+    {
+        std::string buf(length, 0);
+        uint64_t done = 0;
+        while (done < length) {
+            checkInterrupt();
+            auto n = pread(narFd->get(), buf.data() + done, length - done, offset + done);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("reading NAR file '%s'", narFile);
+            }
+            if (n == 0)
+                throw EndOfFile("unexpected end of NAR file '%s'", narFile);
+            done += n;
+        }
+        return buf;
+    };
+
+    if (indexFile) {
+        try {
+            if (auto accessor = mapNarIndex(*indexFile, narSize, getNarBytes))
+                return ref<SourceAccessor>(accessor);
+        } catch (SystemError &) { }
+    }
+
+    /* Reading sequentially doesn't interfere with `pread()`. */
+    std::string index;
+    {
+        FdSource source(narFd->get());
+        index = makeNarIndex(source);
+    }
+
+    if (indexFile) {
+        try {
+            static std::atomic<int> counter{0};
+            auto tmpFile = fmt("%s.tmp.%d.%d", *indexFile, getpid(), ++counter);
+            AutoDelete del(tmpFile, false);
+            writeFile(tmpFile, index);
+            std::filesystem::rename(tmpFile, *indexFile);
+            del.cancel();
+        } catch (...) {
+            ignoreExceptionExceptInterrupt();
+        }
+    }
+
+    return make_ref<NarAccessor>(std::move(index), getNarBytes);
+#endif
 }
 
 using nlohmann::json;
@@ -17,8 +17,33 @@ struct Source;
  */
 ref<SourceAccessor> makeNarAccessor(std::string && nar);
 
+/**
+ * Return an object that provides the listing of the NAR read from
+ * `source`. Its `readFile()` method cannot be used, since the contents
+ * of the NAR are not kept.
+ */
 ref<SourceAccessor> makeNarAccessor(Source & source);
 
+/**
+ * Compute an index of the NAR read from `source`, i.e. a compact flat
+ * table of its file system objects with their offsets in the NAR. This
+ * is what all NAR accessors use to look up paths.
+ */
+std::string makeNarIndex(Source & source);
+
+/**
+ * Return an object that provides access to the contents of the NAR
+ * stored in `narFile`. The NAR is not loaded into memory: file
+ * contents are read from `narFile` on demand.
+ *
+ * If `indexFile` is given, the index of the NAR (see `makeNarIndex()`)
+ * is memory-mapped from that file, or written to it if it doesn't
+ * exist yet or belongs to a different NAR.
+ */
+ref<SourceAccessor> makeIndexedNarAccessor(
+    const Path & narFile,
+    const std::optional<Path> & indexFile = std::nullopt);
+
 /**
  * Create a NAR accessor from a NAR listing (in the format produced by
  * listNar()). The callback getNarBytes(offset, length) is used by the
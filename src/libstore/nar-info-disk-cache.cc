@@ -257,31 +257,92 @@ public:
             if (!queryNAR.next())
                 return {oUnknown, 0};
 
-            if (!queryNAR.getInt(0))
-                return {oInvalid, 0};
+            return narInfoFromRow(queryNAR, hashPart, 0);
+        });
+    }
+
+    std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> lookupNarInfos(
+        const std::string & uri, const std::set<std::string> & hashParts) override
+    {
+        using Result = std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>>;
+
+        return retrySQLite<Result>([&]() -> Result {
+            Result res;
+
+            auto state(_state.lock());
+
+            auto & cache(getCache(*state, uri));
+
+            auto now = time(0);
+
+            /* Query the hash parts in chunks, to stay well below
+               SQLite's limit on the number of parameters. */
+            static constexpr size_t chunkSize = 500;
 
-            auto namePart = queryNAR.getStr(1);
-            auto narInfo = make_ref<NarInfo>(
-                StorePath(hashPart + "-" + namePart),
-                Hash::parseAnyPrefixed(queryNAR.getStr(6)));
-            narInfo->url = queryNAR.getStr(2);
-            narInfo->compression = queryNAR.getStr(3);
-            if (!queryNAR.isNull(4))
-                narInfo->fileHash = Hash::parseAnyPrefixed(queryNAR.getStr(4));
-            narInfo->fileSize = queryNAR.getInt(5);
-            narInfo->narSize = queryNAR.getInt(7);
-            for (auto & r : tokenizeString<Strings>(queryNAR.getStr(8), " "))
-                narInfo->references.insert(StorePath(r));
-            if (!queryNAR.isNull(9))
-                narInfo->deriver = StorePath(queryNAR.getStr(9));
-            for (auto & sig : tokenizeString<Strings>(queryNAR.getStr(10), " "))
-                narInfo->sigs.insert(sig);
-            narInfo->ca = ContentAddress::parseOpt(queryNAR.getStr(11));
-
-            return {oValid, narInfo};
+            for (auto i = hashParts.begin(); i != hashParts.end(); ) {
+                std::vector<std::string_view> chunk;
+                for (; i != hashParts.end() && chunk.size() < chunkSize; ++i)
+                    chunk.push_back(*i);
+
+                std::string placeholders;
+                for (size_t n = 0; n < chunk.size(); ++n)
+                    placeholders += n ? ", ?" : "?";
+
+                SQLiteStmt queryNARs(state->db,
+                    "select hashPart, present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca from NARs where cache = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?)) and hashPart in (" + placeholders + ")");
+
+                auto use(queryNARs.use()
+                    (cache.id)
+                    (now - settings.ttlNegativeNarInfoCache)
+                    (now - settings.ttlPositiveNarInfoCache));
+                for (auto & hashPart : chunk)
+                    use(hashPart);
+
+                while (use.next()) {
+                    auto hashPart = use.getStr(0);
+                    res.insert_or_assign(hashPart, narInfoFromRow(use, hashPart, 1));
+                }
+            }
+
+            return res;
         });
     }
 
+private:
+
+    /**
+     * Decode a row returned by `queryNAR`, whose columns start at
+     * column `col`.
+     */
+    static std::pair<Outcome, std::shared_ptr<NarInfo>> narInfoFromRow(
+        SQLiteStmt::Use & query, const std::string & hashPart, int col)
+    {
+        if (!query.getInt(col))
+            return {oInvalid, 0};
+
+        auto namePart = query.getStr(col + 1);
+        auto narInfo = make_ref<NarInfo>(
+            StorePath(hashPart + "-" + namePart),
+            Hash::parseAnyPrefixed(query.getStr(col + 6)));
+        narInfo->url = query.getStr(col + 2);
+        narInfo->compression = query.getStr(col + 3);
+        if (!query.isNull(col + 4))
+            narInfo->fileHash = Hash::parseAnyPrefixed(query.getStr(col + 4));
+        narInfo->fileSize = query.getInt(col + 5);
+        narInfo->narSize = query.getInt(col + 7);
+        for (auto & r : tokenizeString<Strings>(query.getStr(col + 8), " "))
+            narInfo->references.insert(StorePath(r));
+        if (!query.isNull(col + 9))
+            narInfo->deriver = StorePath(query.getStr(col + 9));
+        for (auto & sig : tokenizeString<Strings>(query.getStr(col + 10), " "))
+            narInfo->sigs.insert(sig);
+        narInfo->ca = ContentAddress::parseOpt(query.getStr(col + 11));
+
+        return {oValid, narInfo};
+    }
+
+public:
+
     std::pair<Outcome, std::shared_ptr<Realisation>> lookupRealisation(
         const std::string & uri, const DrvOutput & id) override
     {
@@ -29,6 +29,13 @@ public:
     virtual std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
         const std::string & uri, const std::string & hashPart) = 0;
 
+    /**
+     * Look up the NAR infos of many paths at once. The result contains
+     * only the hash parts for which the outcome is not `oUnknown`.
+     */
+    virtual std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> lookupNarInfos(
+        const std::string & uri, const std::set<std::string> & hashParts) = 0;
+
     virtual void upsertNarInfo(
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<const ValidPathInfo> info) = 0;
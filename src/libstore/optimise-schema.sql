@@ -0,0 +1,13 @@
+-- Extension of the sql schema that records the hashes of the regular
+-- files in the store, so that `optimise-store-method = reflink' can
+-- find files with the same contents without hashing the whole store.
+
+create table if not exists OptimisedFiles (
+    path integer not null,
+    name text not null, -- path of the file relative to the store path, e.g. '/bin/foo'
+    hash blob not null, -- SHA-256 NAR hash of the file
+    primary key (path, name),
+    foreign key (path) references ValidPaths(id) on delete cascade
+);
+
+create index if not exists IndexOptimisedFilesHash on OptimisedFiles(hash);
@@ -11,8 +11,14 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <fcntl.h>
 #include <regex>
 
+#ifdef __linux__
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+#endif
+
 
 namespace nix {
 
@@ -41,6 +47,12 @@ struct MakeReadOnly
 };
 
 
+static bool useReflinks()
+{
+    return settings.optimiseStoreMethod == OptimiseStoreMethod::Reflink;
+}
+
+
 LocalStore::InodeHash LocalStore::loadInodeHash()
 {
     debug("loading hash inodes in memory");
@@ -90,7 +102,8 @@ Strings LocalStore::readDirectoryIgnoringInodes(const Path & path, const InodeHa
 
 
 void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
-    const Path & path, InodeHash & inodeHash, RepairFlag repair)
+    const Path & path, InodeHash & inodeHash, RepairFlag repair,
+    const FileHashes * knownHashes, const CanonPath & relPath)
 {
     checkInterrupt();
 
@@ -113,7 +126,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     if (S_ISDIR(st.st_mode)) {
         Strings names = readDirectoryIgnoringInodes(path, inodeHash);
         for (auto & i : names)
-            optimisePath_(act, stats, path + "/" + i, inodeHash, repair);
+            optimisePath_(act, stats, path + "/" + i, inodeHash, repair, knownHashes, relPath / i);
         return;
     }
 
@@ -148,7 +161,8 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
        Also note that if `path' is a symlink, then we're hashing the
        contents of the symlink (i.e. the result of readlink()), not
        the contents of the target (which may not even exist). */
-    Hash hash = ({
+    auto knownHash = knownHashes ? get(*knownHashes, relPath) : nullptr;
+    Hash hash = knownHash ? *knownHash : ({
         hashPath(
             {make_ref<PosixSourceAccessor>(), CanonPath(path)},
             FileSerialisationMethod::NixArchive, HashAlgorithm::SHA256).first;
@@ -268,12 +282,160 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
 }
 
 
+bool LocalStore::reflinkFile(const Path & source, const Path & path, const struct stat & st)
+{
+#ifdef FICLONE
+    AutoCloseFD fdSource = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fdSource) {
+        if (errno == ENOENT) return false;
+        throw SysError("opening '%1%'", source);
+    }
+
+    /* The database may be out of date if the source was modified or
+       replaced, so check that it still looks right. Its contents are
+       not checked; `nix-store --verify --check-contents` does that. */
+    struct stat stSource;
+    if (fstat(fdSource.get(), &stSource) == -1)
+        throw SysError("getting status of '%1%'", source);
+    if (!S_ISREG(stSource.st_mode)
+        || stSource.st_size != st.st_size
+        || (stSource.st_mode & S_IWUSR))
+        return false;
+
+    if (stSource.st_dev == st.st_dev && stSource.st_ino == st.st_ino) {
+        debug("'%1%' is already linked to '%2%'", path, source);
+        return false;
+    }
+
+    Path tempFile = fmt("%1%/.tmp-reflink-%2%-%3%", realStoreDir, getpid(), rand());
+
+    AutoCloseFD fdTemp = open(tempFile.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (!fdTemp) throw SysError("creating '%1%'", tempFile);
+    AutoDelete delTemp(tempFile, false);
+
+    if (ioctl(fdTemp.get(), FICLONE, fdSource.get()) == -1) {
+        if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV || errno == EINVAL) {
+            static std::atomic<bool> warned{false};
+            if (!warned.exchange(true))
+                warn("the file system of '%s' does not support reflinks, so files are not deduplicated", realStoreDir);
+            return false;
+        }
+        throw SysError("cloning '%1%' to '%2%'", source, tempFile);
+    }
+
+    if (fchmod(fdTemp.get(), st.st_mode & 07777) == -1)
+        throw SysError("changing mode of '%1%'", tempFile);
+    fdTemp.close();
+
+    canonicaliseTimestampAndPermissions(tempFile);
+
+    printMsg(lvlTalkative, "reflinking '%1%' to '%2%'", path, source);
+
+    /* As in optimisePath_(), make the containing directory writable
+       while we replace the file. */
+    const Path dirOfPath(dirOf(path));
+    bool mustToggle = dirOfPath != realStoreDir.get();
+    if (mustToggle) makeWritable(dirOfPath);
+
+    MakeReadOnly makeReadOnly(mustToggle ? dirOfPath : "");
+
+    std::filesystem::rename(tempFile, path);
+    delTemp.cancel();
+
+    return true;
+#else
+    static std::atomic<bool> warned{false};
+    if (!warned.exchange(true))
+        warn("reflinks are not supported on this platform, so files are not deduplicated");
+    return false;
+#endif
+}
+
+
+LocalStore::FileHashes LocalStore::optimisePathReflink(Activity * act, OptimiseStats & stats,
+    const StorePath & storePath, const FileHashes * knownHashes)
+{
+    auto root = realStoreDir + "/" + std::string(storePath.to_string());
+
+    /* Skip the files that were already optimised. */
+    auto done = queryOptimisedFiles(storePath);
+
+    FileHashes newHashes;
+
+    /* Files in this path that we've already seen, since they're not
+       in the database yet. */
+    std::map<Hash, Path> seen;
+
+    std::function<void(const CanonPath &)> recurse;
+    recurse = [&](const CanonPath & relPath)
+    {
+        checkInterrupt();
+
+        auto path = relPath.isRoot() ? root : root + relPath.abs();
+        auto st = lstat(path);
+
+        if (S_ISDIR(st.st_mode)) {
+            for (auto & name : readDirectoryIgnoringInodes(path, {}))
+                recurse(relPath / name);
+            return;
+        }
+
+        /* Unlike hard links, reflinks only make sense for regular
+           files. */
+        if (!S_ISREG(st.st_mode) || done.count(relPath)) return;
+
+        if (st.st_mode & S_IWUSR) {
+            warn("skipping suspicious writable file '%1%'", path);
+            return;
+        }
+
+        auto knownHash = knownHashes ? get(*knownHashes, relPath) : nullptr;
+        Hash hash = knownHash ? *knownHash : ({
+            hashPath(
+                {make_ref<PosixSourceAccessor>(), CanonPath(path)},
+                FileSerialisationMethod::NixArchive, HashAlgorithm::SHA256).first;
+        });
+        debug("'%1%' has hash '%2%'", path, hash.to_string(HashFormat::Nix32, true));
+
+        newHashes.insert_or_assign(relPath, hash);
+
+        /* Empty files don't use any data blocks. */
+        if (st.st_size == 0) return;
+
+        std::optional<Path> source;
+        if (auto p = get(seen, hash))
+            source = *p;
+        else {
+            source = queryOptimisedFileByHash(hash);
+            seen.emplace(hash, path);
+        }
+
+        if (!source || *source == path || !reflinkFile(*source, path, st)) return;
+
+        stats.filesLinked++;
+        stats.bytesFreed += st.st_size;
+
+        if (act)
+            act->result(resFileLinked, st.st_size
+#ifndef _WIN32
+                , st.st_blocks
+#endif
+                );
+    };
+
+    recurse(CanonPath::root);
+
+    return newHashes;
+}
+
+
 void LocalStore::optimiseStore(OptimiseStats & stats)
 {
     Activity act(*logger, actOptimiseStore);
 
     auto paths = queryAllValidPaths();
-    InodeHash inodeHash = loadInodeHash();
+    bool reflink = useReflinks();
+    InodeHash inodeHash = reflink ? InodeHash() : loadInodeHash();
 
     act.progress(0, paths.size());
 
@@ -284,7 +446,12 @@ void LocalStore::optimiseStore(OptimiseStats & stats)
         if (!isValidPath(i)) continue; /* path was GC'ed, probably */
         {
             Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", printStorePath(i)));
-            optimisePath_(&act, stats, realStoreDir + "/" + std::string(i.to_string()), inodeHash, NoRepair);
+            /* Record the hashes, so that other paths can find these
+               files. */
+            if (reflink)
+                addOptimisedFiles(i, optimisePathReflink(&act, stats, i));
+            else
+                optimisePath_(&act, stats, realStoreDir + "/" + std::string(i.to_string()), inodeHash, NoRepair);
         }
         done++;
         act.progress(done, paths.size());
@@ -297,17 +464,26 @@ void LocalStore::optimiseStore()
 
     optimiseStore(stats);
 
-    printInfo("%s freed by hard-linking %d files",
+    printInfo("%s freed by %s %d files",
         showBytes(stats.bytesFreed),
+        useReflinks() ? "reflinking" : "hard-linking",
         stats.filesLinked);
 }
 
-void LocalStore::optimisePath(const Path & path, RepairFlag repair)
+LocalStore::FileHashes LocalStore::optimisePath(const Path & path, RepairFlag repair, const FileHashes * knownHashes)
 {
     OptimiseStats stats;
     InodeHash inodeHash;
 
-    if (settings.autoOptimiseStore) optimisePath_(nullptr, stats, path, inodeHash, repair);
+    if (!settings.autoOptimiseStore) return {};
+
+    if (useReflinks())
+        return optimisePathReflink(nullptr, stats, StorePath(baseNameOf(path)), knownHashes);
+
+    /* With hard links, `.links` already maps hashes to files, so
+       there is nothing to record. */
+    optimisePath_(nullptr, stats, path, inodeHash, repair, knownHashes);
+    return {};
 }
 
 
@@ -1,4 +1,3 @@
-#include <nlohmann/json.hpp>
 #include "remote-fs-accessor.hh"
 #include "nar-accessor.hh"
 
@@ -23,29 +22,45 @@ Path RemoteFSAccessor::makeCacheFile(std::string_view hashPart, const std::strin
     return fmt("%s/%s.%s", cacheDir, hashPart, ext);
 }
 
-ref<SourceAccessor> RemoteFSAccessor::addToCache(std::string_view hashPart, std::string && nar)
+ref<SourceAccessor> RemoteFSAccessor::addToCache(const StorePath & storePath)
 {
-    if (cacheDir != "") {
-        try {
-            /* FIXME: do this asynchronously. */
-            writeFile(makeCacheFile(hashPart, "nar"), nar);
-        } catch (...) {
-            ignoreExceptionExceptInterrupt();
-        }
-    }
-
-    auto narAccessor = makeNarAccessor(std::move(nar));
-    nars.emplace(hashPart, narAccessor);
+    auto hashPart = storePath.hashPart();
 
     if (cacheDir != "") {
         try {
-            nlohmann::json j = listNar(narAccessor, CanonPath::root, true);
-            writeFile(makeCacheFile(hashPart, "ls"), j.dump());
-        } catch (...) {
+            /* Write the NAR straight to the cache, rather than into
+               memory. */
+            auto narFile = makeCacheFile(hashPart, "nar");
+            static std::atomic<int> counter{0};
+            auto tmpFile = fmt("%s.tmp.%d.%d", narFile, getpid(), ++counter);
+            AutoDelete del(tmpFile, false);
+            {
+                AutoCloseFD fd = toDescriptor(open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC
+                #ifndef _WIN32
+                    | O_CLOEXEC
+                #endif
+                    , 0666));
+                if (!fd)
+                    throw SysError("creating NAR cache file '%s'", tmpFile);
+                FdSink sink(fd.get());
+                store->narFromPath(storePath, sink);
+                sink.flush();
+            }
+            std::filesystem::rename(tmpFile, narFile);
+            del.cancel();
+
+            auto narAccessor = makeIndexedNarAccessor(narFile, makeCacheFile(hashPart, "narindex"));
+            nars.emplace(hashPart, narAccessor);
+            return narAccessor;
+        } catch (SystemError &) {
             ignoreExceptionExceptInterrupt();
         }
     }
 
+    StringSink sink;
+    store->narFromPath(storePath, sink);
+    auto narAccessor = makeNarAccessor(std::move(sink.s));
+    nars.emplace(hashPart, narAccessor);
     return narAccessor;
 }
 
@@ -60,49 +75,17 @@ std::pair<ref<SourceAccessor>, CanonPath> RemoteFSAccessor::fetch(const CanonPat
     auto i = nars.find(std::string(storePath.hashPart()));
     if (i != nars.end()) return {i->second, restPath};
 
-    std::string listing;
     Path cacheFile;
 
     if (cacheDir != "" && nix::pathExists(cacheFile = makeCacheFile(storePath.hashPart(), "nar"))) {
-
         try {
-            listing = nix::readFile(makeCacheFile(storePath.hashPart(), "ls"));
-
-            auto narAccessor = makeLazyNarAccessor(listing,
-                [cacheFile](uint64_t offset, uint64_t length) {
-
-                    AutoCloseFD fd = toDescriptor(open(cacheFile.c_str(), O_RDONLY
-                    #ifndef _WIN32
-                        | O_CLOEXEC
-                    #endif
-                        ));
-                    if (!fd)
-                        throw SysError("opening NAR cache file '%s'", cacheFile);
-
-                    if (lseek(fromDescriptorReadOnly(fd.get()), offset, SEEK_SET) != (off_t) offset)
-                        throw SysError("seeking in '%s'", cacheFile);
-
-                    std::string buf(length, 0);
-                    readFull(fd.get(), buf.data(), length);
-
-                    return buf;
-                });
-
-            nars.emplace(storePath.hashPart(), narAccessor);
-            return {narAccessor, restPath};
-
-        } catch (SystemError &) { }
-
-        try {
-            auto narAccessor = makeNarAccessor(nix::readFile(cacheFile));
+            auto narAccessor = makeIndexedNarAccessor(cacheFile, makeCacheFile(storePath.hashPart(), "narindex"));
             nars.emplace(storePath.hashPart(), narAccessor);
             return {narAccessor, restPath};
         } catch (SystemError &) { }
     }
 
-    StringSink sink;
-    store->narFromPath(storePath, sink);
-    return {addToCache(storePath.hashPart(), std::move(sink.s)), restPath};
+    return {addToCache(storePath), restPath};
 }
 
 std::optional<SourceAccessor::Stat> RemoteFSAccessor::maybeLstat(const CanonPath & path)
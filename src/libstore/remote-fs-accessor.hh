@@ -23,7 +23,11 @@ class RemoteFSAccessor : public SourceAccessor
 
     Path makeCacheFile(std::string_view hashPart, const std::string & ext);
 
-    ref<SourceAccessor> addToCache(std::string_view hashPart, std::string && nar);
+    /**
+     * Fetch the NAR of `storePath` and store it in the cache
+     * directory, if any.
+     */
+    ref<SourceAccessor> addToCache(const StorePath & storePath);
 
 public:
 
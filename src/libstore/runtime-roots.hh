@@ -0,0 +1,29 @@
+#pragma once
+///@file
+
+#include <functional>
+#include <optional>
+#include <string_view>
+
+namespace nix {
+
+/**
+ * Parse a line of `/proc/<pid>/maps`, returning the name of the mapped
+ * file, if any. Only lines with exactly six whitespace-separated
+ * fields, the last of which is an absolute path other than `/`, have a
+ * file name.
+ */
+std::optional<std::string_view> parseProcMapsLine(std::string_view line);
+
+/**
+ * Call `callback` on every substring of `s` that looks like a path in
+ * `storeDir`, i.e. `storeDir` followed by `/`, a character in
+ * `[0-9a-z]`, and the longest sequence of store path name characters
+ * after that. Occurrences don't overlap.
+ */
+void scanForStorePaths(
+    std::string_view storeDir,
+    std::string_view s,
+    std::function<void(std::string_view)> callback);
+
+}
@@ -208,6 +208,12 @@ std::string SQLiteStmt::Use::getStr(int col)
     return s;
 }
 
+std::string SQLiteStmt::Use::getBlob(int col)
+{
+    auto p = (const char *) sqlite3_column_blob(stmt, col);
+    return std::string(p, p ? sqlite3_column_bytes(stmt, col) : 0);
+}
+
 int64_t SQLiteStmt::Use::getInt(int col)
 {
     // FIXME: detect nulls?
@@ -8,6 +8,8 @@
 #include "util.hh"
 #include "nar-info-disk-cache.hh"
 #include "thread-pool.hh"
+#include "finally.hh"
+#include "topo-sort.hh"
 #include "references.hh"
 #include "archive.hh"
 #include "callback.hh"
@@ -246,6 +248,14 @@ void Store::addMultipleToStore(
         act.progress(nrDone, pathsToCopy.size(), nrRunning, nrFailed);
     };
 
+    /* The total NAR size of the paths being added concurrently. Some
+       stores (e.g. binary caches) hold an entire NAR in memory while
+       adding it, so keep this within `copy-memory-budget`. A path that
+       is larger than the budget is added while nothing else is. */
+    Sync<uint64_t> bytesInFlight_{0};
+    std::condition_variable bytesReleased;
+    uint64_t memoryBudget = settings.copyMemoryBudget;
+
     ThreadPool pool;
 
     processGraph<StorePath>(pool,
@@ -282,6 +292,21 @@ void Store::addMultipleToStore(
             auto source = std::move(source_);
 
             if (!isValidPath(info.path)) {
+                if (memoryBudget) {
+                    auto bytesInFlight(bytesInFlight_.lock());
+                    while (*bytesInFlight && *bytesInFlight + info.narSize > memoryBudget)
+                        bytesInFlight.wait(bytesReleased);
+                    *bytesInFlight += info.narSize;
+                }
+                Finally releaseBytes([&]() {
+                    /* Free the source's buffers before other paths can
+                       use its share of the budget. */
+                    source.reset();
+                    if (!memoryBudget) return;
+                    *bytesInFlight_.lock() -= info.narSize;
+                    bytesReleased.notify_all();
+                });
+
                 MaintainCount<decltype(nrRunning)> mc(nrRunning);
                 showProgress();
                 try {
@@ -436,7 +461,7 @@ StringSet StoreConfig::getDefaultSystemFeatures()
 
 Store::Store(const Params & params)
     : StoreConfig(params)
-    , state({(size_t) pathInfoCacheSize})
+    , pathInfoCache((size_t) pathInfoCacheSize)
 {
     assertLibStoreInitialized();
 }
@@ -520,6 +545,26 @@ void Store::querySubstitutablePathInfos(const StorePathCAMap & paths, Substituta
 {
     if (!settings.useSubstitutes) return;
     for (auto & sub : getDefaultSubstituters()) {
+        /* Fetch the path infos from the substituter concurrently, so
+           that the queries below hit its in-memory cache. Errors are
+           reported below. */
+        if (paths.size() > 1) {
+            StorePathSet subPaths;
+            for (auto & path : paths) {
+                if (infos.count(path.first)) continue;
+                if (path.second)
+                    subPaths.insert(makeFixedOutputPathFromCA(
+                        path.first.name(),
+                        ContentAddressWithReferences::withoutRefs(*path.second)));
+                else if (sub->storeDir == storeDir)
+                    subPaths.insert(path.first);
+            }
+            try {
+                sub->queryPathInfos(subPaths);
+            } catch (Error &) {
+            }
+        }
+
         for (auto & path : paths) {
             if (infos.count(path.first))
                 // Choose first succeeding substituter.
@@ -569,8 +614,7 @@ void Store::querySubstitutablePathInfos(const StorePathCAMap & paths, Substituta
 bool Store::isValidPath(const StorePath & storePath)
 {
     {
-        auto state_(state.lock());
-        auto res = state_->pathInfoCache.get(std::string(storePath.to_string()));
+        auto res = pathInfoCache.get(storePath);
         if (res && res->isKnownNow()) {
             stats.narInfoReadAverted++;
             return res->didExist();
@@ -581,8 +625,7 @@ bool Store::isValidPath(const StorePath & storePath)
         auto res = diskCache->lookupNarInfo(getUri(), std::string(storePath.hashPart()));
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
-            auto state_(state.lock());
-            state_->pathInfoCache.upsert(std::string(storePath.to_string()),
+            pathInfoCache.upsert(storePath,
                 res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue { .value = res.second });
             return res.first == NarInfoDiskCache::oValid;
         }
@@ -641,7 +684,7 @@ std::optional<std::shared_ptr<const ValidPathInfo>> Store::queryPathInfoFromClie
     auto hashPart = std::string(storePath.hashPart());
 
     {
-        auto res = state.lock()->pathInfoCache.get(std::string(storePath.to_string()));
+        auto res = pathInfoCache.get(storePath);
         if (res && res->isKnownNow()) {
             stats.narInfoReadAverted++;
             if (res->didExist())
@@ -655,14 +698,11 @@ std::optional<std::shared_ptr<const ValidPathInfo>> Store::queryPathInfoFromClie
         auto res = diskCache->lookupNarInfo(getUri(), hashPart);
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
-            {
-                auto state_(state.lock());
-                state_->pathInfoCache.upsert(std::string(storePath.to_string()),
-                    res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue{ .value = res.second });
-                if (res.first == NarInfoDiskCache::oInvalid ||
-                    !goodStorePath(storePath, res.second->path))
-                    return std::make_optional(nullptr);
-            }
+            pathInfoCache.upsert(storePath,
+                res.first == NarInfoDiskCache::oInvalid ? PathInfoCacheValue{} : PathInfoCacheValue{ .value = res.second });
+            if (res.first == NarInfoDiskCache::oInvalid ||
+                !goodStorePath(storePath, res.second->path))
+                return std::make_optional(nullptr);
             assert(res.second);
             return std::make_optional(res.second);
         }
@@ -672,6 +712,38 @@ std::optional<std::shared_ptr<const ValidPathInfo>> Store::queryPathInfoFromClie
 }
 
 
+void Store::queryPathInfosFromClientCache(const StorePathSet & paths)
+{
+    if (!diskCache) return;
+
+    std::map<std::string, const StorePath *> unknown;
+    for (auto & path : paths) {
+        auto res = pathInfoCache.get(path);
+        if (!res || !res->isKnownNow())
+            unknown.emplace(path.hashPart(), &path);
+    }
+
+    if (unknown.empty()) return;
+
+    std::set<std::string> hashParts;
+    for (auto & [hashPart, _] : unknown)
+        hashParts.insert(hashPart);
+
+    auto results = diskCache->lookupNarInfos(getUri(), hashParts);
+
+    /* The reads are counted as averted by queryPathInfoFromClientCache()
+       when the entries are used. Entries for a different name are left
+       to the single-path lookup, which treats them as invalid. */
+    for (auto & [hashPart, res] : results) {
+        auto & storePath = *unknown.at(hashPart);
+        if (res.first == NarInfoDiskCache::oInvalid)
+            pathInfoCache.upsert(storePath, PathInfoCacheValue{});
+        else if (goodStorePath(storePath, res.second->path))
+            pathInfoCache.upsert(storePath, PathInfoCacheValue{ .value = res.second });
+    }
+}
+
+
 void Store::queryPathInfo(const StorePath & storePath,
     Callback<ref<const ValidPathInfo>> callback) noexcept
 {
@@ -699,10 +771,7 @@ void Store::queryPathInfo(const StorePath & storePath,
                 if (diskCache)
                     diskCache->upsertNarInfo(getUri(), hashPart, info);
 
-                {
-                    auto state_(state.lock());
-                    state_->pathInfoCache.upsert(std::string(storePath.to_string()), PathInfoCacheValue { .value = info });
-                }
+                pathInfoCache.upsert(storePath, PathInfoCacheValue { .value = info });
 
                 if (!info || !goodStorePath(storePath, info->path)) {
                     stats.narInfoMissing++;
@@ -807,6 +876,8 @@ void Store::substitutePaths(const StorePathSet & paths)
 
 StorePathSet Store::queryValidPaths(const StorePathSet & paths, SubstituteFlag maybeSubstitute)
 {
+    queryPathInfosFromClientCache(paths);
+
     struct State
     {
         size_t left;
@@ -863,6 +934,65 @@ StorePathSet Store::queryValidPaths(const StorePathSet & paths, SubstituteFlag m
 }
 
 
+std::map<StorePath, ref<const ValidPathInfo>> Store::queryPathInfos(const StorePathSet & paths)
+{
+    queryPathInfosFromClientCache(paths);
+
+    struct State
+    {
+        size_t left;
+        std::map<StorePath, ref<const ValidPathInfo>> infos;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_(State{paths.size(), {}});
+
+    std::condition_variable wakeup;
+    ThreadPool pool;
+
+    auto doQuery = [&](const StorePath & path) {
+        checkInterrupt();
+        queryPathInfo(path, {[path, &state_, &wakeup](std::future<ref<const ValidPathInfo>> fut) {
+            std::shared_ptr<const ValidPathInfo> info;
+            std::exception_ptr newExc{};
+
+            try {
+                info = fut.get();
+            } catch (InvalidPath &) {
+            } catch (...) {
+                newExc = std::current_exception();
+            }
+
+            auto state(state_.lock());
+
+            if (info)
+                state->infos.insert_or_assign(path, ref(info));
+
+            if (newExc)
+                state->exc = newExc;
+
+            assert(state->left);
+            if (!--state->left)
+                wakeup.notify_one();
+        }});
+    };
+
+    for (auto & path : paths)
+        pool.enqueue(std::bind(doQuery, path));
+
+    pool.process();
+
+    while (true) {
+        auto state(state_.lock());
+        if (!state->left) {
+            if (state->exc) std::rethrow_exception(state->exc);
+            return std::move(state->infos);
+        }
+        state.wait(wakeup);
+    }
+}
+
+
 /* Return a string accepted by decodeValidPathInfo() that
    registers the specified paths as valid.  Note: it's the
    responsibility of the caller to provide a closure. */
@@ -932,10 +1062,10 @@ StorePathSet Store::exportReferences(const StorePathSet & storePaths, const Stor
 
 const Store::Stats & Store::getStats()
 {
-    {
-        auto state_(state.readLock());
-        stats.pathInfoCacheSize = state_->pathInfoCache.size();
-    }
+    stats.pathInfoCacheSize = pathInfoCache.size();
+    stats.pathInfoCacheHits = pathInfoCache.getHits();
+    stats.pathInfoCacheMisses = pathInfoCache.getMisses();
+    stats.pathInfoCacheEvictions = pathInfoCache.getEvictions();
     return stats;
 }
 
@@ -1079,9 +1209,25 @@ std::map<StorePath, StorePath> copyPaths(
 
     Activity act(*logger, lvlInfo, actCopyPaths, fmt("copying %d paths", missing.size()));
 
+    /* Query the path infos of all missing paths at once, rather than
+       paying a round trip per path to a remote source store. */
+    auto infos = srcStore.queryPathInfos(missing);
+    for (auto & path : missing)
+        if (!infos.count(path))
+            throw InvalidPath("path '%s' is not valid", srcStore.printStorePath(path));
+
     // In the general case, `addMultipleToStore` requires a sorted list of
     // store paths to add, so sort them right now
-    auto sortedMissing = srcStore.topoSortPaths(missing);
+    auto sortedMissing = topoSort(missing,
+        {[&](const StorePath & path) {
+            return infos.at(path)->references;
+        }},
+        {[&](const StorePath & path, const StorePath & parent) {
+            return BuildError(
+                "cycle detected in the references of '%s' from '%s'",
+                srcStore.printStorePath(path),
+                srcStore.printStorePath(parent));
+        }});
     std::reverse(sortedMissing.begin(), sortedMissing.end());
 
     std::map<StorePath, StorePath> pathsMap;
@@ -1112,7 +1258,7 @@ std::map<StorePath, StorePath> copyPaths(
     std::atomic<uint64_t> total = 0;
 
     for (auto & missingPath : sortedMissing) {
-        auto info = srcStore.queryPathInfo(missingPath);
+        auto & info = infos.at(missingPath);
 
         auto storePathForDst = computeStorePathForDst(*info);
         pathsMap.insert_or_assign(missingPath, storePathForDst);
@@ -6,7 +6,7 @@
 #include "hash.hh"
 #include "content-address.hh"
 #include "serialise.hh"
-#include "lru-cache.hh"
+#include "clock-cache.hh"
 #include "sync.hh"
 #include "globals.hh"
 #include "config.hh"
@@ -196,12 +196,12 @@ protected:
         }
     };
 
-    struct State
-    {
-        LRUCache<std::string, PathInfoCacheValue> pathInfoCache;
-    };
-
-    SharedSync<State> state;
+    /**
+     * Cache of path info lookups. Entries are found through the hash
+     * part of the store path (see `std::hash<StorePath>`), but only
+     * match if the whole path is equal.
+     */
+    ClockCache<StorePath, PathInfoCacheValue> pathInfoCache;
 
     std::shared_ptr<NarInfoDiskCache> diskCache;
 
@@ -283,6 +283,13 @@ public:
     void queryPathInfo(const StorePath & path,
         Callback<ref<const ValidPathInfo>> callback) noexcept;
 
+    /**
+     * Query information about a set of paths concurrently, looking
+     * them up in the narinfo disk cache in a single batch first. Paths
+     * that are not valid are omitted from the result.
+     */
+    std::map<StorePath, ref<const ValidPathInfo>> queryPathInfos(const StorePathSet & paths);
+
     /**
      * Version of queryPathInfo() that only queries the local narinfo cache and not
      * the actual store.
@@ -293,6 +300,13 @@ public:
      */
     std::optional<std::shared_ptr<const ValidPathInfo>> queryPathInfoFromClientCache(const StorePath & path);
 
+    /**
+     * Batched version of queryPathInfoFromClientCache() that only
+     * loads what the narinfo disk cache knows about `paths` into the
+     * in-memory path info cache.
+     */
+    void queryPathInfosFromClientCache(const StorePathSet & paths);
+
     /**
      * Query the information about a realisation.
      */
@@ -695,6 +709,9 @@ public:
         std::atomic<uint64_t> narInfoMissing{0};
         std::atomic<uint64_t> narInfoWrite{0};
         std::atomic<uint64_t> pathInfoCacheSize{0};
+        std::atomic<uint64_t> pathInfoCacheHits{0};
+        std::atomic<uint64_t> pathInfoCacheMisses{0};
+        std::atomic<uint64_t> pathInfoCacheEvictions{0};
         std::atomic<uint64_t> narRead{0};
         std::atomic<uint64_t> narReadBytes{0};
         std::atomic<uint64_t> narReadCompressedBytes{0};
@@ -703,6 +720,16 @@ public:
         std::atomic<uint64_t> narWriteBytes{0};
         std::atomic<uint64_t> narWriteCompressedBytes{0};
         std::atomic<uint64_t> narWriteCompressionTimeMs{0};
+        std::atomic<uint64_t> chunkRead{0};
+        std::atomic<uint64_t> chunkReadBytes{0};
+        std::atomic<uint64_t> chunkReadCompressedBytes{0};
+        std::atomic<uint64_t> chunkReadAverted{0};
+        std::atomic<uint64_t> chunkReadAvertedBytes{0};
+        std::atomic<uint64_t> chunkWrite{0};
+        std::atomic<uint64_t> chunkWriteBytes{0};
+        std::atomic<uint64_t> chunkWriteCompressedBytes{0};
+        std::atomic<uint64_t> chunkWriteAverted{0};
+        std::atomic<uint64_t> chunkWriteAvertedBytes{0};
     };
 
     const Stats & getStats();
@@ -726,7 +753,7 @@ public:
      */
     void clearPathInfoCache()
     {
-        state.lock()->pathInfoCache.clear();
+        pathInfoCache.clear();
     }
 
     /**
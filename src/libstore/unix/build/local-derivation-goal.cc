@@ -2284,6 +2284,69 @@ void LocalDerivationGoal::runChild()
 }
 
 
+/**
+ * A `PosixSourceAccessor` that, while a path is being serialised, also
+ * records the NAR hash of every regular file and symlink in it, so
+ * that `LocalStore::optimisePath()` doesn't have to read them again.
+ */
+struct FileHashingAccessor : PosixSourceAccessor
+{
+    LocalStore::FileHashes fileHashes;
+
+    /**
+     * The last regular file that was statted, and whether it's
+     * executable. `dumpPath()` stats a file right before reading it.
+     */
+    std::optional<std::pair<CanonPath, bool>> lastRegularFile;
+
+    FileHashingAccessor(std::filesystem::path && root)
+        : PosixSourceAccessor(std::move(root))
+    { }
+
+    std::optional<Stat> maybeLstat(const CanonPath & path) override
+    {
+        auto st = PosixSourceAccessor::maybeLstat(path);
+        if (st && st->type == tRegular)
+            lastRegularFile.emplace(path, st->isExecutable);
+        return st;
+    }
+
+    void readFile(
+        const CanonPath & path,
+        Sink & sink,
+        std::function<void(uint64_t)> sizeCallback) override
+    {
+        bool executable = lastRegularFile && lastRegularFile->first == path
+            ? lastRegularFile->second
+            : lstat(path).isExecutable;
+        HashSink hashSink(HashAlgorithm::SHA256);
+        hashSink << narVersionMagic1 << "(" << "type" << "regular";
+        if (executable)
+            hashSink << "executable" << "";
+        hashSink << "contents";
+        uint64_t size = 0;
+        TeeSink teeSink(sink, hashSink);
+        PosixSourceAccessor::readFile(path, teeSink, [&](uint64_t _size) {
+            size = _size;
+            sizeCallback(_size);
+            hashSink << _size;
+        });
+        writePadding(size, hashSink);
+        hashSink << ")";
+        fileHashes.insert_or_assign(path, hashSink.finish().first);
+    }
+
+    std::string readLink(const CanonPath & path) override
+    {
+        auto target = PosixSourceAccessor::readLink(path);
+        HashSink hashSink(HashAlgorithm::SHA256);
+        hashSink << narVersionMagic1 << "(" << "type" << "symlink" << "target" << target << ")";
+        fileHashes.insert_or_assign(path, hashSink.finish().first);
+        return target;
+    }
+};
+
+
 SingleDrvOutputs LocalDerivationGoal::registerOutputs()
 {
     /* When using a build hook, the build hook can register the output
@@ -2298,6 +2361,10 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
 
     std::map<std::string, ValidPathInfo> infos;
 
+    /* File hashes computed by optimisePath(), to be recorded once the
+       outputs are valid. */
+    std::map<StorePath, LocalStore::FileHashes> fileHashes;
+
     /* Set of inodes seen during calls to canonicalisePathMetaData()
        for this build's outputs.  This needs to be shared between
        outputs to allow hard links between outputs. */
@@ -2333,6 +2400,12 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
     struct PerhapsNeedToRegister { StorePathSet refs; };
     std::map<std::string, std::variant<AlreadyRegistered, PerhapsNeedToRegister>> outputReferencesIfUnregistered;
     std::map<std::string, struct stat> outputStats;
+    struct OutputScan {
+        HashResult narHashAndSize;
+        std::optional<Hash> caHashModulo;
+        LocalStore::FileHashes fileHashes;
+    };
+    std::map<std::string, OutputScan> outputScans;
     for (auto & [outputName, _] : drv->outputs) {
         auto scratchOutput = get(scratchOutputs, outputName);
         if (!scratchOutput)
@@ -2399,21 +2472,62 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
             }
         }
 
-        StorePathSet references;
         if (discardReferences)
             debug("discarding references of output '%s'", outputName);
-        else {
+        else
             debug("scanning for references for output '%s' in temp location '%s'", outputName, actualPath);
 
-            /* Pass blank Sink as we are not ready to hash data at this stage. */
-            NullSink blank;
-            references = scanForReferences(blank, actualPath, referenceablePaths);
+        /* Serialise the output only once, and compute everything we
+           need from the NAR while scanning for references: the NAR
+           hash, the content address (modulo self-references) and the
+           hashes of the files for the store optimiser. These remain
+           valid unless the output is rewritten below. Fixed outputs are
+           always copied before they're hashed, so only the references
+           are needed from them. */
+        auto & outputRaw = drv->outputs.at(outputName).raw;
+        bool isFixed = std::holds_alternative<DerivationOutput::CAFixed>(outputRaw);
+        std::optional<HashAlgorithm> caHashAlgo;
+        std::visit(overloaded {
+            [&](const DerivationOutput::CAFloating & dof) {
+                if (dof.method.getFileIngestionMethod() == FileIngestionMethod::NixArchive)
+                    caHashAlgo = dof.hashAlgo;
+            },
+            [&](const DerivationOutput::Impure & doi) {
+                if (doi.method.getFileIngestionMethod() == FileIngestionMethod::NixArchive)
+                    caHashAlgo = doi.hashAlgo;
+            },
+            [&](const auto &) { },
+        }, outputRaw);
+
+        std::shared_ptr<FileHashingAccessor> hashingAccessor;
+        if (settings.autoOptimiseStore && !isFixed)
+            hashingAccessor = std::make_shared<FileHashingAccessor>(std::filesystem::path(actualPath));
+        auto accessor = hashingAccessor
+            ? ref<PosixSourceAccessor>(hashingAccessor)
+            : make_ref<PosixSourceAccessor>(std::filesystem::path(actualPath));
+        auto refsSink = PathRefScanSink::fromPaths(discardReferences ? StorePathSet{} : referenceablePaths);
+        HashSink narSink { HashAlgorithm::SHA256 };
+        TeeSink hashingSink { refsSink, narSink };
+        Sink & sink = isFixed ? (Sink &) refsSink : hashingSink;
+        std::unique_ptr<HashModuloSink> caSink;
+        std::optional<TeeSink> caTeeSink;
+        if (caHashAlgo) {
+            caSink = std::make_unique<HashModuloSink>(*caHashAlgo, std::string(scratchOutput->hashPart()));
+            caTeeSink.emplace(sink, *caSink);
         }
 
+        SourcePath(accessor).dumpPath(caTeeSink ? (Sink &) *caTeeSink : sink);
+
         outputReferencesIfUnregistered.insert_or_assign(
             outputName,
-            PerhapsNeedToRegister { .refs = references });
+            PerhapsNeedToRegister { .refs = refsSink.getResultPaths() });
         outputStats.insert_or_assign(outputName, std::move(st));
+        if (!isFixed)
+            outputScans.insert_or_assign(outputName, OutputScan {
+                .narHashAndSize = narSink.finish(),
+                .caHashModulo = caSink ? std::optional(caSink->finish().first) : std::nullopt,
+                .fileHashes = hashingAccessor ? std::move(hashingAccessor->fileHashes) : LocalStore::FileHashes{},
+            });
     }
 
     auto sortedOutputNames = topoSort(outputsToSort,
@@ -2483,10 +2597,17 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
             continue;
         auto references = *referencesOpt;
 
+        /* What we computed while scanning the output, or null for
+           fixed outputs and once the output has been rewritten. */
+        auto scan = get(outputScans, outputName);
+        bool modified = false;
+
         auto rewriteOutput = [&](const StringMap & rewrites) {
             /* Apply hash rewriting if necessary. */
             if (!rewrites.empty()) {
                 debug("rewriting hashes in '%1%'; cross fingers", actualPath);
+                scan = nullptr;
+                modified = true;
 
                 /* FIXME: Is this actually streaming? */
                 auto source = sinkToSource([&](Sink & nextSink) {
@@ -2554,6 +2675,8 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
                 case FileIngestionMethod::Flat:
                 case FileIngestionMethod::NixArchive:
                 {
+                    if (fim == FileIngestionMethod::NixArchive && scan && scan->caHashModulo)
+                        return *scan->caHashModulo;
                     HashModuloSink caSink { outputHash.hashAlgo, oldHashPart };
                     auto fim = outputHash.method.getFileIngestionMethod();
                     dumpPath(
@@ -2592,7 +2715,7 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
             }
 
             {
-                HashResult narHashAndSize = hashPath(
+                HashResult narHashAndSize = scan ? scan->narHashAndSize : hashPath(
                     {getFSSourceAccessor(), CanonPath(actualPath)},
                     FileSerialisationMethod::NixArchive, HashAlgorithm::SHA256);
                 newInfo0.narHash = narHashAndSize.first;
@@ -2615,7 +2738,7 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
                         std::string { scratchPath->hashPart() },
                         std::string { requiredFinalPath.hashPart() });
                 rewriteOutput(outputRewrites);
-                HashResult narHashAndSize = hashPath(
+                HashResult narHashAndSize = scan ? scan->narHashAndSize : hashPath(
                     {getFSSourceAccessor(), CanonPath(actualPath)},
                     FileSerialisationMethod::NixArchive, HashAlgorithm::SHA256);
                 ValidPathInfo newInfo0 { requiredFinalPath, narHashAndSize.first };
@@ -2638,6 +2761,11 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
                     std::filesystem::path(tmpOutput), true);
 
                 std::filesystem::rename(tmpOutput, actualPath);
+                /* A process holding such a descriptor may have changed
+                   the output since it was scanned, which is why it
+                   wasn't hashed during the scan. */
+                assert(!scan);
+                modified = true;
 
                 auto newInfo0 = newInfoFromCA(DerivationOutput::CAFloating {
                     .method = dof.ca.method,
@@ -2684,9 +2812,12 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
 
         }, output->raw);
 
-        /* FIXME: set proper permissions in restorePath() so
-            we don't have to do another traversal. */
-        canonicalisePathMetaData(actualPath, {}, inodesSeen);
+        /* The output was canonicalised before scanning it, so this is
+           only needed if it has been replaced since.
+           FIXME: set proper permissions in restorePath() so
+           we don't have to do another traversal. */
+        if (modified)
+            canonicalisePathMetaData(actualPath, {}, inodesSeen);
 
         /* Calculate where we'll move the output files. In the checking case we
            will leave leave them where they are, for now, rather than move to
@@ -2770,7 +2901,8 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
                 debug("unreferenced input: '%1%'", worker.store.printStorePath(i));
         }
 
-        localStore.optimisePath(actualPath, NoRepair); // FIXME: combine with scanForReferences()
+        fileHashes.insert_or_assign(newInfo.path,
+            localStore.optimisePath(actualPath, NoRepair, scan ? &scan->fileHashes : nullptr));
         worker.markContentsGood(newInfo.path);
 
         newInfo.deriver = drvPath;
@@ -2782,8 +2914,10 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
         /* If it's a CA path, register it right away. This is necessary if it
            isn't statically known so that we can safely unlock the path before
            the next iteration */
-        if (newInfo.ca)
+        if (newInfo.ca) {
             localStore.registerValidPaths({{newInfo.path, newInfo}});
+            localStore.addOptimisedFiles(newInfo.path, fileHashes[newInfo.path]);
+        }
 
         infos.emplace(outputName, std::move(newInfo));
     }
@@ -2811,6 +2945,9 @@ SingleDrvOutputs LocalDerivationGoal::registerOutputs()
             infos2.insert_or_assign(newInfo.path, newInfo);
         }
         localStore.registerValidPaths(infos2);
+
+        for (auto & [path, hashes] : fileHashes)
+            localStore.addOptimisedFiles(path, hashes);
     }
 
     /* In case of a fixed-output derivation hash mismatch, throw an
@@ -0,0 +1,98 @@
+#include <gtest/gtest.h>
+
+#include <random>
+#include <set>
+
+#include "chunking.hh"
+
+namespace nix {
+
+static std::string randomData(size_t size, unsigned int seed)
+{
+    std::mt19937 gen(seed);
+    std::string s(size, 0);
+    for (auto & c : s)
+        c = gen();
+    return s;
+}
+
+static std::vector<std::string> chunk(std::string_view data, size_t avgSize, size_t writeSize = 65536)
+{
+    std::vector<std::string> chunks;
+    ChunkingSink sink(avgSize, [&](std::string_view chunk) {
+        chunks.emplace_back(chunk);
+    });
+    for (size_t i = 0; i < data.size(); i += writeSize)
+        sink(data.substr(i, writeSize));
+    sink.finish();
+    return chunks;
+}
+
+TEST(ChunkingSink, sizes)
+{
+    auto data = randomData(4 << 20, 1);
+    auto chunks = chunk(data, 16384);
+
+    std::string concatenated;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (i + 1 < chunks.size()) {
+            ASSERT_GE(chunks[i].size(), 16384u / 4);
+            ASSERT_LE(chunks[i].size(), 16384u * 8);
+        }
+        concatenated += chunks[i];
+    }
+    ASSERT_EQ(concatenated, data);
+
+    auto avg = data.size() / chunks.size();
+    ASSERT_GT(avg, 16384u / 2);
+    ASSERT_LT(avg, 16384u * 2);
+}
+
+TEST(ChunkingSink, independentOfWrites)
+{
+    auto data = randomData(1 << 20, 2);
+    auto chunks = chunk(data, 4096);
+    ASSERT_EQ(chunk(data, 4096, 1), chunks);
+    ASSERT_EQ(chunk(data, 4096, 1000), chunks);
+    ASSERT_EQ(chunk(data, 4096, data.size()), chunks);
+}
+
+TEST(ChunkingSink, maxSize)
+{
+    auto chunks = chunk(std::string(100000, 'x'), 1024);
+    ASSERT_EQ(chunks.size(), 13u);
+    ASSERT_EQ(chunks[0].size(), 8192u);
+    ASSERT_EQ(chunks.back().size(), 100000u % 8192);
+}
+
+TEST(ChunkingSink, insertion)
+{
+    auto data = randomData(1 << 20, 3);
+    auto data2 = data;
+    data2.insert(data.size() / 2, "inserted");
+
+    auto chunks = chunk(data, 8192);
+    auto chunks2 = chunk(data2, 8192);
+
+    std::set<std::string> chunkSet(chunks.begin(), chunks.end());
+    size_t shared = 0;
+    for (auto & c : chunks2)
+        shared += chunkSet.count(c);
+
+    /* Only the chunk containing the insertion (and possibly its
+       neighbour) should have changed. */
+    ASSERT_GE(shared + 2, chunks2.size());
+}
+
+TEST(ChunkingSink, empty)
+{
+    ASSERT_TRUE(chunk("", 4096).empty());
+    ASSERT_EQ(chunk("foo", 4096), std::vector<std::string>{"foo"});
+}
+
+TEST(ChunkingSink, tooSmall)
+{
+    ASSERT_THROW(ChunkingSink(32, [](std::string_view) {}), Error);
+}
+
+}
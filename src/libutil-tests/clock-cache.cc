@@ -0,0 +1,104 @@
+#include "clock-cache.hh"
+
+#include <gtest/gtest.h>
+#include <thread>
+
+namespace nix {
+
+    TEST(ClockCache, getFromEmptyCache) {
+        ClockCache<std::string, std::string> c(10);
+        ASSERT_EQ(c.get("x"), std::nullopt);
+        ASSERT_EQ(c.size(), 0);
+        ASSERT_EQ(c.getMisses(), 1);
+    }
+
+    TEST(ClockCache, upsertAndGet) {
+        ClockCache<std::string, std::string> c(10);
+        c.upsert("foo", "bar");
+        c.upsert("foo", "baz");
+        ASSERT_EQ(c.get("foo"), "baz");
+        ASSERT_EQ(c.size(), 1);
+        ASSERT_EQ(c.getHits(), 1);
+    }
+
+    TEST(ClockCache, zeroCapacity) {
+        ClockCache<std::string, std::string> c(0);
+        c.upsert("foo", "bar");
+        ASSERT_EQ(c.get("foo"), std::nullopt);
+        ASSERT_EQ(c.size(), 0);
+    }
+
+    TEST(ClockCache, erase) {
+        ClockCache<std::string, std::string> c(10);
+        c.upsert("foo", "bar");
+        ASSERT_TRUE(c.erase("foo"));
+        ASSERT_FALSE(c.erase("foo"));
+        ASSERT_EQ(c.get("foo"), std::nullopt);
+
+        /* The freed slot is reused. */
+        for (int i = 0; i < 10; ++i)
+            c.upsert(std::to_string(i), "x");
+        ASSERT_EQ(c.size(), 10);
+        ASSERT_EQ(c.getEvictions(), 0);
+    }
+
+    TEST(ClockCache, evictsUnreferencedEntries) {
+        ClockCache<std::string, std::string> c(3);
+        c.upsert("a", "1");
+        c.upsert("b", "2");
+        c.upsert("c", "3");
+
+        /* "a" has been used since it was inserted, so the clock hand
+           skips it. */
+        c.get("a");
+        c.upsert("d", "4");
+
+        ASSERT_EQ(c.size(), 3);
+        ASSERT_EQ(c.getEvictions(), 1);
+        ASSERT_EQ(c.get("a"), "1");
+        ASSERT_EQ(c.get("b"), std::nullopt);
+        ASSERT_EQ(c.get("c"), "3");
+        ASSERT_EQ(c.get("d"), "4");
+    }
+
+    TEST(ClockCache, boundedSize) {
+        ClockCache<int, int> c(1000);
+        for (int i = 0; i < 10000; ++i)
+            c.upsert(i, i);
+        ASSERT_LE(c.size(), 1000);
+        ASSERT_EQ(c.getEvictions(), 10000 - c.size());
+        ASSERT_EQ(c.get(9999), 9999);
+    }
+
+    TEST(ClockCache, clear) {
+        ClockCache<int, int> c(1000);
+        for (int i = 0; i < 100; ++i)
+            c.upsert(i, i);
+        c.clear();
+        ASSERT_EQ(c.size(), 0);
+        ASSERT_EQ(c.get(1), std::nullopt);
+        c.upsert(1, 2);
+        ASSERT_EQ(c.get(1), 2);
+    }
+
+    TEST(ClockCache, concurrentAccess) {
+        ClockCache<int, int> c(512);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+            threads.emplace_back([&, t]() {
+                for (int i = 0; i < 10000; ++i) {
+                    c.upsert((i * 7 + t) % 2048, i);
+                    if (auto v = c.get(i % 2048))
+                        ASSERT_GE(*v, 0);
+                    if (i % 100 == 0)
+                        c.erase(i % 2048);
+                }
+            });
+        for (auto & thread : threads)
+            thread.join();
+        ASSERT_LE(c.size(), 512);
+        /* The counters of all shards add up. */
+        ASSERT_EQ(c.getHits() + c.getMisses(), 4 * 10000);
+    }
+
+}
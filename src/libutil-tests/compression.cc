@@ -59,6 +59,42 @@ namespace nix {
         ASSERT_EQ(o, str);
     }
 
+    TEST(decompress, decompressZstdCompressed) {
+        auto method = "zstd";
+        auto str = "slfja;sljfklsa;jfklsjfkl;sdjfkl;sadjfkl;sdjf;lsdfjsadlf";
+        auto o = decompress(method, compress(method, str));
+
+        ASSERT_EQ(o, str);
+    }
+
+    static std::string makeCompressibleData(size_t size) {
+        std::string str;
+        for (size_t i = 0; str.size() < size; ++i)
+            str += std::to_string(i * i) + " ";
+        str.resize(size);
+        return str;
+    }
+
+    TEST(decompress, decompressZstdSeekableCompressed) {
+        // Several frames, the last one partial.
+        auto str = makeCompressibleData(10 * 1024 * 1024 + 123);
+        for (auto parallel : {false, true}) {
+            auto compressed = compress("zstd-seekable", str, parallel);
+            ASSERT_EQ(decompress("zstd", compressed), str);
+            // Concatenations of zstd data are valid zstd data.
+            ASSERT_EQ(decompress("zstd", compressed + compress("zstd", "foo", parallel)), str + "foo");
+        }
+    }
+
+    TEST(decompress, decompressTruncatedZstdThrowsCompressionError) {
+        auto str = makeCompressibleData(100000);
+        for (auto method : {"zstd", "zstd-seekable"}) {
+            auto compressed = compress(method, str);
+            ASSERT_THROW(decompress(method, compressed.substr(0, compressed.size() / 2)), CompressionError);
+        }
+        ASSERT_THROW(decompress("zstd", "this is not zstd data"), CompressionError);
+    }
+
     TEST(decompress, decompressInvalidInputThrowsCompressionError) {
         auto method = "bzip2";
         auto str = "this is a string that does not qualify as valid bzip2 data";
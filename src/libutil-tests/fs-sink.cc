@@ -0,0 +1,45 @@
+#include <gtest/gtest.h>
+
+#include "archive.hh"
+#include "file-content-address.hh"
+#include "file-system.hh"
+#include "posix-source-accessor.hh"
+#include "source-path.hh"
+
+namespace nix {
+
+TEST(FileHashingSink, matchesHashPath)
+{
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir, true);
+
+    auto src = tmpDir + "/src";
+    createDirs(src + "/dir");
+    writeFile(src + "/file", "hello");
+    writeFile(src + "/empty", "");
+    writeFile(src + "/dir/exe", std::string(100000, 'x'));
+    std::filesystem::permissions(src + "/dir/exe", std::filesystem::perms::owner_exec, std::filesystem::perm_options::add);
+    createSymlink("file", src + "/link");
+
+    StringSink nar;
+    dumpPath(src, nar);
+
+    RestoreSink restoreSink(false);
+    restoreSink.dstPath = tmpDir + "/dst";
+    FileHashingSink sink(restoreSink);
+    StringSource source(nar.s);
+    parseDump(sink, source);
+
+    ASSERT_EQ(sink.fileHashes.size(), 4u);
+    for (auto & name : {"/file", "/empty", "/dir/exe", "/link"}) {
+        CanonPath path(name);
+        auto expected = hashPath(
+            PosixSourceAccessor::createAtRoot(restoreSink.dstPath / path.rel()),
+            FileSerialisationMethod::NixArchive, HashAlgorithm::SHA256).first;
+        ASSERT_EQ(sink.fileHashes.at(path), expected) << name;
+    }
+
+    ASSERT_EQ(readFile(tmpDir + "/dst/dir/exe").size(), 100000u);
+}
+
+}
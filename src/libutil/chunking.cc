@@ -0,0 +1,93 @@
+#include "chunking.hh"
+#include "error.hh"
+
+#include <array>
+#include <bit>
+
+namespace nix {
+
+/**
+ * The random values that the gear hash adds for each byte. They're
+ * generated with SplitMix64 from a fixed seed, since changing them
+ * would change all chunk boundaries.
+ */
+static constexpr std::array<uint64_t, 256> gear = []() {
+    std::array<uint64_t, 256> res;
+    uint64_t state = 0x6e69782d63686e6bULL;
+    for (auto & v : res) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        v = z ^ (z >> 31);
+    }
+    return res;
+}();
+
+/**
+ * A mask of the `bits` most significant bits. The gear hash shifts
+ * left, so its high bits depend on the most bytes.
+ */
+static uint64_t topBits(unsigned int bits)
+{
+    return bits ? ~uint64_t(0) << (64 - bits) : 0;
+}
+
+ChunkingSink::ChunkingSink(size_t avgSize, ChunkCallback callback)
+    : callback(std::move(callback))
+{
+    if (avgSize < 64)
+        throw Error("average chunk size %d is too small", avgSize);
+    this->avgSize = std::bit_floor(avgSize);
+    minSize = this->avgSize / 4;
+    maxSize = this->avgSize * 8;
+    unsigned int bits = std::countr_zero(this->avgSize);
+    /* With these masks, the average chunk size is within a few
+       percent of `avgSize`. */
+    maskS = topBits(bits + 1);
+    maskL = topBits(bits - 2);
+}
+
+void ChunkingSink::operator () (std::string_view data)
+{
+    while (!data.empty()) {
+        size_t len = chunk.size();
+        size_t i = 0;
+        bool cut = false;
+
+        /* Don't bother hashing the first `minSize` bytes of a chunk,
+           since there can't be a boundary there. */
+        if (len < minSize) {
+            i = std::min(minSize - len, data.size());
+            len += i;
+        }
+
+        while (i < data.size()) {
+            hash = (hash << 1) + gear[(unsigned char) data[i++]];
+            len++;
+            if (!(hash & (len < avgSize ? maskS : maskL)) || len >= maxSize) {
+                cut = true;
+                break;
+            }
+        }
+
+        chunk.append(data.substr(0, i));
+        data.remove_prefix(i);
+
+        if (cut) {
+            callback(chunk);
+            chunk.clear();
+            hash = 0;
+        }
+    }
+}
+
+void ChunkingSink::finish()
+{
+    if (!chunk.empty()) {
+        callback(chunk);
+        chunk.clear();
+    }
+    hash = 0;
+}
+
+}
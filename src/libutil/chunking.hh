@@ -0,0 +1,56 @@
+#pragma once
+///@file
+
+#include "serialise.hh"
+
+#include <functional>
+
+namespace nix {
+
+/**
+ * A sink that splits its input into content-defined chunks, using the
+ * FastCDC algorithm. A chunk boundary is placed wherever a rolling
+ * ("gear") hash of the last 64 bytes matches a mask, so boundaries only
+ * depend on the data around them: inserting or removing bytes only
+ * changes the chunks around the edit, and identical data in different
+ * streams tends to be split into identical chunks.
+ *
+ * Chunks are at least `avgSize / 4` and at most `avgSize * 8` bytes
+ * long (except for the last one, which may be shorter). To keep most
+ * chunks close to `avgSize`, a stricter mask is used before that size
+ * and a looser one after it ("normalised chunking").
+ *
+ * Chunk boundaries depend on `avgSize`, so streams must be chunked
+ * with the same `avgSize` to share chunks.
+ */
+struct ChunkingSink : FinishSink
+{
+    using ChunkCallback = std::function<void(std::string_view chunk)>;
+
+    /**
+     * @param avgSize The desired average chunk size. It is rounded
+     * down to a power of 2 and must be at least 64.
+     */
+    ChunkingSink(size_t avgSize, ChunkCallback callback);
+
+    void operator () (std::string_view data) override;
+
+    /**
+     * Pass the remaining data to the callback as the last chunk.
+     */
+    void finish() override;
+
+private:
+
+    size_t minSize, avgSize, maxSize;
+
+    uint64_t maskS, maskL;
+
+    uint64_t hash = 0;
+
+    std::string chunk;
+
+    ChunkCallback callback;
+};
+
+}
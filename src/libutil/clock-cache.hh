@@ -0,0 +1,231 @@
+#pragma once
+///@file
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "sync.hh"
+
+namespace nix {
+
+/**
+ * A thread-safe cache with approximate LRU eviction, for caches that
+ * are hit from many threads at once.
+ *
+ * The cache is split into a number of shards, selected by the hash of
+ * the key, that each have their own lock. Lookups only take a shared
+ * lock on their shard. Instead of maintaining a global LRU list, each
+ * entry has a "referenced" bit that is set on every lookup; when a
+ * shard is full, a "clock hand" sweeps over its entries, clearing
+ * referenced bits until it finds an entry that hasn't been used since
+ * the last sweep, and evicts that one.
+ */
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class ClockCache
+{
+private:
+
+    struct Slot
+    {
+        /**
+         * Points to the key in `Shard::index`, or `nullptr` if this
+         * slot is free.
+         */
+        const Key * key = nullptr;
+        Value value;
+        std::atomic<bool> referenced{false};
+    };
+
+    struct Shard
+    {
+        std::unordered_map<Key, size_t, Hash> index;
+
+        /**
+         * A deque, so that slots don't move when it grows.
+         */
+        std::deque<Slot> slots;
+
+        std::vector<size_t> freeSlots;
+
+        size_t hand = 0;
+    };
+
+    size_t shardCapacity;
+
+    unsigned int shardBits;
+
+    std::unique_ptr<SharedSync<Shard>[]> shards;
+
+    /**
+     * The statistics of a shard. They're kept per shard and on their
+     * own cache line, so that lookups in different shards don't write
+     * to the same cache line.
+     */
+    struct alignas(64) Counters
+    {
+        std::atomic<uint64_t> hits{0}, misses{0}, evictions{0};
+    };
+
+    std::unique_ptr<Counters[]> counters;
+
+    size_t shardIndex(const Key & key) const
+    {
+        if (!shardBits) return 0;
+        /* Mix the hash, since `std::hash` of a string-like key may
+           only have entropy in some of its bits. */
+        uint64_t h = Hash()(key) * 0x9e3779b97f4a7c15ULL;
+        return h >> (64 - shardBits);
+    }
+
+    SharedSync<Shard> & shardFor(const Key & key) const
+    {
+        return shards[shardIndex(key)];
+    }
+
+    uint64_t sum(std::atomic<uint64_t> Counters::* counter) const
+    {
+        uint64_t n = 0;
+        for (size_t i = 0; i < (size_t(1) << shardBits); ++i)
+            n += (counters[i].*counter).load(std::memory_order_relaxed);
+        return n;
+    }
+
+public:
+
+    /**
+     * @param capacity The maximum number of entries (approximately,
+     * since it's rounded up to a multiple of the number of shards). A
+     * capacity of 0 disables the cache.
+     */
+    ClockCache(size_t capacity, unsigned int maxShardBits = 4)
+    {
+        shardBits = 0;
+        while (shardBits < maxShardBits && (capacity >> (shardBits + 1)) >= 64)
+            shardBits++;
+        size_t nrShards = size_t(1) << shardBits;
+        shardCapacity = (capacity + nrShards - 1) / nrShards;
+        shards = std::make_unique<SharedSync<Shard>[]>(nrShards);
+        counters = std::make_unique<Counters[]>(nrShards);
+    }
+
+    /**
+     * Insert or upsert an item in the cache.
+     */
+    void upsert(const Key & key, const Value & value)
+    {
+        if (shardCapacity == 0) return;
+
+        auto idx = shardIndex(key);
+        auto shard(shards[idx].lock());
+
+        auto i = shard->index.find(key);
+        if (i != shard->index.end()) {
+            auto & slot = shard->slots[i->second];
+            slot.value = value;
+            slot.referenced.store(true, std::memory_order_relaxed);
+            return;
+        }
+
+        size_t n;
+
+        if (!shard->freeSlots.empty()) {
+            n = shard->freeSlots.back();
+            shard->freeSlots.pop_back();
+        } else if (shard->slots.size() < shardCapacity) {
+            n = shard->slots.size();
+            shard->slots.emplace_back();
+        } else {
+            /* Evict the first entry that the clock hand finds
+               without its referenced bit set. This terminates after
+               at most one full sweep. */
+            while (true) {
+                auto & slot = shard->slots[shard->hand];
+                if (!slot.referenced.exchange(false, std::memory_order_relaxed)) break;
+                shard->hand = (shard->hand + 1) % shard->slots.size();
+            }
+            n = shard->hand;
+            shard->hand = (shard->hand + 1) % shard->slots.size();
+            shard->index.erase(*shard->slots[n].key);
+            counters[idx].evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        auto j = shard->index.emplace(key, n).first;
+        auto & slot = shard->slots[n];
+        slot.key = &j->first;
+        slot.value = value;
+        slot.referenced.store(false, std::memory_order_relaxed);
+    }
+
+    bool erase(const Key & key)
+    {
+        auto shard(shardFor(key).lock());
+        auto i = shard->index.find(key);
+        if (i == shard->index.end()) return false;
+        auto & slot = shard->slots[i->second];
+        slot.key = nullptr;
+        slot.value = Value();
+        slot.referenced.store(false, std::memory_order_relaxed);
+        shard->freeSlots.push_back(i->second);
+        shard->index.erase(i);
+        return true;
+    }
+
+    /**
+     * Look up an item in the cache. If it exists, it is marked as
+     * recently used.
+     */
+    std::optional<Value> get(const Key & key)
+    {
+        auto idx = shardIndex(key);
+        auto shard(shards[idx].readLock());
+        auto i = shard->index.find(key);
+        if (i == shard->index.end()) {
+            counters[idx].misses.fetch_add(1, std::memory_order_relaxed);
+            return {};
+        }
+        counters[idx].hits.fetch_add(1, std::memory_order_relaxed);
+        auto & slot = shard->slots[i->second];
+        const_cast<Slot &>(slot).referenced.store(true, std::memory_order_relaxed);
+        return slot.value;
+    }
+
+    size_t size() const
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < (size_t(1) << shardBits); ++i)
+            n += shards[i].readLock()->index.size();
+        return n;
+    }
+
+    void clear()
+    {
+        for (size_t i = 0; i < (size_t(1) << shardBits); ++i) {
+            auto shard(shards[i].lock());
+            shard->index.clear();
+            shard->slots.clear();
+            shard->freeSlots.clear();
+            shard->hand = 0;
+        }
+    }
+
+    /**
+     * Number of lookups that found an entry.
+     */
+    uint64_t getHits() const { return sum(&Counters::hits); }
+
+    /**
+     * Number of lookups that didn't find an entry.
+     */
+    uint64_t getMisses() const { return sum(&Counters::misses); }
+
+    /**
+     * Number of entries that were evicted to make room for others.
+     */
+    uint64_t getEvictions() const { return sum(&Counters::evictions); }
+};
+
+}
@@ -12,6 +12,12 @@
 #include <brotli/decode.h>
 #include <brotli/encode.h>
 
+#include <zstd.h>
+
+#include <deque>
+#include <future>
+#include <thread>
+
 namespace nix {
 
 static const int COMPRESSION_LEVEL_DEFAULT = -1;
@@ -204,6 +210,335 @@ struct BrotliDecompressionSink : ChunkedCompressionSink
     }
 };
 
+/**
+ * The number of zstd frames that are (de)compressed concurrently.
+ */
+static size_t zstdParallelism()
+{
+    return std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 16);
+}
+
+/**
+ * Frames with a known decompressed size up to this size are
+ * decompressed in parallel. Larger frames, or frames that don't record
+ * their size (e.g. those produced by a streaming compressor), are
+ * decompressed as a stream.
+ */
+static constexpr size_t zstdMaxParallelFrameSize = 16 * 1024 * 1024;
+
+/**
+ * The amount of uncompressed data per frame in the `zstd-seekable`
+ * format.
+ */
+static constexpr size_t zstdSeekableFrameSize = 4 * 1024 * 1024;
+
+static constexpr size_t zstdFrameHeaderSizeMax = 18;
+
+static constexpr uint32_t zstdSkippableMagic = 0x184D2A5E;
+static constexpr uint32_t zstdSeekableMagic = 0x8F92EAB1;
+
+/**
+ * Decompress zstd data, which may consist of any number of frames.
+ * Independent frames (such as those written in the `zstd-seekable`
+ * format) are decompressed on multiple threads.
+ */
+struct ZstdDecompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    ZSTD_DStream * dstream;
+
+    /**
+     * Input that hasn't been decompressed yet, starting at `bufPos`.
+     */
+    std::string buf;
+    size_t bufPos = 0;
+
+    /**
+     * Whether we're in the middle of a frame that is being
+     * decompressed by `dstream`.
+     */
+    bool streaming = false;
+
+    /**
+     * Frames being decompressed in parallel, in order.
+     */
+    std::deque<std::future<std::string>> pending;
+
+    const size_t maxPending = zstdParallelism();
+
+    ZstdDecompressionSink(Sink & nextSink)
+        : nextSink(nextSink)
+    {
+        dstream = ZSTD_createDStream();
+        if (!dstream)
+            throw CompressionError("unable to initialise zstd decoder");
+    }
+
+    ~ZstdDecompressionSink()
+    {
+        ZSTD_freeDStream(dstream);
+    }
+
+    void finish() override
+    {
+        flush();
+        process(true);
+        drain(0);
+        if (streaming || bufPos < buf.size())
+            throw CompressionError("zstd data is truncated");
+    }
+
+    void writeUnbuffered(std::string_view data) override
+    {
+        buf.append(data);
+        process(false);
+    }
+
+    void drain(size_t limit)
+    {
+        while (pending.size() > limit) {
+            auto out = pending.front().get();
+            pending.pop_front();
+            nextSink(out);
+        }
+    }
+
+    void process(bool atEnd)
+    {
+        while (bufPos < buf.size()) {
+            checkInterrupt();
+
+            std::string_view in(buf.data() + bufPos, buf.size() - bufPos);
+
+            if (streaming) {
+                drain(0);
+                char outbuf[64 * 1024];
+                ZSTD_inBuffer input{in.data(), in.size(), 0};
+                while (streaming) {
+                    ZSTD_outBuffer output{outbuf, sizeof(outbuf), 0};
+                    auto res = ZSTD_decompressStream(dstream, &output, &input);
+                    if (ZSTD_isError(res))
+                        throw CompressionError("error while decompressing zstd data: %s", ZSTD_getErrorName(res));
+                    if (output.pos)
+                        nextSink({outbuf, output.pos});
+                    if (res == 0)
+                        streaming = false;
+                    else if (input.pos == input.size && output.pos < output.size)
+                        break;
+                }
+                bufPos += input.pos;
+                if (streaming) break;
+                continue;
+            }
+
+            /* Wait for a complete frame header. */
+            if (in.size() < zstdFrameHeaderSizeMax && !atEnd) break;
+
+            auto contentSize = ZSTD_getFrameContentSize(in.data(), in.size());
+            if (contentSize == ZSTD_CONTENTSIZE_ERROR)
+                throw CompressionError("invalid zstd data");
+
+            if (contentSize == ZSTD_CONTENTSIZE_UNKNOWN || contentSize > zstdMaxParallelFrameSize) {
+                auto res = ZSTD_DCtx_reset(dstream, ZSTD_reset_session_only);
+                if (ZSTD_isError(res))
+                    throw CompressionError("unable to reset zstd decoder: %s", ZSTD_getErrorName(res));
+                streaming = true;
+                continue;
+            }
+
+            /* Wait until we have the entire frame. */
+            auto frameSize = ZSTD_findFrameCompressedSize(in.data(), in.size());
+            if (ZSTD_isError(frameSize)) {
+                if (atEnd || in.size() > ZSTD_compressBound(contentSize) + 1024)
+                    throw CompressionError("invalid zstd frame: %s", ZSTD_getErrorName(frameSize));
+                break;
+            }
+
+            /* Skippable frames, such as seek tables, have no content. */
+            if (contentSize) {
+                pending.push_back(std::async(std::launch::async, [frame = std::string(in.substr(0, frameSize)), contentSize]() {
+                    std::string out(contentSize, 0);
+                    auto res = ZSTD_decompress(out.data(), out.size(), frame.data(), frame.size());
+                    if (ZSTD_isError(res))
+                        throw CompressionError("error while decompressing zstd data: %s", ZSTD_getErrorName(res));
+                    if (res != contentSize)
+                        throw CompressionError("zstd frame has the wrong size");
+                    return out;
+                }));
+                drain(maxPending);
+            }
+
+            bufPos += frameSize;
+        }
+
+        if (bufPos) {
+            buf.erase(0, bufPos);
+            bufPos = 0;
+        }
+    }
+};
+
+/**
+ * Compress data to zstd. With `seekable` set, the output is in the
+ * zstd seekable format: a sequence of independent frames of at most
+ * `zstdSeekableFrameSize` bytes of uncompressed data, followed by a
+ * seek table in a skippable frame. This is still valid zstd data, but
+ * it can be decompressed in parallel. With `parallel` set, frames are
+ * compressed on multiple threads.
+ */
+struct ZstdCompressionSink : CompressionSink
+{
+    Sink & nextSink;
+    const bool parallel;
+    const bool seekable;
+    const int level;
+
+    ZSTD_CStream * cstream = nullptr;
+
+    /**
+     * In seekable mode, the uncompressed data of the current frame,
+     * the frames being compressed, and the compressed and
+     * uncompressed sizes of the frames written so far.
+     */
+    std::string frame;
+    std::deque<std::future<std::string>> pending;
+    std::vector<std::pair<uint32_t, uint32_t>> seekTable;
+
+    const size_t maxPending = zstdParallelism();
+
+    ZstdCompressionSink(Sink & nextSink, bool parallel, bool seekable, int level)
+        : nextSink(nextSink)
+        , parallel(parallel)
+        , seekable(seekable)
+        , level(level == COMPRESSION_LEVEL_DEFAULT ? ZSTD_CLEVEL_DEFAULT : level)
+    {
+        if (seekable) return;
+
+        cstream = ZSTD_createCStream();
+        if (!cstream)
+            throw CompressionError("unable to initialise zstd encoder");
+        check(ZSTD_CCtx_setParameter(cstream, ZSTD_c_compressionLevel, this->level));
+        if (parallel) {
+            /* This fails if libzstd was built without threads, in
+               which case we just compress on this thread. */
+            auto res = ZSTD_CCtx_setParameter(cstream, ZSTD_c_nbWorkers, std::thread::hardware_concurrency());
+            if (ZSTD_isError(res))
+                debug("cannot use multi-threaded zstd compression: %s", ZSTD_getErrorName(res));
+        }
+    }
+
+    ~ZstdCompressionSink()
+    {
+        ZSTD_freeCStream(cstream);
+    }
+
+    void check(size_t res)
+    {
+        if (ZSTD_isError(res))
+            throw CompressionError("error while compressing zstd data: %s", ZSTD_getErrorName(res));
+    }
+
+    void finish() override
+    {
+        flush();
+
+        if (!seekable) {
+            compressStream({}, ZSTD_e_end);
+            return;
+        }
+
+        if (!frame.empty())
+            endFrame();
+        drain(0);
+
+        StringSink table;
+        auto put32 = [&](uint32_t n) {
+            char bytes[4] = {(char) n, (char) (n >> 8), (char) (n >> 16), (char) (n >> 24)};
+            table({bytes, sizeof(bytes)});
+        };
+        put32(zstdSkippableMagic);
+        put32(seekTable.size() * 8 + 9);
+        for (auto & [compressedSize, size] : seekTable) {
+            put32(compressedSize);
+            put32(size);
+        }
+        put32(seekTable.size());
+        table({"\0", 1}); // descriptor: no checksums
+        put32(zstdSeekableMagic);
+        nextSink(table.s);
+    }
+
+    void writeUnbuffered(std::string_view data) override
+    {
+        if (!seekable) {
+            compressStream(data, ZSTD_e_continue);
+            return;
+        }
+
+        while (!data.empty()) {
+            auto n = std::min(data.size(), zstdSeekableFrameSize - frame.size());
+            frame.append(data.substr(0, n));
+            data.remove_prefix(n);
+            if (frame.size() == zstdSeekableFrameSize)
+                endFrame();
+        }
+    }
+
+    void compressStream(std::string_view data, ZSTD_EndDirective mode)
+    {
+        char outbuf[64 * 1024];
+        ZSTD_inBuffer input{data.data(), data.size(), 0};
+        while (true) {
+            checkInterrupt();
+            ZSTD_outBuffer output{outbuf, sizeof(outbuf), 0};
+            auto remaining = ZSTD_compressStream2(cstream, &output, &input, mode);
+            check(remaining);
+            if (output.pos)
+                nextSink({outbuf, output.pos});
+            if (mode == ZSTD_e_end ? remaining == 0 : input.pos == input.size)
+                break;
+        }
+    }
+
+    void endFrame()
+    {
+        auto compressFrame = [level(level)](std::string frame) {
+            std::string out(ZSTD_compressBound(frame.size()), 0);
+            auto res = ZSTD_compress(out.data(), out.size(), frame.data(), frame.size(), level);
+            if (ZSTD_isError(res))
+                throw CompressionError("error while compressing zstd data: %s", ZSTD_getErrorName(res));
+            out.resize(res);
+            return out;
+        };
+
+        seekTable.emplace_back(0, frame.size());
+
+        if (parallel)
+            pending.push_back(std::async(std::launch::async, compressFrame, std::move(frame)));
+        else {
+            std::promise<std::string> promise;
+            promise.set_value(compressFrame(std::move(frame)));
+            pending.push_back(promise.get_future());
+        }
+        frame.clear();
+
+        drain(parallel ? maxPending : 0);
+    }
+
+    void drain(size_t limit)
+    {
+        while (pending.size() > limit) {
+            auto out = pending.front().get();
+            pending.pop_front();
+            /* Fill in the compressed sizes in order. */
+            auto i = seekTable.size() - pending.size() - 1;
+            seekTable[i].first = out.size();
+            nextSink(out);
+        }
+    }
+};
+
+
 std::string decompress(const std::string & method, std::string_view in)
 {
     StringSink ssink;
@@ -219,6 +554,8 @@ std::unique_ptr<FinishSink> makeDecompressionSink(const std::string & method, Si
         return std::make_unique<NoneSink>(nextSink);
     else if (method == "br")
         return std::make_unique<BrotliDecompressionSink>(nextSink);
+    else if (method == "zstd" || method == "zstd-seekable")
+        return std::make_unique<ZstdDecompressionSink>(nextSink);
     else
         return sourceToSink([method, &nextSink](Source & source) {
             auto decompressionSource = std::make_unique<ArchiveDecompressionSource>(source, method);
@@ -286,7 +623,7 @@ struct BrotliCompressionSink : ChunkedCompressionSink
 ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel, int level)
 {
     std::vector<std::string> la_supports = {
-        "bzip2", "compress", "grzip", "gzip", "lrzip", "lz4", "lzip", "lzma", "lzop", "xz", "zstd"};
+        "bzip2", "compress", "grzip", "gzip", "lrzip", "lz4", "lzip", "lzma", "lzop", "xz"};
     if (std::find(la_supports.begin(), la_supports.end(), method) != la_supports.end()) {
         return make_ref<ArchiveCompressionSink>(nextSink, method, parallel, level);
     }
@@ -294,6 +631,8 @@ ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & next
         return make_ref<NoneSink>(nextSink);
     else if (method == "br")
         return make_ref<BrotliCompressionSink>(nextSink);
+    else if (method == "zstd" || method == "zstd-seekable")
+        return make_ref<ZstdCompressionSink>(nextSink, parallel, method == "zstd-seekable", level);
     else
         throw UnknownCompressionMethod("unknown compression method '%s'", method);
 }
@@ -3,6 +3,7 @@
 #include "error.hh"
 #include "config-global.hh"
 #include "fs-sink.hh"
+#include "archive.hh"
 
 #if _WIN32
 # include <fileapi.h>
@@ -162,6 +163,80 @@ void RestoreSink::createSymlink(const CanonPath & path, const std::string & targ
 }
 
 
+void FileHashingSink::createDirectory(const CanonPath & path)
+{
+    next.createDirectory(path);
+}
+
+
+void FileHashingSink::createRegularFile(const CanonPath & path, std::function<void(CreateRegularFileSink &)> func)
+{
+    /* The NAR serialisation of a file starts with its executable bit
+       and its size, which the parser passes to us before the
+       contents. */
+    struct CRF : CreateRegularFileSink {
+        CreateRegularFileSink * next = nullptr;
+        HashSink hashSink{HashAlgorithm::SHA256};
+        bool executable = false;
+        std::optional<uint64_t> size;
+        bool unknownSize = false;
+
+        void operator () (std::string_view data) override
+        {
+            /* Without the size, we can't compute the hash. */
+            if (size) hashSink(data); else unknownSize = true;
+            (*next)(data);
+        }
+
+        void isExecutable() override
+        {
+            executable = true;
+            next->isExecutable();
+        }
+
+        void preallocateContents(uint64_t _size) override
+        {
+            startContents(_size);
+            next->preallocateContents(_size);
+        }
+
+        void startContents(uint64_t _size)
+        {
+            size = _size;
+            hashSink << narVersionMagic1 << "(" << "type" << "regular";
+            if (executable)
+                hashSink << "executable" << "";
+            hashSink << "contents" << _size;
+        }
+    } crf;
+
+    next.createRegularFile(path, [&](CreateRegularFileSink & nextCrf) {
+        crf.next = &nextCrf;
+        func(crf);
+    });
+
+    if (crf.unknownSize) return;
+
+    /* An empty file may not have a "contents" field. */
+    if (!crf.size)
+        crf.startContents(0);
+
+    writePadding(*crf.size, crf.hashSink);
+    crf.hashSink << ")";
+    fileHashes.insert_or_assign(path, crf.hashSink.finish().first);
+}
+
+
+void FileHashingSink::createSymlink(const CanonPath & path, const std::string & target)
+{
+    next.createSymlink(path, target);
+
+    HashSink hashSink(HashAlgorithm::SHA256);
+    hashSink << narVersionMagic1 << "(" << "type" << "symlink" << "target" << target << ")";
+    fileHashes.insert_or_assign(path, hashSink.finish().first);
+}
+
+
 void RegularFileSink::createRegularFile(const CanonPath & path, std::function<void(CreateRegularFileSink &)> func)
 {
     struct CRF : CreateRegularFileSink {
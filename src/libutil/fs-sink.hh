@@ -4,6 +4,7 @@
 #include "serialise.hh"
 #include "source-accessor.hh"
 #include "file-system.hh"
+#include "hash.hh"
 
 namespace nix {
 
@@ -17,7 +18,8 @@ struct CreateRegularFileSink : Sink
     virtual void isExecutable() = 0;
 
     /**
-     * An optimization. By default, do nothing.
+     * An optimization. By default, do nothing. If called, `size` must
+     * be the exact size of the contents.
      */
     virtual void preallocateContents(uint64_t size) { };
 };
@@ -93,6 +95,29 @@ struct RestoreSink : FileSystemObjectSink
     void createSymlink(const CanonPath & path, const std::string & target) override;
 };
 
+/**
+ * Pass file system objects on to another sink, while recording the NAR
+ * hash of every regular file and symlink, keyed on its path. This
+ * allows the files of a store path to be deduplicated without reading
+ * them again after unpacking it.
+ */
+struct FileHashingSink : FileSystemObjectSink
+{
+    FileSystemObjectSink & next;
+
+    std::map<CanonPath, Hash> fileHashes;
+
+    FileHashingSink(FileSystemObjectSink & next) : next(next) { }
+
+    void createDirectory(const CanonPath & path) override;
+
+    void createRegularFile(
+        const CanonPath & path,
+        std::function<void(CreateRegularFileSink &)>) override;
+
+    void createSymlink(const CanonPath & path, const std::string & target) override;
+};
+
 /**
  * Restore a single file at the top level, passing along
  * `receiveContents` to the underlying `Sink`. For anything but a single
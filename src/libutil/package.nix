@@ -9,6 +9,7 @@
 , libsodium
 , nlohmann_json
 , openssl
+, zstd
 
 # Configuration Options
 
@@ -42,6 +43,7 @@ mkMesonLibrary (finalAttrs: {
     brotli
     libsodium
     openssl
+    zstd
   ] ++ lib.optional stdenv.hostPlatform.isx86_64 libcpuid
   ;
 
@@ -4,60 +4,254 @@
 
 #include <map>
 #include <cstdlib>
+#include <cstring>
 #include <mutex>
 #include <algorithm>
+#include <bit>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
 
 
 namespace nix {
 
 
-static size_t refLength = 32; /* characters */
-
-
-static void search(
-    std::string_view s,
-    StringSet & hashes,
-    StringSet & seen)
-{
-    static std::once_flag initialised;
-    static bool isBase32[256];
-    std::call_once(initialised, [](){
-        for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
-        for (unsigned int i = 0; i < nix32Chars.size(); ++i)
-            isBase32[(unsigned char) nix32Chars[i]] = true;
-    });
-
-    for (size_t i = 0; i + refLength <= s.size(); ) {
-        int j;
-        bool match = true;
-        for (j = refLength - 1; j >= 0; --j)
-            if (!isBase32[(unsigned char) s[i + j]]) {
-                i += j + 1;
-                match = false;
-                break;
-            }
-        if (!match) continue;
-        std::string ref(s.substr(i, refLength));
-        if (hashes.erase(ref)) {
-            debug("found reference to '%1%' at offset '%2%'", ref, i);
-            seen.insert(ref);
+static constexpr size_t refLength = RefScanSink::refLength; /* characters */
+
+
+/* The scanner classifies the input 64 bytes at a time into a bitmask
+   of the bytes that are Nix base-32 characters, and then finds the
+   runs of at least `refLength` such characters using bit operations.
+   Only the starts of those runs are looked up in the hash table, so
+   binary data and text without long base-32 runs are skipped
+   quickly. */
+
+static constexpr size_t blockSize = 64;
+
+
+#if defined(__AVX2__)
+
+static inline uint32_t classify32(const unsigned char * p)
+{
+    auto v = _mm256_loadu_si256((const __m256i *) p);
+    auto inRange = [&](char lo, char hi) {
+        return _mm256_and_si256(
+            _mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
+    };
+    auto excluded = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('e')),
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('o'))),
+        _mm256_or_si256(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('t')),
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('u'))));
+    auto m = _mm256_andnot_si256(excluded, _mm256_or_si256(inRange('0', '9'), inRange('a', 'z')));
+    return (uint32_t) _mm256_movemask_epi8(m);
+}
+
+static inline uint64_t classify(const unsigned char * p)
+{
+    return (uint64_t) classify32(p) | ((uint64_t) classify32(p + 32) << 32);
+}
+
+#elif defined(__SSE2__)
+
+static inline uint64_t classify16(const unsigned char * p)
+{
+    /* Bytes >= 0x80 are negative in these signed comparisons, so they
+       fall outside both ranges. */
+    auto v = _mm_loadu_si128((const __m128i *) p);
+    auto inRange = [&](char lo, char hi) {
+        return _mm_and_si128(
+            _mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+            _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+    };
+    auto excluded = _mm_or_si128(
+        _mm_or_si128(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('e')),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('o'))),
+        _mm_or_si128(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('t')),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('u'))));
+    auto m = _mm_andnot_si128(excluded, _mm_or_si128(inRange('0', '9'), inRange('a', 'z')));
+    return (uint64_t) (uint16_t) _mm_movemask_epi8(m);
+}
+
+static inline uint64_t classify(const unsigned char * p)
+{
+    return classify16(p)
+        | (classify16(p + 16) << 16)
+        | (classify16(p + 32) << 32)
+        | (classify16(p + 48) << 48);
+}
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+
+static inline uint64_t classify16(const unsigned char * p)
+{
+    auto v = vld1q_u8(p);
+    auto inRange = [&](unsigned char lo, unsigned char hi) {
+        return vcleq_u8(vsubq_u8(v, vdupq_n_u8(lo)), vdupq_n_u8(hi - lo));
+    };
+    auto excluded = vorrq_u8(
+        vorrq_u8(vceqq_u8(v, vdupq_n_u8('e')), vceqq_u8(v, vdupq_n_u8('o'))),
+        vorrq_u8(vceqq_u8(v, vdupq_n_u8('t')), vceqq_u8(v, vdupq_n_u8('u'))));
+    auto m = vbicq_u8(vorrq_u8(inRange('0', '9'), inRange('a', 'z')), excluded);
+    /* NEON has no movemask, so weigh each lane by its bit and add up
+       each half. */
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    auto bits = vandq_u8(m, vld1q_u8(weights));
+    return (uint64_t) vaddv_u8(vget_low_u8(bits)) | ((uint64_t) vaddv_u8(vget_high_u8(bits)) << 8);
+}
+
+static inline uint64_t classify(const unsigned char * p)
+{
+    return classify16(p)
+        | (classify16(p + 16) << 16)
+        | (classify16(p + 32) << 32)
+        | (classify16(p + 48) << 48);
+}
+
+#else
+
+static const std::array<bool, 256> & getBase32Table()
+{
+    static const std::array<bool, 256> isBase32 = []() {
+        std::array<bool, 256> res{};
+        for (auto c : nix32Chars)
+            res[(unsigned char) c] = true;
+        return res;
+    }();
+    return isBase32;
+}
+
+static inline uint64_t classify(const unsigned char * p)
+{
+    auto & isBase32 = getBase32Table();
+    uint64_t res = 0;
+    for (size_t i = 0; i < blockSize; ++i)
+        res |= (uint64_t) isBase32[p[i]] << i;
+    return res;
+}
+
+#endif
+
+
+/**
+ * Return the base-32 mask of the block of `s` starting at `offset`,
+ * treating bytes past the end of `s` as non-base-32.
+ */
+static uint64_t classifyAt(std::string_view s, size_t offset)
+{
+    if (offset >= s.size()) return 0;
+
+    auto p = (const unsigned char *) s.data() + offset;
+    if (offset + blockSize <= s.size())
+        return classify(p);
+
+    unsigned char buf[blockSize] = {};
+    memcpy(buf, p, s.size() - offset);
+    return classify(buf);
+}
+
+
+/**
+ * Given the base-32 masks of two consecutive blocks, return the mask
+ * of positions in the first block at which a run of at least
+ * `refLength` base-32 characters starts.
+ */
+static inline uint64_t runStarts(uint64_t lo, uint64_t hi)
+{
+    for (unsigned int shift = 1; shift < refLength; shift *= 2) {
+        lo &= (lo >> shift) | (hi << (64 - shift));
+        hi &= hi >> shift;
+    }
+    return lo;
+}
+
+
+static inline size_t slotIndex(const char * p, unsigned int tableBits)
+{
+    uint64_t h;
+    memcpy(&h, p, sizeof(h));
+    return (h * 0x9e3779b97f4a7c15ULL) >> (64 - tableBits);
+}
+
+
+RefScanSink::RefScanSink(StringSet && hashes)
+{
+    tableBits = 1;
+    while (((size_t) 1 << tableBits) < hashes.size() * 2)
+        tableBits++;
+    table.resize((size_t) 1 << tableBits);
+
+    for (auto & hash : hashes) {
+        /* Anything else can never match a store path hash. */
+        if (hash.size() != refLength) continue;
+        auto i = slotIndex(hash.data(), tableBits);
+        while (table[i].used) {
+            if (memcmp(table[i].hash.data(), hash.data(), refLength) == 0) break;
+            i = (i + 1) & (table.size() - 1);
+        }
+        if (table[i].used) continue;
+        memcpy(table[i].hash.data(), hash.data(), refLength);
+        table[i].used = true;
+        nrHashes++;
+    }
+}
+
+
+void RefScanSink::check(const char * p, size_t offset)
+{
+    auto mask = table.size() - 1;
+    for (auto i = slotIndex(p, tableBits); table[i].used; i = (i + 1) & mask) {
+        auto & slot = table[i];
+        if (memcmp(slot.hash.data(), p, refLength) != 0) continue;
+        if (!slot.found) {
+            std::string ref(p, refLength);
+            debug("found reference to '%1%' at offset '%2%'", ref, offset);
+            slot.found = true;
+            seen.insert(std::move(ref));
         }
-        ++i;
+        return;
+    }
+}
+
+
+void RefScanSink::search(std::string_view s)
+{
+    if (s.size() < refLength) return;
+
+    uint64_t cur = classifyAt(s, 0);
+    for (size_t offset = 0; offset + refLength <= s.size(); offset += blockSize) {
+        uint64_t next = classifyAt(s, offset + blockSize);
+        for (auto starts = runStarts(cur, next); starts; starts &= starts - 1) {
+            auto pos = offset + std::countr_zero(starts);
+            check(s.data() + pos, pos);
+        }
+        cur = next;
     }
 }
 
 
 void RefScanSink::operator () (std::string_view data)
 {
+    /* Once every hash has been found, there is nothing left to do. */
+    if (seen.size() == nrHashes) return;
+
     /* It's possible that a reference spans the previous and current
        fragment, so search in the concatenation of the tail of the
        previous fragment and the start of the current fragment. */
     auto s = tail;
     auto tailLen = std::min(data.size(), refLength);
     s.append(data.data(), tailLen);
-    search(s, hashes, seen);
+    search(s);
 
-    search(data, hashes, seen);
+    search(data);
 
     auto rest = refLength - tailLen;
     if (rest < tail.size())
@@ -3,19 +3,48 @@
 
 #include "hash.hh"
 
+#include <array>
+
 namespace nix {
 
 class RefScanSink : public Sink
 {
-    StringSet hashes;
+public:
+
+    /**
+     * The length of the hash parts of store paths that we look for.
+     */
+    static constexpr size_t refLength = 32;
+
+private:
+
+    /**
+     * A slot in the open-addressing hash table of the hashes to look
+     * for. Lookups compare the candidate in place, so scanning doesn't
+     * allocate.
+     */
+    struct Slot
+    {
+        std::array<char, refLength> hash;
+        bool used = false;
+        bool found = false;
+    };
+
+    std::vector<Slot> table;
+    unsigned int tableBits = 0;
+    size_t nrHashes = 0;
+
     StringSet seen;
 
     std::string tail;
 
+    void search(std::string_view s);
+
+    void check(const char * p, size_t offset);
+
 public:
 
-    RefScanSink(StringSet && hashes) : hashes(hashes)
-    { }
+    RefScanSink(StringSet && hashes);
 
     StringSet & getResult()
     { return seen; }
@@ -215,6 +215,9 @@ time_t unpackTarfileToSink(TarArchive & archive, ExtendedFileSystemObjectSink &
                 if (archive_entry_mode(entry) & S_IXUSR)
                     crf.isExecutable();
 
+                if (archive_entry_size_is_set(entry))
+                    crf.preallocateContents(archive_entry_size(entry));
+
                 while (true) {
                     std::vector<unsigned char> buf(128 * 1024);
                     auto n = archive_read_data(archive.archive, buf.data(), buf.size());
@@ -77,7 +77,7 @@ struct CmdCatNar : StoreCommand, MixCat
 
     void run(ref<Store> store) override
     {
-        cat(makeNarAccessor(readFile(narPath)));
+        cat(makeIndexedNarAccessor(narPath));
     }
 };
 
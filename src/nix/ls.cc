@@ -152,7 +152,7 @@ struct CmdLsNar : Command, MixLs
 
     void run() override
     {
-        list(makeNarAccessor(readFile(narPath)));
+        list(makeIndexedNarAccessor(narPath));
     }
 };
 
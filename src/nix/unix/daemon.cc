@@ -17,8 +17,11 @@
 #include "daemon.hh"
 
 #include <algorithm>
+#include <array>
+#include <chrono>
 #include <climits>
 #include <cstring>
+#include <set>
 
 #include <unistd.h>
 #include <signal.h>
@@ -28,6 +31,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <errno.h>
 #include <pwd.h>
 #include <grp.h>
@@ -283,6 +287,263 @@ static std::pair<TrustedFlag, std::string> authPeer(const PeerInfo & peer)
 }
 
 
+/**
+ * Decide whether to trust the client on the other end of `remote`
+ * (throwing an `Error` if it is not allowed to connect at all), and log
+ * the new connection.
+ *
+ * @param peer Set to the identity of the client, if it was looked up.
+ */
+static TrustedFlag authConnection(int remote, std::optional<TrustedFlag> forceTrustClientOpt, PeerInfo & peer)
+{
+    TrustedFlag trusted;
+    std::string user;
+
+    if (forceTrustClientOpt)
+        trusted = *forceTrustClientOpt;
+    else {
+        peer = getPeerInfo(remote);
+        auto [_trusted, _user] = authPeer(peer);
+        trusted = _trusted;
+        user = _user;
+    };
+
+    printInfo((std::string) "accepted connection from pid %1%, user %2%" + (trusted ? " (trusted)" : ""),
+        peer.pidKnown ? std::to_string(peer.pid) : "<unknown>",
+        peer.uidKnown ? user : "<unknown>");
+
+    return trusted;
+}
+
+/**
+ * For debugging, stuff the pid of the client into argv[1].
+ */
+static void setProcessName(const PeerInfo & peer)
+{
+    if (peer.pidKnown && savedArgv[1]) {
+        auto processName = std::to_string(peer.pid);
+        strncpy(savedArgv[1], processName.c_str(), strlen(savedArgv[1]));
+    }
+}
+
+static void logConnectionError(Error & error)
+{
+    auto ei = error.info();
+    // FIXME: add to trace?
+    ei.msg = HintFmt("error processing connection: %1%", ei.msg.str());
+    logError(ei);
+}
+
+/**
+ * Body of a preforked worker process. It waits for a connection on
+ * `fdSocket` and then handles that connection just like a child forked
+ * by `daemonLoop()`. The store is only opened once there is a
+ * connection, so that idle workers don't hold its locks and database
+ * handles.
+ *
+ * @param accepted Pipe on which to send our pid to the parent once we
+ * have taken a connection, so that it can fork a replacement.
+ *
+ * @param parentAlive Pipe whose write side is only held by the parent,
+ * so that idle workers notice when the daemon goes away.
+ */
+static void preforkedWorker(
+    AutoCloseFD & fdSocket,
+    Pipe & accepted,
+    Pipe & parentAlive,
+    std::optional<TrustedFlag> forceTrustClientOpt)
+{
+    accepted.readSide = -1;
+    parentAlive.writeSide = -1;
+
+    //  Background the daemon.
+    if (setsid() == -1)
+        throw SysError("creating a new session");
+
+    //  Restore normal handling of SIGCHLD.
+    setSigChldAction(false);
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    if (pthread_sigmask(SIG_UNBLOCK, &chld, nullptr))
+        throw SysError("unblocking SIGCHLD");
+
+    AutoCloseFD remote;
+
+    while (!remote) {
+        std::array<struct pollfd, 2> fds;
+        fds[0] = { .fd = fdSocket.get(), .events = POLLIN, .revents = 0 };
+        fds[1] = { .fd = parentAlive.readSide.get(), .events = POLLIN, .revents = 0 };
+
+        if (poll(fds.data(), fds.size(), -1) == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("waiting for a connection");
+        }
+
+        //  The daemon has exited, so there is nothing left to do.
+        if (fds[1].revents)
+            return;
+
+        if (!fds[0].revents) continue;
+
+        /* The socket is non-blocking, since another worker may
+           have taken the connection in the meantime. */
+        remote = accept(fdSocket.get(), nullptr, nullptr);
+        if (!remote && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+            throw SysError("accepting connection");
+    }
+
+    pid_t pid = getpid();
+    writeFull(accepted.writeSide.get(), std::string_view((const char *) &pid, sizeof(pid)));
+    accepted.writeSide = -1;
+    fdSocket = -1;
+    parentAlive.readSide = -1;
+
+    unix::closeOnExec(remote.get());
+
+    /* Some platforms make accepted sockets inherit the non-blocking
+       flag of the listening socket. */
+    int flags = fcntl(remote.get(), F_GETFL);
+    if (flags == -1 || fcntl(remote.get(), F_SETFL, flags & ~O_NONBLOCK) == -1)
+        throw SysError("making connection socket blocking");
+
+    PeerInfo peer { .pidKnown = false };
+    TrustedFlag trusted;
+
+    try {
+        trusted = authConnection(remote.get(), forceTrustClientOpt, peer);
+    } catch (Error & error) {
+        logConnectionError(error);
+        return;
+    }
+
+    setProcessName(peer);
+
+    //  Handle the connection.
+    processConnection(
+        openUncachedStore(),
+        FdSource(remote.get()),
+        FdSink(remote.get()),
+        trusted,
+        NotRecursive);
+}
+
+static void ignoreSigChld(int sigNo)
+{
+}
+
+/**
+ * Serve connections on `fdSocket` from a pool of `nrWorkers` idle
+ * worker processes that are forked in advance. Each worker handles a
+ * single connection and then exits; the loop forks a replacement as
+ * soon as a worker takes a connection, so that `fork()` is not on the
+ * critical path of a new client.
+ */
+static void preforkLoop(AutoCloseFD & fdSocket, std::optional<TrustedFlag> forceTrustClientOpt, unsigned int nrWorkers)
+{
+    int flags = fcntl(fdSocket.get(), F_GETFL);
+    if (flags == -1 || fcntl(fdSocket.get(), F_SETFL, flags | O_NONBLOCK) == -1)
+        throw SysError("making daemon socket non-blocking");
+
+    Pipe accepted, parentAlive;
+    accepted.create();
+    parentAlive.create();
+
+    flags = fcntl(accepted.readSide.get(), F_GETFL);
+    if (flags == -1 || fcntl(accepted.readSide.get(), F_SETFL, flags | O_NONBLOCK) == -1)
+        throw SysError("making worker pipe non-blocking");
+
+    /* Reap children here rather than in the signal handler, so that
+       we know which idle workers have exited. SIGCHLD is blocked
+       except while waiting in pselect(), which it interrupts. */
+    struct sigaction act;
+    act.sa_handler = ignoreSigChld;
+    sigfillset(&act.sa_mask);
+    act.sa_flags = 0;
+    if (sigaction(SIGCHLD, &act, nullptr))
+        throw SysError("setting SIGCHLD handler");
+
+    sigset_t chld, unblocked;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    if (pthread_sigmask(SIG_BLOCK, &chld, &unblocked))
+        throw SysError("blocking SIGCHLD");
+    sigdelset(&unblocked, SIGCHLD);
+
+    std::set<pid_t> idleWorkers;
+    unsigned int missing = nrWorkers;
+    auto notBefore = std::chrono::steady_clock::now();
+
+    while (1) {
+
+        try {
+            checkInterrupt();
+
+            std::vector<std::pair<pid_t, int>> exited;
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+                exited.emplace_back(pid, status);
+
+            /* A worker reports that it has taken a connection before
+               it exits, so after reaping, the pipe tells us about all
+               exited workers that took a connection. */
+            pid_t pids[64];
+            ssize_t n;
+            while ((n = read(accepted.readSide.get(), pids, sizeof(pids))) > 0) {
+                assert(n % sizeof(pid_t) == 0);
+                for (size_t i = 0; i < n / sizeof(pid_t); ++i)
+                    if (idleWorkers.erase(pids[i]))
+                        missing++;
+            }
+            if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                throw SysError("reading from daemon workers");
+
+            /* An idle worker only exits by itself if something is
+               wrong, so don't fork replacements in a tight loop. */
+            for (auto & [pid, status] : exited)
+                if (idleWorkers.erase(pid)) {
+                    printError("idle daemon worker %d exited unexpectedly: %s", pid, statusToString(status));
+                    missing++;
+                    notBefore = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+                }
+
+            auto now = std::chrono::steady_clock::now();
+            if (now >= notBefore)
+                for (; missing; missing--) {
+                    ProcessOptions options;
+                    options.errorPrefix = "unexpected Nix daemon error: ";
+                    options.dieWithParent = false;
+                    options.runExitHandlers = true;
+                    options.allowVfork = false;
+                    idleWorkers.insert(startProcess([&]() {
+                        preforkedWorker(fdSocket, accepted, parentAlive, forceTrustClientOpt);
+                        exit(0);
+                    }, options));
+                }
+
+            struct timespec timeout, * timeoutPtr = nullptr;
+            if (missing) {
+                auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(notBefore - now).count();
+                timeout = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+                timeoutPtr = &timeout;
+            }
+
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(accepted.readSide.get(), &fds);
+            if (pselect(accepted.readSide.get() + 1, &fds, nullptr, nullptr, timeoutPtr, &unblocked) == -1
+                && errno != EINTR)
+                throw SysError("waiting for daemon workers");
+
+        } catch (Interrupted & e) {
+            return;
+        } catch (Error & error) {
+            logConnectionError(error);
+        }
+    }
+}
+
 /**
  * Run a server. The loop opens a socket and accepts new connections from that
  * socket.
@@ -337,6 +598,11 @@ static void daemonLoop(std::optional<TrustedFlag> forceTrustClientOpt)
     }
     #endif
 
+    if (settings.daemonPreforkedWorkers > 0) {
+        preforkLoop(fdSocket, forceTrustClientOpt, settings.daemonPreforkedWorkers);
+        return;
+    }
+
     //  Loop accepting connections.
     while (1) {
 
@@ -356,21 +622,7 @@ static void daemonLoop(std::optional<TrustedFlag> forceTrustClientOpt)
             unix::closeOnExec(remote.get());
 
             PeerInfo peer { .pidKnown = false };
-            TrustedFlag trusted;
-            std::string user;
-
-            if (forceTrustClientOpt)
-                trusted = *forceTrustClientOpt;
-            else {
-                peer = getPeerInfo(remote.get());
-                auto [_trusted, _user] = authPeer(peer);
-                trusted = _trusted;
-                user = _user;
-            };
-
-            printInfo((std::string) "accepted connection from pid %1%, user %2%" + (trusted ? " (trusted)" : ""),
-                peer.pidKnown ? std::to_string(peer.pid) : "<unknown>",
-                peer.uidKnown ? user : "<unknown>");
+            auto trusted = authConnection(remote.get(), forceTrustClientOpt, peer);
 
             //  Fork a child to handle the connection.
             ProcessOptions options;
@@ -388,11 +640,7 @@ static void daemonLoop(std::optional<TrustedFlag> forceTrustClientOpt)
                 //  Restore normal handling of SIGCHLD.
                 setSigChldAction(false);
 
-                //  For debugging, stuff the pid into argv[1].
-                if (peer.pidKnown && savedArgv[1]) {
-                    auto processName = std::to_string(peer.pid);
-                    strncpy(savedArgv[1], processName.c_str(), strlen(savedArgv[1]));
-                }
+                setProcessName(peer);
 
                 //  Handle the connection.
                 processConnection(
@@ -408,10 +656,7 @@ static void daemonLoop(std::optional<TrustedFlag> forceTrustClientOpt)
         } catch (Interrupted & e) {
             return;
         } catch (Error & error) {
-            auto ei = error.info();
-            // FIXME: add to trace?
-            ei.msg = HintFmt("error processing connection: %1%", ei.msg.str());
-            logError(ei);
+            logConnectionError(error);
         }
     }
 }
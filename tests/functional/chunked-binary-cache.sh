@@ -0,0 +1,94 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+TODO_NixOS
+
+clearStore
+clearCache
+
+cacheURI="file://$cacheDir?chunk-nars=true&chunk-size=1024"
+
+mkData() {
+    # shellcheck disable=SC2016
+    nix-build --no-out-link -E '
+      with import '"${config_nix}"';
+      mkDerivation {
+        name = "chunked-'"$1"'";
+        buildCommand = "mkdir $out; seq 1 20000 > $out/data; echo '"$1"' >> $out/data";
+      }
+    '
+}
+
+outPath1=$(mkData 1)
+outPath2=$(mkData 2)
+
+nix copy --to "$cacheURI" "$outPath1"
+
+[[ -n $(find "$cacheDir/nar" -name "*.chunks") ]]
+nrChunks1=$(find "$cacheDir/chunks" -type f | wc -l)
+(( nrChunks1 > 50 ))
+
+# The second path only differs at the end, so it should share almost
+# all chunks with the first one.
+nix copy --to "$cacheURI" "$outPath2"
+nrChunks2=$(find "$cacheDir/chunks" -type f | wc -l)
+(( nrChunks2 - nrChunks1 <= 3 ))
+
+HASH1=$(nix hash path "$outPath1")
+HASH2=$(nix hash path "$outPath2")
+
+clearStore
+clearCacheCache
+
+chunkCache=$TEST_ROOT/chunk-cache
+rm -rf "$chunkCache"
+
+nix copy --from "$cacheURI&local-chunk-cache=$chunkCache" "$outPath1" --no-check-sigs
+[[ $(nix hash path "$outPath1") = "$HASH1" ]]
+[[ $(find "$chunkCache" -type f | wc -l) = "$nrChunks1" ]]
+
+# With the chunks of the first path in the local chunk cache, we only
+# need to download the chunks that are new in the second path.
+for f in "$chunkCache"/*; do
+    rm -f "$cacheDir/chunks/$(basename "$f")".xz
+done
+
+nix copy --from "$cacheURI&local-chunk-cache=$chunkCache" "$outPath2" --no-check-sigs
+[[ $(nix hash path "$outPath2") = "$HASH2" ]]
+
+# Substituting without the local chunk cache now fails.
+clearStore
+clearCacheCache
+expectStderr 1 nix copy --from "$cacheURI" "$outPath1" --no-check-sigs | grepQuiet "does not exist in binary cache"
+
+# A path with many more chunks than are uploaded at once, most of which
+# are identical. The chunk list refers to each of them, but each is only
+# stored once.
+clearStore
+clearCache
+
+# shellcheck disable=SC2016
+outPath3=$(nix-build --no-out-link -E '
+  with import '"${config_nix}"';
+  mkDerivation {
+    name = "chunked-repeated";
+    buildCommand = "mkdir $out; seq 1 200000 > $out/data; yes abcdefghijklmnopqrstuvwxyz | head -c 1000000 > $out/repeated";
+  }
+')
+HASH3=$(nix hash path "$outPath3")
+
+nix copy --to "$cacheURI" "$outPath3"
+
+chunkList=$(find "$cacheDir/nar" -name "*.chunks")
+nrListed=$(wc -l < "$chunkList")
+nrUnique=$(cut -d' ' -f1 "$chunkList" | sort -u | wc -l)
+(( nrListed > 1000 ))
+(( nrUnique < nrListed ))
+[[ $(find "$cacheDir/chunks" -type f | wc -l) = "$nrUnique" ]]
+
+clearStore
+clearCacheCache
+
+nix copy --from "$cacheURI" "$outPath3" --no-check-sigs
+[[ $(nix hash path "$outPath3") = "$HASH3" ]]
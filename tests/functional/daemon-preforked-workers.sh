@@ -0,0 +1,41 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+TODO_NixOS
+
+clearStore
+
+# Serve every connection from a pool of two preforked workers.
+NIX_CONFIG="${NIX_CONFIG:-}"$'\n'"daemon-preforked-workers = 2" startDaemon
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix-store -qR "$outPath" > "$TEST_ROOT/closure"
+
+# Many more concurrent clients than idle workers, so that most of them
+# wait for a replacement worker.
+pids=()
+for i in $(seq 1 20); do
+    (
+        nix-store -qR "$outPath" > "$TEST_ROOT/closure-$i"
+        echo "client $i" > "$TEST_ROOT/file-$i"
+        nix-store --add "$TEST_ROOT/file-$i" > "$TEST_ROOT/added-$i"
+        nix-build dependencies.nix --no-out-link > "$TEST_ROOT/built-$i"
+    ) &
+    pids+=($!)
+done
+
+for pid in "${pids[@]}"; do
+    wait "$pid"
+done
+
+for i in $(seq 1 20); do
+    diff "$TEST_ROOT/closure" "$TEST_ROOT/closure-$i"
+    [[ $(cat "$(cat "$TEST_ROOT/added-$i")") = "client $i" ]]
+    [[ $(cat "$TEST_ROOT/built-$i") = "$outPath" ]]
+done
+
+# The daemon still accepts connections afterwards.
+nix store info
+
+killDaemon
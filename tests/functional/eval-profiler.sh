@@ -0,0 +1,25 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+profile="$TEST_ROOT/nix.profile"
+
+nix-instantiate --eval \
+    --eval-profiler flamegraph \
+    --eval-profiler-frequency 1000 \
+    --eval-profile-file "$profile" \
+    --expr '
+      let
+        fib = n: if n < 2 then n else fib (n - 1) + fib (n - 2);
+      in fib 25
+    '
+
+# Every line is a stack followed by a sample count.
+[[ -s "$profile" ]]
+grepQuietInverse -v '^[^ ].* [0-9][0-9]*$' "$profile"
+
+# The samples are attributed to `fib`.
+grepQuiet '^fib at «string»:3:15.* [0-9][0-9]*$' "$profile"
+
+expectStderr 1 nix-instantiate --eval --eval-profiler foo --expr 1 \
+    | grepQuiet "option 'eval-profiler' has invalid value 'foo'"
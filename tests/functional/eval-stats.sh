@@ -0,0 +1,24 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+stats="$TEST_ROOT/stats.json"
+
+NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH="$stats" NIX_COUNT_CALLS=1 \
+    nix-instantiate --eval --expr '
+      let
+        f = n: builtins.genList (x: { inherit x; }) n;
+        g = n: n + 1;
+      in builtins.length (f (g 1000))
+    '
+
+# Time is broken down by phase.
+jq -e '.phases | has("eval") and has("parse") and has("derivation") and has("storeCopy")' "$stats"
+jq -e '.phases.parse.number >= 1' "$stats"
+jq -e '.nrThunksForced > 0' "$stats"
+
+# Allocations are attributed to lambdas and files, most expensive first.
+jq -e '.allocations.functions[0].name == "f"' "$stats"
+jq -e 'any(.allocations.functions[]; .name == "g")' "$stats"
+jq -e '[.allocations.functions[].bytes] | . == (sort | reverse)' "$stats"
+jq -e '[.allocations.files[].bytes] | . == (sort | reverse)' "$stats"
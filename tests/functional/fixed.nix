@@ -64,6 +64,21 @@ rec {
     (f2 "bar" ./fixed.builder2.sh "recursive" "md5" "3670af73070fa14077ad74e0f5ea4e42")
   ];
 
+  # A builder that leaves behind a process that keeps writing to the
+  # output through a file descriptor that it opened during the build.
+  leakedFd = mkDerivation {
+    name = "leaked-fd";
+    outputHashMode = "flat";
+    outputHashAlgo = "sha256";
+    outputHash = "1ixr6yd3297ciyp9im522dfxpqbkhcw0pylkb2aab915278fqaik";
+    buildCommand = ''
+      set -m
+      exec 3>$out
+      (SECONDS=0; while [ $SECONDS -lt 3 ]; do printf x >&3; done) </dev/null >/dev/null 2>&1 &
+      sleep 1
+    '';
+  };
+
   # Can use "nar" instead of "recursive" now.
   nar-not-recursive = f2 "foo" ./fixed.builder2.sh "nar" "md5" "3670af73070fa14077ad74e0f5ea4e42";
 }
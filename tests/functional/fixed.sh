@@ -35,6 +35,14 @@ if isDaemonNewer "2.20pre20240108"; then
     expectStderr 1 nix-build fixed.nix -A badReferences | grepQuiet "not allowed to refer to other store paths"
 fi
 
+# The output of a fixed-output derivation is replaced by a fresh copy
+# before it's registered, so a process that still has it open can't
+# make the registered hashes differ from what's on disk.
+echo 'testing leakedFd...'
+nix-build fixed.nix -A leakedFd --no-out-link && fail "should fail"
+sleep 3
+nix-store --verify --check-contents
+
 # While we're at it, check attribute selection a bit more.
 echo 'testing attribute selection...'
 test $(nix-instantiate fixed.nix -A good.1 | wc -l) = 1
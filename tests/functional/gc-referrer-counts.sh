@@ -0,0 +1,92 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+TODO_NixOS
+
+clearStore
+
+makeChain() {
+    nix eval --raw --expr '
+      let
+        go = n:
+          if n == 0
+          then builtins.toFile "chain-0" "bottom"
+          else builtins.toFile "chain-${toString n}" "${go (n - 1)}";
+      in go 10
+    '
+}
+
+# A chain of garbage paths, each referring to the previous one. Only
+# the head of the chain has no referrers at first, so collecting the
+# whole chain takes several rounds of the unreferenced paths loop.
+chain=$(makeChain)
+chainPaths=($(nix-store -qR "$chain"))
+(( ${#chainPaths[@]} == 11 ))
+
+nix-store --gc
+
+for p in "${chainPaths[@]}"; do
+    [[ ! -e $p ]] || fail "chain path '$p' was not deleted"
+done
+
+# A root in the middle of a chain keeps it and the paths below it.
+chain=$(makeChain)
+middle=$(nix-store -qR "$chain" | grep -- -chain-5$)
+nix-store --add-root "$TEST_ROOT/middle" -r "$middle"
+
+nix-store --gc
+
+[[ ! -e $chain ]]
+(( $(nix-store -qR "$middle" | wc -l) == 6 ))
+rm "$TEST_ROOT/middle"
+
+[[ -n "$(type -p sqlite3)" ]] || skipTest "sqlite3 is not available"
+
+db="$NIX_STATE_DIR/db/db.sqlite"
+
+# Check that the count of every valid path matches the Refs table.
+checkCounts() {
+    [[ "$(sqlite3 "$db" "
+        select count(*) from ValidPaths v left join GCReferrerCounts c using (id)
+        where c.referrers is null
+          or c.referrers != (select count(*) from Refs where reference = v.id and referrer != reference)
+    ")" = 0 ]] || fail "referrer counts don't match the references"
+}
+
+checkCounts
+
+# Registering paths with references.
+outPath=$(nix-build dependencies.nix --no-out-link)
+checkCounts
+(( $(sqlite3 "$db" "select count(*) from GCReferrerCounts where referrers > 0") > 0 ))
+
+# Registering paths that are already valid, which replaces their
+# references.
+nix-store --dump-db "$outPath" | nix-store --load-db
+checkCounts
+
+# Deleting paths.
+nix-store --delete "$outPath"
+checkCounts
+nix-store --gc
+checkCounts
+(( $(sqlite3 "$db" "select count(*) from GCReferrerCounts") == $(sqlite3 "$db" "select count(*) from ValidPaths") ))
+
+# A database that was modified by a version of Nix without the triggers
+# is migrated with the correct counts.
+outPath=$(nix-build dependencies.nix --no-out-link)
+sqlite3 "$db" "
+    drop trigger GCAddPath;
+    drop trigger GCAddRef;
+    drop trigger GCDeleteRef;
+    delete from Refs where referrer = (select id from ValidPaths where path = '$outPath');
+"
+rm "$NIX_STATE_DIR/db/gc-schema"
+nix-store -q --references "$outPath" > /dev/null
+[[ -e "$NIX_STATE_DIR/db/gc-schema" ]]
+checkCounts
+(( $(sqlite3 "$db" "select count(*) from sqlite_master where type = 'trigger' and name like 'GC%'") == 3 ))
+
+nix-store --gc
+checkCounts
@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+TODO_NixOS
+
+clearStore
+
+# A live path, and many garbage paths, some of which refer to each other.
+echo live > "$TEST_ROOT/live"
+livePath=$(nix-store --add "$TEST_ROOT/live")
+nix-store --add-root "$TEST_ROOT/live-root" -r "$livePath"
+
+makeGarbage() {
+    garbage=()
+    for i in $(seq 1 200); do
+        echo "garbage $i $1" > "$TEST_ROOT/garbage-$i"
+        garbage+=("$(nix-store --add "$TEST_ROOT/garbage-$i")")
+    done
+    outPath=$(nix-build dependencies.nix --no-out-link)
+    garbage+=($(nix-store -qR "$outPath"))
+}
+
+makeGarbage 1
+
+nix-store --gc --option gc-threads 4
+
+for p in "${garbage[@]}"; do
+    [[ ! -e $p ]] || fail "garbage path '$p' was not deleted"
+done
+[[ $(cat "$livePath") = live ]]
+nix-store --verify --check-contents
+
+# With a limit, the deletion threads stop soon after reaching it.
+makeGarbage 2
+
+nix-store --gc --max-freed 1 --option gc-threads 4
+
+remaining=0
+for p in "${garbage[@]}"; do
+    if [[ -e $p ]]; then remaining=$((remaining + 1)); fi
+done
+(( remaining > 0 && remaining < ${#garbage[@]} ))
+(( remaining >= 100 )) || fail "deleted $(( ${#garbage[@]} - remaining )) paths to free 1 byte"
+nix-store --verify --check-contents
+
+# The remaining garbage is deleted by the next collection.
+nix-store --gc --option gc-threads 4
+for p in "${garbage[@]}"; do
+    [[ ! -e $p ]] || fail "garbage path '$p' was not deleted"
+done
+[[ $(cat "$livePath") = live ]]
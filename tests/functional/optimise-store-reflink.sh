@@ -0,0 +1,56 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+TODO_NixOS
+
+clearStoreIfPossible
+
+# Reflinks need a file system such as Btrfs or XFS.
+mkdir -p "$NIX_STORE_DIR"
+echo hello > "$NIX_STORE_DIR/.reflink-probe"
+if ! cp --reflink=always "$NIX_STORE_DIR/.reflink-probe" "$NIX_STORE_DIR/.reflink-probe2" 2>/dev/null; then
+    rm -f "$NIX_STORE_DIR/.reflink-probe"
+    skipTest "the file system of the store does not support reflinks"
+fi
+rm -f "$NIX_STORE_DIR/.reflink-probe" "$NIX_STORE_DIR/.reflink-probe2"
+
+opts=(--no-out-link --auto-optimise-store --option optimise-store-method reflink)
+
+outPath1=$(echo 'with import '"${config_nix}"'; mkDerivation { name = "foo1"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo; echo bye > $out/bar"; }' | nix-build - "${opts[@]}")
+
+# The second output's file is replaced by a reflink to the first one.
+outPath2=$(echo 'with import '"${config_nix}"'; mkDerivation { name = "foo2"; builder = builtins.toFile "builder" "mkdir $out; echo hello > $out/foo"; }' | nix-build - "${opts[@]}" -v 2> "$TEST_ROOT/log")
+grepQuiet "reflinking '$outPath2/foo' to '$outPath1/foo'" "$TEST_ROOT/log"
+
+# Unlike with hard links, the files are still separate.
+[[ "$(stat --format=%i "$outPath1/foo")" != "$(stat --format=%i "$outPath2/foo")" ]]
+[[ "$(stat --format=%h "$outPath1/foo")" = 1 ]]
+[[ "$(cat "$outPath2/foo")" = hello ]]
+[[ ! -e "$NIX_STORE_DIR/.links" ]] || [[ -z "$(ls "$NIX_STORE_DIR/.links")" ]]
+
+nix-store --verify --check-contents
+
+# The hashes of the files are recorded once the paths are valid.
+if [[ -n "$(type -p sqlite3)" ]]; then
+    [[ "$(sqlite3 "$NIX_STATE_DIR/db/db.sqlite" "select count(*) from OptimisedFiles f join ValidPaths v on f.path = v.id where v.path in ('$outPath1', '$outPath2')")" = 3 ]]
+    [[ "$(sqlite3 "$NIX_STATE_DIR/db/db.sqlite" "select count(*) from OptimisedFiles where length(hash) != 32")" = 0 ]]
+fi
+
+# `nix-store --optimise` reflinks paths that weren't optimised when
+# they were added.
+outPath3=$(echo 'with import '"${config_nix}"'; mkDerivation { name = "foo3"; builder = builtins.toFile "builder" "mkdir $out; echo bye > $out/bar"; }' | nix-build - --no-out-link)
+
+NIX_REMOTE="" nix-store --optimise --option optimise-store-method reflink -v 2> "$TEST_ROOT/log"
+grepQuiet "reflinking '$outPath3/bar' to '$outPath1/bar'" "$TEST_ROOT/log"
+grepQuiet "freed by reflinking" "$TEST_ROOT/log"
+[[ "$(cat "$outPath3/bar")" = bye ]]
+
+nix-store --verify --check-contents
+
+# Deleting a path removes its file hashes.
+nix-store --gc
+
+if [[ -n "$(type -p sqlite3)" ]]; then
+    [[ "$(sqlite3 "$NIX_STATE_DIR/db/db.sqlite" 'select count(*) from OptimisedFiles')" = 0 ]]
+fi
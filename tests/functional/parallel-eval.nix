@@ -0,0 +1,37 @@
+# Data that has enough independent attributes to keep the workers
+# busy, and that shares thunks between attributes, so that workers
+# run into values claimed by other threads.
+let
+  shared = builtins.genList (i: i * i) 1000;
+  sum = builtins.foldl' (a: b: a + b) 0;
+  # Forced by every attribute of `big`, so the workers that don't get
+  # to claim it first abort their tasks (`ParallelEvalAbort`).
+  total = sum shared;
+in
+{
+  big = builtins.listToAttrs (builtins.genList (i: {
+    name = "a${toString i}";
+    value = {
+      inherit i;
+      square = builtins.elemAt shared i;
+      inherit total;
+      sub = builtins.genList (j: { inherit j; k = i * j; s = "${toString i}-${toString j}"; }) 20;
+    };
+  }) 200);
+
+  traces = builtins.listToAttrs (builtins.genList (i: {
+    name = "t${toString i}";
+    value = builtins.trace "trace ${toString i}" i;
+  }) 50);
+
+  throws = builtins.listToAttrs (builtins.genList (i: {
+    name = "e${toString i}";
+    value = if i == 37 then throw "error in attribute ${toString i}" else total + i;
+  }) 100);
+
+  tryEvals = builtins.genList (i:
+    (builtins.tryEval (if builtins.elemAt shared i > 500 then throw "too big" else i)).success
+  ) 100;
+
+  recursive = let x = { a = x.b; b = x.a; c = 1; d = 2; }; in x;
+}
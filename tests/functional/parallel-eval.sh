@@ -0,0 +1,29 @@
+#!/usr/bin/env bash
+
+source common.sh
+
+# Parallel evaluation gives the same results as sequential evaluation.
+for attr in big tryEvals; do
+    nix-instantiate --eval --strict --json --option eval-cores 1 parallel-eval.nix -A "$attr" > "$TEST_ROOT/serial.json"
+    for cores in 2 8; do
+        nix-instantiate --eval --strict --json --option eval-cores "$cores" parallel-eval.nix -A "$attr" > "$TEST_ROOT/parallel.json"
+        diff "$TEST_ROOT/serial.json" "$TEST_ROOT/parallel.json"
+    done
+done
+
+# Side effects only happen on the main thread, so traces are printed
+# once each, in the same order.
+nix-instantiate --eval --strict --option eval-cores 1 parallel-eval.nix -A traces 2> "$TEST_ROOT/serial.log" > /dev/null
+nix-instantiate --eval --strict --option eval-cores 8 parallel-eval.nix -A traces 2> "$TEST_ROOT/parallel.log" > /dev/null
+[[ $(grep -c '^trace: trace' "$TEST_ROOT/parallel.log") = 50 ]]
+diff <(grep '^trace:' "$TEST_ROOT/serial.log") <(grep '^trace:' "$TEST_ROOT/parallel.log")
+
+# Errors thrown on a worker are reported by the main thread.
+expectStderr 1 nix-instantiate --eval --strict --option eval-cores 8 parallel-eval.nix -A throws \
+    | grepQuiet "error in attribute 37"
+
+# Infinite recursion is detected even if a worker claimed the thunk
+# first and had to abort its task.
+expectStderr 1 nix-instantiate --eval --strict --option eval-cores 8 parallel-eval.nix -A recursive \
+    | grepQuiet "infinite recursion encountered"
+